@@ -0,0 +1,481 @@
+/*
+ * ArcHTTPBridge
+ *
+ * Reach the adapter's built-in web interface without its Ethernet port.
+ * We listen on a localhost TCP port and pass each HTTP request through
+ * the driver to the adapter's HTTP server as GUI_HTTP management commands,
+ * and the response back the same way.
+ *
+ * Static assets (images, style sheets and scripts) don't change, so
+ * successful responses for them are kept in memory and served from there;
+ * only pages and form posts go to the adapter.
+ *
+ * All the protocol notes say of GUI_HTTP is that the data is passed
+ * directly to the HTTP server, so by default that is all we assume: the
+ * request goes out in as many GUI_HTTP commands as it takes, at most
+ * GUI_CHUNK bytes each, and every reply payload is the next piece of the
+ * response.  Once the request is sent we keep sending empty commands to
+ * collect the rest, until one comes back empty after the response has
+ * started.  -F instead takes the first byte of each reply as a status:
+ * HTTP_MORE means there is more to come, GUI_OK that this piece is the
+ * last, and anything else is an error.  That framing has not been checked
+ * against an adapter yet.
+ *
+ * A request the adapter hasn't finished answering within -t seconds
+ * (default 30) is given up with 504.  One refused because a terminal
+ * session holds the channel gets 503; the driver gives up on those after
+ * ARCMSR_GUI_QUEUE_TIMEOUT.  A response bigger than MAX_RESPONSE is
+ * refused with 502 rather than passed on cut short.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <mach/mach.h>
+#include <IOKit/IOKitLib.h>
+
+#include "../ArcMSRUserClientInterface.h"
+#include "../ArcMSRManagement.h"
+
+#define GUI_CHUNK		(GUI_MAX_LENGTH - 1)	/* argument bytes per command */
+#define MAX_REQUEST		(64 * 1024)
+#define MAX_RESPONSE		(4 * 1024 * 1024)
+#define HTTP_MORE		0x00			/* -F reply status: not done yet */
+#define READ_TIMEOUT		5			/* seconds, per client read */
+#define POLL_US			10000			/* after an empty reply */
+
+/* tunnel failures */
+#define TUNNEL_FAILED		-1
+#define TUNNEL_BUSY		-2			/* channel held by a terminal */
+#define TUNNEL_TIMEOUT		-3
+
+io_connect_t	connectionPort;
+int		verbose;
+int		framed;				/* -F: replies start with a status */
+int		request_timeout = 30;		/* seconds */
+
+/*
+ * Growable byte buffer.
+ */
+struct buf {
+	char	*data;
+	int	len;
+	int	size;
+};
+
+void
+buf_append(struct buf *b, const void *data, int len)
+{
+	if (b->len + len > b->size) {
+		b->size = (b->len + len) * 2;
+		if ((b->data = realloc(b->data, b->size)) == NULL)
+			errx(1, "out of memory");
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+double
+now(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return(tv.tv_sec + tv.tv_usec / 1000000.0);
+}
+
+/*
+ * One GUI_HTTP command through the driver.  Returns the reply payload
+ * length, or TUNNEL_FAILED or TUNNEL_BUSY.
+ */
+int
+adapter_http(const uint8_t *args, int argLen, uint8_t *reply, int replyMax)
+{
+	ArcMSRManagementTransaction	t;
+	IOByteCount			outSize;
+
+	t.opcode = GUI_HTTP;
+	t.arg_buffer = (vm_address_t)args;
+	t.arg_size = argLen;
+	t.reply_buffer = (vm_address_t)reply;
+	t.reply_size = replyMax;
+	t.result = 0;
+	outSize = sizeof(t);
+	if (IOConnectMethodStructureIStructureO(connectionPort, kArcMSRUserClientTransact,
+						sizeof(t), &outSize, &t, &t) != KERN_SUCCESS)
+		return(TUNNEL_FAILED);
+	if (t.result != kIOReturnSuccess) {
+		if (verbose)
+			warnx("GUI_HTTP failed: 0x%x", t.result);
+		return((t.result == kIOReturnExclusiveAccess) ? TUNNEL_BUSY : TUNNEL_FAILED);
+	}
+	return(t.reply_size);
+}
+
+void
+adapter_init(void)
+{
+	mach_port_t	masterPort;
+	io_service_t	serviceObject;
+	io_iterator_t	iterator;
+	CFDictionaryRef	classToMatch;
+
+	if (IOMasterPort(MACH_PORT_NULL, &masterPort) != KERN_SUCCESS)
+		errx(1, "IOMasterPort failed");
+	if ((classToMatch = IOServiceMatching("ArcMSR")) == NULL)
+		errx(1, "IOServiceMatching failed (no controller found?)");
+	if ((IOServiceGetMatchingServices(masterPort, classToMatch, &iterator)) != KERN_SUCCESS)
+		errx(1, "IOServiceGetMatchingServices failed");
+	if ((serviceObject = IOIteratorNext(iterator)) == 0)
+		errx(1, "Controller not found");
+
+	/* management commands don't need the terminal channel, so no Open */
+	if (IOServiceOpen(serviceObject, mach_task_self(), 0, &connectionPort) != KERN_SUCCESS)
+		errx(1, "IOServiceOpen failed");
+	IOObjectRelease(serviceObject);
+}
+
+/*
+ * Take one reply (or adapter_http's failure): keep its piece of the
+ * response, and say whether that was the last (1), there's more (0), or
+ * it went wrong (a TUNNEL_ failure).
+ */
+int
+tunnel_reply(const uint8_t *reply, int got, struct buf *response)
+{
+	int	last;
+
+	if (got < 0)
+		return(got);
+	last = 0;
+	if (framed) {
+		if (got < 1)
+			return(TUNNEL_FAILED);
+		if ((reply[0] != HTTP_MORE) && (reply[0] != GUI_OK)) {
+			if (verbose)
+				warnx("GUI_HTTP refused: 0x%x", reply[0]);
+			return(TUNNEL_FAILED);
+		}
+		last = (reply[0] == GUI_OK);
+		reply++;
+		got--;
+	} else if (got == 0) {
+		/* nothing yet, or nothing more */
+		if (response->len > 0)
+			return(1);
+		usleep(POLL_US);
+		return(0);
+	}
+	if (response->len + got > MAX_RESPONSE) {
+		warnx("response over %d bytes, refused", MAX_RESPONSE);
+		return(TUNNEL_FAILED);
+	}
+	buf_append(response, reply, got);
+	return(last);
+}
+
+/*
+ * Pass a request to the adapter and collect the response.  Returns the
+ * response length, or a TUNNEL_ failure.
+ */
+int
+tunnel(const char *request, int reqLen, struct buf *response)
+{
+	uint8_t	reply[GUI_MAX_LENGTH];
+	double	deadline;
+	int	off, len, got, done;
+
+	response->len = 0;
+	deadline = now() + request_timeout;
+	done = 0;
+	for (off = 0; off < reqLen; off += len) {
+		len = reqLen - off;
+		if (len > GUI_CHUNK)
+			len = GUI_CHUNK;
+		got = adapter_http((const uint8_t *)request + off, len, reply, sizeof(reply));
+		if ((done = tunnel_reply(reply, got, response)) < 0)
+			return(done);
+	}
+	while (!done) {
+		if (now() >= deadline) {
+			if (verbose)
+				warnx("no complete response in %d seconds", request_timeout);
+			return(TUNNEL_TIMEOUT);
+		}
+		got = adapter_http(NULL, 0, reply, sizeof(reply));
+		if ((done = tunnel_reply(reply, got, response)) < 0)
+			return(done);
+	}
+	return(response->len);
+}
+
+/*
+ * Static asset cache, most recently used first, bounded by cache_limit
+ * bytes.  Only bodies of successful GETs without a query string are kept.
+ */
+struct cache_entry {
+	struct cache_entry *next;
+	char		*path;
+	char		*data;
+	int		len;
+};
+struct cache_entry *cache;
+int		cache_size;
+int		cache_limit = 4 * 1024 * 1024;
+
+int
+cacheable(const char *method, const char *path)
+{
+	const char	*ext;
+	static const char *exts[] = {".gif", ".jpg", ".jpeg", ".png", ".ico", ".css", ".js", NULL};
+	int		i;
+
+	if (strcmp(method, "GET") || (strchr(path, '?') != NULL))
+		return(0);
+	if ((ext = strrchr(path, '.')) == NULL)
+		return(0);
+	for (i = 0; exts[i] != NULL; i++)
+		if (!strcasecmp(ext, exts[i]))
+			return(1);
+	return(0);
+}
+
+struct cache_entry *
+cache_find(const char *path)
+{
+	struct cache_entry **ep, *e;
+
+	for (ep = &cache; (e = *ep) != NULL; ep = &e->next) {
+		if (!strcmp(e->path, path)) {
+			/* move to the front */
+			*ep = e->next;
+			e->next = cache;
+			cache = e;
+			return(e);
+		}
+	}
+	return(NULL);
+}
+
+void
+cache_add(const char *path, const char *data, int len)
+{
+	struct cache_entry **ep, *e;
+
+	if (len > cache_limit / 4)
+		return;
+	if ((e = malloc(sizeof(*e))) == NULL)
+		return;
+	e->path = strdup(path);
+	e->data = malloc(len);
+	if ((e->path == NULL) || (e->data == NULL)) {
+		free(e->path);
+		free(e->data);
+		free(e);
+		return;
+	}
+	memcpy(e->data, data, len);
+	e->len = len;
+	e->next = cache;
+	cache = e;
+	cache_size += len;
+
+	/* drop the least recently used until we fit */
+	while (cache_size > cache_limit) {
+		for (ep = &cache; (*ep)->next != NULL; ep = &(*ep)->next)
+			;
+		e = *ep;
+		*ep = NULL;
+		cache_size -= e->len;
+		free(e->path);
+		free(e->data);
+		free(e);
+	}
+}
+
+/*
+ * Handle one request, from the cache if we can.  response points at the
+ * bytes to send back; it may be cache storage.  Returns the length, or a
+ * TUNNEL_ failure.
+ */
+int
+handle(const char *request, int reqLen, struct buf *scratch, const char **response)
+{
+	char		method[16], path[1024];
+	struct cache_entry *e;
+	int		len, cache_it;
+
+	cache_it = 0;
+	if (sscanf(request, "%15s %1023s", method, path) == 2) {
+		cache_it = cacheable(method, path);
+		if (cache_it && ((e = cache_find(path)) != NULL)) {
+			*response = e->data;
+			return(e->len);
+		}
+	}
+
+	if ((len = tunnel(request, reqLen, scratch)) < 0)
+		return(len);
+	if (len == 0)
+		return(TUNNEL_FAILED);
+	if (cache_it && (len > 12) && !strncmp(scratch->data + 8, " 200", 4))
+		cache_add(path, scratch->data, len);
+	*response = scratch->data;
+	return(len);
+}
+
+/*
+ * Read a whole request: headers, and a body if Content-Length says so.
+ */
+int
+read_request(int fd, struct buf *req)
+{
+	char	chunk[4096], *eoh, *cl;
+	int	got, want;
+
+	req->len = 0;
+	want = -1;
+	while ((want < 0) || (req->len < want)) {
+		if (req->len >= MAX_REQUEST)
+			return(-1);
+		if ((got = read(fd, chunk, sizeof(chunk))) <= 0)
+			return(-1);
+		buf_append(req, chunk, got);
+		buf_append(req, "", 1);
+		req->len--;
+		if ((want < 0) && ((eoh = strstr(req->data, "\r\n\r\n")) != NULL)) {
+			want = (eoh - req->data) + 4;
+			if (((cl = strcasestr(req->data, "\r\nContent-Length:")) != NULL) && (cl < eoh))
+				want += atoi(cl + 17);
+		}
+	}
+	return(req->len);
+}
+
+void
+serve(int port)
+{
+	struct sockaddr_in	sin;
+	struct buf		req, scratch;
+	struct timeval		tv;
+	const char		*response;
+	int			s, fd, on, len, off, put;
+	double			start;
+
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		err(1, "socket");
+	on = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	bzero(&sin, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(s, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+		err(1, "bind to port %d", port);
+	if (listen(s, 16) < 0)
+		err(1, "listen");
+
+	bzero(&req, sizeof(req));
+	bzero(&scratch, sizeof(scratch));
+	signal(SIGPIPE, SIG_IGN);
+
+	/* the adapter takes one request at a time, and so do we */
+	for (;;) {
+		if ((fd = accept(s, NULL, NULL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "accept");
+		}
+		/* don't let a client that never finishes its request hold up the others */
+		tv.tv_sec = READ_TIMEOUT;
+		tv.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		start = now();
+		if (read_request(fd, &req) > 0) {
+			switch (len = handle(req.data, req.len, &scratch, &response)) {
+			case TUNNEL_BUSY:
+				response = "HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+				break;
+			case TUNNEL_TIMEOUT:
+				response = "HTTP/1.0 504 Gateway Timeout\r\nContent-Length: 0\r\n\r\n";
+				break;
+			case TUNNEL_FAILED:
+				response = "HTTP/1.0 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n";
+				break;
+			}
+			if (len < 0)
+				len = strlen(response);
+			for (off = 0; off < len; off += put)
+				if ((put = write(fd, response + off, len - off)) <= 0)
+					break;
+			if (verbose)
+				printf("%.*s %d bytes %.1fms\n", (int)strcspn(req.data, "\r\n"), req.data,
+				       len, (now() - start) * 1000.0);
+			fflush(stdout);
+		}
+		close(fd);
+	}
+}
+
+void
+usage(void)
+{
+	errx(1, "usage: ArcHTTPBridge [-v] [-f] [-F] [-p port] [-c cache-kb] [-t seconds]\n"
+	     "  -p port    listen on localhost:port (default 8080)\n"
+	     "  -c kb      static asset cache size (default 4096, 0 for none)\n"
+	     "  -t seconds give up on a request after this long (default 30)\n"
+	     "  -F         replies start with a status byte (unconfirmed)\n"
+	     "  -f         stay in the foreground");
+}
+
+int
+main(int argc, char *argv[])
+{
+	int		ch, port, foreground;
+
+	port = 8080;
+	foreground = 0;
+	while ((ch = getopt(argc, argv, "vfFp:c:t:")) != -1) {
+		switch (ch) {
+		case 'v':
+			verbose = 1;
+			break;
+		case 'f':
+			foreground = 1;
+			break;
+		case 'F':
+			framed = 1;
+			break;
+		case 'p':
+			if ((port = atoi(optarg)) <= 0)
+				usage();
+			break;
+		case 'c':
+			cache_limit = atoi(optarg) * 1024;
+			break;
+		case 't':
+			if ((request_timeout = atoi(optarg)) <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	adapter_init();
+	if (!foreground && (daemon(0, 0) < 0))
+		err(1, "daemon");
+	serve(port);
+	return(0);
+}
@@ -36,14 +36,22 @@
 
 #define DEBUG
 
+// Time every trip through the command gates, published as "gate-statistics"
+// (see gateEnter).  Costs two clock reads per trip, so it is off by default.
+//#define ARCMSR_GATE_STATS
+
 // System headers
 
 #include <libkern/OSByteOrder.h>
+#include <sys/kauth.h>
 
 #include <IOKit/assert.h>
 #include <IOKit/IOBufferMemoryDescriptor.h>
 #include <IOKit/IOCommand.h>
+#include <IOKit/IOCommandGate.h>
 #include <IOKit/IOCommandPool.h>
+#include <IOKit/IODataQueue.h>
+#include <IOKit/IOInterruptEventSource.h>
 #include <IOKit/IOKitKeys.h>
 #include <IOKit/IOLib.h>
 #include <IOKit/IOMemoryCursor.h>
@@ -53,8 +61,11 @@
 #include <IOKit/IOService.h>
 #include <IOKit/IOTimerEventSource.h>
 #include <IOKit/IOUserClient.h>
+#include <IOKit/IOWorkLoop.h>
 #include <IOKit/pci/IOPCIDevice.h>
 #include <IOKit/scsi-parallel/IOSCSIParallelInterfaceController.h>
+#include <IOKit/scsi/IOSCSITargetDevice.h>
+#include <IOKit/scsi/IOSCSILogicalUnitNub.h>
 #include <IOKit/storage/IOStorageDeviceCharacteristics.h>
 #include <IOKit/pwr_mgt/RootDomain.h>
 
@@ -63,12 +74,137 @@
 // ARCMSR_STATUS_INTERVAL
 //
 // The interval at which the driver will poll the adapter to check for changes in target status, in
-// milliseconds.  This value is a tradeoff between the overhead introduced by polling, and the risk
-// that a user may delete a volume and create a new one at the same address within the polling
-// interval
+// milliseconds, when it cannot watch the adapter event log (the firmware does not support event
+// polling, or an event poll is stuck behind other management traffic).  This value is a tradeoff between the
+// overhead introduced by polling, and the risk that a user may delete a volume and create a new one
+// at the same address within the polling interval
 //
 #define ARCMSR_STATUS_INTERVAL		5000
 
+// ARCMSR_STATUS_INTERVAL_MIN, ARCMSR_STATUS_INTERVAL_MAX
+//
+// Bounds on the interval at which the driver polls the adapter event log, in milliseconds.  The
+// adapter configuration is only fetched when the event log reports activity.  The interval drops
+// to the minimum after any change and doubles each time a poll finds nothing new, so a stable
+// configuration costs one short management command every few minutes.
+//
+#define ARCMSR_STATUS_INTERVAL_MIN	1000
+#define ARCMSR_STATUS_INTERVAL_MAX	(4 * 60 * 1000)
+
+// ARCMSR_GUI_TIMEOUT
+//
+// How long the driver will wait for the adapter to answer a management command that the driver
+// has issued itself, in milliseconds.
+//
+#define ARCMSR_GUI_TIMEOUT		3000
+
+// ARCMSR_GUI_QUEUE_TIMEOUT
+//
+// How long a management command may wait for the message channel while a terminal client or the
+// loopback path holds it, in milliseconds.  Commands still waiting after that are failed with
+// kIOReturnExclusiveAccess, so nobody waits on a terminal session that may last all day.
+//
+#define ARCMSR_GUI_QUEUE_TIMEOUT	10000
+
+// ARCMSR_BROKER_QUEUE_DEPTH
+//
+// How many management commands a single userclient may have waiting for the message channel.
+// Further commands are refused with kIOReturnBusy rather than left to grow the queue.
+//
+#define ARCMSR_BROKER_QUEUE_DEPTH	4
+
+// ARCMSR_STREAM_STALL_TIMEOUT
+//
+// How long a streamed message channel payload may go without the adapter taking any of it
+// before the driver gives up on the rest, in milliseconds, if the client doesn't say.
+//
+#define ARCMSR_STREAM_STALL_TIMEOUT	5000
+
+// ARCMSR_STREAM_WINDOW
+//
+// How much of a streamed payload is wired at a time, in bytes.  The adapter takes
+// one message buffer per doorbell, so a larger window buys nothing but wired
+// memory.
+//
+#define ARCMSR_STREAM_WINDOW		(64 * 1024)
+
+// ARCMSR_MESSAGE_TIMEOUT
+//
+// How long the driver will spin waiting for the adapter to acknowledge a message0 command
+// (get config, flush cache, etc.) when interrupts are not in use, in milliseconds.
+//
+#define ARCMSR_MESSAGE_TIMEOUT		20000
+
+// ARCMSR_SHUTDOWN_DRAIN_TIMEOUT, ARCMSR_SHUTDOWN_TIMEOUT
+//
+// When the adapter is stopped, the driver stops accepting new commands and waits up to
+// ARCMSR_SHUTDOWN_DRAIN_TIMEOUT for those already issued to complete.  The whole stop
+// sequence (drain, wait for the adapter to go idle, flush the cache) is bounded by
+// ARCMSR_SHUTDOWN_TIMEOUT.  Both are in milliseconds.  The cache flush is always
+// attempted, and is allowed at least ARCMSR_SHUTDOWN_FLUSH_MIN however little time
+// remains.
+//
+#define ARCMSR_SHUTDOWN_DRAIN_TIMEOUT	10000
+#define ARCMSR_SHUTDOWN_TIMEOUT		30000
+#define ARCMSR_SHUTDOWN_FLUSH_MIN	5000
+
+// ARCMSR_FIRMWARE_TIMEOUT
+//
+// How long to wait for the adapter firmware to report ready, at attach time and when
+// coming back from sleep, in milliseconds.
+//
+#define ARCMSR_FIRMWARE_TIMEOUT		1000
+
+// ARCMSR_REBUILD_*
+//
+// Defaults for the background rebuild scheduler, which holds back background rebuild
+// and verify while the host is keeping the adapter busy.  Foreground load is sampled
+// every ARCMSR_REBUILD_SAMPLE_INTERVAL milliseconds.  A sample is busy if the command
+// rate reaches ARCMSR_REBUILD_BUSY_IOPS or the average completion latency reaches
+// ARCMSR_REBUILD_BUSY_LATENCY (us), and idle if the rate and latency are no more than
+// ARCMSR_REBUILD_IDLE_IOPS and ARCMSR_REBUILD_IDLE_LATENCY.  Background work is held
+// back after ARCMSR_REBUILD_BUSY_SAMPLES consecutive busy samples and let go again after
+// ARCMSR_REBUILD_IDLE_SAMPLES consecutive idle samples.
+//
+// ARCMSR_REBUILD_POLICY is one of "pause" (stop and restart background rebuild),
+// "priority" (switch between the busy and idle rebuild priorities, 0 to 3) or "off".
+// Only "priority" keeps a rebuild moving under sustained load, so it is the default.
+// Under "pause" a rebuild is never held back for more than ARCMSR_REBUILD_MAX_PAUSE ms at
+// a time, and once let go it runs for at least ARCMSR_REBUILD_MIN_RUN ms however busy the
+// host is, so a degraded array always gets some of the adapter's time.
+// Each of these may be overridden by the correspondingly-named personality property
+// (eg. RebuildBusyIOPS); see rebuildInit.
+//
+#define ARCMSR_REBUILD_SAMPLE_INTERVAL	1000
+#define ARCMSR_REBUILD_BUSY_IOPS	200
+#define ARCMSR_REBUILD_BUSY_LATENCY	20000
+#define ARCMSR_REBUILD_IDLE_IOPS	20
+#define ARCMSR_REBUILD_IDLE_LATENCY	5000
+#define ARCMSR_REBUILD_BUSY_SAMPLES	2
+#define ARCMSR_REBUILD_IDLE_SAMPLES	10
+#define ARCMSR_REBUILD_POLICY		"priority"
+#define ARCMSR_REBUILD_MAX_PAUSE	(2 * 60 * 1000)
+#define ARCMSR_REBUILD_MIN_RUN		(30 * 1000)
+#define ARCMSR_REBUILD_BUSY_PRIORITY	0
+#define ARCMSR_REBUILD_IDLE_PRIORITY	3
+
+// ARCMSR_MONITOR_INTERVAL
+//
+// How often the driver samples the adapter's fans, voltages and temperatures for the hardware
+// monitor history, in milliseconds, unless overridden by the MonitorInterval personality
+// property.  Each sample is one management command; 0 turns sampling off, and anything else
+// below ARCMSR_MONITOR_INTERVAL_MIN is raised to it.
+//
+#define ARCMSR_MONITOR_INTERVAL		10000
+#define ARCMSR_MONITOR_INTERVAL_MIN	1000
+
+// ARCMSR_GUI_PASSWORD
+//
+// The adapter password the driver uses for management commands that require one, unless
+// overridden by the ManagementPassword personality property.  This is the factory default.
+//
+#define ARCMSR_GUI_PASSWORD		"0000"
+
 // ARCMSR_MAX_OUTSTANDING_SRB
 //
 // The upper bound on the number of SRBs we permit outstanding.  At present this must not
@@ -88,6 +224,7 @@ class ArcMSREventSource;
 #include "ArcMSRUserClientInterface.h"
 #include "ArcMSRUserClient.h"
 #include "ArcMSRRegisters.h"
+#include "ArcMSRManagement.h"
 #include "ArcMSRUtils.h"
 #include "ArcMSRController.h"
 
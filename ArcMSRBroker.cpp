@@ -0,0 +1,312 @@
+//-
+//
+// @APPLE_LICENSE_HEADER_START@
+// 
+// Copyright (c) 2005 Apple Computer, Inc.  All Rights Reserved.
+// 
+// This file contains Original Code and/or Modifications of Original Code
+// as defined in and that are subject to the Apple Public Source License
+// Version 2.0 (the 'License'). You may not use this file except in
+// compliance with the License. Please obtain a copy of the License at
+// http://www.opensource.apple.com/apsl/ and read it before using this
+// file.
+// 
+// The Original Code and all software distributed under the License are
+// distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+// EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+// INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+// Please see the License for the specific language governing rights and
+// limitations under the License.
+// 
+// @APPLE_LICENSE_HEADER_END@
+
+// $Id$
+
+#include "ArcMSR.h"
+
+#define self ArcMSR
+
+////////////////////////////////////////////////////////////////////////////////
+// Management broker
+//
+// Any number of userclients may send GUI protocol commands, either as a
+// whole frame or as an opcode and arguments for us to frame.  A client's
+// commands wait on its own queue; the GUI engine in the management module
+// takes the driver's own requests first and then one command from each
+// client in turn, so a busy tool cannot starve a monitoring agent.  Since
+// only one command is ever outstanding on the channel, each reply is known
+// to belong to the command that went before it and goes back to the client
+// that sent it.
+//
+// The calling thread sleeps until its command completes.  A command still
+// queued is given up if the thread is interrupted, or failed by the engine
+// if a terminal client holds the channel for too long; commands already on
+// the channel are never abandoned, so the request stays valid until the
+// engine has finished with it.
+//
+// Everything here runs on the management workloop with its gate held.
+//
+
+MANAGEMENTGATE_GLUE1(brokerAttach, struct arcmsr_broker_client *);
+
+void
+self::brokerAttach(struct arcmsr_broker_client *client)
+{
+	client->queue = NULL;
+	client->queued = 0;
+	client->next = brokerClients;
+	brokerClients = client;
+	brokerCount++;
+	debug(DEBUGF_MANAGEMENT, "broker client attached, %d now", brokerCount);
+	brokerPublish();
+}
+
+MANAGEMENTGATE_GLUE1(brokerDetach, struct arcmsr_broker_client *);
+
+void
+self::brokerDetach(struct arcmsr_broker_client *client)
+{
+	struct arcmsr_broker_client **cp;
+	struct arcmsr_gui_request *req;
+
+	for (cp = &brokerClients; *cp != NULL; cp = &(*cp)->next) {
+		if (*cp == client) {
+			*cp = client->next;
+			brokerCount--;
+			break;
+		}
+	}
+	if (brokerTurn == client)
+		brokerTurn = brokerClients;
+
+	// anything not yet sent is abandoned; the waiting threads go home
+	while ((req = client->queue) != NULL) {
+		client->queue = req->next;
+		brokerFail(req, kIOReturnAborted);
+	}
+	client->queued = 0;
+	debug(DEBUGF_MANAGEMENT, "broker client detached, %d left", brokerCount);
+	brokerPublish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Queue a client's command and wait for it to complete
+//
+// The frame has already been checked and unpacked into breq by the
+// userclient.  Returns with breq->gui.status set.
+//
+MANAGEMENTGATE_GLUE2(brokerCommand, struct arcmsr_broker_client *, struct arcmsr_broker_request *);
+
+void
+self::brokerCommand(struct arcmsr_broker_client *client, struct arcmsr_broker_request *breq)
+{
+	struct arcmsr_gui_request *req, **rp;
+	int		interruptible, result;
+
+	req = &breq->gui;
+	if (client->queued >= ARCMSR_BROKER_QUEUE_DEPTH) {
+		debug(DEBUGF_MANAGEMENT, "broker client queue full");
+		client->stats.rejected++;
+		brokerStats.rejected++;
+		req->status = kIOReturnBusy;
+		return;
+	}
+
+	req->busy = true;
+	req->loggingIn = false;			// clients log themselves in
+	req->loggedIn = false;
+	req->next = NULL;
+	req->client = client;
+	req->args = breq->args;
+	req->done = &ArcMSR::brokerDone;
+	breq->finished = false;
+	breq->replyLen = 0;
+	clock_get_uptime(&req->queuedTime);
+	req->sentTime = 0;
+	for (rp = &client->queue; *rp != NULL; rp = &(*rp)->next)
+		;
+	*rp = req;
+	client->queued++;
+	if ((uint32_t)client->queued > client->stats.maxQueued)
+		client->stats.maxQueued = client->queued;
+	client->stats.submitted++;
+	brokerStats.submitted++;
+	debug(DEBUGF_MANAGEMENT, "broker queued command 0x%02x, %d waiting", req->opcode, client->queued);
+
+	// once a command is on the channel we have to see it through
+	GUIstart();
+	interruptible = THREAD_ABORTSAFE;
+	while (!breq->finished) {
+		result = managementGate->commandSleep(breq, interruptible);
+		if ((result == THREAD_INTERRUPTED) || (result == THREAD_TIMED_OUT)) {
+			if (brokerWithdraw(req))
+				brokerFail(req, kIOReturnAborted);
+			interruptible = THREAD_UNINT;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Pick the next client command for the GUI engine
+//
+// brokerPeek finds the first client at or after the current turn with
+// something queued; brokerDequeue takes it and passes the turn on.
+//
+struct arcmsr_gui_request *
+self::brokerPeek(void)
+{
+	struct arcmsr_broker_client *client;
+	int	i;
+
+	if ((client = brokerTurn) == NULL)
+		client = brokerClients;
+	for (i = 0; i < brokerCount; i++) {
+		if (client->queue != NULL) {
+			brokerTurn = client;
+			return(client->queue);
+		}
+		if ((client = client->next) == NULL)
+			client = brokerClients;
+	}
+	return(NULL);
+}
+
+void
+self::brokerDequeue(struct arcmsr_gui_request *req)
+{
+	struct arcmsr_broker_client *client;
+
+	client = req->client;
+	client->queue = req->next;
+	client->queued--;
+	if ((brokerTurn = client->next) == NULL)
+		brokerTurn = brokerClients;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Take back client commands that haven't been sent
+//
+// brokerWithdraw unlinks one command, returning false if it has already
+// left the queue.  brokerFail completes an unsent command with status.
+// brokerExpire fails every command queued before cutoff and returns when
+// the oldest of the rest was queued, or 0 if there are none.
+//
+bool
+self::brokerWithdraw(struct arcmsr_gui_request *req)
+{
+	struct arcmsr_broker_client *client;
+	struct arcmsr_gui_request **rp;
+
+	client = req->client;
+	for (rp = &client->queue; *rp != NULL; rp = &(*rp)->next) {
+		if (*rp == req) {
+			*rp = req->next;
+			client->queued--;
+			return(true);
+		}
+	}
+	return(false);
+}
+
+void
+self::brokerFail(struct arcmsr_gui_request *req, IOReturn status)
+{
+	req->busy = false;
+	req->status = status;
+	req->reply = NULL;
+	req->replyLen = 0;
+	(this->*req->done)(req);
+}
+
+uint64_t
+self::brokerExpire(uint64_t cutoff)
+{
+	struct arcmsr_broker_client *client;
+	struct arcmsr_gui_request *req;
+	uint64_t	oldest;
+
+	oldest = 0;
+	for (client = brokerClients; client != NULL; client = client->next) {
+		while (((req = client->queue) != NULL) && (req->queuedTime < cutoff)) {
+			debug(DEBUGF_MANAGEMENT, "client command 0x%02x expired waiting for the channel", req->opcode);
+			client->queue = req->next;
+			client->queued--;
+			brokerFail(req, kIOReturnExclusiveAccess);
+		}
+		if ((req != NULL) && ((oldest == 0) || (req->queuedTime < oldest)))
+			oldest = req->queuedTime;
+	}
+	return(oldest);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A client command has completed
+//
+// The reply payload is reframed so the client can have exactly what the
+// adapter sent, or just the payload.
+//
+void
+self::brokerDone(struct arcmsr_gui_request *req)
+{
+	struct arcmsr_broker_request *breq;
+
+	breq = (struct arcmsr_broker_request *)req;
+	if ((req->status == kIOReturnSuccess) && (req->replyLen > 0)) {
+		bcopy(req->reply, &breq->reply[GUI_FRAME_BODY], req->replyLen);
+		breq->replyLen = GUIframe(breq->reply, req->replyLen);
+	}
+
+	brokerAccount(&req->client->stats, req);
+	brokerAccount(&brokerStats, req);
+	brokerPublish();
+
+	breq->finished = true;
+	managementGate->commandWakeup(breq, false);
+}
+
+void
+self::brokerAccount(struct arcmsr_broker_stats *stats, struct arcmsr_gui_request *req)
+{
+	uint64_t	now, elapsed;
+
+	if (req->status == kIOReturnSuccess) {
+		stats->completed++;
+	} else {
+		stats->failed++;
+	}
+
+	// aborted commands were never sent
+	clock_get_uptime(&now);
+	if (req->sentTime >= req->queuedTime) {
+		absolutetime_to_nanoseconds(req->sentTime - req->queuedTime, &elapsed);
+		stats->queueTime += elapsed / 1000;
+		absolutetime_to_nanoseconds(now - req->sentTime, &elapsed);
+		stats->serviceTime += elapsed / 1000;
+	} else {
+		absolutetime_to_nanoseconds(now - req->queuedTime, &elapsed);
+		stats->queueTime += elapsed / 1000;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Publish broker totals as "broker-statistics"; each userclient publishes
+// its own figures in the same form
+//
+void
+self::brokerPublish(void)
+{
+	OSDictionary	*dict;
+
+	if ((dict = OSDictionary::withCapacity(8)) == NULL)
+		return;
+	dictSetNumber(dict, "clients", brokerCount);
+	dictSetNumber(dict, "submitted", brokerStats.submitted);
+	dictSetNumber(dict, "completed", brokerStats.completed);
+	dictSetNumber(dict, "failed", brokerStats.failed);
+	dictSetNumber(dict, "rejected", brokerStats.rejected);
+	dictSetNumber(dict, "queue-us", brokerStats.queueTime);
+	dictSetNumber(dict, "service-us", brokerStats.serviceTime);
+	setProperty("broker-statistics", dict);
+	dict->release();
+}
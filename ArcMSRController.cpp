@@ -43,7 +43,7 @@ bool
 self::InitializeController(void)
 {
 	const OSSymbol *userClient;
-	int		i;
+	int		i, j;
 
 	set_debug_flags("error,event");
 	
@@ -61,9 +61,61 @@ self::InitializeController(void)
 	// client mutex
 	clientActive = false;
 
+	// no shared rings or notification port until a client asks
+	sharedIn = NULL;
+	sharedOut = NULL;
+	notifyClient = NULL;
+	notifyArmed = false;
+	writableArmed = false;
+	streamBuf = NULL;
+	bzero(&MQStats, sizeof(MQStats));
+
+	// nothing outstanding, accepting commands
+	adapterState = 0;
+	activeSRB = 0;
+	msg0Current = ARCMSR_INBOUND_MESG0_NOP;
+	msg0Wanted = 0;
+	powerManaged = false;
+
+	// no cache flushes in flight
+	for (i = 0; i < ARCMSR_MAX_TARGETID; i++) {
+		for (j = 0; j < ARCMSR_MAX_TARGETLUN; j++) {
+			flushState[i][j].carrierTag = -1;
+			flushState[i][j].riders = NULL;
+			flushState[i][j].next = NULL;
+		}
+	}
+	bzero(&flushStats, sizeof(flushStats));
+	heldTasks = NULL;
+
 	// zero the initial device maps
 	bzero(deviceMap, sizeof(deviceMap));
 	bzero(deviceMapUpdate, sizeof(deviceMapUpdate));
+	bzero(&scanStats, sizeof(scanStats));
+	deviceChangeTime = 0;
+
+	// no management commands yet
+	guiQueue = NULL;
+	guiActive = NULL;
+	guiFinished = NULL;
+	managementWorkLoop = NULL;
+	managementGate = NULL;
+	doorbellSource = NULL;
+	guiDoneSource = NULL;
+	doorbellPending = 0;
+	outboundMQTimeout = NULL;
+	inboundMQTimeout = NULL;
+	guiTimeout = NULL;
+#ifdef ARCMSR_GATE_STATS
+	bzero(gateStats, sizeof(gateStats));
+#endif
+	brokerClients = NULL;
+	brokerTurn = NULL;
+	brokerCount = 0;
+	bzero(&brokerStats, sizeof(brokerStats));
+	bzero(&deviceScanRequest, sizeof(deviceScanRequest));
+	deviceScanRequest.opcode = GUI_POLL_EVENT;
+	deviceScanRequest.done = &ArcMSR::deviceScanDone;
 	
 	//
 	// PCI configuration
@@ -119,7 +171,11 @@ self::InitializeController(void)
 	//
 	// Initialise message queue handling
 	//
+	if (!managementInit())
+		goto fail;
 	inboundMQBuffer.init(ARCMSR_MESSAGE_BUFFER);
+	inboundMQBuffer.setWatermarks(ARCMSR_MESSAGE_BUFFER / 2, ARCMSR_MESSAGE_BUFFER,
+				      &ArcMSR::inboundMQWatermark, this);
 	outboundMQBuffer.init(ARCMSR_MESSAGE_BUFFER);    
 	MQFlags |= ARCMSR_MQF_UNDERFLOW;		// no send data pending
 
@@ -127,12 +183,59 @@ self::InitializeController(void)
 								 OSMemberFunctionCast(IOTimerEventSource::Action,
 										      this,
 										      &ArcMSR::outboundMQWakeup));
-	if (GetWorkLoop()->addEventSource(outboundMQTimeout)) {
+	if (managementWorkLoop->addEventSource(outboundMQTimeout)) {
+		error("could not add message queue timeout source to workloop");
+		goto fail;
+	}
+	inboundMQTimeout = IOTimerEventSource::timerEventSource(this,
+								OSMemberFunctionCast(IOTimerEventSource::Action,
+										     this,
+										     &ArcMSR::inboundMQWakeup));
+	if (managementWorkLoop->addEventSource(inboundMQTimeout)) {
 		error("could not add message queue timeout source to workloop");
 		goto fail;
 	}
 	debug(DEBUGF_MESSAGES, "message queues initialised, %d bytes in/out buffer", ARCMSR_MESSAGE_BUFFER);
 
+	guiTimeout = IOTimerEventSource::timerEventSource(this,
+							  OSMemberFunctionCast(IOTimerEventSource::Action,
+									       this,
+									       &ArcMSR::GUItimeout));
+	if (managementWorkLoop->addEventSource(guiTimeout)) {
+		error("could not add management command timeout source to workloop");
+		goto fail;
+	}
+
+	//
+	// Initialise the background rebuild scheduler
+	//
+	if (!rebuildInit())
+		goto fail;
+
+	//
+	// Allocate the I/O statistics
+	//
+	if (!statsInit())
+		goto fail;
+
+	//
+	// Allocate the adapter inventory
+	//
+	if (!inventoryInit())
+		goto fail;
+
+	//
+	// Initialise the hardware monitor sampler
+	//
+	if (!monitorInit())
+		goto fail;
+
+	//
+	// Initialise the adapter event stream
+	//
+	if (!eventInit())
+		goto fail;
+
 	//
 	// Initialise the device scanner
 	//
@@ -177,9 +280,8 @@ self::InitializeController(void)
 	//
 	// Initialize Power Management
 	//
-    
-	// XXX
-	debug(DEBUGF_POWER, "XXX power management not implemented");
+	if (!powerInit())
+		goto fail;
     
 	//
 	// Create the UserClient
@@ -204,6 +306,9 @@ self::InitializeController(void)
 fail:
 	error("Initialisation failed");
 	showStatus("Initialisation failed");
+
+	// the management workloop has its own thread; don't leave it running
+	managementStop();
 	return(false);
 }
 
@@ -213,6 +318,8 @@ fail:
 void
 self::TerminateController(void)
 {
+	powerStop();
+
 	SRBPool->complete();
 	SRBPool->release();
 
@@ -223,8 +330,14 @@ self::TerminateController(void)
 	if (deviceScanTimer)
 		deviceScanTimer->release();
 	
-	if (outboundMQTimeout)
-		outboundMQTimeout->release();
+	managementStop();
+	inventoryFree();
+	statsFree();
+	monitorFree();
+	eventFree();
+
+	if (rebuildTimer)
+		rebuildTimer->release();
 	
 	if (asyncEventSource)
 		asyncEventSource->release();
@@ -247,33 +360,180 @@ self::StartController(void)
 {
 	debug(DEBUGF_MISC, "start adapter");
 	
+	setQuiescedInvoke(false);
+	CTLstartBackgroundRebuild();		// polled, so before interrupts are on
 	CTLenableInterrupts();
-	CTLstartBackgroundRebuild();
+	rebuildStart();
+	monitorStart();
+	adapterState |= ARCMSR_STATE_RUNNING;
 
 	// kick off the device scan timer
+	deviceScanInterval = ARCMSR_STATUS_INTERVAL_MIN;
+	deviceScanEvents = true;
 	deviceScanTimer->enable();
 	deviceScanTimer->setTimeoutMS(1);		// scan ASAP
 	debug(DEBUGF_RESCAN, "rescan handler started");
+
+	// find out what the adapter has, and where its event log is
+	inventoryRefreshInvoke();
+	eventRefreshInvoke();
     
 	showStatus("started");
 	return(true);
 };
 
+////////////////////////////////////////////////////////////////////////////////
+// Stop the adapter
+//
+// This is on the shutdown/restart path, so it must complete in bounded time
+// even if the adapter is wedged.  New commands are refused, those already
+// issued are given ARCMSR_SHUTDOWN_DRAIN_TIMEOUT to complete, and the adapter
+// is asked to confirm that it is idle before the cache is flushed.  Whatever
+// happens, the flush is always attempted.
+//
 void
 self::StopController(void)
 {
-	debug(DEBUGF_MISC, "stop adapter");
+	OSDictionary	*dict;
+	uint64_t	start, deadline, phase, now;
+	uint64_t	drainTime, idleTime, flushTime, totalTime;
+	uint32_t	remaining;
+	bool		drained, idle, flushed;
 
-	CTLstopBackgroundRebuild();
-	CTLflushCache();
-	CTLdisableInterrupts();
-	
+	debug(DEBUGF_MISC, "stop adapter");
+	adapterState &= ~ARCMSR_STATE_RUNNING;
+	clock_get_uptime(&start);
+	clock_interval_to_deadline(ARCMSR_SHUTDOWN_TIMEOUT, kMillisecondScale, &deadline);
+
+	// stop accepting new commands and wait for the old ones to finish
+	showStatus("draining outstanding commands");
+	drained = quiesceIO(ARCMSR_SHUTDOWN_DRAIN_TIMEOUT);
+	setHoldingInvoke(false);	// anything held over sleep fails now
+	clock_get_uptime(&phase);
+	drainTime = phase - start;
+
+	// no more management traffic
+	rebuildStop();
+	monitorStop();
 	deviceScanTimer->disable();
 	debug(DEBUGF_RESCAN, "rescan handler stopped");
+	CTLdisableInterrupts();
+
+	// ask the adapter to finish up anything it's still working on
+	showStatus("waiting for adapter to go idle");
+	remaining = deadlineRemainingMS(deadline);
+	idle = false;
+	if (remaining > 0) {
+		CTLstopBackgroundRebuild(remaining);
+		remaining = deadlineRemainingMS(deadline);
+		if (remaining > 0)
+			idle = CTLwaitIdle(remaining);
+	}
+	clock_get_uptime(&now);
+	idleTime = now - phase;
+	phase = now;
+
+	// flush the cache, even if we've blown the budget
+	remaining = deadlineRemainingMS(deadline);
+	if (remaining < ARCMSR_SHUTDOWN_FLUSH_MIN)
+		remaining = ARCMSR_SHUTDOWN_FLUSH_MIN;
+	flushed = CTLflushCache(remaining);
+	clock_get_uptime(&now);
+	flushTime = now - phase;
+	totalTime = now - start;
+
+	absolutetime_to_nanoseconds(drainTime, &drainTime);
+	absolutetime_to_nanoseconds(idleTime, &idleTime);
+	absolutetime_to_nanoseconds(flushTime, &flushTime);
+	absolutetime_to_nanoseconds(totalTime, &totalTime);
+
+	if ((dict = OSDictionary::withCapacity(8)) != NULL) {
+		dictSetNumber(dict, "drain-ms", drainTime / 1000000);
+		dictSetNumber(dict, "idle-ms", idleTime / 1000000);
+		dictSetNumber(dict, "flush-ms", flushTime / 1000000);
+		dictSetNumber(dict, "total-ms", totalTime / 1000000);
+		dictSetNumber(dict, "abandoned-commands", drained ? 0 : activeSRB);
+		dict->setObject("adapter-idle", idle ? kOSBooleanTrue : kOSBooleanFalse);
+		dict->setObject("cache-flushed", flushed ? kOSBooleanTrue : kOSBooleanFalse);
+		setProperty("shutdown-statistics", dict);
+		dict->release();
+	}
+	IOLog("ArcMSR: stopped in %llums (drain %llums%s, idle %llums%s, flush %llums%s)\n",
+	      totalTime / 1000000,
+	      drainTime / 1000000, drained ? "" : " INCOMPLETE",
+	      idleTime / 1000000, idle ? "" : " INCOMPLETE",
+	      flushTime / 1000000, flushed ? "" : " FAILED");
 
-	showStatus("stopped");
+	showStatus(flushed ? "stopped" : "stopped, cache flush failed");
 };
 
+////////////////////////////////////////////////////////////////////////////////
+// Milliseconds left before (deadline), or zero if it has passed
+//
+uint32_t
+self::deadlineRemainingMS(uint64_t deadline)
+{
+	uint64_t	now, ns;
+
+	clock_get_uptime(&now);
+	if (now >= deadline)
+		return(0);
+	absolutetime_to_nanoseconds(deadline - now, &ns);
+	return((uint32_t)(ns / 1000000));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Stop accepting new commands and wait for outstanding commands to complete
+//
+// Interrupts may not be delivered if we are called with the workloop held,
+// so completions are polled for directly.  Returns true if everything
+// completed before (timeout) milliseconds had passed.
+//
+bool
+self::quiesceIO(uint32_t timeout)
+{
+	uint64_t	deadline, now;
+	int		count;
+
+	setQuiescedInvoke(true);
+	clock_interval_to_deadline(timeout, kMillisecondScale, &deadline);
+	for (;;) {
+		pollOutstandingInvoke(&count);
+		if (count == 0) {
+			debug(DEBUGF_SRB, "all commands drained");
+			return(true);
+		}
+		clock_get_uptime(&now);
+		if (now >= deadline)
+			break;
+		IOSleep(10);
+	}
+	error("gave up waiting for %d outstanding commands", count);
+	return(false);
+}
+
+COMMANDGATE_GLUE1(setQuiesced, bool);
+
+void
+self::setQuiesced(bool state)
+{
+	if (state) {
+		adapterState |= ARCMSR_STATE_QUIESCED;
+	} else {
+		adapterState &= ~ARCMSR_STATE_QUIESCED;
+	}
+	debug(DEBUGF_SRB, "%s new commands", state ? "refusing" : "accepting");
+}
+
+COMMANDGATE_GLUE1(pollOutstanding, int *);
+
+void
+self::pollOutstanding(int *count)
+{
+	handlePostQueueInterrupt();
+	*count = activeSRB;
+}
+
 
 //////////////////////////////////////////////////////////////////////////////
 // Command tag management
@@ -286,12 +546,22 @@ void
 self::getTag(int *tagp)
 {
 	uint32_t	tag;
-	
+
+	if (adapterState & ARCMSR_STATE_QUIESCED) {
+		*tagp = -1;
+		debug(DEBUGF_SRB, "quiesced, not vending tags");
+		return;
+	}
 	if (freeSRB.remove(&tag) == 1) {
+		activeSRB++;
+		if (activeSRB > (int)stats->tagsPeak)
+			stats->tagsPeak = activeSRB;
+		clock_get_uptime(&SRBStart[tag]);
 		*tagp = tag;
 		debug(DEBUGF_SRB, "vending tag %d", tag);
 	} else {
 		*tagp = -1;
+		stats->tagsExhausted++;
 		debug(DEBUGF_SRB, "no free tags to vend");
 	}
 }
@@ -303,12 +573,102 @@ self::returnTag(int tag)
 {
 	debug(DEBUGF_SRB, "freeing tag %d", tag);
 	freeSRB.insert((uint32_t)tag);
+	activeSRB--;
+}
+
+#ifdef ARCMSR_GATE_STATS
+//////////////////////////////////////////////////////////////////////////////
+// Gate accounting
+//
+// Every trip through one of our gates records how long the caller waited
+// to get in and how long it stayed.  The glue calls us with the gate held,
+// which is all the locking each gate's figures need.
+//
+uint64_t
+self::gateEnter(int which, uint64_t *called)
+{
+	struct arcmsr_gate_stats *gs;
+	uint64_t	now, wait;
+
+	clock_get_uptime(&now);
+	wait = now - *called;
+	gs = &gateStats[which];
+	gs->calls++;
+	gs->waitTime += wait;
+	if (wait > gs->maxWait)
+		gs->maxWait = wait;
+	return(now);
+}
+
+void
+self::gateLeave(int which, uint64_t entered)
+{
+	struct arcmsr_gate_stats *gs;
+	uint64_t	now, hold;
+
+	clock_get_uptime(&now);
+	hold = now - entered;
+	gs = &gateStats[which];
+	gs->holdTime += hold;
+	if (hold > gs->maxHold)
+		gs->maxHold = hold;
+}
+
+COMMANDGATE_GLUE1(gateSnapshotIO, struct arcmsr_gate_stats *);
+
+void
+self::gateSnapshotIO(struct arcmsr_gate_stats *snap)
+{
+	*snap = gateStats[ARCMSR_GATE_IO];
+}
+
+MANAGEMENTGATE_GLUE1(gateSnapshotManagement, struct arcmsr_gate_stats *);
+
+void
+self::gateSnapshotManagement(struct arcmsr_gate_stats *snap)
+{
+	*snap = gateStats[ARCMSR_GATE_MANAGEMENT];
 }
 
+// Called without either gate held, when someone asks for the statistics
+void
+self::gatePublish(void)
+{
+	static const char *names[ARCMSR_GATES] = {"io", "management"};
+	struct arcmsr_gate_stats snap[ARCMSR_GATES];
+	OSDictionary	*dict, *gd;
+	uint64_t	ns;
+	int		i;
+
+	gateSnapshotIOInvoke(&snap[ARCMSR_GATE_IO]);
+	gateSnapshotManagementInvoke(&snap[ARCMSR_GATE_MANAGEMENT]);
+
+	if ((dict = OSDictionary::withCapacity(ARCMSR_GATES)) == NULL)
+		return;
+	for (i = 0; i < ARCMSR_GATES; i++) {
+		if ((gd = OSDictionary::withCapacity(5)) == NULL)
+			break;
+		dictSetNumber(gd, "calls", snap[i].calls);
+		absolutetime_to_nanoseconds(snap[i].waitTime, &ns);
+		dictSetNumber(gd, "wait-us", ns / 1000);
+		absolutetime_to_nanoseconds(snap[i].maxWait, &ns);
+		dictSetNumber(gd, "max-wait-us", ns / 1000);
+		absolutetime_to_nanoseconds(snap[i].holdTime, &ns);
+		dictSetNumber(gd, "hold-us", ns / 1000);
+		absolutetime_to_nanoseconds(snap[i].maxHold, &ns);
+		dictSetNumber(gd, "max-hold-us", ns / 1000);
+		dict->setObject(names[i], gd);
+		gd->release();
+	}
+	setProperty("gate-statistics", dict);
+	dict->release();
+}
+#endif
+
 //////////////////////////////////////////////////////////////////////////////
 // Ensure only one userclient can be active at a time
 //
-COMMANDGATE_GLUE1(setClientActive, bool *);
+MANAGEMENTGATE_GLUE1(setClientActive, bool *);
 
 void
 self::setClientActive(bool *state)
@@ -333,6 +693,7 @@ self::setClientActive(bool *state)
 			debug(DEBUGF_USERCLIENT, "client deactivation succeeded");
 			clientActive = false;	// turn off active flag
 			*state = true;		// success
+			GUIstart();		// send anything held while the client had the channel
 		}
 	}
 }
@@ -365,21 +726,144 @@ self::asyncEventHandler()
 ////////////////////////////////////////////////////////////////////////////////
 // Device scanner
 //
+// Rather than fetching the adapter configuration on every tick, we ask the
+// adapter whether anything has been added to its event log since we last
+// looked, and only fetch the configuration (and thus the device map) when
+// it has.  The adapter logs every configuration change, so the first poll
+// after any change both fetches the new map and tightens the interval.
+//
+// Note that a volume deleted and recreated at the same address still
+// leaves the device map unchanged; see targetRescan.
+//
+// The poll interval backs off while nothing is happening and drops back to
+// the minimum as soon as a change is seen.  If the channel is in use by a
+// userclient (the poll is held until it closes), or the adapter doesn't
+// understand the event poll, we fall back to fetching the configuration at
+// the fixed legacy interval.
+//
 void
 self::deviceScanStub(void */*refcon*/, OSObject *owner, IOTimerEventSource *es)
 {
 	ArcMSR	*ap;
+	uint32_t interval;
 
 	if ((ap = OSDynamicCast(ArcMSR, owner)) == NULL) {
 		error("device scan not signalled by ArcMSR");
 		return;
 	}
+
 	// initiate a scan and queue another instance
-	debug(DEBUGF_RESCAN, "periodic device rescan requesting current status");
-	setInboundMsgaddr0(ARCMSR_INBOUND_MESG0_GET_CONFIG);
-	debug(DEBUGF_RESCAN, "periodic device rescan setting new timeout");
-	ap->deviceScanTimer->setTimeoutMS(ARCMSR_STATUS_INTERVAL);
-	debug(DEBUGF_RESCAN, "periodic device rescan done");
+	if (deviceScanEvents && GUIsubmit(&deviceScanRequest)) {
+		debug(DEBUGF_RESCAN, "periodic device rescan polling event log");
+		scanStats.eventPolls++;
+		interval = deviceScanInterval;
+	} else if (deviceScanRequest.busy && !clientActive) {
+		debug(DEBUGF_RESCAN, "periodic device rescan still waiting for event poll");
+		interval = deviceScanInterval;
+	} else {
+		debug(DEBUGF_RESCAN, "periodic device rescan requesting current status");
+		CTLrequestConfig();
+		interval = ARCMSR_STATUS_INTERVAL;
+	}
+	scanStats.scannedTime += interval;
+	debug(DEBUGF_RESCAN, "periodic device rescan setting new timeout %dms", interval);
+	ap->deviceScanTimer->setTimeoutMS(interval);
+	deviceScanPublish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Handle the reply to an event log poll
+//
+// The adapter answers with a single status byte: GUI_OK if nothing has been
+// logged since the last poll, anything else (normally GUI_DISK_CONFIG_CHANGED)
+// if it has.  A longer reply carries a flag byte that is nonzero on change.
+//
+void
+self::deviceScanDone(struct arcmsr_gui_request *req)
+{
+	bool	changed;
+
+	if (req->status != kIOReturnSuccess) {
+		debug(DEBUGF_RESCAN, "event poll failed (0x%x), requesting current status", req->status);
+		CTLrequestConfig();
+		return;
+	}
+	if ((req->replyLen == 1) && (req->reply[0] == GUI_UNSUPPORTED_COMMAND)) {
+		debug(DEBUGF_RESCAN, "adapter does not support event polling, using legacy scan");
+		deviceScanEvents = false;
+		CTLrequestConfig();
+		return;
+	}
+	if (req->replyLen == 1) {
+		changed = (req->reply[0] != GUI_OK);
+	} else {
+		changed = (req->replyLen < 1) || (req->reply[0] != 0);
+	}
+
+	if (changed) {
+		debug(DEBUGF_RESCAN, "event log changed, requesting current status");
+		if (deviceChangeTime == 0)
+			clock_get_uptime(&deviceChangeTime);
+		deviceScanChanged();
+		CTLrequestConfig();
+		inventoryRefresh();
+		eventRefresh();
+	} else if (deviceScanInterval < ARCMSR_STATUS_INTERVAL_MAX) {
+		// nothing new, back off
+		deviceScanInterval *= 2;
+		if (deviceScanInterval > ARCMSR_STATUS_INTERVAL_MAX)
+			deviceScanInterval = ARCMSR_STATUS_INTERVAL_MAX;
+		debug(DEBUGF_RESCAN, "event log quiet, scan interval now %dms", deviceScanInterval);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Something changed; watch closely for a while
+//
+void
+self::deviceScanChanged(void)
+{
+	if (deviceScanInterval > ARCMSR_STATUS_INTERVAL_MIN) {
+		deviceScanInterval = ARCMSR_STATUS_INTERVAL_MIN;
+		deviceScanTimer->setTimeoutMS(deviceScanInterval);
+		debug(DEBUGF_RESCAN, "scan interval reset to %dms", deviceScanInterval);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Advertise the scanner statistics in the registry
+//
+// "polls-saved" counts the configuration polls the fixed-interval scanner
+// would have made over the same period, less the adapter commands we have
+// actually issued.
+//
+void
+self::deviceScanPublish(void)
+{
+	OSDictionary	*dict;
+	int64_t		saved;
+
+	if ((dict = OSDictionary::withCapacity(7)) == NULL)
+		return;
+
+	saved = (int64_t)(scanStats.scannedTime / ARCMSR_STATUS_INTERVAL) -
+		(scanStats.eventPolls + scanStats.configPolls);
+	if (saved < 0)
+		saved = 0;
+
+	dictSetNumber(dict, "event-polls", scanStats.eventPolls);
+	dictSetNumber(dict, "config-polls", scanStats.configPolls);
+	dictSetNumber(dict, "polls-saved", saved);
+	dictSetNumber(dict, "changes", scanStats.changes);
+	dictSetNumber(dict, "scan-interval-ms", deviceScanEvents ? deviceScanInterval : ARCMSR_STATUS_INTERVAL);
+	dictSetNumber(dict, "change-latency-us", scanStats.lastLatency);
+	dictSetNumber(dict, "change-latency-max-us", scanStats.maxLatency);
+	dictSetNumber(dict, "targets", scanStats.targets);
+	dictSetNumber(dict, "units", scanStats.units);
+	dictSetNumber(dict, "rescan-us", scanStats.rescanTime);
+
+	setProperty("scan-statistics", dict);
+	dict->release();
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -23,6 +23,219 @@
 
 // $Id$
 
+////////////////////////////////////////////////////////////////////////////////
+// A management (GUI protocol) command issued by the driver itself
+//
+// The owner supplies the opcode, any argument bytes and a completion method;
+// the reply payload is valid only for the duration of the completion call.
+//
+struct arcmsr_gui_request {
+	struct arcmsr_gui_request *next;		// submission queue linkage
+	bool		busy;				// queued or in flight
+	bool		loggingIn;			// next send is the login, not the command
+	bool		loggedIn;			// login already tried for this submission
+	uint8_t		opcode;				// GUI_* command code
+	const uint8_t	*args;				// argument bytes following the opcode
+	int		argLen;
+	void		(ArcMSR::*done)(struct arcmsr_gui_request *req);
+	IOReturn	status;				// completion status
+	uint8_t		*reply;				// reply payload (status or data)
+	int		replyLen;
+	struct arcmsr_broker_client *client;		// submitted for a userclient, or NULL
+	uint64_t	queuedTime;			// when submitted
+	uint64_t	sentTime;			// when framed to the adapter
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Gate statistics, published as "gate-statistics"
+//
+// Kept with ARCMSR_GATE_STATS.  Times are absolute time units; hold time
+// includes any time spent in commandSleep.  Each gate's figures are only
+// touched with that gate held, and are copied out through it to publish.
+//
+#define ARCMSR_GATE_IO			0		// the controller's gate
+#define ARCMSR_GATE_MANAGEMENT		1		// message channel and management commands
+#define ARCMSR_GATES			2
+
+struct arcmsr_gate_stats {
+	uint64_t	calls;
+	uint64_t	waitTime;			// total waiting to get in
+	uint64_t	maxWait;
+	uint64_t	holdTime;			// total spent inside
+	uint64_t	maxHold;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Management broker (ArcMSRBroker module)
+//
+// Each userclient that sends management commands has one of these; its
+// commands wait on its own queue and the queues are served in turn.
+//
+struct arcmsr_broker_stats {
+	uint64_t	submitted;			// commands accepted
+	uint64_t	completed;			// ... answered by the adapter
+	uint64_t	failed;				// ... timed out, bad reply or aborted
+	uint64_t	rejected;			// refused, queue full
+	uint64_t	queueTime;			// total us spent waiting for the channel
+	uint64_t	serviceTime;			// total us spent waiting for the reply
+	uint32_t	maxQueued;			// deepest the queue has been
+};
+
+struct arcmsr_broker_client {
+	struct arcmsr_broker_client *next;		// registration list
+	struct arcmsr_gui_request *queue;		// waiting to be sent
+	int		queued;
+	struct arcmsr_broker_stats stats;
+};
+
+// A userclient's command, with room for the whole exchange
+struct arcmsr_broker_request {
+	struct arcmsr_gui_request gui;			// must be first
+	bool		finished;
+	uint8_t		args[GUI_MAX_LENGTH];
+	uint8_t		reply[GUI_MAX_FRAME];		// reply frame
+	int		replyLen;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Device scanner statistics, published as "scan-statistics"
+//
+struct arcmsr_scan_stats {
+	uint32_t	eventPolls;			// GUI_POLL_EVENT commands issued
+	uint32_t	configPolls;			// GET_CONFIG messages issued
+	uint64_t	scannedTime;			// ms covered by the scanner so far
+	uint32_t	changes;			// device map changes found
+	uint64_t	lastLatency;			// us from noticing a change to finishing the rescan
+	uint64_t	maxLatency;
+	uint32_t	targets;			// targets with at least one unit
+	uint32_t	units;				// units (volumes) present
+	uint64_t	rescanTime;			// us spent in the last rescan
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Per-task driver data (see ReportHBASpecificTaskDataSize)
+//
+struct arcmsr_task {
+	SCSIParallelTaskIdentifier next;		// cache flush coalescing chain
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Cache flush coalescing state, per volume
+//
+struct arcmsr_flush_state {
+	int			carrierTag;		// tag of the flush in flight, -1 if none
+	SCSIParallelTaskIdentifier riders;		// requests completing with it
+	SCSIParallelTaskIdentifier next;		// requests waiting for the next flush
+};
+
+struct arcmsr_flush_stats {
+	uint64_t	requested;			// SYNCHRONIZE CACHE requests received
+	uint64_t	issued;				// flushes sent to the adapter
+	uint64_t	published;			// when last published
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Message channel receive statistics, published as "message-statistics"
+//
+struct arcmsr_mq_stats {
+	uint64_t	notifications;			// receive notifications sent
+	uint64_t	sleeps;				// readers put to sleep waiting for data
+	uint64_t	timeouts;			// ... and woken by the timeout
+	uint64_t	partialWrites;			// writes that took only some of the data
+	uint64_t	wouldBlock;			// ... or none of it
+	uint64_t	writableNotifications;		// writable notifications sent
+	uint64_t	streams;			// payloads streamed
+	uint64_t	streamBytes;			// ... bytes sent to the adapter
+	uint64_t	streamTime;			// ... and how long that took (us)
+	uint64_t	streamRate;			// bytes/s achieved by the last window
+	uint64_t	published;			// when last published
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Power management statistics, published as "power-statistics"
+//
+struct arcmsr_power_stats {
+	uint32_t	sleeps;
+	uint32_t	wakes;
+	uint32_t	failedFlushes;			// sleeps where the cache flush was not acknowledged
+	uint32_t	fullResumes;			// wakes that needed a full CTLinit
+	uint32_t	failedWakes;			// wakes after which the adapter was given up on
+	uint64_t	lastSleepTime;			// ms taken to quiesce and flush
+	uint64_t	lastResumeTime;			// us taken to bring the adapter back
+	uint64_t	lastResyncTime;			// us from wake until the device map was checked
+	uint64_t	maxResyncTime;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Background rebuild scheduler policy and statistics, published as "rebuild-scheduler"
+//
+struct arcmsr_rebuild_policy {
+	int		mode;
+#define ARCMSR_REBUILD_OFF		0
+#define ARCMSR_REBUILD_PAUSE		1
+#define ARCMSR_REBUILD_PRIORITY		2
+	uint32_t	sampleInterval;			// ms
+	uint32_t	busyIOPS;
+	uint32_t	busyLatency;			// us
+	uint32_t	idleIOPS;
+	uint32_t	idleLatency;			// us
+	uint32_t	busySamples;
+	uint32_t	idleSamples;
+	uint8_t		busyPriority;
+	uint8_t		idlePriority;
+	uint32_t	maxPause;			// ms, "pause" only
+	uint32_t	minRun;				// ms, "pause" only
+};
+
+struct arcmsr_rebuild_stats {
+	uint32_t	throttles;			// times background work was held back
+	uint32_t	releases;			// times it was let go again
+	uint32_t	failures;			// adapter refused or didn't answer
+	uint32_t	forcedReleases;			// let go because the pause ran out
+	uint64_t	normalTime;			// ms spent running normally
+	uint64_t	throttledTime;			// ms spent held back
+	uint32_t	lastIOPS;
+	uint64_t	lastLatency;			// us, average over the last sample
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Adapter inventory statistics, published as "inventory-statistics"
+//
+struct arcmsr_inventory_stats {
+	uint32_t	refreshes;			// complete inventories fetched
+	uint32_t	failures;			// ... abandoned
+	uint64_t	commands;			// adapter commands issued for them
+	uint64_t	lastRefreshTime;		// us taken by the last refresh
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Hardware monitor sampler statistics, published as "monitor-statistics"
+//
+struct arcmsr_monitor_stats {
+	uint32_t	samples;			// samples recorded
+	uint32_t	failures;			// adapter didn't answer or sent nonsense
+	uint32_t	skipped;			// previous request still outstanding
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Adapter event stream subscriber, and statistics published as "event-statistics"
+//
+struct arcmsr_event_subscriber {
+	struct arcmsr_event_subscriber *next;
+	IODataQueue	*queue;
+	uint32_t	lost;				// events dropped since the last one queued
+};
+
+struct arcmsr_event_stats {
+	uint32_t	events;				// new events found
+	uint32_t	queued;				// ... queued to subscribers (counted per subscriber)
+	uint32_t	logged;				// ... logged for want of subscribers
+	uint32_t	dropped;			// ... lost to full subscriber queues
+	uint32_t	lost;				// overwritten or cleared before we read them
+	uint32_t	reads;				// event pages read
+	uint32_t	failures;			// reads abandoned
+};
+
 class ArcMSR : public IOSCSIParallelInterfaceController
 {
 	OSDeclareAbstractStructors(ArcMSR)
@@ -45,7 +258,7 @@ public:
 	SCSILogicalUnitNumber	ReportHBAHighestLogicalUnitNumber(void);
 	SCSIDeviceIdentifier	ReportHighestSupportedDeviceID(void);
 	UInt32			ReportMaximumTaskCount(void)				{return(maxSRB);};
-	UInt32			ReportHBASpecificTaskDataSize(void)			{return(4);};	// must be > 0
+	UInt32			ReportHBASpecificTaskDataSize(void)			{return(sizeof(struct arcmsr_task));};
 	UInt32			ReportHBASpecificDeviceDataSize(void)			{return(4);};
     
 	// feature queries
@@ -69,32 +282,85 @@ public:
 	// inbound SCSI requests
 	SCSIServiceResponse	ProcessParallelTask(SCSIParallelTaskIdentifier parallelRequest);
     
-	// power management
-	bool			finalize(IOOptionBits options)
-	    {PMstop(); return IOSCSIParallelInterfaceController::finalize(options);};
-	
-	UInt32			initialPowerStateForDomainStat(IOPMPowerFlags flags)
-	    {return(1);};
-	
-	IOReturn		setPowerState(UInt32 powerStateOrdinal, IOService *device)
-	    {return(kIOReturnSuccess);};
+	// power management (ArcMSRPower module)
+	unsigned long		initialPowerStateForDomainState(IOPMPowerFlags flags);
+	IOReturn		setPowerState(unsigned long powerStateOrdinal, IOService *device);
     
     
 	// Userclient incalls
 	COMMANDGATE_PROTO1(inboundMQBufferInsert, IOMemoryDescriptor *, dataBuf);
+	COMMANDGATE_PROTO3(inboundMQBufferWrite, IOMemoryDescriptor *, dataBuf, int *, written, int, wait);
+	COMMANDGATE_PROTO3(inboundMQStream, IOMemoryDescriptor *, dataBuf, int *, sent, int, stall);
+	COMMANDGATE_PROTO1(setStreaming, bool *, state);
 	COMMANDGATE_PROTO3(outboundMQBufferRemove, IOMemoryDescriptor *, dataBuf, int *, bytesRead, int, wait);
 	COMMANDGATE_PROTO0(inboundMQBufferClear);
 	COMMANDGATE_PROTO0(outboundMQBufferClear);
+	COMMANDGATE_PROTO2(setSharedRing, int, type, ArcMSRSharedRing *, ring);
+	COMMANDGATE_PROTO0(sharedRingKick);
+	COMMANDGATE_PROTO1(sharedRingWait, int, timeout);
+	COMMANDGATE_PROTO2(setLoopback, bool, state, IOReturn *, status);
+	COMMANDGATE_PROTO1(setNotifyClient, ArcMSRUserClient *, client);
+	COMMANDGATE_PROTO2(swapNotifyMessage, mach_msg_header_t *, slot, mach_msg_header_t *, msg);
 
 	// Userclient exclusive-access flag control
 	COMMANDGATE_PROTO1(setClientActive, bool *, state);
 
+#ifdef ARCMSR_GATE_STATS
+	// Gate accounting, called by the gate glue; published on demand
+	uint64_t		gateEnter(int which, uint64_t *called);
+	void			gateLeave(int which, uint64_t entered);
+	COMMANDGATE_PROTO1(gateSnapshotIO, struct arcmsr_gate_stats *, snap);
+	COMMANDGATE_PROTO1(gateSnapshotManagement, struct arcmsr_gate_stats *, snap);
+	void			gatePublish(void);
+#endif
+
+	// Message channel side of sleep/wake, and driver management commands
+	COMMANDGATE_PROTO1(MQsetAsleep, bool, state);
+	COMMANDGATE_PROTO2(GUIqueue, struct arcmsr_gui_request *, req, bool *, queued);
+	COMMANDGATE_PROTO0(GUIrelease);
+
+	// Management broker
+	COMMANDGATE_PROTO1(brokerAttach, struct arcmsr_broker_client *, client);
+	COMMANDGATE_PROTO1(brokerDetach, struct arcmsr_broker_client *, client);
+	COMMANDGATE_PROTO2(brokerCommand, struct arcmsr_broker_client *, client, struct arcmsr_broker_request *, breq);
+
+	// GUI protocol frame codec
+	static int		GUIframe(uint8_t *frame, int length);
+	static int		GUIunframe(const uint8_t *frame, int size);
+
 	// Command tag management
 	COMMANDGATE_PROTO1(getTag, int *, tag);
 	COMMANDGATE_PROTO1(returnTag, int, tag);
 
+	// Quiesce support
+	COMMANDGATE_PROTO1(setQuiesced, bool, state);
+	COMMANDGATE_PROTO1(pollOutstanding, int *, count);
+	COMMANDGATE_PROTO1(setAsleep, bool, state);
+	COMMANDGATE_PROTO1(setFailed, bool, state);
+	COMMANDGATE_PROTO1(setHolding, bool, state);
+	COMMANDGATE_PROTO2(holdTask, SCSIParallelTaskIdentifier, parallelRequest, bool *, held);
+
 	// Command stuff into controller
-	COMMANDGATE_PROTO1(postSRB, uint32_t *, postValue);
+	COMMANDGATE_PROTO2(postSRB, int, tag, uint32_t, postValue);
+
+	// Adapter inventory
+	COMMANDGATE_PROTO0(inventoryRefresh);
+	COMMANDGATE_PROTO1(inventorySnapshot, ArcMSRInventory *, snap);
+
+	// Adapter event stream
+	COMMANDGATE_PROTO0(eventRefresh);
+	COMMANDGATE_PROTO1(eventSubscribe, struct arcmsr_event_subscriber *, sub);
+	COMMANDGATE_PROTO1(eventUnsubscribe, struct arcmsr_event_subscriber *, sub);
+
+	// I/O statistics
+	COMMANDGATE_PROTO1(statsSnapshot, ArcMSRStatistics *, snap);
+	COMMANDGATE_PROTO0(statsReset);
+
+	// Hardware monitor history, for mapping by userclients
+	IOMemoryDescriptor	*monitorMemory(void);
+
+	// Cache flush coalescing
+	COMMANDGATE_PROTO2(flushSubmit, SCSIParallelTaskIdentifier, parallelRequest, SCSIServiceResponse *, response);
 
 	// memory cursor segment outputter
 	static void	outputArcMSRSegment(IOMemoryCursor::PhysicalSegment segment, void *pvt, UInt32 outSegmentIndex);
@@ -110,6 +376,11 @@ private:
 	// Adapter state flags
 	int			adapterState;
 #define ARCMSR_STATE_MSG0_POSTING	(1<<0)
+#define ARCMSR_STATE_QUIESCED		(1<<1)		// not accepting new commands
+#define ARCMSR_STATE_RUNNING		(1<<2)		// between StartController and StopController
+#define ARCMSR_STATE_ASLEEP		(1<<3)		// powered down, don't touch the adapter
+#define ARCMSR_STATE_FAILED		(1<<4)		// didn't come back from sleep
+#define ARCMSR_STATE_HOLDING		(1<<5)		// going to sleep, hold refused commands for wake
 	
 	// client mutex
 	bool			clientActive;
@@ -121,6 +392,12 @@ private:
 	char			*SRBPtr;
 	IOPhysicalAddress	SRBPhys;
 	RingBuffer		freeSRB;
+	int			activeSRB;		// tags currently vended
+	uint64_t		SRBStart[ARCMSR_MAX_OUTSTANDING_SRB];	// when each tag was vended
+	uint64_t		SRBPosted[ARCMSR_MAX_OUTSTANDING_SRB];	// and posted to the adapter
+
+	bool			quiesceIO(uint32_t timeout);
+	uint32_t		deadlineRemainingMS(uint64_t deadline);
 
 	struct arcmsr_srb	*getSRBPtr(int tag);
 	IOPhysicalAddress	getSRBPhys(int tag);
@@ -131,6 +408,142 @@ private:
 	uint8_t			deviceMapUpdate[16];	// updated device map
 	IOTimerEventSource	*deviceScanTimer;	// regular scan for device changes
 	void			deviceScanStub(void *, OSObject *who, IOTimerEventSource *es);
+	uint32_t		deviceScanInterval;	// current scan interval (ms)
+	bool			deviceScanEvents;	// adapter supports GUI_POLL_EVENT
+	struct arcmsr_gui_request deviceScanRequest;	// event log poll
+	void			deviceScanDone(struct arcmsr_gui_request *req);
+	void			deviceScanChanged(void);
+	void			deviceScanPublish(void);
+	uint64_t		deviceChangeTime;	// when a pending change was first noticed, 0 if none
+	struct arcmsr_scan_stats scanStats;
+
+	// SCSI request handling
+	SCSIServiceResponse	dispatchTask(SCSIParallelTaskIdentifier parallelRequest, int *tagp);
+	bool			unitAttach(int target, int lun);
+	bool			unitDetach(int target, int lun);
+	IOSCSITargetDevice	*unitTargetDevice(int target);
+	IOSCSILogicalUnitNub	*unitFind(IOSCSITargetDevice *device, int lun);
+	struct arcmsr_flush_state flushState[ARCMSR_MAX_TARGETID][ARCMSR_MAX_TARGETLUN];
+	struct arcmsr_flush_stats flushStats;
+	void			flushDone(struct arcmsr_srb *srb, SCSITaskStatus taskStatus, SCSIServiceResponse serviceResponse);
+	void			flushAbandon(struct arcmsr_flush_state *fs);
+	void			flushNext(struct arcmsr_flush_state *fs);
+	bool			flushForget(SCSIParallelTaskIdentifier parallelRequest);
+	void			flushPublish(void);
+	SCSIParallelTaskIdentifier heldTasks;		// refused while going to sleep, sent on wake
+	bool			holdForget(SCSIParallelTaskIdentifier parallelRequest);
+
+	// Background rebuild scheduling (ArcMSRRebuild module)
+	struct arcmsr_rebuild_policy rebuildPolicy;
+	struct arcmsr_rebuild_stats rebuildStats;
+	IOTimerEventSource	*rebuildTimer;
+	bool			rebuildThrottled;	// background work currently held back
+	uint32_t		rebuildCount;		// consecutive samples calling for a change
+	uint64_t		rebuildSince;		// when we last accounted for the time in this mode
+	uint64_t		rebuildChanged;		// when we last changed mode
+	bool			rebuildResync;		// adapter state unknown, set it on next sample
+	uint32_t		loadCommands;		// completions in the current sample
+	uint64_t		loadLatency;		// total latency of those completions (abstime)
+	struct arcmsr_gui_request rebuildRequest;
+	uint8_t			rebuildArgs[16];
+	uint8_t			rebuildPriority;	// priority being set
+	bool			rebuildWanted;		// mode that priority is for
+	char			guiPassword[16];
+	bool			rebuildInit(void);
+	void			rebuildStart(void);
+	void			rebuildStop(void);
+	void			rebuildSample(int tag);
+	void			rebuildStub(void *, OSObject *who, IOTimerEventSource *es);
+	void			rebuildSetMode(bool throttle);
+	void			rebuildModeChanged(bool throttle);
+	void			rebuildAccount(void);
+	bool			rebuildSetPriority(uint8_t priority);
+	void			rebuildPriorityDone(struct arcmsr_gui_request *req);
+	void			rebuildPublish(void);
+
+	// Adapter inventory (ArcMSRInventory module)
+	ArcMSRInventory		*inventory;		// last complete inventory
+	ArcMSRInventory		*inventoryNext;		// inventory being fetched
+	uint32_t		inventoryGeneration;
+	bool			inventoryActive;	// refresh in progress
+	bool			inventoryPending;	// something changed during it, go again
+	uint8_t			inventoryStep;		// GUI_GET_INFO_x being fetched
+	int			inventoryIndex;		// ... and record number
+	uint64_t		inventoryStart;
+	struct arcmsr_gui_request inventoryRequest;
+	uint8_t			inventoryArgs[16];
+	struct arcmsr_inventory_stats inventoryStats;
+	bool			inventoryInit(void);
+	void			inventoryFree(void);
+	void			inventoryFetch(void);
+	int			inventoryLimit(uint8_t step);
+	void			inventoryNextStep(void);
+	void			inventoryFinish(bool complete);
+	void			inventoryDone(struct arcmsr_gui_request *req);
+	void			inventoryPublish(void);
+
+	// Hardware monitor sampler (ArcMSRMonitor module)
+	IOBufferMemoryDescriptor *monitorBuffer;	// shared history
+	ArcMSRMonitorHistory	*monitorHistory;
+	IOTimerEventSource	*monitorTimer;
+	uint32_t		monitorInterval;	// ms, 0 if off
+	struct arcmsr_gui_request monitorRequest;
+	uint8_t			monitorArgs[16];
+	struct arcmsr_monitor_stats monitorStats;
+	bool			monitorInit(void);
+	void			monitorFree(void);
+	void			monitorStart(void);
+	void			monitorStop(void);
+	void			monitorStub(void *, OSObject *who, IOTimerEventSource *es);
+	void			monitorDone(struct arcmsr_gui_request *req);
+	bool			monitorRecord(const uint8_t *reply, int len);
+	void			monitorPublish(ArcMSRMonitorSample *sample);
+
+	// Adapter event stream (ArcMSREventLog module)
+#define ARCMSR_EVENT_PAGES		4
+	struct arcmsr_event_subscriber *eventSubscribers;
+	int			eventSubscriberCount;
+	uint8_t			eventCursor[ARCMSR_EVENT_RECORD_SIZE];	// newest event seen
+	bool			eventPrimed;		// eventCursor is valid
+	bool			eventActive;		// read in progress
+	bool			eventPending;		// log changed during it, go again
+	uint8_t			eventPage;		// page being read
+	uint8_t			*eventBuffer;		// new events found so far, newest first
+	int			eventCount;
+	uint32_t		eventSequence;		// events delivered
+	uint32_t		eventLost;		// missed since the last one delivered
+	struct arcmsr_gui_request eventRequest;
+	uint8_t			eventArgs[16];
+	struct arcmsr_event_stats eventStats;
+	bool			eventInit(void);
+	void			eventFree(void);
+	void			eventFetch(void);
+	void			eventDone(struct arcmsr_gui_request *req);
+	void			eventFinish(bool found);
+	void			eventFail(void);
+	void			eventDeliver(const uint8_t *record, uint64_t when);
+	void			eventPublish(void);
+
+	// I/O statistics (ArcMSRStatistics module)
+	ArcMSRStatistics	*stats;
+	bool			statsInit(void);
+	void			statsFree(void);
+	void			statsSample(int tag, struct arcmsr_srb *srb, SCSIParallelTaskIdentifier parallelRequest, bool failed);
+
+	// Power management
+#define ARCMSR_POWER_OFF		0
+#define ARCMSR_POWER_ON			1
+#define ARCMSR_POWER_STATES		2
+	bool			powerManaged;		// registered with power management
+	unsigned long		powerState;		// current power state ordinal
+	uint64_t		resumeTime;		// when we last woke, 0 once the device map is resynced
+	struct arcmsr_power_stats powerStats;
+	bool			powerInit(void);
+	void			powerStop(void);
+	void			powerSleep(void);
+	void			powerWake(void);
+	void			powerResynced(void);
+	void			powerPublish(void);
 
 	// Asynchronous event handling
 	ArcMSREventSource	*asyncEventSource;
@@ -138,19 +551,91 @@ private:
 	void			asyncEventHandler(void);
 	void			targetRescan(void);
 	
+	// Management workloop; everything below to do with the message channel runs on it
+	IOWorkLoop		*managementWorkLoop;
+	IOCommandGate		*managementGate;
+	IOInterruptEventSource	*doorbellSource;	// doorbell interrupts handed off from the I/O workloop
+	volatile UInt32		doorbellPending;	// doorbell bits not yet handled
+	void			doorbellHandler(IOInterruptEventSource *es, int count);
+	bool			managementInit(void);
+	void			managementStop(void);
+#ifdef ARCMSR_GATE_STATS
+	struct arcmsr_gate_stats gateStats[ARCMSR_GATES];
+#endif
+
 	// Message queues
 #define ARCMSR_MESSAGE_BUFFER		4096
 	uint32_t		MQFlags;
 #define ARCMSR_MQF_OVERFLOW		(1<<0)		// outbound ringbuffer full
 #define ARCMSR_MQF_UNDERFLOW		(1<<1)		// inbound controller buffer empty
+#define ARCMSR_MQF_LOOPBACK		(1<<2)		// inbound data goes straight to outbound
+#define ARCMSR_MQF_STREAM		(1<<3)		// a stream owns the inbound side
 	RingBuffer		outboundMQBuffer;
 	RingBuffer		inboundMQBuffer;
+	ArcMSRSharedRing	*sharedIn;		// client-mapped rings, or NULL
+	ArcMSRSharedRing	*sharedOut;
+	ArcMSRUserClient	*notifyClient;		// channel owner, may want notifications
+	bool			notifyArmed;		// not told about outbound data yet
+	bool			writableArmed;		// a write came up short, tell it about space
+	IOMemoryDescriptor	*streamBuf;		// payload being streamed to the adapter, or NULL
+	int			streamOffset;		// ... how far it has got
+	uint64_t		streamProgress;		// ... and when it last moved
+	int			inboundMQStreamFetch(char *buf, int len);
+	struct arcmsr_mq_stats	MQStats;
+	void			outboundMQPublish(void);
     
 	void			inboundMQWrite(void);
+	static void		inboundMQWatermark(void *arg, RingBuffer *ring, bool high);
+	int			inboundMQFetch(char *buf, int len);
+	bool			inboundMQLoopback(void);
 	void			outboundMQRead(void);
+	bool			outboundMQDeliver(char *data, int length);
+	int			outboundMQSpace(void);
+	void			outboundMQResume(void);
+	void			outboundMQNotify(void);
+	void			outboundMQRearm(void);
 
 	IOTimerEventSource	*outboundMQTimeout;
 	void			outboundMQWakeup(void *, OSObject *who, IOTimerEventSource *junk);
+	IOTimerEventSource	*inboundMQTimeout;
+	void			inboundMQWakeup(void *, OSObject *who, IOTimerEventSource *junk);
+
+	// Driver-issued management commands (ArcMSRManagement module)
+	struct arcmsr_gui_request *guiQueue;		// waiting to be sent
+	struct arcmsr_gui_request *guiActive;		// awaiting a reply
+	struct arcmsr_gui_request *guiFinished;		// driver request awaiting its completion call
+	IOInterruptEventSource	*guiDoneSource;		// runs completion calls on the I/O workloop
+	void			GUIfinish(IOInterruptEventSource *es, int count);
+	IOTimerEventSource	*guiTimeout;
+	int			guiParseState;
+	int			guiParseLength;
+	int			guiParseCount;
+	uint8_t			guiParseSum;
+	uint8_t			guiReply[GUI_MAX_LENGTH];
+	uint8_t			guiFrame[GUI_MAX_FRAME];	// command being framed
+
+	bool			GUIsubmit(struct arcmsr_gui_request *req);
+	void			GUIstart(void);
+	void			GUIinput(const char *data, int len);
+	void			GUIpassthrough(const uint8_t *data, int len);
+	void			GUIflushHeader(void);
+	void			GUIcomplete(IOReturn status);
+	void			GUItimeout(void *, OSObject *who, IOTimerEventSource *junk);
+	void			GUIexpire(void);
+
+	// Management broker (ArcMSRBroker module)
+	struct arcmsr_broker_client *brokerClients;	// registered clients
+	struct arcmsr_broker_client *brokerTurn;	// next to be served
+	struct arcmsr_broker_stats brokerStats;		// totals across clients
+	int			brokerCount;
+	struct arcmsr_gui_request *brokerPeek(void);
+	void			brokerDequeue(struct arcmsr_gui_request *req);
+	bool			brokerWithdraw(struct arcmsr_gui_request *req);
+	void			brokerFail(struct arcmsr_gui_request *req, IOReturn status);
+	uint64_t		brokerExpire(uint64_t cutoff);
+	void			brokerDone(struct arcmsr_gui_request *req);
+	void			brokerAccount(struct arcmsr_broker_stats *stats, struct arcmsr_gui_request *req);
+	void			brokerPublish(void);
 
 	// register accessors
 	volatile uint32_t	getOutboundMsgaddr1(void);
@@ -168,11 +653,19 @@ private:
 
 	// controller interface (ArcMSRControllerIO module)
 	bool			CTLinit(void);				// controller/IOP init
-	bool			CTLwaitMsgintReady(void);
+	bool			CTLwaitFirmware(uint32_t timeout);	// wait for firmware, drain stale messages
+	bool			CTLwaitMsgintReady(uint32_t timeout);
+	bool			CTLpostMessage(uint32_t message, uint32_t timeout);	// polled message0 command
 	bool			CTLstartBackgroundRebuild(void);	// start background rebuild
-	bool			CTLstopBackgroundRebuild(void);		// stop background rebuild
-	bool			CTLflushCache(void);			// flush the cache
+	bool			CTLstopBackgroundRebuild(uint32_t timeout);	// stop background rebuild
+	bool			CTLflushCache(uint32_t timeout);	// flush the cache
+	bool			CTLwaitIdle(uint32_t timeout);		// wait for adapter to finish host commands
 	bool			CTLgetConfig(void);			// get controller configuration
+	void			CTLsendMessage(uint32_t message);	// interrupt-driven message0 command
+	void			CTLnextMessage(void);
+	uint32_t		msg0Current;		// message0 command awaiting completion
+	uint32_t		msg0Wanted;		// (1 << message) for each message waiting to go
+	uint64_t		msg0Time;		// when msg0Current was posted
 	void			CTLrequestConfig(void);			// request controller config message
 	void			CTLdisableInterrupts(void);
 	void			CTLenableInterrupts(void);
@@ -38,18 +38,36 @@
 bool
 self::CTLinit(void)
 {
-	uint32_t	odb;
-	int		timeout;
-    
 	CTLdisableInterrupts();
-    
+
+	if (!CTLwaitFirmware(ARCMSR_FIRMWARE_TIMEOUT))
+		return(false);
+
+	// get adapter configuration parameters
+	if (!CTLgetConfig())
+		return(false);
+
+	debug(DEBUGF_ADAPTER, "init done");
+	return(true);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Wait for the adapter firmware to come ready
+//
+// Also discards anything left in the inbound message buffer, which is all
+// that is needed to bring the adapter back after sleep.
+//
+bool
+self::CTLwaitFirmware(uint32_t timeout)
+{
+	uint32_t	odb, retries;
+
 	// Spin waiting for the FIRMWARE_OK bit
-	// Time out after a second (XXX should this be longer?)
 	debug(DEBUGF_ADAPTER, "waiting for firmware...");
 	showStatus("waiting for firmware");
-	timeout = 0;
+	retries = 0;
 	while ((getOutboundMsgaddr1() & ARCMSR_OUTBOUND_MESG1_FIRMWARE_OK) == 0) {
-		if (timeout++ > 100) {
+		if (retries++ > (timeout / 10)) {
 			error("timed out waiting for firmware");
 			return(false);
 		}
@@ -63,12 +81,6 @@ self::CTLinit(void)
 		setOutboundDoorbell(odb);
 		setInboundDoorbell(ARCMSR_INBOUND_DRIVER_DATA_READ_OK);
 	}
-
-	// get adapter configuration parameters
-	if (!CTLgetConfig())
-		return(false);
-
-	debug(DEBUGF_ADAPTER, "init done");
 	return(true);
 }
 
@@ -86,7 +98,7 @@ self::CTLgetConfig(void)
 	showStatus("waiting for initial adapter configuration");
 
 	setInboundMsgaddr0(ARCMSR_INBOUND_MESG0_GET_CONFIG);
-	if (!CTLwaitMsgintReady())
+	if (!CTLwaitMsgintReady(ARCMSR_MESSAGE_TIMEOUT))
 		return(false);
 
 	cfg = (struct arcmsr_adapter_config *)&mu->message_wbuffer;
@@ -135,6 +147,78 @@ self::CTLgetConfig(void)
 	return(true);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Ask the adapter for its configuration
+//
+// The reply is fielded by handleMessageInterrupt.
+//
+void
+self::CTLrequestConfig(void)
+{
+	scanStats.configPolls++;
+	CTLsendMessage(ARCMSR_INBOUND_MESG0_GET_CONFIG);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Post an interrupt-driven message0 command
+//
+// The adapter only handles one message at a time and the completion
+// doesn't say which message it is for, so messages are posted one at a
+// time and the rest are held as a set; asking for the same message twice
+// before it is posted sends it once.  Start and stop background rebuild
+// cancel each other.
+//
+// A completion that never arrives would stall everything behind it, so a
+// message outstanding for longer than ARCMSR_MESSAGE_TIMEOUT is given up.
+//
+// We are on the workloop.
+//
+void
+self::CTLsendMessage(uint32_t message)
+{
+	uint64_t	now, limit;
+
+	if (adapterState & ARCMSR_STATE_ASLEEP)
+		return;
+
+	if (message == ARCMSR_INBOUND_MESG0_START_BGRB)
+		msg0Wanted &= ~(1 << ARCMSR_INBOUND_MESG0_STOP_BGRB);
+	if (message == ARCMSR_INBOUND_MESG0_STOP_BGRB)
+		msg0Wanted &= ~(1 << ARCMSR_INBOUND_MESG0_START_BGRB);
+	msg0Wanted |= (1 << message);
+
+	if (adapterState & ARCMSR_STATE_MSG0_POSTING) {
+		clock_get_uptime(&now);
+		nanoseconds_to_absolutetime((uint64_t)ARCMSR_MESSAGE_TIMEOUT * 1000000, &limit);
+		if ((now - msg0Time) < limit) {
+			debug(DEBUGF_ADAPTER, "message 0x%x held behind 0x%x", message, msg0Current);
+			return;
+		}
+		error("adapter never completed message 0x%x", msg0Current);
+		adapterState &= ~ARCMSR_STATE_MSG0_POSTING;
+	}
+	CTLnextMessage();
+}
+
+void
+self::CTLnextMessage(void)
+{
+	uint32_t	message;
+
+	if ((adapterState & (ARCMSR_STATE_MSG0_POSTING | ARCMSR_STATE_ASLEEP)) || (msg0Wanted == 0))
+		return;
+
+	// lowest-numbered first, so config requests go before rebuild control
+	for (message = 0; (msg0Wanted & (1 << message)) == 0; message++)
+		;
+	msg0Wanted &= ~(1 << message);
+	msg0Current = message;
+	clock_get_uptime(&msg0Time);
+	adapterState |= ARCMSR_STATE_MSG0_POSTING;
+	setInboundMsgaddr0(message);
+	debug(DEBUGF_ADAPTER, "posted message 0x%x", message);
+}
+
 /////////////////////////////////////////////////////////////////////////////////
 // Disable interrupts
 void
@@ -172,18 +256,25 @@ self::HandleInterruptRequest(void)
 	intstatus = getOutboundIntstatus();
 	setOutboundIntstatus(intstatus);
 	debug(DEBUGF_INTERRUPT, "interrupted with status 0x%x", intstatus);
+	stats->interrupts++;
 
 	// MU doorbell interrupts
-	if (intstatus & ARCMSR_MU_OUTBOUND_DOORBELL_INT)
+	if (intstatus & ARCMSR_MU_OUTBOUND_DOORBELL_INT) {
+		stats->doorbellInterrupts++;
 		handleDoorbellInterrupt();
+	}
     
 	// MU post queue interrupts
-	if (intstatus & ARCMSR_MU_OUTBOUND_POSTQUEUE_INT)
+	if (intstatus & ARCMSR_MU_OUTBOUND_POSTQUEUE_INT) {
+		stats->postQueueInterrupts++;
 		handlePostQueueInterrupt();
+	}
 
 	// MU message interrupt
-	if (intstatus & ARCMSR_MU_OUTBOUND_MESSAGE0_INT)
+	if (intstatus & ARCMSR_MU_OUTBOUND_MESSAGE0_INT) {
+		stats->messageInterrupts++;
 		handleMessageInterrupt();
+	}
 
 }
 
@@ -199,24 +290,28 @@ self::handleDoorbellInterrupt(void)
 	doorbell = getOutboundDoorbell();
 	setOutboundDoorbell(doorbell);		// acknowledge
     
-	if (doorbell & ARCMSR_OUTBOUND_IOP331_DATA_WRITE_OK) {
+	if (doorbell & ARCMSR_OUTBOUND_IOP331_DATA_WRITE_OK)
 		debug(DEBUGF_INTERRUPT, "adapter posted outbound message");
-		outboundMQRead();
-	}
     
 	// Adapter ready for more data from the IOCTL interface
-	if (doorbell & ARCMSR_OUTBOUND_IOP331_DATA_READ_OK) {
+	if (doorbell & ARCMSR_OUTBOUND_IOP331_DATA_READ_OK)
 		debug(DEBUGF_INTERRUPT, "adapter consumed inbound message");
-		inboundMQWrite();
+
+	// the message channel is serviced on the management workloop
+	doorbell &= ARCMSR_OUTBOUND_IOP331_DATA_WRITE_OK | ARCMSR_OUTBOUND_IOP331_DATA_READ_OK;
+	if (doorbell != 0) {
+		OSBitOrAtomic(doorbell, &doorbellPending);
+		doorbellSource->interruptOccurred(NULL, NULL, 0);
 	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // Handle a message interrupt
 //
-// The only message interrupt we expect is in response to a query for the
-// current adapter config.  We want this in order to compare the drivemap
-// so that we can detect newly-attached drives.
+// Most message interrupts are in response to a query for the current
+// adapter config.  We want this in order to compare the drivemap so that
+// we can detect newly-attached drives.  The rest complete rebuild control
+// messages, and need nothing more than to let the next message go.
 //
 void
 self::handleMessageInterrupt(void)
@@ -225,6 +320,18 @@ self::handleMessageInterrupt(void)
 	int		target;
 	bool		updated;
 
+	// note the message done, post the next one once we've finished with the buffer
+	if (!(adapterState & ARCMSR_STATE_MSG0_POSTING)) {
+		debug(DEBUGF_INTERRUPT, "unexpected message completion");
+		return;
+	}
+	adapterState &= ~ARCMSR_STATE_MSG0_POSTING;
+	if (msg0Current != ARCMSR_INBOUND_MESG0_GET_CONFIG) {
+		debug(DEBUGF_INTERRUPT, "adapter completed message 0x%x", msg0Current);
+		CTLnextMessage();
+		return;
+	}
+
 	// is it the async config check?
 	cfg = (struct arcmsr_adapter_config *)&mu->message_wbuffer;
 	if (OSSwapLittleToHostInt32(cfg->signature) == ARCMSR_CONFIG_SIGNATURE) {
@@ -242,24 +349,37 @@ self::handleMessageInterrupt(void)
 		}
 		if (updated) {
 			debug(DEBUGF_RESCAN, "adapter config message contains changed device map");
+			scanStats.changes++;
+			if (deviceChangeTime == 0)
+				clock_get_uptime(&deviceChangeTime);
+			deviceScanChanged();
+			inventoryRefresh();
 			// queue a target rescan
 			asyncEventSource->addNotification(ARCMSR_ESFLAG_RESCAN);
+		} else {
+			// the event log may have reported something that didn't affect the map
+			deviceChangeTime = 0;
 		}
+
+		// first look at the map since waking up?
+		if (resumeTime != 0)
+			powerResynced();
 	} else {
 		debug(DEBUGF_INTERRUPT, "adapter posted message with unrecognised signature 0x%08x",
 		      OSSwapLittleToHostInt32(cfg->signature));
 	}
+	CTLnextMessage();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // Spin waiting for a message0 command to finish
 //
 bool
-self::CTLwaitMsgintReady(void)
+self::CTLwaitMsgintReady(uint32_t timeout)
 {
-	int	retries;
+	uint32_t	retries;
 
-	for (retries = 0; retries < 2000; retries++) {
+	for (retries = 0; retries <= (timeout / 10); retries++) {
                 if (getOutboundIntstatus() & ARCMSR_MU_OUTBOUND_MESSAGE0_INT) {
                         setOutboundIntstatus(ARCMSR_MU_OUTBOUND_MESSAGE0_INT);
                         debug(DEBUGF_ADAPTER, "polled command wait succeeded");
@@ -271,6 +391,21 @@ self::CTLwaitMsgintReady(void)
         return(false);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Issue a message0 command and spin waiting for it to finish
+//
+// Any stale completion (eg. from a configuration poll that was in flight
+// when interrupts were turned off) is discarded first so that it isn't
+// mistaken for ours.
+//
+bool
+self::CTLpostMessage(uint32_t message, uint32_t timeout)
+{
+	setOutboundIntstatus(ARCMSR_MU_OUTBOUND_MESSAGE0_INT);
+	setInboundMsgaddr0(message);
+	return(CTLwaitMsgintReady(timeout));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Start/stop background rebuild
 //
@@ -279,42 +414,72 @@ self::CTLwaitMsgintReady(void)
 bool
 self::CTLstartBackgroundRebuild(void)
 {
-	setInboundMsgaddr0(ARCMSR_INBOUND_MESG0_START_BGRB);
 	showStatus("starting background rebuild");
-	return(CTLwaitMsgintReady());
+	return(CTLpostMessage(ARCMSR_INBOUND_MESG0_START_BGRB, ARCMSR_MESSAGE_TIMEOUT));
 }
 
 bool
-self::CTLstopBackgroundRebuild(void)
+self::CTLstopBackgroundRebuild(uint32_t timeout)
 {
-	setInboundMsgaddr0(ARCMSR_INBOUND_MESG0_STOP_BGRB);
 	showStatus("stopping background rebuild");
-	return(CTLwaitMsgintReady());
+	return(CTLpostMessage(ARCMSR_INBOUND_MESG0_STOP_BGRB, timeout));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // Flush the adapter cache
 //
 bool
-self::CTLflushCache(void)
+self::CTLflushCache(uint32_t timeout)
 {
 	debug(DEBUGF_ADAPTER, "flushing adapter cache");
-	setInboundMsgaddr0(ARCMSR_INBOUND_MESG0_FLUSH_CACHE);
 	showStatus("flushing cache");
-	return(CTLwaitMsgintReady());
+	return(CTLpostMessage(ARCMSR_INBOUND_MESG0_FLUSH_CACHE, timeout));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Wait for the adapter to finish any host commands it is still working on
+//
+// The adapter answers CHK331PENDING in the message buffer; a nonzero first
+// word means that host commands are still pending.
+//
+bool
+self::CTLwaitIdle(uint32_t timeout)
+{
+	uint64_t	deadline;
+	uint32_t	remaining;
+
+	clock_interval_to_deadline(timeout, kMillisecondScale, &deadline);
+	for (;;) {
+		// each check gets what's left of the budget, not all of it
+		if ((remaining = deadlineRemainingMS(deadline)) == 0)
+			break;
+		if (!CTLpostMessage(ARCMSR_INBOUND_MESG0_CHK331PENDING, remaining)) {
+			debug(DEBUGF_ADAPTER, "adapter did not answer pending command check");
+			return(false);
+		}
+		if (OSSwapLittleToHostInt32(mu->message_wbuffer[0]) == 0) {
+			debug(DEBUGF_ADAPTER, "adapter idle");
+			return(true);
+		}
+		debug(DEBUGF_ADAPTER, "adapter still has host commands pending");
+		IOSleep(10);
+	}
+	debug(DEBUGF_ADAPTER, "timed out waiting for adapter to go idle");
+	return(false);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // Post an SRB to the adapter
 //
-COMMANDGATE_GLUE1(postSRB, uint32_t *);
+COMMANDGATE_GLUE2(postSRB, int, uint32_t);
 
 void
-self::postSRB(uint32_t *postValue)
+self::postSRB(int tag, uint32_t postValue)
 {
 	// make sure that everything written to the SRB has made it to memory
 	OSSynchronizeIO();
-	setInboundQueueport(*postValue);
+	clock_get_uptime(&SRBPosted[tag]);
+	setInboundQueueport(postValue);
 	debug(DEBUGF_SRB, "posting SRB at 0x%08x", postValue);
 }
 
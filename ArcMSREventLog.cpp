@@ -0,0 +1,318 @@
+//-
+//
+// @APPLE_LICENSE_HEADER_START@
+// 
+// Copyright (c) 2005 Apple Computer, Inc.  All Rights Reserved.
+// 
+// This file contains Original Code and/or Modifications of Original Code
+// as defined in and that are subject to the Apple Public Source License
+// Version 2.0 (the 'License'). You may not use this file except in
+// compliance with the License. Please obtain a copy of the License at
+// http://www.opensource.apple.com/apsl/ and read it before using this
+// file.
+// 
+// The Original Code and all software distributed under the License are
+// distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+// EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+// INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+// Please see the License for the specific language governing rights and
+// limitations under the License.
+// 
+// @APPLE_LICENSE_HEADER_END@
+
+// $Id$
+
+#include "ArcMSR.h"
+
+#define self ArcMSR
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// Adapter event stream
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+//
+// The adapter keeps an event log, read a page at a time with
+// GUI_GET_EVENT, newest first.  When the device scanner's event poll says
+// the log has changed we read from the top until we meet the newest event
+// we have already seen (eventCursor), and hand everything above it to
+// subscribed userclients, oldest first.  So each change costs a page read
+// or two however long the log is.
+//
+// If the cursor has gone (the log wrapped or was cleared) we take the
+// whole log as new and tell subscribers that something may have been
+// missed.  On the first read after starting we just note where the log
+// is; events from before we started are not delivered.
+//
+// Subscribers each have an IODataQueue that they map (see
+// ArcMSRUserClientInterface.h).  If there are none, events are logged.
+//
+// Everything here other than eventInit and eventFree runs on the workloop.
+//
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocate the page buffer
+//
+bool
+self::eventInit(void)
+{
+	if ((eventBuffer = (uint8_t *)IOMalloc(ARCMSR_EVENT_PAGES * GUI_MAX_LENGTH)) == NULL) {
+		error("could not allocate event buffer");
+		return(false);
+	}
+	eventSubscribers = NULL;
+	eventSubscriberCount = 0;
+	eventPrimed = false;
+	eventActive = false;
+	eventPending = false;
+	eventCount = 0;
+	eventSequence = 0;
+	eventLost = 0;
+	bzero(&eventStats, sizeof(eventStats));
+	bzero(&eventRequest, sizeof(eventRequest));
+	eventRequest.args = eventArgs;
+	eventRequest.done = &ArcMSR::eventDone;
+	return(true);
+}
+
+void
+self::eventFree(void)
+{
+	if (eventBuffer != NULL) {
+		IOFree(eventBuffer, ARCMSR_EVENT_PAGES * GUI_MAX_LENGTH);
+		eventBuffer = NULL;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Subscriber list
+//
+COMMANDGATE_GLUE1(eventSubscribe, struct arcmsr_event_subscriber *);
+
+void
+self::eventSubscribe(struct arcmsr_event_subscriber *sub)
+{
+	sub->lost = 0;
+	sub->next = eventSubscribers;
+	eventSubscribers = sub;
+	eventSubscriberCount++;
+	debug(DEBUGF_EVENT, "event subscriber attached, %d now", eventSubscriberCount);
+	eventPublish();
+}
+
+COMMANDGATE_GLUE1(eventUnsubscribe, struct arcmsr_event_subscriber *);
+
+void
+self::eventUnsubscribe(struct arcmsr_event_subscriber *sub)
+{
+	struct arcmsr_event_subscriber **sp;
+
+	for (sp = &eventSubscribers; *sp != NULL; sp = &(*sp)->next) {
+		if (*sp == sub) {
+			*sp = sub->next;
+			eventSubscriberCount--;
+			break;
+		}
+	}
+	debug(DEBUGF_EVENT, "event subscriber detached, %d now", eventSubscriberCount);
+	eventPublish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The log has changed; read the new events, or note that we should
+//
+COMMANDGATE_GLUE0(eventRefresh);
+
+void
+self::eventRefresh(void)
+{
+	if (eventActive) {
+		eventPending = true;
+		return;
+	}
+	eventActive = true;
+	eventPending = false;
+	eventCount = 0;
+	eventPage = 0;
+	eventFetch();
+}
+
+void
+self::eventFetch(void)
+{
+	eventRequest.opcode = GUI_GET_EVENT;
+	eventArgs[0] = eventPage;
+	eventRequest.argLen = 1;
+	eventStats.reads++;
+	if (!GUIsubmit(&eventRequest)) {
+		// can't happen; we only submit from the completion
+		error("event request already queued");
+		eventFail();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A page has arrived
+//
+// An all-zero record is the end of the log.  Reaching it before the
+// cursor (unless the log was empty when the cursor was set, in which case
+// the cursor is all-zero too) means we can't tell what went by.
+//
+void
+self::eventDone(struct arcmsr_gui_request *req)
+{
+	static const uint8_t empty[ARCMSR_EVENT_RECORD_SIZE] = {0};
+	const uint8_t	*rec;
+	int		i;
+
+	if (req->status != kIOReturnSuccess) {
+		debug(DEBUGF_EVENT, "adapter did not answer command 0x%02x (0x%x)", req->opcode, req->status);
+		eventFail();
+		return;
+	}
+
+	if (req->replyLen < ARCMSR_EVENT_RECORD_SIZE) {
+		debug(DEBUGF_EVENT, "unusable %d-byte reply to command 0x%02x", req->replyLen, req->opcode);
+		eventFail();
+		return;
+	}
+
+	for (i = 0; (i + ARCMSR_EVENT_RECORD_SIZE) <= req->replyLen; i += ARCMSR_EVENT_RECORD_SIZE) {
+		rec = req->reply + i;
+
+		// first look; just remember where the log is
+		if (!eventPrimed) {
+			bcopy(rec, eventCursor, ARCMSR_EVENT_RECORD_SIZE);
+			eventPrimed = true;
+			debug(DEBUGF_EVENT, "event log cursor set");
+			eventFinish(true);
+			return;
+		}
+
+		// caught up?
+		if (!bcmp(rec, eventCursor, ARCMSR_EVENT_RECORD_SIZE)) {
+			eventFinish(true);
+			return;
+		}
+
+		// the end of the log without passing the cursor; it has been cleared or wrapped
+		if (!bcmp(rec, empty, ARCMSR_EVENT_RECORD_SIZE)) {
+			eventFinish(false);
+			return;
+		}
+		bcopy(rec, eventBuffer + (eventCount * ARCMSR_EVENT_RECORD_SIZE), ARCMSR_EVENT_RECORD_SIZE);
+		eventCount++;
+	}
+
+	// keep going until the last page
+	if (++eventPage < ARCMSR_EVENT_PAGES) {
+		eventFetch();
+	} else {
+		eventFinish(false);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Deliver what we found, oldest first, and move the cursor
+//
+// If we didn't find the cursor, events may have gone by unread.
+//
+void
+self::eventFinish(bool found)
+{
+	uint64_t	now;
+	int		i;
+
+	eventActive = false;
+	if (!found) {
+		debug(DEBUGF_EVENT, "event log cursor lost, events may have been missed");
+		eventStats.lost++;
+		eventLost++;
+	}
+	clock_get_uptime(&now);
+	for (i = eventCount - 1; i >= 0; i--)
+		eventDeliver(eventBuffer + (i * ARCMSR_EVENT_RECORD_SIZE), now);
+	if (eventCount > 0)
+		bcopy(eventBuffer, eventCursor, ARCMSR_EVENT_RECORD_SIZE);
+	eventCount = 0;
+	eventPublish();
+
+	if (eventPending)
+		eventRefresh();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Give up on a read; the next change will try again
+//
+void
+self::eventFail(void)
+{
+	eventActive = false;
+	eventCount = 0;
+	eventStats.failures++;
+	eventPublish();
+
+	if (eventPending)
+		eventRefresh();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Queue an event to each subscriber, or log it if there are none
+//
+void
+self::eventDeliver(const uint8_t *record, uint64_t when)
+{
+	struct arcmsr_event_subscriber *sub;
+	ArcMSREvent	ev;
+	char		text[(ARCMSR_EVENT_RECORD_SIZE * 2) + 1];
+	int		i;
+
+	ev.sequence = eventSequence++;
+	ev.time = when;
+	bcopy(record, ev.record, ARCMSR_EVENT_RECORD_SIZE);
+	eventStats.events++;
+
+	if (eventSubscribers == NULL) {
+		for (i = 0; i < ARCMSR_EVENT_RECORD_SIZE; i++)
+			snprintf(&text[i * 2], 3, "%02x", record[i]);
+		IOLog("ArcMSR: adapter event %u%s: %s\n", ev.sequence, (eventLost > 0) ? " (after lost events)" : "", text);
+		eventStats.logged++;
+		eventLost = 0;
+		return;
+	}
+
+	for (sub = eventSubscribers; sub != NULL; sub = sub->next) {
+		ev.lost = eventLost + sub->lost;
+		if (sub->queue->enqueue(&ev, sizeof(ev))) {
+			sub->lost = 0;
+			eventStats.queued++;
+		} else {
+			sub->lost++;
+			eventStats.dropped++;
+		}
+	}
+	eventLost = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Advertise the statistics in the registry
+//
+void
+self::eventPublish(void)
+{
+	OSDictionary	*dict;
+
+	if ((dict = OSDictionary::withCapacity(9)) == NULL)
+		return;
+	dictSetNumber(dict, "subscribers", eventSubscriberCount);
+	dictSetNumber(dict, "events", eventStats.events);
+	dictSetNumber(dict, "queued", eventStats.queued);
+	dictSetNumber(dict, "logged", eventStats.logged);
+	dictSetNumber(dict, "dropped", eventStats.dropped);
+	dictSetNumber(dict, "lost", eventStats.lost);
+	dictSetNumber(dict, "page-reads", eventStats.reads);
+	dictSetNumber(dict, "failures", eventStats.failures);
+	setProperty("event-statistics", dict);
+	dict->release();
+}
@@ -0,0 +1,428 @@
+//-
+//
+// @APPLE_LICENSE_HEADER_START@
+// 
+// Copyright (c) 2005 Apple Computer, Inc.  All Rights Reserved.
+// 
+// This file contains Original Code and/or Modifications of Original Code
+// as defined in and that are subject to the Apple Public Source License
+// Version 2.0 (the 'License'). You may not use this file except in
+// compliance with the License. Please obtain a copy of the License at
+// http://www.opensource.apple.com/apsl/ and read it before using this
+// file.
+// 
+// The Original Code and all software distributed under the License are
+// distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+// EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+// INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+// Please see the License for the specific language governing rights and
+// limitations under the License.
+// 
+// @APPLE_LICENSE_HEADER_END@
+
+// $Id$
+
+#include "ArcMSR.h"
+
+#define self ArcMSR
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// Adapter inventory
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+//
+// Management tools want to know what the adapter has: its system
+// information, RAID sets, volume sets and drives.  Left to themselves they
+// ask for it over and over, each asking the adapter for every record.
+// Instead we fetch the lot when the adapter starts and again whenever the
+// device scanner notices a change, and hand out copies.
+//
+// A refresh is a chain of driver management commands, one record at a
+// time: the system information first, which tells us how many of the
+// others there can be, then each RAID set, volume set and drive.  The
+// records go into inventoryNext, which is swapped with inventory once the
+// last one is in, so readers only ever see a complete set.  A change
+// noticed while a refresh is running sets inventoryPending, and we go
+// again when it finishes.
+//
+// Everything here other than inventoryInit and inventoryFree runs on the
+// workloop; StartController comes in through the gate.
+//
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocate the inventory buffers
+//
+bool
+self::inventoryInit(void)
+{
+	inventory = (ArcMSRInventory *)IOMalloc(sizeof(*inventory));
+	inventoryNext = (ArcMSRInventory *)IOMalloc(sizeof(*inventoryNext));
+	if ((inventory == NULL) || (inventoryNext == NULL)) {
+		error("could not allocate inventory buffers");
+		return(false);
+	}
+	bzero(inventory, sizeof(*inventory));
+	inventory->version = ARCMSR_INVENTORY_VERSION;
+	inventoryGeneration = 0;
+	inventoryActive = false;
+	inventoryPending = false;
+	bzero(&inventoryStats, sizeof(inventoryStats));
+	bzero(&inventoryRequest, sizeof(inventoryRequest));
+	inventoryRequest.args = inventoryArgs;
+	inventoryRequest.done = &ArcMSR::inventoryDone;
+	return(true);
+}
+
+void
+self::inventoryFree(void)
+{
+	if (inventory != NULL) {
+		IOFree(inventory, sizeof(*inventory));
+		inventory = NULL;
+	}
+	if (inventoryNext != NULL) {
+		IOFree(inventoryNext, sizeof(*inventoryNext));
+		inventoryNext = NULL;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Start a refresh, or note that another is wanted
+//
+COMMANDGATE_GLUE0(inventoryRefresh);
+
+void
+self::inventoryRefresh(void)
+{
+	if (inventoryActive) {
+		inventoryPending = true;
+		return;
+	}
+	debug(DEBUGF_INVENTORY, "refreshing inventory");
+	inventoryActive = true;
+	inventoryPending = false;
+	bzero(inventoryNext, sizeof(*inventoryNext));
+	inventoryNext->version = ARCMSR_INVENTORY_VERSION;
+	clock_get_uptime(&inventoryStart);
+
+	inventoryStep = GUI_GET_INFO_S;
+	inventoryIndex = 0;
+	inventoryFetch();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Ask for the current record
+//
+void
+self::inventoryFetch(void)
+{
+	inventoryRequest.opcode = inventoryStep;
+	if (inventoryStep == GUI_GET_INFO_S) {
+		inventoryRequest.argLen = 0;
+	} else {
+		inventoryArgs[0] = inventoryIndex;
+		inventoryRequest.argLen = 1;
+	}
+	inventoryStats.commands++;
+	if (!GUIsubmit(&inventoryRequest)) {
+		// can't happen; we only submit from the completion
+		error("inventory request already queued");
+		inventoryFinish(false);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// How many records the adapter may have for a step
+//
+int
+self::inventoryLimit(uint8_t step)
+{
+	sSYSTEM_INFO	*sys;
+	int		count, limit;
+
+	sys = (sSYSTEM_INFO *)inventoryNext->system;
+	switch (step) {
+	case GUI_GET_INFO_S:
+		return(1);
+	case GUI_GET_INFO_R:
+		count = sys->gsiMaxRaidSet;
+		limit = ARCMSR_INVENTORY_RAIDSETS;
+		break;
+	case GUI_GET_INFO_V:
+		count = sys->gsiMaxVolumeSet;
+		limit = ARCMSR_INVENTORY_VOLUMES;
+		break;
+	case GUI_GET_INFO_P:
+		count = sys->gsiIdeChannels;
+		limit = ARCMSR_INVENTORY_DRIVES;
+		break;
+	default:
+		return(0);
+	}
+	return((count < limit) ? count : limit);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Move on to the next record, or finish
+//
+void
+self::inventoryNextStep(void)
+{
+	inventoryIndex++;
+	while (inventoryIndex >= inventoryLimit(inventoryStep)) {
+		switch (inventoryStep) {
+		case GUI_GET_INFO_S:
+			inventoryStep = GUI_GET_INFO_R;
+			break;
+		case GUI_GET_INFO_R:
+			inventoryStep = GUI_GET_INFO_V;
+			break;
+		case GUI_GET_INFO_V:
+			inventoryStep = GUI_GET_INFO_P;
+			break;
+		default:
+			inventoryFinish(true);
+			return;
+		}
+		inventoryIndex = 0;
+	}
+	inventoryFetch();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A refresh is over; keep it if it completed, and go again if asked
+//
+void
+self::inventoryFinish(bool complete)
+{
+	ArcMSRInventory	*inv;
+	uint64_t	now, elapsed;
+
+	inventoryActive = false;
+	if (complete) {
+		clock_get_uptime(&now);
+		absolutetime_to_nanoseconds(now - inventoryStart, &elapsed);
+		inventoryStats.lastRefreshTime = elapsed / 1000;
+		inventoryStats.refreshes++;
+
+		// generation 0 means "never fetched"
+		if (++inventoryGeneration == 0)
+			inventoryGeneration = 1;
+		inventoryNext->generation = inventoryGeneration;
+		inv = inventory;
+		inventory = inventoryNext;
+		inventoryNext = inv;
+		debug(DEBUGF_INVENTORY, "inventory generation %d: raid sets 0x%x, volumes 0x%x, drives 0x%x, %lluus",
+		      inventoryGeneration, inventory->raidSetMask, inventory->volumeMask, inventory->driveMask,
+		      inventoryStats.lastRefreshTime);
+	} else {
+		inventoryStats.failures++;
+	}
+	inventoryPublish();
+
+	if (inventoryPending)
+		inventoryRefresh();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A record has arrived
+//
+// A reply of exactly the record size is the record; anything else means
+// there isn't one at that index (the GUI engine has already logged in if
+// the adapter wanted a password).  Without the system information we don't
+// know what else to ask for, so the refresh is abandoned.
+//
+void
+self::inventoryDone(struct arcmsr_gui_request *req)
+{
+	uint8_t		*dst;
+	uint32_t	*mask;
+	int		size;
+
+	if (req->status != kIOReturnSuccess) {
+		debug(DEBUGF_INVENTORY, "adapter did not answer command 0x%02x (0x%x)", req->opcode, req->status);
+		inventoryFinish(false);
+		return;
+	}
+
+	switch (inventoryStep) {
+	case GUI_GET_INFO_S:
+		size = sizeof(sSYSTEM_INFO);
+		dst = inventoryNext->system;
+		mask = NULL;
+		break;
+	case GUI_GET_INFO_R:
+		size = sizeof(sGUI_RAIDSET);
+		dst = inventoryNext->raidSet[inventoryIndex];
+		mask = &inventoryNext->raidSetMask;
+		break;
+	case GUI_GET_INFO_V:
+		size = sizeof(sGUI_VOLUMESET);
+		dst = inventoryNext->volume[inventoryIndex];
+		mask = &inventoryNext->volumeMask;
+		break;
+	default:
+		size = sizeof(sGUI_PHY_DRV);
+		dst = inventoryNext->drive[inventoryIndex];
+		mask = &inventoryNext->driveMask;
+		break;
+	}
+	if (req->replyLen == size) {
+		bcopy(req->reply, dst, size);
+		if (mask != NULL)
+			*mask |= 1 << inventoryIndex;
+	} else if (mask == NULL) {
+		error("adapter returned %d bytes of system information", req->replyLen);
+		inventoryFinish(false);
+		return;
+	}
+	inventoryNextStep();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Copy the inventory out for a userclient
+//
+COMMANDGATE_GLUE1(inventorySnapshot, ArcMSRInventory *);
+
+void
+self::inventorySnapshot(ArcMSRInventory *snap)
+{
+	bcopy(inventory, snap, sizeof(*snap));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Advertise the inventory in the registry
+//
+// Capacities are as the adapter reports them, in 512-byte blocks.
+//
+static void
+inventorySetArray(OSDictionary *dict, const char *key, OSArray *array)
+{
+	if (array != NULL) {
+		dict->setObject(key, array);
+		array->release();
+	}
+}
+
+void
+self::inventoryPublish(void)
+{
+	OSDictionary	*dict, *stats, *rec;
+	OSArray		*raidSets, *volumes, *drives;
+	sSYSTEM_INFO	*sys;
+	sGUI_RAIDSET	*rs;
+	sGUI_VOLUMESET	*vs;
+	sGUI_PHY_DRV	*pd;
+	int		i;
+
+	if ((stats = OSDictionary::withCapacity(5)) != NULL) {
+		dictSetNumber(stats, "refreshes", inventoryStats.refreshes);
+		dictSetNumber(stats, "failures", inventoryStats.failures);
+		dictSetNumber(stats, "commands", inventoryStats.commands);
+		dictSetNumber(stats, "refresh-us", inventoryStats.lastRefreshTime);
+		setProperty("inventory-statistics", stats);
+		stats->release();
+	}
+	if (inventory->generation == 0)
+		return;
+
+	if ((dict = OSDictionary::withCapacity(5)) == NULL)
+		return;
+	dictSetNumber(dict, "generation", inventory->generation);
+
+	// system
+	sys = (sSYSTEM_INFO *)inventory->system;
+	if ((rec = OSDictionary::withCapacity(12)) != NULL) {
+		dictSetString(rec, "vendor", sys->gsiVendorName, sizeof(sys->gsiVendorName));
+		dictSetString(rec, "model", sys->gsiModelName, sizeof(sys->gsiModelName));
+		dictSetString(rec, "serial", sys->gsiSerialNumber, sizeof(sys->gsiSerialNumber));
+		dictSetString(rec, "firmware", sys->gsiFirmVersion, sizeof(sys->gsiFirmVersion));
+		dictSetString(rec, "boot-rom", sys->gsiBootVersion, sizeof(sys->gsiBootVersion));
+		dictSetString(rec, "board", sys->gsiMbVersion, sizeof(sys->gsiMbVersion));
+		dictSetNumber(rec, "cpu-mhz", OSSwapLittleToHostInt32(sys->gsiCpuSpeed));
+		dictSetNumber(rec, "memory-mb", OSSwapLittleToHostInt32(sys->gsiMemorySize));
+		dictSetNumber(rec, "ecc", sys->gsiSdramEcc);
+		dictSetNumber(rec, "drive-channels", sys->gsiIdeChannels);
+		dictSetNumber(rec, "max-raid-sets", sys->gsiMaxRaidSet);
+		dictSetNumber(rec, "max-volumes", sys->gsiMaxVolumeSet);
+		dict->setObject("system", rec);
+		rec->release();
+	}
+
+	// RAID sets
+	if ((raidSets = OSArray::withCapacity(4)) != NULL) {
+		for (i = 0; i < ARCMSR_INVENTORY_RAIDSETS; i++) {
+			if (!(inventory->raidSetMask & (1 << i)))
+				continue;
+			rs = (sGUI_RAIDSET *)inventory->raidSet[i];
+			if ((rec = OSDictionary::withCapacity(7)) == NULL)
+				continue;
+			dictSetNumber(rec, "index", i);
+			dictSetString(rec, "name", rs->grsRaidSetName, sizeof(rs->grsRaidSetName));
+			dictSetNumber(rec, "capacity", OSSwapLittleToHostInt32(rs->grsCapacity) |
+				      ((uint64_t)OSSwapLittleToHostInt32(rs->grsCapacityX) << 32));
+			dictSetNumber(rec, "state", rs->grsRaidState);
+			dictSetNumber(rec, "members", rs->grsMemberDevices);
+			dictSetNumber(rec, "volumes", rs->grsVolumes);
+			dictSetNumber(rec, "fail-mask", OSSwapLittleToHostInt32(rs->grsFailMask));
+			raidSets->setObject(rec);
+			rec->release();
+		}
+		inventorySetArray(dict, "raid-sets", raidSets);
+	}
+
+	// volume sets
+	if ((volumes = OSArray::withCapacity(4)) != NULL) {
+		for (i = 0; i < ARCMSR_INVENTORY_VOLUMES; i++) {
+			if (!(inventory->volumeMask & (1 << i)))
+				continue;
+			vs = (sGUI_VOLUMESET *)inventory->volume[i];
+			if ((rec = OSDictionary::withCapacity(12)) == NULL)
+				continue;
+			dictSetNumber(rec, "index", i);
+			dictSetString(rec, "name", vs->gvsVolumeName, sizeof(vs->gvsVolumeName));
+			dictSetNumber(rec, "capacity", OSSwapLittleToHostInt32(vs->gvsCapacity) |
+				      ((uint64_t)OSSwapLittleToHostInt32(vs->gvsCapacityX) << 32));
+			dictSetNumber(rec, "raid-level", vs->gvsRaidLevel);
+			dictSetNumber(rec, "raid-set", vs->gvsRaidSetNumber);
+			dictSetNumber(rec, "members", vs->gvsMemberDisks);
+			dictSetNumber(rec, "stripe-size", OSSwapLittleToHostInt32(vs->gvsStripeSize));
+			dictSetNumber(rec, "status", OSSwapLittleToHostInt32(vs->gvsVolumeStatus));
+			dictSetNumber(rec, "progress", OSSwapLittleToHostInt32(vs->gvsProgress));
+			dictSetNumber(rec, "scsi-channel", vs->gvsScsi.ScsiChannel);
+			dictSetNumber(rec, "scsi-id", vs->gvsScsi.ScsiId);
+			dictSetNumber(rec, "scsi-lun", vs->gvsScsi.ScsiLun);
+			volumes->setObject(rec);
+			rec->release();
+		}
+		inventorySetArray(dict, "volumes", volumes);
+	}
+
+	// drives
+	if ((drives = OSArray::withCapacity(8)) != NULL) {
+		for (i = 0; i < ARCMSR_INVENTORY_DRIVES; i++) {
+			if (!(inventory->driveMask & (1 << i)))
+				continue;
+			pd = (sGUI_PHY_DRV *)inventory->drive[i];
+			if ((rec = OSDictionary::withCapacity(8)) == NULL)
+				continue;
+			dictSetNumber(rec, "index", i);
+			dictSetString(rec, "model", pd->gpdModelName, sizeof(pd->gpdModelName));
+			dictSetString(rec, "serial", pd->gpdSerialNumber, sizeof(pd->gpdSerialNumber));
+			dictSetString(rec, "firmware", pd->gpdFirmRev, sizeof(pd->gpdFirmRev));
+			dictSetNumber(rec, "capacity", OSSwapLittleToHostInt32(pd->gpdCapacity) |
+				      ((uint64_t)OSSwapLittleToHostInt32(pd->gpdCapacityX) << 32));
+			dictSetNumber(rec, "state", pd->gpdDeviceState);
+			dictSetNumber(rec, "raid-set", pd->gpdRaidNumber);
+			dictSetNumber(rec, "udma-mode", pd->gpdCurrentUdmaMode);
+			drives->setObject(rec);
+			rec->release();
+		}
+		inventorySetArray(dict, "drives", drives);
+	}
+
+	setProperty("inventory", dict);
+	dict->release();
+}
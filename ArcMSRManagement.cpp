@@ -0,0 +1,473 @@
+//-
+//
+// @APPLE_LICENSE_HEADER_START@
+// 
+// Copyright (c) 2005 Apple Computer, Inc.  All Rights Reserved.
+// 
+// This file contains Original Code and/or Modifications of Original Code
+// as defined in and that are subject to the Apple Public Source License
+// Version 2.0 (the 'License'). You may not use this file except in
+// compliance with the License. Please obtain a copy of the License at
+// http://www.opensource.apple.com/apsl/ and read it before using this
+// file.
+// 
+// The Original Code and all software distributed under the License are
+// distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+// EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+// INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+// Please see the License for the specific language governing rights and
+// limitations under the License.
+// 
+// @APPLE_LICENSE_HEADER_END@
+
+// $Id$
+
+#include "ArcMSR.h"
+
+#define self ArcMSR
+
+////////////////////////////////////////////////////////////////////////////////
+// Driver-issued management commands
+//
+// The adapter's message channel doubles as the transport for the GUI
+// management protocol described in ArcMSRManagement.h.  The driver uses it
+// for its own housekeeping (eg. watching the event log), and the broker
+// (ArcMSRBroker module) for commands from userclients, one command at a
+// time: a request is framed straight into the inbound message queue, and
+// while it is outstanding everything the adapter sends back is run through
+// the frame parser below.  Output that isn't part of a reply frame goes to
+// the userclient holding the raw (terminal) channel, if there is one.
+//
+// The channel belongs to a raw client for as long as it has it open, and
+// to the loopback path while that is on: nothing new is sent until it is
+// given back, since our frames would land in the middle of the client's
+// partial writes or streams, and in loopback would go straight back out
+// without reaching the parser.  Requests queued meanwhile go out as soon as
+// the client closes, or fail with kIOReturnExclusiveAccess if it hasn't
+// within ARCMSR_GUI_QUEUE_TIMEOUT.  A request already on the channel when a
+// client opens finishes normally; anything the parser doesn't claim goes to
+// the client.
+//
+// Everything here runs on the management workloop with its gate held,
+// apart from the completion calls for the driver's own requests: those run
+// on the I/O workloop, since that's where their owners live, and the next
+// command waits until they are done with the reply.
+//
+
+enum {
+	GUI_PARSE_SIG0,
+	GUI_PARSE_SIG1,
+	GUI_PARSE_SIG2,
+	GUI_PARSE_LENGTH0,
+	GUI_PARSE_LENGTH1,
+	GUI_PARSE_DATA,
+	GUI_PARSE_CHECKSUM
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Frame codec
+//
+// Commands and replies are framed alike: signature, a two byte length, the
+// body (opcode and arguments, or the reply payload) and a checksum over
+// the length and body.  GUIframe fills in the rest of a frame around a
+// body already at GUI_FRAME_BODY and returns the frame size; GUIunframe
+// checks a frame and returns the body length, or -1 if it is malformed.
+//
+int
+self::GUIframe(uint8_t *frame, int length)
+{
+	uint8_t	sum;
+	int	i;
+
+	frame[0] = GUI_SIG0;
+	frame[1] = GUI_SIG1;
+	frame[2] = GUI_SIG2;
+	frame[3] = length & 0xff;
+	frame[4] = (length >> 8) & 0xff;
+	for (sum = 0, i = 3; i < (GUI_FRAME_BODY + length); i++)
+		sum += frame[i];
+	frame[i] = sum;
+	return(length + GUI_FRAME_OVERHEAD);
+}
+
+int
+self::GUIunframe(const uint8_t *frame, int size)
+{
+	uint8_t	sum;
+	int	i, length;
+
+	if ((size < (GUI_FRAME_OVERHEAD + 1)) || (size > GUI_MAX_FRAME))
+		return(-1);
+	if ((frame[0] != GUI_SIG0) || (frame[1] != GUI_SIG1) || (frame[2] != GUI_SIG2))
+		return(-1);
+	length = frame[3] | (frame[4] << 8);
+	if (length != (size - GUI_FRAME_OVERHEAD))
+		return(-1);
+	for (sum = 0, i = 3; i < (size - 1); i++)
+		sum += frame[i];
+	if (sum != frame[size - 1])
+		return(-1);
+	return(length);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Queue a request
+//
+// Returns false if the request is already queued.  Called on the I/O
+// workloop.
+//
+bool
+self::GUIsubmit(struct arcmsr_gui_request *req)
+{
+	bool	queued;
+
+	GUIqueueInvoke(req, &queued);
+	return(queued);
+}
+
+MANAGEMENTGATE_GLUE2(GUIqueue, struct arcmsr_gui_request *, bool *);
+
+void
+self::GUIqueue(struct arcmsr_gui_request *req, bool *queued)
+{
+	struct arcmsr_gui_request **rp;
+
+	if (req->busy) {
+		*queued = false;
+		return;
+	}
+
+	req->busy = true;
+	req->loggingIn = false;
+	req->loggedIn = false;
+	req->next = NULL;
+	req->client = NULL;
+	clock_get_uptime(&req->queuedTime);
+	req->sentTime = 0;
+	for (rp = &guiQueue; *rp != NULL; rp = &(*rp)->next)
+		;
+	*rp = req;
+	debug(DEBUGF_MANAGEMENT, "queued command 0x%02x", req->opcode);
+
+	GUIstart();
+	*queued = true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Send the next queued request if the channel is idle
+//
+// The driver's own requests go first; they are few and the device scanner
+// is waiting on them.  After that the broker picks a client's command.
+//
+void
+self::GUIstart(void)
+{
+	struct arcmsr_gui_request *req;
+	int		size, argLen;
+
+	if ((guiActive != NULL) || (guiFinished != NULL))
+		return;
+	if (clientActive || (MQFlags & ARCMSR_MQF_LOOPBACK)) {
+		debug(DEBUGF_MANAGEMENT, "channel held by a client, deferring commands");
+		GUIexpire();
+		return;
+	}
+	if (((req = guiQueue) == NULL) && ((req = brokerPeek()) == NULL))
+		return;
+
+	// wait for room for the entire frame; the inbound writer calls us again when it drains
+	argLen = req->loggingIn ? (int)strlen(guiPassword) + 1 : req->argLen;
+	if (inboundMQBuffer.avail() < (argLen + 1 + (int)GUI_FRAME_OVERHEAD)) {
+		debug(DEBUGF_MANAGEMENT, "waiting for inbound queue space");
+		return;
+	}
+
+	// frame the command: signature, length, opcode, arguments, checksum
+	if (req->loggingIn) {
+		guiFrame[GUI_FRAME_BODY] = GUI_CHECK_PASSWORD;
+		guiFrame[GUI_FRAME_BODY + 1] = argLen - 1;
+		bcopy(guiPassword, &guiFrame[GUI_FRAME_BODY + 2], argLen - 1);
+	} else {
+		guiFrame[GUI_FRAME_BODY] = req->opcode;
+		if (argLen > 0)
+			bcopy(req->args, &guiFrame[GUI_FRAME_BODY + 1], argLen);
+	}
+	size = GUIframe(guiFrame, argLen + 1);
+
+	// leave the request queued if the frame didn't go in; we'll be back when the queue drains
+	if (!inboundMQBuffer.insert((char *)guiFrame, size)) {
+		debug(DEBUGF_MANAGEMENT, "inbound queue refused %d byte frame", size);
+		return;
+	}
+	if (req->client != NULL) {
+		brokerDequeue(req);
+	} else {
+		guiQueue = req->next;
+	}
+	guiActive = req;
+	clock_get_uptime(&req->sentTime);
+
+	guiParseState = GUI_PARSE_SIG0;
+	guiTimeout->setTimeoutMS(ARCMSR_GUI_TIMEOUT);
+	debug(DEBUGF_MANAGEMENT, "sending command 0x%02x with %d argument bytes", guiFrame[GUI_FRAME_BODY], argLen);
+
+	// kick the adapter if it's quiescent
+	if (MQFlags & ARCMSR_MQF_UNDERFLOW) {
+		MQFlags &= ~ARCMSR_MQF_UNDERFLOW;
+		inboundMQWrite();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Fail requests that have waited too long for a held channel
+//
+// Client commands complete here, so all that are due go at once.  The
+// driver's own complete on the I/O workloop one at a time, like replies;
+// GUIrelease brings us back for the next.  The reply timer is idle while
+// nothing is on the channel, so it wakes us when the next one is due.
+//
+void
+self::GUIexpire(void)
+{
+	struct arcmsr_gui_request *req;
+	uint64_t	now, limit, oldest, ns;
+
+	clock_get_uptime(&now);
+	nanoseconds_to_absolutetime((uint64_t)ARCMSR_GUI_QUEUE_TIMEOUT * 1000 * 1000, &limit);
+	oldest = brokerExpire((now > limit) ? (now - limit) : 0);
+
+	if ((req = guiQueue) != NULL) {
+		if ((now - req->queuedTime) >= limit) {
+			debug(DEBUGF_MANAGEMENT, "command 0x%02x expired waiting for the channel", req->opcode);
+			guiQueue = req->next;
+			req->status = kIOReturnExclusiveAccess;
+			req->reply = NULL;
+			req->replyLen = 0;
+			guiFinished = req;
+			guiDoneSource->interruptOccurred(NULL, NULL, 0);
+			return;
+		}
+		if ((oldest == 0) || (req->queuedTime < oldest))
+			oldest = req->queuedTime;
+	}
+
+	if (oldest != 0) {
+		absolutetime_to_nanoseconds(oldest + limit - now, &ns);
+		guiTimeout->setTimeoutMS(ns / (1000 * 1000) + 1);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Feed data from the adapter to the reply parser
+//
+// Bytes that are not part of a reply frame (eg. VT100 output generated for
+// a client that has just opened) are passed along to the outbound queue if
+// anyone is there to read them, and dropped otherwise.  That includes the
+// start of anything that looked like a frame header but turned out not to
+// be one; the byte that broke the match is looked at again from the top.
+//
+void
+self::GUIinput(const char *data, int len)
+{
+	uint8_t	c;
+	int	i;
+
+	for (i = 0; (i < len) && (guiActive != NULL); i++) {
+		c = (uint8_t)data[i];
+		switch (guiParseState) {
+		case GUI_PARSE_SIG0:
+			if (c == GUI_SIG0) {
+				guiParseState = GUI_PARSE_SIG1;
+			} else {
+				GUIpassthrough(&c, 1);
+			}
+			break;
+		case GUI_PARSE_SIG1:
+		case GUI_PARSE_SIG2:
+			if (c == ((guiParseState == GUI_PARSE_SIG1) ? GUI_SIG1 : GUI_SIG2)) {
+				guiParseState++;
+			} else {
+				GUIflushHeader();
+				i--;
+			}
+			break;
+		case GUI_PARSE_LENGTH0:
+			guiParseLength = c;
+			guiParseSum = c;
+			guiParseState = GUI_PARSE_LENGTH1;
+			break;
+		case GUI_PARSE_LENGTH1:
+			guiParseLength |= c << 8;
+			guiParseSum += c;
+			guiParseCount = 0;
+			if ((guiParseLength < 1) || (guiParseLength > GUI_MAX_LENGTH)) {
+				debug(DEBUGF_MANAGEMENT, "reply with bad length %d", guiParseLength);
+				GUIflushHeader();
+				GUIpassthrough(&c, 1);
+			} else {
+				guiParseState = GUI_PARSE_DATA;
+			}
+			break;
+		case GUI_PARSE_DATA:
+			guiReply[guiParseCount++] = c;
+			guiParseSum += c;
+			if (guiParseCount == guiParseLength)
+				guiParseState = GUI_PARSE_CHECKSUM;
+			break;
+		case GUI_PARSE_CHECKSUM:
+			guiParseState = GUI_PARSE_SIG0;
+			if (c != guiParseSum) {
+				debug(DEBUGF_MANAGEMENT, "reply checksum 0x%02x, expected 0x%02x", c, guiParseSum);
+				GUIcomplete(kIOReturnIOError);
+			} else {
+				GUIcomplete(kIOReturnSuccess);
+			}
+			break;
+		}
+	}
+
+	// anything following a completed reply is for the client
+	if (i < len)
+		GUIpassthrough((const uint8_t *)data + i, len - i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Hand output the parser didn't claim to the raw client
+//
+// GUIflushHeader passes on the part of a frame header matched so far and
+// resets the parser; the signature is fixed, so the bytes are rebuilt here.
+//
+void
+self::GUIpassthrough(const uint8_t *data, int len)
+{
+	if (clientActive && (len > 0))
+		outboundMQDeliver((char *)data, len);
+}
+
+void
+self::GUIflushHeader(void)
+{
+	uint8_t	header[GUI_FRAME_BODY - 1];
+	int	held;
+
+	header[0] = GUI_SIG0;
+	header[1] = GUI_SIG1;
+	header[2] = GUI_SIG2;
+	header[3] = guiParseLength & 0xff;
+	switch (guiParseState) {
+	case GUI_PARSE_SIG1:
+	case GUI_PARSE_SIG2:
+	case GUI_PARSE_LENGTH0:
+	case GUI_PARSE_LENGTH1:
+		held = guiParseState - GUI_PARSE_SIG0;
+		break;
+	default:
+		held = 0;	// a reply body is ours whatever became of it
+		break;
+	}
+	guiParseState = GUI_PARSE_SIG0;
+	GUIpassthrough(header, held);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Finish the active request and start the next
+//
+// If the adapter wants a password for one of the driver's own commands we
+// log in with guiPassword and send the command again, once per submission;
+// the owner only sees the final reply.  The command keeps its place at the
+// front of the queue meanwhile.  If the login is refused the owner gets
+// the refusal in place of its reply.
+//
+void
+self::GUIcomplete(IOReturn status)
+{
+	struct arcmsr_gui_request *req;
+	bool		retry;
+
+	if ((req = guiActive) == NULL)
+		return;
+	guiActive = NULL;
+	guiTimeout->cancelTimeout();
+
+	req->status = status;
+	req->reply = guiReply;
+	req->replyLen = (status == kIOReturnSuccess) ? guiParseLength : 0;
+	debug(DEBUGF_MANAGEMENT, "command 0x%02x%s complete, status 0x%x, %d reply bytes",
+	      req->opcode, req->loggingIn ? " login" : "", status, req->replyLen);
+
+	if (req->client == NULL) {
+		retry = false;
+		if (req->loggingIn) {
+			req->loggingIn = false;
+			if ((req->replyLen == 1) && (req->reply[0] == GUI_OK))
+				retry = true;
+			else if (status == kIOReturnSuccess)
+				error("adapter refused management password");
+		} else if (!req->loggedIn && (req->replyLen == 1) && (req->reply[0] == GUI_PASSWORD_REQUIRED)) {
+			debug(DEBUGF_MANAGEMENT, "logging in for command 0x%02x", req->opcode);
+			req->loggingIn = true;
+			req->loggedIn = true;
+			retry = true;
+		}
+		if (retry) {
+			req->next = guiQueue;
+			guiQueue = req;
+			GUIstart();
+			return;
+		}
+	}
+
+	if (req->client != NULL) {
+		req->busy = false;
+		(this->*req->done)(req);
+		GUIstart();
+	} else {
+		guiFinished = req;
+		guiDoneSource->interruptOccurred(NULL, NULL, 0);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Run a driver request's completion on the I/O workloop, then let the
+// engine move on
+//
+void
+self::GUIfinish(__unused IOInterruptEventSource *es, __unused int count)
+{
+	struct arcmsr_gui_request *req;
+
+	if ((req = guiFinished) == NULL)
+		return;
+	req->busy = false;
+	(this->*req->done)(req);
+	GUIreleaseInvoke();
+}
+
+MANAGEMENTGATE_GLUE0(GUIrelease);
+
+void
+self::GUIrelease(void)
+{
+	guiFinished = NULL;
+	GUIstart();
+}
+
+void
+self::GUItimeout(void */*refcon*/, OSObject *owner, __unused IOTimerEventSource *junk)
+{
+	ArcMSR	*ap;
+
+	if ((ap = OSDynamicCast(ArcMSR, owner)) == NULL) {
+		error("timeout not signalled by ArcMSR");
+		return;
+	}
+	// nothing on the channel; something queued behind a client is due
+	if (ap->guiActive == NULL) {
+		ap->GUIstart();
+		return;
+	}
+	debug(DEBUGF_MANAGEMENT, "timed out waiting for reply");
+	ap->GUIflushHeader();
+	ap->GUIcomplete(kIOReturnTimeout);
+}
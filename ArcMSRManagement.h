@@ -54,6 +54,9 @@
 // Derived (with permission) from the Areca/FreeBSD 'arcmsr' driver.
 //
 
+#ifndef ARCMSRMANAGEMENT_H
+#define ARCMSRMANAGEMENT_H
+
 /**********************************************************************************************************
  **				  RS-232 Interface for Areca Raid Controller
  **		      The low level command interface is exclusive with VT100 terminal
@@ -174,7 +177,7 @@ struct gui_cmd_set_vendor {
  **	      byte 0x14--0x1B : model string (must be 8 bytes)
  **/
 
-struct gui_cmd_set_vendor {
+struct gui_cmd_set_model {
 	uint8_t	pw_len;
 	uint8_t	password[15];
 	uint8_t	model[8];
@@ -221,11 +224,11 @@ struct gui_cmd_set_logo {
 	union {
 		struct {
 			uint16_t imagesize;
-			uint8_t bytes[];
-		} page0;
-		bytes[];
+			uint8_t bytes[0];
+		} __attribute__((packed)) page0;
+		uint8_t bytes[0];
 	} data;
-};
+} __attribute__((packed));
 		
 /**
  **	GUI_POLL_EVENT : Poll If Event Log Changed
@@ -262,6 +265,16 @@ struct gui_cmd_set_logo {
  **	      byte 2	      : command code 0x20
  **	      byte 3	      : raidset#
  **/
+typedef struct sSCSI_ATTR
+{
+	uint8_t ScsiChannel;
+	uint8_t ScsiId;
+	uint8_t ScsiLun;
+	uint8_t ScsiTagQueue;
+	uint8_t ScsiCacheMode;
+	uint8_t ScsiMaxSpeed;
+} __attribute__((packed)) sSCSI_ATTR, *pSCSI_ATTR;
+
 typedef struct sGUI_RAIDSET
 {
 	uint8_t grsRaidSetName[16];
@@ -282,7 +295,7 @@ typedef struct sGUI_RAIDSET
 	uint32_t grsRes4;
 	uint32_t grsRes5; //	    Total to 128 bytes
 	uint32_t grsRes6; //	    Total to 128 bytes
-} sGUI_RAIDSET, *pGUI_RAIDSET;
+} __attribute__((packed)) sGUI_RAIDSET, *pGUI_RAIDSET;
 
 /**
  **	GUI_GET_INFO_V : Get Volume Set Information
@@ -310,7 +323,7 @@ typedef struct sGUI_VOLUMESET
 	uint8_t gvsRaidSetNumber;
 	uint8_t gvsRes0; //	   4
 	uint8_t gvsRes1[4]; //     64 bytes
-} sGUI_VOLUMESET, *pGUI_VOLUMESET;
+} __attribute__((packed)) sGUI_VOLUMESET, *pGUI_VOLUMESET;
 
 /**    
  **	GUI_GET_INFO_P : Get Physical Drive Information
@@ -333,7 +346,7 @@ typedef struct sGUI_PHY_DRV
 	uint8_t gpdRaidNumber; //	 0xff if not belongs to a raid set
 	sSCSI_ATTR gpdScsi;
 	uint8_t gpdReserved[40]; //	   Total to 128 bytes
-} sGUI_PHY_DRV, *pGUI_PHY_DRV;
+} __attribute__((packed)) sGUI_PHY_DRV, *pGUI_PHY_DRV;
 
 /**    
  **	  GUI_GET_INFO_S : Get System Information
@@ -347,7 +360,7 @@ typedef struct sCOM_ATTR
 	uint8_t comStopBits;
 	uint8_t comParity;
 	uint8_t comFlowControl;
-} sCOM_ATTR, *pCOM_ATTR;
+} __attribute__((packed)) sCOM_ATTR, *pCOM_ATTR;
     
 typedef struct sSYSTEM_INFO
 {
@@ -384,7 +397,7 @@ typedef struct sSYSTEM_INFO
 	uint8_t gsiEtherPort; //	1:if ether net port supported
 	uint8_t gsiRaid6Engine; //	  1:Raid6 engine supported
 	uint8_t gsiRes[75];
-} sSYSTEM_INFO, *pSYSTEM_INFO;
+} __attribute__((packed)) sSYSTEM_INFO, *pSYSTEM_INFO;
 
 /**    
  **	GUI_CLEAR_EVENT : Clear System Event
@@ -588,10 +601,35 @@ typedef struct sSYSTEM_INFO
  */
 
 
+#define GUI_OK			0x41
+#define GUI_RAIDSET_NOT_NORMAL	0x42
+#define GUI_VOLUMESET_NOT_NORMAL	0x43
+#define GUI_NO_RAIDSET		0x44
+#define GUI_NO_VOLUMESET	0x45
+#define GUI_NO_PHYSICAL_DRIVE	0x46
+#define GUI_PARAMETER_ERROR	0x47
+#define GUI_UNSUPPORTED_COMMAND	0x48
+#define GUI_DISK_CONFIG_CHANGED	0x49
+#define GUI_INVALID_PASSWORD	0x4a
+#define GUI_NO_DISK_SPACE	0x4b
+#define GUI_CHECKSUM_ERROR	0x4c
+#define GUI_PASSWORD_REQUIRED	0x4d
+
 typedef struct sGUI_COMMAND {
 	uint8_t	sig[3];
+#define GUI_SIG0		0x5e
+#define GUI_SIG1		0x01
+#define GUI_SIG2		0x61
 	uint16_t length;
 	uint8_t opcode;
 	
-} sGUI_COMMAND, *pGUI_COMMAND;
+} __attribute__((packed)) sGUI_COMMAND, *pGUI_COMMAND;
+
+// Frame size limits; the length field never exceeds GUI_MAX_LENGTH
+#define GUI_MAX_LENGTH		2040
+#define GUI_FRAME_OVERHEAD	6		// signature (3), length (2), checksum (1)
+#define GUI_FRAME_BODY		5		// offset of the opcode/reply payload
+#define GUI_MAX_FRAME		(GUI_MAX_LENGTH + GUI_FRAME_OVERHEAD)
+
+#endif /* ARCMSRMANAGEMENT_H */
 
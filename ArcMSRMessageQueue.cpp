@@ -43,14 +43,127 @@
 // this seems odd.  The interrupt handler supports waking a sleeper if we 
 // decide to change this (we should).
 //
-COMMANDGATE_GLUE1(inboundMQBufferInsert, IOMemoryDescriptor *);
+// All of this, along with the management command engine and broker, runs
+// on a workloop of its own so that a busy or sleeping management client
+// never holds up the controller's gate.  The interrupt handler just notes
+// the doorbell bits and hands them over.
+//
+
+////////////////////////////////////////////////////////////////////////////////
+// Management workloop setup and teardown
+//
+// managementStop copes with a partial setup, so a failed initialisation
+// uses it too.
+//
+bool
+self::managementInit(void)
+{
+	if ((managementWorkLoop = IOWorkLoop::workLoop()) == NULL) {
+		error("could not create management workloop");
+		return(false);
+	}
+	if ((managementGate = IOCommandGate::commandGate(this)) == NULL) {
+		error("could not create management command gate");
+		return(false);
+	}
+	if (managementWorkLoop->addEventSource(managementGate)) {
+		error("could not add management command gate to workloop");
+		return(false);
+	}
+
+	doorbellSource = IOInterruptEventSource::interruptEventSource(this,
+								      OSMemberFunctionCast(IOInterruptEventSource::Action,
+											   this,
+											   &ArcMSR::doorbellHandler));
+	if ((doorbellSource == NULL) || managementWorkLoop->addEventSource(doorbellSource)) {
+		error("could not add doorbell handler to management workloop");
+		return(false);
+	}
+
+	// driver management commands log in with this when the adapter asks
+	strncpy(guiPassword, getStringProperty(this, "ManagementPassword", ARCMSR_GUI_PASSWORD), sizeof(guiPassword) - 1);
+	guiPassword[sizeof(guiPassword) - 1] = 0;
+
+	// driver management commands complete back on the I/O workloop
+	guiDoneSource = IOInterruptEventSource::interruptEventSource(this,
+								     OSMemberFunctionCast(IOInterruptEventSource::Action,
+											  this,
+											  &ArcMSR::GUIfinish));
+	if ((guiDoneSource == NULL) || GetWorkLoop()->addEventSource(guiDoneSource)) {
+		error("could not add management completion source to workloop");
+		return(false);
+	}
+	return(true);
+}
+
+void
+self::managementStop(void)
+{
+	if (guiDoneSource) {
+		GetWorkLoop()->removeEventSource(guiDoneSource);
+		guiDoneSource->release();
+		guiDoneSource = NULL;
+	}
+	if (managementWorkLoop == NULL)
+		return;
+	if (outboundMQTimeout) {
+		managementWorkLoop->removeEventSource(outboundMQTimeout);
+		outboundMQTimeout->release();
+		outboundMQTimeout = NULL;
+	}
+	if (inboundMQTimeout) {
+		managementWorkLoop->removeEventSource(inboundMQTimeout);
+		inboundMQTimeout->release();
+		inboundMQTimeout = NULL;
+	}
+	if (guiTimeout) {
+		managementWorkLoop->removeEventSource(guiTimeout);
+		guiTimeout->release();
+		guiTimeout = NULL;
+	}
+	if (doorbellSource) {
+		managementWorkLoop->removeEventSource(doorbellSource);
+		doorbellSource->release();
+		doorbellSource = NULL;
+	}
+	if (managementGate) {
+		managementWorkLoop->removeEventSource(managementGate);
+		managementGate->release();
+		managementGate = NULL;
+	}
+	managementWorkLoop->release();
+	managementWorkLoop = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Doorbell bits handed over by the interrupt handler
+//
+// The adapter won't ring the same doorbell again until we've answered, so
+// nothing is lost by collecting them this way.
+//
+void
+self::doorbellHandler(__unused IOInterruptEventSource *es, __unused int count)
+{
+	UInt32	doorbell;
+
+	do {
+		doorbell = doorbellPending;
+	} while (!OSCompareAndSwap(doorbell, 0, &doorbellPending));
+
+	if (doorbell & ARCMSR_OUTBOUND_IOP331_DATA_WRITE_OK)
+		outboundMQRead();
+	if (doorbell & ARCMSR_OUTBOUND_IOP331_DATA_READ_OK)
+		inboundMQWrite();
+}
+
+MANAGEMENTGATE_GLUE1(inboundMQBufferInsert, IOMemoryDescriptor *);
 
 void
 self::inboundMQBufferInsert(IOMemoryDescriptor *dataBuf)
 {
-	// spin trying to enqueue the data on the inbound queue
+	// spin trying to enqueue the data on the inbound queue, behind any stream
 	for (;;) {
-		if (inboundMQBuffer.insert(dataBuf)) {
+		if (!(MQFlags & ARCMSR_MQF_STREAM) && inboundMQBuffer.insert(dataBuf)) {
 			// insert successful, kick the adapter if it's quiescent
 			if (MQFlags & ARCMSR_MQF_UNDERFLOW) {
 				debug(DEBUGF_MESSAGES, "kicking adapter with inbound message");
@@ -63,7 +176,214 @@ self::inboundMQBufferInsert(IOMemoryDescriptor *dataBuf)
 		}    
 		// No room in the ringbuffer, sleep waiting for space
 		debug(DEBUGF_MESSAGES, "waiting for inbound queue space");
-		GetCommandGate()->commandSleep(&inboundMQBuffer);
+		managementGate->commandSleep(&inboundMQBuffer);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Take as much as will fit without blocking
+//
+// If nothing fits and the caller is prepared to wait, sleep once until
+// there is room or the timeout expires.  Whoever comes up short is sent a
+// writable notification (if the channel owner has asked for them) once the
+// queue drains.  *written is -1 while a stream owns the channel.
+//
+MANAGEMENTGATE_GLUE3(inboundMQBufferWrite, IOMemoryDescriptor *, int *, int);
+
+void
+self::inboundMQBufferWrite(IOMemoryDescriptor *dataBuf, int *written, int timeout)
+{
+	char	*p;
+	int	length, done, frag, slept;
+
+	if (MQFlags & ARCMSR_MQF_STREAM) {
+		debug(DEBUGF_MESSAGES, "refusing write during a stream");
+		*written = -1;
+		return;
+	}
+
+	length = dataBuf->getLength();
+	done = 0;
+	slept = 0;
+	for (;;) {
+		// straight into the ringbuffer, at most two runs
+		while ((done < length) && ((p = inboundMQBuffer.reserve(&frag)), frag > 0)) {
+			if (frag > (length - done))
+				frag = length - done;
+			dataBuf->readBytes(done, p, frag);
+			inboundMQBuffer.commit(frag);
+			done += frag;
+		}
+		if ((done > 0) || slept || (timeout <= 0))
+			break;
+
+		slept = 1;
+		debug(DEBUGF_MESSAGES, "waiting %dms for inbound queue space", timeout);
+		inboundMQTimeout->setTimeoutMS(timeout);
+		managementGate->commandSleep(&inboundMQBuffer);
+		inboundMQTimeout->cancelTimeout();
+		MQStats.sleeps++;
+	}
+
+	if (done < length) {
+		writableArmed = true;
+		if (done == 0) {
+			MQStats.wouldBlock++;
+		} else {
+			MQStats.partialWrites++;
+		}
+	}
+	if ((done > 0) && (MQFlags & ARCMSR_MQF_UNDERFLOW)) {
+		debug(DEBUGF_MESSAGES, "kicking adapter with inbound message");
+		MQFlags &= ~ARCMSR_MQF_UNDERFLOW;
+		inboundMQWrite();
+	}
+	debug(DEBUGF_MESSAGES, "queued %d of %d inbound bytes", done, length);
+	*written = done;
+	outboundMQPublish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Stream a payload of any size to the adapter
+//
+// The userclient claims the inbound side with setStreaming, then wires the
+// caller's buffer a window at a time and passes each window here, where it
+// is read a message buffer at a time as the adapter rings for more.  While
+// the claim is held nothing else gets onto the channel: Send waits for the
+// end of the stream, Write is refused, and the shared ring and management
+// commands hold off, so the payload reaches the adapter in one piece.
+// Data queued before the stream started still goes ahead of it.
+//
+// If the adapter takes nothing for stall ms we give up and return what was
+// sent.
+//
+MANAGEMENTGATE_GLUE1(setStreaming, bool *);
+
+void
+self::setStreaming(bool *state)
+{
+	if (*state) {
+		if (MQFlags & ARCMSR_MQF_STREAM) {
+			*state = false;
+			return;
+		}
+		MQFlags |= ARCMSR_MQF_STREAM;
+		MQStats.streams++;
+		outboundMQPublish();
+	} else {
+		MQFlags &= ~ARCMSR_MQF_STREAM;
+
+		// let the deferred senders in, and the shared ring if it has anything
+		managementGate->commandWakeup(&inboundMQBuffer, false /* wake everyone */);
+		if (MQFlags & ARCMSR_MQF_UNDERFLOW) {
+			MQFlags &= ~ARCMSR_MQF_UNDERFLOW;
+			inboundMQWrite();
+		}
+	}
+	*state = true;
+}
+
+MANAGEMENTGATE_GLUE3(inboundMQStream, IOMemoryDescriptor *, int *, int);
+
+void
+self::inboundMQStream(IOMemoryDescriptor *dataBuf, int *sent, int stall)
+{
+	uint64_t	start, now, limit, ns;
+	int		length;
+
+	if (streamBuf != NULL) {
+		*sent = -1;
+		return;
+	}
+	if (stall <= 0)
+		stall = ARCMSR_STREAM_STALL_TIMEOUT;
+	nanoseconds_to_absolutetime((uint64_t)stall * 1000000ULL, &limit);
+
+	length = dataBuf->getLength();
+	streamBuf = dataBuf;
+	streamOffset = 0;
+	clock_get_uptime(&start);
+	streamProgress = start;
+	debug(DEBUGF_MESSAGES, "streaming %d bytes", length);
+
+	// kick the adapter if it's quiescent
+	if (MQFlags & ARCMSR_MQF_UNDERFLOW) {
+		MQFlags &= ~ARCMSR_MQF_UNDERFLOW;
+		inboundMQWrite();
+	}
+
+	// woken when the last of it goes
+	while (streamBuf != NULL) {
+		clock_get_uptime(&now);
+		if ((now - streamProgress) >= limit) {
+			error("stream stalled after %d of %d bytes", streamOffset, length);
+			streamBuf = NULL;
+			break;
+		}
+		inboundMQTimeout->setTimeoutMS(stall);
+		managementGate->commandSleep(&inboundMQBuffer);
+		inboundMQTimeout->cancelTimeout();
+	}
+	*sent = streamOffset;
+
+	clock_get_uptime(&now);
+	absolutetime_to_nanoseconds(now - start, &ns);
+	MQStats.streamBytes += streamOffset;
+	MQStats.streamTime += ns / 1000;
+	MQStats.streamRate = (ns > 0) ? (((uint64_t)streamOffset * 1000000000ULL) / ns) : 0;
+	debug(DEBUGF_MESSAGES, "streamed %d bytes, %llu bytes/s", streamOffset, MQStats.streamRate);
+	outboundMQPublish();
+}
+
+int
+self::inboundMQStreamFetch(char *buf, int len)
+{
+	int	length;
+
+	length = streamBuf->getLength() - streamOffset;
+	if (length > len)
+		length = len;
+	streamBuf->readBytes(streamOffset, buf, length);
+	streamOffset += length;
+	clock_get_uptime(&streamProgress);
+
+	if (streamOffset >= (int)streamBuf->getLength()) {
+		streamBuf = NULL;
+		managementGate->commandWakeup(&inboundMQBuffer, false /* wake everyone */);
+	}
+	return(length);
+}
+
+void
+self::inboundMQWakeup(void */*refcon*/, OSObject *owner, __unused IOTimerEventSource *junk)
+{
+	ArcMSR	*ap;
+
+	if ((ap = OSDynamicCast(ArcMSR, owner)) == NULL) {
+		error("timeout not signalled by ArcMSR");
+		return;
+	}
+
+	debug(DEBUGF_MESSAGES, "timed out waiting for inbound queue space");
+	ap->MQStats.timeouts++;
+	ap->outboundMQPublish();
+	ap->managementGate->commandWakeup(&inboundMQBuffer, false);
+}
+
+// Blocked writers needn't wait for the adapter to take everything
+void
+self::inboundMQWatermark(void *arg, __unused RingBuffer *ring, bool high)
+{
+	ArcMSR	*ap = (ArcMSR *)arg;
+
+	if (high)
+		return;
+	ap->managementGate->commandWakeup(&ap->inboundMQBuffer, false /* wake everyone */);
+	if (ap->writableArmed && (ap->notifyClient != NULL)) {
+		ap->writableArmed = false;
+		ap->notifyClient->sendNotification(kArcMSRNotifyWritable);
+		ap->MQStats.writableNotifications++;
+		ap->outboundMQPublish();
 	}
 }
 
@@ -72,8 +392,15 @@ self::inboundMQWrite(void)
 {
 	uint32_t    length;
 
-	// Check to see if we have more to send
-	length = inboundMQBuffer.remove(mu->ioctl_wbuffer.data, sizeof(mu->ioctl_wbuffer.data));
+	if (MQFlags & ARCMSR_MQF_LOOPBACK) {
+		// looped back, the data never goes near the adapter
+		if (!inboundMQLoopback())
+			return;
+		length = 0;
+	} else {
+		// Check to see if we have more to send
+		length = inboundMQFetch(mu->ioctl_wbuffer.data, sizeof(mu->ioctl_wbuffer.data));
+	}
 	if (length > 0) {
 		mu->ioctl_wbuffer.length = OSSwapHostToLittleInt32(length);
 		setInboundDoorbell(ARCMSR_INBOUND_DRIVER_DATA_WRITE_OK);
@@ -81,12 +408,71 @@ self::inboundMQWrite(void)
 	} else {
 		// nothing left to write, flag underflow and wake blocked sender
 		MQFlags |= ARCMSR_MQF_UNDERFLOW;
-		GetCommandGate()->commandWakeup(&inboundMQBuffer, false /* wake everyone */);
+		managementGate->commandWakeup(&inboundMQBuffer, false /* wake everyone */);
 		debug(DEBUGF_MESSAGES, "inbound buffer empty, waking writers");
+
+		// a management command may have been waiting for space
+		GUIstart();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Fetch the next chunk of inbound data
+//
+// Nothing new is queued while a stream owns the channel, so whatever is in
+// the inbound queue was there first and goes ahead of the stream.  The
+// shared ring waits until the stream has finished, not just its current
+// window.
+//
+int
+self::inboundMQFetch(char *buf, int len)
+{
+	int	length;
+
+	length = inboundMQBuffer.remove(buf, len);
+	if ((length == 0) && (streamBuf != NULL))
+		length = inboundMQStreamFetch(buf, len);
+	if ((length == 0) && (sharedIn != NULL) && !(MQFlags & ARCMSR_MQF_STREAM))
+		length = ArcMSRSharedRingGet(sharedIn, buf, len);
+	return(length);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Move inbound data straight to the outbound side
+//
+// Like the adapter, we move a message buffer at a time and stall if the
+// reader isn't keeping up.  Returns true once there is nothing left to
+// move.
+//
+bool
+self::inboundMQLoopback(void)
+{
+	char	buf[sizeof(mu->ioctl_wbuffer.data)];
+	char	*data;
+	int	length;
+
+	for (;;) {
+		if (outboundMQSpace() < (int)sizeof(buf)) {
+			MQFlags |= ARCMSR_MQF_OVERFLOW;
+			debug(DEBUGF_MESSAGES, "loopback stalled waiting for reader");
+			return(false);
+		}
+		// our own queue can be handed on without copying it out first
+		if (!inboundMQBuffer.empty()) {
+			data = inboundMQBuffer.peek(&length);
+			if (length > (int)sizeof(buf))
+				length = sizeof(buf);
+			outboundMQDeliver(data, length);
+			inboundMQBuffer.consume(length);
+			continue;
+		}
+		if ((length = inboundMQFetch(buf, sizeof(buf))) == 0)
+			return(true);
+		outboundMQDeliver(buf, length);
 	}
 }
 
-COMMANDGATE_GLUE3(outboundMQBufferRemove, IOMemoryDescriptor *, int *, int);
+MANAGEMENTGATE_GLUE3(outboundMQBufferRemove, IOMemoryDescriptor *, int *, int);
 
 void
 self::outboundMQWakeup(void */*refcon*/, OSObject *owner, __unused IOTimerEventSource *junk)
@@ -99,7 +485,9 @@ self::outboundMQWakeup(void */*refcon*/, OSObject *owner, __unused IOTimerEventS
 	}
 
 	debug(DEBUGF_MESSAGES, "timed out waiting for outbound message data");
-	ap->GetCommandGate()->commandWakeup(&outboundMQBuffer, false);
+	ap->MQStats.timeouts++;
+	ap->outboundMQPublish();
+	ap->managementGate->commandWakeup(&outboundMQBuffer, false);
 }
 
 void
@@ -120,8 +508,7 @@ restart:
 		// Check to see if there is overflow data in the ioctl_rbuffer
 		if (MQFlags & ARCMSR_MQF_OVERFLOW) {
 			// This is guaranteed to fit in the ringbuffer now, since we just emptied it
-			outboundMQRead();
-			MQFlags &= ~ARCMSR_MQF_OVERFLOW;
+			outboundMQResume();
 	    
 			// pull data out into the requester's buffer
 			length = outboundMQBuffer.remove(dataBuf, total_length);
@@ -134,11 +521,13 @@ restart:
 		slept = 1;
 		debug(DEBUGF_MESSAGES, "waiting %dms for data from adapter", timeout);
 		outboundMQTimeout->setTimeoutMS(timeout);
-		GetCommandGate()->commandSleep(&outboundMQBuffer);
+		managementGate->commandSleep(&outboundMQBuffer);
+		MQStats.sleeps++;
 		goto restart;
 	}
 		
 	*bytesRead = total_length;
+	outboundMQRearm();
 }
 
 void
@@ -148,11 +537,27 @@ self::outboundMQRead(void)
 
 	length = OSSwapLittleToHostInt32(mu->ioctl_rbuffer.length);
 
+	// Replies to management commands issued by the driver are consumed directly
+	if (guiActive != NULL) {
+		if (length > sizeof(mu->ioctl_rbuffer.data))
+			length = sizeof(mu->ioctl_rbuffer.data);
+		GUIinput(mu->ioctl_rbuffer.data, length);
+		setInboundDoorbell(ARCMSR_INBOUND_DRIVER_DATA_READ_OK);
+		debug(DEBUGF_MESSAGES, "passed %d bytes of outbound message data to the reply parser", length);
+		return;
+	}
+
+	// Nobody holds the raw channel (eg. a late reply to a command that timed out); don't let it back up
+	if (!clientActive) {
+		setInboundDoorbell(ARCMSR_INBOUND_DRIVER_DATA_READ_OK);
+		debug(DEBUGF_MESSAGES, "dropped %d bytes of unsolicited outbound message data", length);
+		return;
+	}
+
 	// Try to enqueue locally
-	if (outboundMQBuffer.insert(mu->ioctl_rbuffer.data, length)) {
-		// all good, acknowledge data read and wake reader
+	if (outboundMQDeliver(mu->ioctl_rbuffer.data, length)) {
+		// all good, acknowledge data read
 		setInboundDoorbell(ARCMSR_INBOUND_DRIVER_DATA_READ_OK);
-		GetCommandGate()->commandWakeup(&outboundMQBuffer, false /* wake everyone */);
 		debug(DEBUGF_MESSAGES, "got %d bytes of outbound message data from the adapter", length);
 	} else {
 		// no space, flag overflow and don't ack to the adapter
@@ -161,15 +566,263 @@ self::outboundMQRead(void)
 	}
 }
 
-COMMANDGATE_GLUE0(inboundMQBufferClear);
+////////////////////////////////////////////////////////////////////////////////
+// Hand outbound data to the reader, either in our ringbuffer or in the
+// client's mapped ring, and wake the reader
+//
+// Returns false if there isn't room for all of it.
+//
+bool
+self::outboundMQDeliver(char *data, int length)
+{
+	char	*p;
+	int	done, frag;
+
+	if (sharedOut != NULL) {
+		if ((int)ArcMSRSharedRingFree(sharedOut) < length)
+			return(false);
+		ArcMSRSharedRingPut(sharedOut, data, length);
+	} else {
+		if (outboundMQBuffer.avail() < length)
+			return(false);
+		// straight from the adapter's window into the ringbuffer, at most two runs
+		for (done = 0; done < length; done += frag) {
+			p = outboundMQBuffer.reserve(&frag);
+			if (frag > (length - done))
+				frag = length - done;
+			bcopy(data + done, p, frag);
+			outboundMQBuffer.commit(frag);
+		}
+	}
+	managementGate->commandWakeup(&outboundMQBuffer, false /* wake everyone */);
+	outboundMQNotify();
+	return(true);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Receive notification
+//
+// One message per batch: we disarm when we send, and the client rearms
+// by reading.  If data slipped in between the client's last read and the
+// rearm it is told straight away, so nothing can be left unannounced.
+//
+void
+self::outboundMQNotify(void)
+{
+	if ((notifyClient != NULL) && notifyArmed) {
+		notifyArmed = false;
+		notifyClient->sendNotification(kArcMSRNotifyDataAvailable);
+		MQStats.notifications++;
+		outboundMQPublish();
+	}
+}
+
+void
+self::outboundMQRearm(void)
+{
+	notifyArmed = true;
+	if (!outboundMQBuffer.empty() ||
+	    ((sharedOut != NULL) && (ArcMSRSharedRingUsed(sharedOut) > 0)) ||
+	    (MQFlags & ARCMSR_MQF_OVERFLOW))
+		outboundMQNotify();
+	outboundMQPublish();
+}
+
+// Everything that counts something calls this, readers included, so it's
+// rate-limited to once a second
+void
+self::outboundMQPublish(void)
+{
+	OSDictionary	*dict;
+	uint64_t	now, interval;
+
+	clock_get_uptime(&now);
+	nanoseconds_to_absolutetime(1000000000ULL, &interval);
+	if ((now - MQStats.published) < interval)
+		return;
+	MQStats.published = now;
+
+	if ((dict = OSDictionary::withCapacity(10)) == NULL)
+		return;
+	dictSetNumber(dict, "notifications", MQStats.notifications);
+	dictSetNumber(dict, "sleeps", MQStats.sleeps);
+	dictSetNumber(dict, "timeouts", MQStats.timeouts);
+	dictSetNumber(dict, "partial-writes", MQStats.partialWrites);
+	dictSetNumber(dict, "would-block", MQStats.wouldBlock);
+	dictSetNumber(dict, "writable-notifications", MQStats.writableNotifications);
+	dictSetNumber(dict, "streams", MQStats.streams);
+	dictSetNumber(dict, "stream-bytes", MQStats.streamBytes);
+	dictSetNumber(dict, "stream-us", MQStats.streamTime);
+	dictSetNumber(dict, "stream-bytes-per-second", MQStats.streamRate);
+	setProperty("message-statistics", dict);
+	dict->release();
+}
+
+MANAGEMENTGATE_GLUE1(setNotifyClient, ArcMSRUserClient *);
+
+void
+self::setNotifyClient(ArcMSRUserClient *client)
+{
+	notifyClient = client;
+	if (client != NULL) {
+		outboundMQRearm();
+
+		// the queue may have drained before the writable port was registered
+		if (writableArmed && (inboundMQBuffer.used() <= (ARCMSR_MESSAGE_BUFFER / 2))) {
+			writableArmed = false;
+			client->sendNotification(kArcMSRNotifyWritable);
+			MQStats.writableNotifications++;
+		}
+	} else {
+		// the owner is going; whatever it did last is published regardless of the rate limit
+		MQStats.published = 0;
+	}
+	outboundMQPublish();
+}
+
+// Replace a userclient's notification message, handing back the old one;
+// sendNotification reads it with the gate held
+MANAGEMENTGATE_GLUE2(swapNotifyMessage, mach_msg_header_t *, mach_msg_header_t *);
+
+void
+self::swapNotifyMessage(mach_msg_header_t *slot, mach_msg_header_t *msg)
+{
+	mach_msg_header_t	old;
+
+	old = *slot;
+	*slot = *msg;
+	*msg = old;
+}
+
+int
+self::outboundMQSpace(void)
+{
+	if (sharedOut != NULL)
+		return(ArcMSRSharedRingFree(sharedOut));
+	return(outboundMQBuffer.avail());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The reader has made room; pick up whatever was stalled waiting for it
+//
+void
+self::outboundMQResume(void)
+{
+	if (MQFlags & ARCMSR_MQF_OVERFLOW) {
+		MQFlags &= ~ARCMSR_MQF_OVERFLOW;
+		if (MQFlags & ARCMSR_MQF_LOOPBACK) {
+			inboundMQWrite();
+		} else {
+			outboundMQRead();
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Shared ring transport
+//
+// A client that has mapped the rings kicks us after producing inbound data
+// (in case the adapter side has gone idle) or consuming outbound data (in
+// case the adapter is stalled waiting for room), and may sleep waiting for
+// outbound data.
+//
+MANAGEMENTGATE_GLUE2(setSharedRing, int, ArcMSRSharedRing *);
+
+void
+self::setSharedRing(int type, ArcMSRSharedRing *ring)
+{
+	switch (type) {
+	case kArcMSRSharedRingInbound:
+		sharedIn = ring;
+		break;
+	case kArcMSRSharedRingOutbound:
+		sharedOut = ring;
+		managementGate->commandWakeup(&outboundMQBuffer, false);
+		break;
+	}
+	debug(DEBUGF_MESSAGES, "%s shared ring %s", (type == kArcMSRSharedRingInbound) ? "inbound" : "outbound",
+	      (ring != NULL) ? "attached" : "detached");
+}
+
+MANAGEMENTGATE_GLUE0(sharedRingKick);
+
+void
+self::sharedRingKick(void)
+{
+	if ((MQFlags & ARCMSR_MQF_UNDERFLOW) && (sharedIn != NULL) && (ArcMSRSharedRingUsed(sharedIn) > 0)) {
+		debug(DEBUGF_MESSAGES, "kicking adapter with shared ring data");
+		MQFlags &= ~ARCMSR_MQF_UNDERFLOW;
+		inboundMQWrite();
+	}
+	outboundMQResume();
+	outboundMQRearm();
+}
+
+MANAGEMENTGATE_GLUE1(sharedRingWait, int);
+
+void
+self::sharedRingWait(int timeout)
+{
+	if ((sharedOut == NULL) || (ArcMSRSharedRingUsed(sharedOut) > 0) || (timeout <= 0))
+		return;
+	debug(DEBUGF_MESSAGES, "waiting %dms for shared ring data", timeout);
+	outboundMQTimeout->setTimeoutMS(timeout);
+	managementGate->commandSleep(&outboundMQBuffer);
+	outboundMQTimeout->cancelTimeout();
+	MQStats.sleeps++;
+	outboundMQPublish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Loop the message channel back on itself
+//
+// This is for measuring the cost of the transport alone.  Both buffers are
+// emptied when the mode changes, so loopback can't be turned on under a
+// management command still on the channel; the caller can try again once
+// it has completed.  Turning it off is always allowed: nothing is sent
+// while it is on, so there is nothing on the channel to disturb, and a
+// client that closes must never leave it on.
+//
+MANAGEMENTGATE_GLUE2(setLoopback, bool, IOReturn *);
+
+void
+self::setLoopback(bool state, IOReturn *status)
+{
+	if (state && (guiActive != NULL)) {
+		debug(DEBUGF_MESSAGES, "loopback unchanged, management command 0x%02x outstanding", guiActive->opcode);
+		*status = kIOReturnBusy;
+		return;
+	}
+	*status = kIOReturnSuccess;
+	inboundMQBufferClear();
+	outboundMQBufferClear();
+	if (state) {
+		MQFlags |= ARCMSR_MQF_LOOPBACK;
+	} else {
+		// nothing can be in flight to the adapter from loopback mode
+		MQFlags &= ~ARCMSR_MQF_LOOPBACK;
+		MQFlags |= ARCMSR_MQF_UNDERFLOW;
+	}
+	debug(DEBUGF_MESSAGES, "loopback %s", state ? "on" : "off");
+	if (!state)
+		GUIstart();
+}
+
+MANAGEMENTGATE_GLUE0(inboundMQBufferClear);
 
 void
 self::inboundMQBufferClear(void)
 {
 	inboundMQBuffer.clear();
+
+	// and abandon the rest of any stream
+	if (streamBuf != NULL) {
+		streamBuf = NULL;
+		managementGate->commandWakeup(&inboundMQBuffer, false);
+	}
 }
 
-COMMANDGATE_GLUE0(outboundMQBufferClear);
+MANAGEMENTGATE_GLUE0(outboundMQBufferClear);
 
 void
 self::outboundMQBufferClear(void)
@@ -179,7 +832,11 @@ self::outboundMQBufferClear(void)
 	// If there's overflow data we need to kick the adapter to start sending again
 	if (MQFlags & ARCMSR_MQF_OVERFLOW) {
 		MQFlags &= ~ARCMSR_MQF_OVERFLOW;
-		setInboundDoorbell(ARCMSR_INBOUND_DRIVER_DATA_READ_OK);
+		if (MQFlags & ARCMSR_MQF_LOOPBACK) {
+			inboundMQWrite();
+		} else {
+			setInboundDoorbell(ARCMSR_INBOUND_DRIVER_DATA_READ_OK);
+		}
 	}
 }
 
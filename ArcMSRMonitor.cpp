@@ -0,0 +1,287 @@
+//-
+//
+// @APPLE_LICENSE_HEADER_START@
+// 
+// Copyright (c) 2005 Apple Computer, Inc.  All Rights Reserved.
+// 
+// This file contains Original Code and/or Modifications of Original Code
+// as defined in and that are subject to the Apple Public Source License
+// Version 2.0 (the 'License'). You may not use this file except in
+// compliance with the License. Please obtain a copy of the License at
+// http://www.opensource.apple.com/apsl/ and read it before using this
+// file.
+// 
+// The Original Code and all software distributed under the License are
+// distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+// EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+// INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+// Please see the License for the specific language governing rights and
+// limitations under the License.
+// 
+// @APPLE_LICENSE_HEADER_END@
+
+// $Id$
+
+#include "ArcMSR.h"
+
+#define self ArcMSR
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// Hardware monitor sampling
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+//
+// The adapter reports its fan speeds, voltages and temperatures in reply to
+// GUI_GET_HW_MONITOR.  We ask every monitorInterval ms and append the
+// readings to a history that userclients map read-only (see
+// ArcMSRUserClientInterface.h), so any number of monitoring tools can watch
+// the hardware without sending the adapter anything or holding the
+// message channel.  The latest reading is also published in the registry
+// as "hardware-monitor".
+//
+// There is a single writer (the completion, on the workloop); readers
+// check the sample sequence numbers to notice samples that were
+// overwritten while they were copying them.
+//
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocate the history and create the sample timer
+//
+bool
+self::monitorInit(void)
+{
+	int		i;
+
+	monitorBuffer = IOBufferMemoryDescriptor::withOptions(kIODirectionOutIn | kIOMemoryKernelUserShared,
+							      round_page_32(sizeof(ArcMSRMonitorHistory)),
+							      PAGE_SIZE);
+	if (monitorBuffer == NULL) {
+		error("could not allocate hardware monitor history");
+		return(false);
+	}
+	monitorHistory = (ArcMSRMonitorHistory *)monitorBuffer->getBytesNoCopy();
+	bzero(monitorHistory, sizeof(*monitorHistory));
+	for (i = 0; i < ARCMSR_MONITOR_SAMPLES; i++)
+		monitorHistory->sample[i].sequence = ARCMSR_MONITOR_INVALID;
+	monitorHistory->version = ARCMSR_MONITOR_VERSION;
+
+	monitorInterval = getNumberProperty(this, "MonitorInterval", ARCMSR_MONITOR_INTERVAL);
+	if ((monitorInterval > 0) && (monitorInterval < ARCMSR_MONITOR_INTERVAL_MIN))
+		monitorInterval = ARCMSR_MONITOR_INTERVAL_MIN;
+	bzero(&monitorStats, sizeof(monitorStats));
+	bzero(&monitorRequest, sizeof(monitorRequest));
+	monitorRequest.args = monitorArgs;
+	monitorRequest.done = &ArcMSR::monitorDone;
+
+	monitorTimer = IOTimerEventSource::timerEventSource(this,
+							    OSMemberFunctionCast(IOTimerEventSource::Action,
+										 this,
+										 &ArcMSR::monitorStub));
+	if (GetWorkLoop()->addEventSource(monitorTimer)) {
+		error("could not add hardware monitor timer source to workloop");
+		return(false);
+	}
+	debug(DEBUGF_MONITOR, "hardware monitor sampling every %dms", monitorInterval);
+	return(true);
+}
+
+void
+self::monitorFree(void)
+{
+	if (monitorTimer != NULL)
+		monitorTimer->release();
+	if (monitorBuffer != NULL)
+		monitorBuffer->release();
+	monitorHistory = NULL;
+}
+
+IOMemoryDescriptor *
+self::monitorMemory(void)
+{
+	return(monitorBuffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Start/stop sampling
+//
+void
+self::monitorStart(void)
+{
+	monitorHistory->interval = monitorInterval;
+	if (monitorInterval > 0) {
+		monitorTimer->enable();
+		monitorTimer->setTimeoutMS(1);		// first sample ASAP
+	}
+}
+
+void
+self::monitorStop(void)
+{
+	monitorTimer->disable();
+	monitorHistory->interval = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Time for a sample
+//
+void
+self::monitorStub(void */*refcon*/, OSObject *owner, IOTimerEventSource *es)
+{
+	ArcMSR		*ap;
+
+	if ((ap = OSDynamicCast(ArcMSR, owner)) == NULL) {
+		error("hardware monitor not signalled by ArcMSR");
+		return;
+	}
+
+	// don't pile up behind a slow adapter
+	if (monitorRequest.busy) {
+		monitorStats.skipped++;
+	} else {
+		monitorRequest.opcode = GUI_GET_HW_MONITOR;
+		monitorRequest.argLen = 0;
+		GUIsubmit(&monitorRequest);
+	}
+	if (monitorInterval > 0)
+		monitorTimer->setTimeoutMS(monitorInterval);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The readings have arrived
+//
+void
+self::monitorDone(struct arcmsr_gui_request *req)
+{
+	if (req->status != kIOReturnSuccess) {
+		debug(DEBUGF_MONITOR, "adapter did not answer (0x%x)", req->status);
+		monitorStats.failures++;
+		return;
+	}
+
+	if ((req->replyLen == 1) && (req->reply[0] == GUI_UNSUPPORTED_COMMAND)) {
+		error("adapter has no hardware monitor, sampling stopped");
+		monitorInterval = 0;
+		monitorStop();
+		return;
+	}
+	if (!monitorRecord(req->reply, req->replyLen)) {
+		debug(DEBUGF_MONITOR, "unusable %d-byte reply to command 0x%02x", req->replyLen, req->opcode);
+		monitorStats.failures++;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Decode a reply into the next history slot
+//
+// The reply has the sensor counts (fans, voltages, temperatures, power
+// supplies), then a 16-bit RPM per fan, a 16-bit nominal and measured mV
+// pair per voltage, a byte per temperature, and the power supply and UPS
+// status bytes.
+//
+bool
+self::monitorRecord(const uint8_t *reply, int len)
+{
+	ArcMSRMonitorSample *sample;
+	const uint8_t	*p;
+	int		fans, voltages, temperatures, i;
+	uint32_t	n;
+
+	if (len < 4)
+		return(false);
+	fans = reply[0];
+	voltages = reply[1];
+	temperatures = reply[2];
+	if (len < (4 + (fans * 2) + (voltages * 4) + temperatures + 2))
+		return(false);
+
+	// take the slot away from readers while we fill it
+	n = monitorHistory->count;
+	sample = &monitorHistory->sample[n % ARCMSR_MONITOR_SAMPLES];
+	sample->sequence = ARCMSR_MONITOR_INVALID;
+	ArcMSRSharedRingBarrier();
+
+	bzero(&sample->fans, sizeof(*sample) - offsetof(ArcMSRMonitorSample, fans));
+	clock_get_uptime(&sample->time);
+	sample->fans = (fans < ARCMSR_MONITOR_SENSORS) ? fans : ARCMSR_MONITOR_SENSORS;
+	sample->voltages = (voltages < ARCMSR_MONITOR_SENSORS) ? voltages : ARCMSR_MONITOR_SENSORS;
+	sample->temperatures = (temperatures < ARCMSR_MONITOR_SENSORS) ? temperatures : ARCMSR_MONITOR_SENSORS;
+	p = reply + 4;
+	for (i = 0; i < fans; i++, p += 2) {
+		if (i < sample->fans)
+			sample->fan[i] = OSReadLittleInt16(p, 0);
+	}
+	for (i = 0; i < voltages; i++, p += 4) {
+		if (i < sample->voltages) {
+			sample->nominal[i] = OSReadLittleInt16(p, 0);
+			sample->voltage[i] = OSReadLittleInt16(p, 2);
+		}
+	}
+	for (i = 0; i < temperatures; i++, p++) {
+		if (i < sample->temperatures)
+			sample->temperature[i] = *p;
+	}
+	sample->power = p[0];
+	sample->ups = p[1];
+
+	// hand it back
+	ArcMSRSharedRingBarrier();
+	sample->sequence = n;
+	ArcMSRSharedRingBarrier();
+	monitorHistory->count = n + 1;
+	monitorStats.samples++;
+	monitorPublish(sample);
+	return(true);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Advertise the latest readings in the registry
+//
+static void
+monitorSetArray(OSDictionary *dict, const char *key, const uint16_t *values, int count)
+{
+	OSArray		*array;
+	OSNumber	*num;
+	int		i;
+
+	if ((array = OSArray::withCapacity(count ? count : 1)) == NULL)
+		return;
+	for (i = 0; i < count; i++) {
+		if ((num = OSNumber::withNumber((unsigned long long)values[i], 32)) != NULL) {
+			array->setObject(num);
+			num->release();
+		}
+	}
+	dict->setObject(key, array);
+	array->release();
+}
+
+void
+self::monitorPublish(ArcMSRMonitorSample *sample)
+{
+	OSDictionary	*dict;
+	uint16_t	temperature[ARCMSR_MONITOR_SENSORS];
+	int		i;
+
+	if ((dict = OSDictionary::withCapacity(6)) != NULL) {
+		monitorSetArray(dict, "fans-rpm", sample->fan, sample->fans);
+		monitorSetArray(dict, "voltages-mv", sample->voltage, sample->voltages);
+		monitorSetArray(dict, "nominal-mv", sample->nominal, sample->voltages);
+		for (i = 0; i < sample->temperatures; i++)
+			temperature[i] = sample->temperature[i];
+		monitorSetArray(dict, "temperatures-c", temperature, sample->temperatures);
+		dictSetNumber(dict, "power", sample->power);
+		dictSetNumber(dict, "ups", sample->ups);
+		setProperty("hardware-monitor", dict);
+		dict->release();
+	}
+	if ((dict = OSDictionary::withCapacity(4)) != NULL) {
+		dictSetNumber(dict, "interval-ms", monitorInterval);
+		dictSetNumber(dict, "samples", monitorStats.samples);
+		dictSetNumber(dict, "failures", monitorStats.failures);
+		dictSetNumber(dict, "skipped", monitorStats.skipped);
+		setProperty("monitor-statistics", dict);
+		dict->release();
+	}
+}
@@ -0,0 +1,312 @@
+//-
+//
+// @APPLE_LICENSE_HEADER_START@
+// 
+// Copyright (c) 2005 Apple Computer, Inc.  All Rights Reserved.
+// 
+// This file contains Original Code and/or Modifications of Original Code
+// as defined in and that are subject to the Apple Public Source License
+// Version 2.0 (the 'License'). You may not use this file except in
+// compliance with the License. Please obtain a copy of the License at
+// http://www.opensource.apple.com/apsl/ and read it before using this
+// file.
+// 
+// The Original Code and all software distributed under the License are
+// distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+// EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+// INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+// Please see the License for the specific language governing rights and
+// limitations under the License.
+// 
+// @APPLE_LICENSE_HEADER_END@
+
+// $Id$
+
+#include "ArcMSR.h"
+
+#define self ArcMSR
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// Power management
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+//
+// We support two states; on, and off (system sleep).  Going down, new
+// commands are refused, outstanding commands are drained and the adapter
+// cache is flushed.  The adapter keeps its configuration across sleep, so
+// coming back up we only wait for the firmware, re-arm interrupts and
+// re-read the device map, rather than repeating the attach-time CTLinit.
+// If the firmware doesn't come back that way we try CTLinit after all, and
+// if that fails too the adapter is marked failed and commands stay refused.
+//
+// Since our disks are our power children they will normally have stopped
+// issuing commands before we are asked to sleep, so the drain is only a
+// backstop.
+//
+static IOPMPowerState powerStates[ARCMSR_POWER_STATES] = {
+	{1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+	{1, kIOPMDeviceUsable, kIOPMPowerOn, kIOPMPowerOn, 0, 0, 0, 0, 0, 0, 0, 0}
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Register with power management
+//
+bool
+self::powerInit(void)
+{
+	powerState = ARCMSR_POWER_ON;
+	resumeTime = 0;
+	bzero(&powerStats, sizeof(powerStats));
+
+	PMinit();
+	getProvider()->joinPMtree(this);
+	if (registerPowerDriver(this, powerStates, ARCMSR_POWER_STATES) != kIOReturnSuccess) {
+		error("could not register with power management");
+		PMstop();
+		return(false);
+	}
+	powerManaged = true;
+	powerPublish();
+	debug(DEBUGF_POWER, "power management initialised");
+	return(true);
+}
+
+void
+self::powerStop(void)
+{
+	if (powerManaged) {
+		PMstop();
+		powerManaged = false;
+		debug(DEBUGF_POWER, "power management stopped");
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// We come up powered
+//
+unsigned long
+self::initialPowerStateForDomainState(IOPMPowerFlags flags)
+{
+	return(ARCMSR_POWER_ON);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Change power state
+//
+// This is done synchronously; the worst case is bounded by the drain and
+// message timeouts.
+//
+IOReturn
+self::setPowerState(unsigned long powerStateOrdinal, IOService *device)
+{
+	if (powerStateOrdinal >= ARCMSR_POWER_STATES)
+		return(kIOReturnBadArgument);
+	if (powerStateOrdinal == powerState)
+		return(kIOPMAckImplyingSuccess);
+
+	debug(DEBUGF_POWER, "power state %lu -> %lu", powerState, powerStateOrdinal);
+
+	// if the adapter isn't running there is nothing to do but note the new state;
+	// one that failed to wake last time is left alone going down, and retried coming up
+	if (adapterState & ARCMSR_STATE_RUNNING) {
+		if (powerStateOrdinal == ARCMSR_POWER_OFF) {
+			if (!(adapterState & ARCMSR_STATE_FAILED))
+				powerSleep();
+		} else {
+			powerWake();
+		}
+	}
+	powerState = powerStateOrdinal;
+	return(kIOPMAckImplyingSuccess);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Put the adapter to sleep
+//
+void
+self::powerSleep(void)
+{
+	uint64_t	start, now;
+
+	showStatus("preparing for sleep");
+	clock_get_uptime(&start);
+
+	// hold new commands for wake, let the old ones finish
+	setHoldingInvoke(true);
+	quiesceIO(ARCMSR_SHUTDOWN_DRAIN_TIMEOUT);
+
+	// stop talking to the adapter
+	rebuildStop();
+	monitorStop();
+	deviceScanTimer->disable();
+	setAsleepInvoke(true);
+	CTLdisableInterrupts();
+
+	// and make sure everything is on the disks
+	CTLstopBackgroundRebuild(ARCMSR_SHUTDOWN_FLUSH_MIN);
+	if (!CTLflushCache(ARCMSR_MESSAGE_TIMEOUT)) {
+		error("adapter did not acknowledge cache flush before sleep");
+		powerStats.failedFlushes++;
+	}
+
+	clock_get_uptime(&now);
+	absolutetime_to_nanoseconds(now - start, &now);
+	powerStats.lastSleepTime = now / 1000000;
+	powerStats.sleeps++;
+	powerPublish();
+	debug(DEBUGF_POWER, "asleep after %llums", powerStats.lastSleepTime);
+	showStatus("asleep");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Wake the adapter up
+//
+// Resume latency is measured twice; once to the point where we accept
+// commands again, and once more when the first device map comes back and
+// we know whether anything changed while we were asleep (powerResynced).
+//
+void
+self::powerWake(void)
+{
+	uint64_t	now;
+
+	showStatus("waking");
+	clock_get_uptime(&resumeTime);
+
+	if (!CTLwaitFirmware(ARCMSR_FIRMWARE_TIMEOUT)) {
+		error("adapter firmware did not come back after sleep, reinitialising");
+		powerStats.fullResumes++;
+		if (!CTLinit()) {
+			// leave commands refused; there is nothing safe we can do with them
+			error("adapter failed to reinitialise after sleep");
+			IOLog("ArcMSR: adapter did not come back from sleep, commands will be refused\n");
+			setFailedInvoke(true);
+			setHoldingInvoke(false);
+			powerStats.failedWakes++;
+			powerPublish();
+			showStatus("failed to wake");
+			resumeTime = 0;
+			return;
+		}
+	}
+	setFailedInvoke(false);
+
+	// talk to the adapter again, push out anything queued while we slept
+	CTLstartBackgroundRebuild();
+	CTLenableInterrupts();
+	setAsleepInvoke(false);
+	setQuiescedInvoke(false);
+	setHoldingInvoke(false);
+	rebuildStart();
+	monitorStart();
+
+	deviceScanInterval = ARCMSR_STATUS_INTERVAL_MIN;
+	deviceScanTimer->enable();
+	deviceScanTimer->setTimeoutMS(deviceScanInterval);
+
+	clock_get_uptime(&now);
+	absolutetime_to_nanoseconds(now - resumeTime, &now);
+	powerStats.lastResumeTime = now / 1000;
+	powerStats.wakes++;
+	powerPublish();
+	debug(DEBUGF_POWER, "awake after %lluus", powerStats.lastResumeTime);
+	showStatus("started");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The first device map since waking has been examined
+//
+// We are on the workloop.
+//
+void
+self::powerResynced(void)
+{
+	uint64_t	now;
+
+	clock_get_uptime(&now);
+	absolutetime_to_nanoseconds(now - resumeTime, &now);
+	resumeTime = 0;
+	powerStats.lastResyncTime = now / 1000;
+	if (powerStats.lastResyncTime > powerStats.maxResyncTime)
+		powerStats.maxResyncTime = powerStats.lastResyncTime;
+	powerPublish();
+	debug(DEBUGF_POWER, "device map resynced %lluus after wake", powerStats.lastResyncTime);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Stop/start using the message channel
+//
+// Anything queued while asleep is left in the ringbuffer and pushed out
+// on wake; a message in flight when we went to sleep will never be
+// acknowledged, so the writer is restarted unconditionally.  Likewise any
+// message0 command still outstanding is forgotten.
+//
+COMMANDGATE_GLUE1(setAsleep, bool);
+
+void
+self::setAsleep(bool state)
+{
+	if (state) {
+		adapterState |= ARCMSR_STATE_ASLEEP;
+		adapterState &= ~ARCMSR_STATE_MSG0_POSTING;
+		msg0Wanted = 0;
+		MQsetAsleepInvoke(true);
+	} else {
+		adapterState &= ~ARCMSR_STATE_ASLEEP;
+		MQsetAsleepInvoke(false);
+
+		// the configuration may have changed while we were asleep; look now
+		CTLrequestConfig();
+	}
+}
+
+COMMANDGATE_GLUE1(setFailed, bool);
+
+void
+self::setFailed(bool state)
+{
+	if (state) {
+		adapterState |= ARCMSR_STATE_FAILED;
+	} else {
+		adapterState &= ~ARCMSR_STATE_FAILED;
+	}
+}
+
+// The message channel's share, on the management workloop
+MANAGEMENTGATE_GLUE1(MQsetAsleep, bool);
+
+void
+self::MQsetAsleep(bool state)
+{
+	if (state) {
+		MQFlags &= ~ARCMSR_MQF_UNDERFLOW;
+	} else {
+		inboundMQWrite();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Advertise the power statistics in the registry
+//
+void
+self::powerPublish(void)
+{
+	OSDictionary	*dict;
+
+	if ((dict = OSDictionary::withCapacity(10)) == NULL)
+		return;
+	dict->setObject("adapter-failed", (adapterState & ARCMSR_STATE_FAILED) ? kOSBooleanTrue : kOSBooleanFalse);
+	dictSetNumber(dict, "sleeps", powerStats.sleeps);
+	dictSetNumber(dict, "wakes", powerStats.wakes);
+	dictSetNumber(dict, "failed-flushes", powerStats.failedFlushes);
+	dictSetNumber(dict, "full-resumes", powerStats.fullResumes);
+	dictSetNumber(dict, "failed-wakes", powerStats.failedWakes);
+	dictSetNumber(dict, "sleep-ms", powerStats.lastSleepTime);
+	dictSetNumber(dict, "resume-us", powerStats.lastResumeTime);
+	dictSetNumber(dict, "resync-us", powerStats.lastResyncTime);
+	dictSetNumber(dict, "resync-max-us", powerStats.maxResyncTime);
+	setProperty("power-statistics", dict);
+	dict->release();
+}
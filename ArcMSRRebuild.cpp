@@ -0,0 +1,348 @@
+//-
+//
+// @APPLE_LICENSE_HEADER_START@
+// 
+// Copyright (c) 2005 Apple Computer, Inc.  All Rights Reserved.
+// 
+// This file contains Original Code and/or Modifications of Original Code
+// as defined in and that are subject to the Apple Public Source License
+// Version 2.0 (the 'License'). You may not use this file except in
+// compliance with the License. Please obtain a copy of the License at
+// http://www.opensource.apple.com/apsl/ and read it before using this
+// file.
+// 
+// The Original Code and all software distributed under the License are
+// distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+// EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+// INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+// Please see the License for the specific language governing rights and
+// limitations under the License.
+// 
+// @APPLE_LICENSE_HEADER_END@
+
+// $Id$
+
+#include "ArcMSR.h"
+
+#define self ArcMSR
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// Background rebuild scheduling
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+//
+// A rebuild or verify competes with the host for the disks, and the adapter
+// gives it no less than its configured share however busy the host is.
+// Here we watch the foreground load (command rate and completion latency,
+// sampled as commands complete) and hold background work back while the
+// host is busy, either by stopping background rebuild altogether or by
+// dropping the adapter's rebuild priority.  It is let go again once the
+// host has been idle for a while.  The two thresholds and the sample
+// counts give hysteresis, so that a bursty load doesn't flap the adapter.
+//
+// Stopping background rebuild outright could starve a degraded array for
+// as long as the host stays busy, so in that mode a pause is cut off after
+// maxPause and the rebuild then gets at least minRun before it can be
+// paused again.
+//
+// Everything here other than rebuildInit runs on the workloop.
+//
+
+////////////////////////////////////////////////////////////////////////////////
+// Read the policy and create the sample timer
+//
+bool
+self::rebuildInit(void)
+{
+	const char	*policy;
+
+	policy = getStringProperty(this, "RebuildPolicy", ARCMSR_REBUILD_POLICY);
+	if (!strcmp(policy, "pause")) {
+		rebuildPolicy.mode = ARCMSR_REBUILD_PAUSE;
+	} else if (!strcmp(policy, "priority")) {
+		rebuildPolicy.mode = ARCMSR_REBUILD_PRIORITY;
+	} else if (!strcmp(policy, "off")) {
+		rebuildPolicy.mode = ARCMSR_REBUILD_OFF;
+	} else {
+		error("unknown rebuild policy '%s', using '%s'", policy, ARCMSR_REBUILD_POLICY);
+		policy = ARCMSR_REBUILD_POLICY;
+		rebuildPolicy.mode = ARCMSR_REBUILD_PRIORITY;
+	}
+	rebuildPolicy.sampleInterval = getNumberProperty(this, "RebuildSampleInterval", ARCMSR_REBUILD_SAMPLE_INTERVAL);
+	rebuildPolicy.busyIOPS = getNumberProperty(this, "RebuildBusyIOPS", ARCMSR_REBUILD_BUSY_IOPS);
+	rebuildPolicy.busyLatency = getNumberProperty(this, "RebuildBusyLatency", ARCMSR_REBUILD_BUSY_LATENCY);
+	rebuildPolicy.idleIOPS = getNumberProperty(this, "RebuildIdleIOPS", ARCMSR_REBUILD_IDLE_IOPS);
+	rebuildPolicy.idleLatency = getNumberProperty(this, "RebuildIdleLatency", ARCMSR_REBUILD_IDLE_LATENCY);
+	rebuildPolicy.busySamples = getNumberProperty(this, "RebuildBusySamples", ARCMSR_REBUILD_BUSY_SAMPLES);
+	rebuildPolicy.idleSamples = getNumberProperty(this, "RebuildIdleSamples", ARCMSR_REBUILD_IDLE_SAMPLES);
+	rebuildPolicy.busyPriority = getNumberProperty(this, "RebuildBusyPriority", ARCMSR_REBUILD_BUSY_PRIORITY) & 3;
+	rebuildPolicy.idlePriority = getNumberProperty(this, "RebuildIdlePriority", ARCMSR_REBUILD_IDLE_PRIORITY) & 3;
+	rebuildPolicy.maxPause = getNumberProperty(this, "RebuildMaxPause", ARCMSR_REBUILD_MAX_PAUSE);
+	rebuildPolicy.minRun = getNumberProperty(this, "RebuildMinRun", ARCMSR_REBUILD_MIN_RUN);
+	if (rebuildPolicy.sampleInterval == 0)
+		rebuildPolicy.sampleInterval = ARCMSR_REBUILD_SAMPLE_INTERVAL;
+	if (rebuildPolicy.maxPause == 0)
+		rebuildPolicy.maxPause = ARCMSR_REBUILD_MAX_PAUSE;
+
+	bzero(&rebuildStats, sizeof(rebuildStats));
+	bzero(&rebuildRequest, sizeof(rebuildRequest));
+	rebuildRequest.args = rebuildArgs;
+	rebuildRequest.done = &ArcMSR::rebuildPriorityDone;
+	rebuildThrottled = false;
+	rebuildWanted = false;
+	rebuildResync = false;
+
+	rebuildTimer = IOTimerEventSource::timerEventSource(this,
+							    OSMemberFunctionCast(IOTimerEventSource::Action,
+										 this,
+										 &ArcMSR::rebuildStub));
+	if (GetWorkLoop()->addEventSource(rebuildTimer)) {
+		error("could not add rebuild scheduler timer source to workloop");
+		return(false);
+	}
+	debug(DEBUGF_REBUILD, "rebuild policy %s, busy at %d/s or %dus, idle at %d/s and %dus",
+	      policy, rebuildPolicy.busyIOPS, rebuildPolicy.busyLatency,
+	      rebuildPolicy.idleIOPS, rebuildPolicy.idleLatency);
+	return(true);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Start/stop sampling
+//
+// Background rebuild has just been (re)started, so we start out running
+// normally.  If we manage the priority, the adapter may still have the busy
+// priority from before a shutdown or sleep, so it is set again on the first
+// sample.
+//
+void
+self::rebuildStart(void)
+{
+	rebuildThrottled = false;
+	rebuildCount = 0;
+	rebuildResync = (rebuildPolicy.mode == ARCMSR_REBUILD_PRIORITY);
+	loadCommands = 0;
+	loadLatency = 0;
+	clock_get_uptime(&rebuildSince);
+	rebuildChanged = rebuildSince;
+
+	if (rebuildPolicy.mode != ARCMSR_REBUILD_OFF) {
+		rebuildTimer->enable();
+		rebuildTimer->setTimeoutMS(rebuildPolicy.sampleInterval);
+	}
+	rebuildPublish();
+}
+
+void
+self::rebuildStop(void)
+{
+	rebuildTimer->disable();
+	rebuildPublish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Note a command completion
+//
+void
+self::rebuildSample(int tag)
+{
+	uint64_t	now;
+
+	clock_get_uptime(&now);
+	loadCommands++;
+	loadLatency += now - SRBStart[tag];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Look at the load over the last sample period
+//
+void
+self::rebuildStub(void */*refcon*/, OSObject *owner, IOTimerEventSource *es)
+{
+	ArcMSR		*ap;
+	uint64_t	latency, now, inMode;
+	uint32_t	iops;
+	bool		busy, idle;
+
+	if ((ap = OSDynamicCast(ArcMSR, owner)) == NULL) {
+		error("rebuild scheduler not signalled by ArcMSR");
+		return;
+	}
+
+	// work out the rate and average latency, start a new sample
+	iops = (loadCommands * 1000) / rebuildPolicy.sampleInterval;
+	latency = 0;
+	if (loadCommands > 0) {
+		absolutetime_to_nanoseconds(loadLatency, &latency);
+		latency = latency / 1000 / loadCommands;
+	}
+	busy = (iops >= rebuildPolicy.busyIOPS) ||
+		((loadCommands > 0) && (latency >= rebuildPolicy.busyLatency));
+	idle = (iops <= rebuildPolicy.idleIOPS) && (latency <= rebuildPolicy.idleLatency);
+	loadCommands = 0;
+	loadLatency = 0;
+	rebuildStats.lastIOPS = iops;
+	rebuildStats.lastLatency = latency;
+
+	// put the adapter back the way we think it is
+	if (rebuildResync) {
+		rebuildResync = false;
+		rebuildSetMode(rebuildThrottled);
+	}
+
+	// how long we've been in this mode, for the pause limits
+	clock_get_uptime(&now);
+	absolutetime_to_nanoseconds(now - rebuildChanged, &inMode);
+	inMode /= 1000000;
+
+	// change mode after enough samples in a row say so
+	if ((!rebuildThrottled && busy) || (rebuildThrottled && idle)) {
+		rebuildCount++;
+	} else {
+		rebuildCount = 0;
+	}
+	if ((rebuildPolicy.mode == ARCMSR_REBUILD_PAUSE) && rebuildThrottled && (inMode >= rebuildPolicy.maxPause)) {
+		debug(DEBUGF_REBUILD, "background work held back for %llums, letting it go regardless", inMode);
+		rebuildStats.forcedReleases++;
+		rebuildSetMode(false);
+	} else if ((rebuildPolicy.mode == ARCMSR_REBUILD_PAUSE) && !rebuildThrottled && (inMode < rebuildPolicy.minRun)) {
+		// not paused again until it has had its run
+	} else if (!rebuildThrottled && (rebuildCount >= rebuildPolicy.busySamples)) {
+		debug(DEBUGF_REBUILD, "host busy (%d/s, %lluus), holding back background work", iops, latency);
+		rebuildSetMode(true);
+	} else if (rebuildThrottled && (rebuildCount >= rebuildPolicy.idleSamples)) {
+		debug(DEBUGF_REBUILD, "host idle (%d/s, %lluus), letting background work go", iops, latency);
+		rebuildSetMode(false);
+	}
+
+	rebuildTimer->setTimeoutMS(rebuildPolicy.sampleInterval);
+	rebuildPublish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Hold background work back, or let it go
+//
+// If the request can't be made right now (eg. a userclient owns the
+// management channel) we stay as we are and try again on the next sample.
+// A new priority only counts once the adapter has accepted it; until then
+// (and if it refuses) we are still in the old mode.
+//
+void
+self::rebuildSetMode(bool throttle)
+{
+	switch (rebuildPolicy.mode) {
+	case ARCMSR_REBUILD_PAUSE:
+		CTLsendMessage(throttle ? ARCMSR_INBOUND_MESG0_STOP_BGRB : ARCMSR_INBOUND_MESG0_START_BGRB);
+		rebuildModeChanged(throttle);
+		break;
+	case ARCMSR_REBUILD_PRIORITY:
+		if (!rebuildSetPriority(throttle ? rebuildPolicy.busyPriority : rebuildPolicy.idlePriority)) {
+			debug(DEBUGF_REBUILD, "management channel busy, will try again");
+			rebuildStats.failures++;
+			return;
+		}
+		rebuildWanted = throttle;
+		break;
+	default:
+		break;
+	}
+}
+
+void
+self::rebuildModeChanged(bool throttle)
+{
+	if (throttle != rebuildThrottled) {
+		rebuildAccount();
+		rebuildThrottled = throttle;
+		rebuildCount = 0;
+		clock_get_uptime(&rebuildChanged);
+		if (throttle) {
+			rebuildStats.throttles++;
+		} else {
+			rebuildStats.releases++;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Set the adapter rebuild priority
+//
+// The adapter wants a password for this; the GUI engine logs in if it asks.
+//
+bool
+self::rebuildSetPriority(uint8_t priority)
+{
+	rebuildPriority = priority;
+	rebuildRequest.opcode = GUI_REBUILD_PRIORITY;
+	rebuildArgs[0] = priority;
+	rebuildRequest.argLen = 1;
+	return(GUIsubmit(&rebuildRequest));
+}
+
+void
+self::rebuildPriorityDone(struct arcmsr_gui_request *req)
+{
+	if ((req->status != kIOReturnSuccess) || (req->replyLen != 1) || (req->reply[0] != GUI_OK)) {
+		if ((req->status != kIOReturnSuccess) || (req->replyLen != 1)) {
+			error("adapter did not answer command 0x%02x", req->opcode);
+		} else {
+			error("adapter refused command 0x%02x with status 0x%02x", req->opcode, req->reply[0]);
+		}
+		// we don't know what it has now; the next sample sets it again
+		rebuildStats.failures++;
+		rebuildResync = true;
+		return;
+	}
+	debug(DEBUGF_REBUILD, "rebuild priority now %d", rebuildPriority);
+	rebuildModeChanged(rebuildWanted);
+	rebuildPublish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Add the time since the last mode change to the current mode
+//
+void
+self::rebuildAccount(void)
+{
+	uint64_t	now, elapsed;
+
+	clock_get_uptime(&now);
+	absolutetime_to_nanoseconds(now - rebuildSince, &elapsed);
+	rebuildSince = now;
+	if (rebuildThrottled) {
+		rebuildStats.throttledTime += elapsed / 1000000;
+	} else {
+		rebuildStats.normalTime += elapsed / 1000000;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Advertise the scheduler state in the registry
+//
+void
+self::rebuildPublish(void)
+{
+	OSDictionary	*dict;
+	OSString	*policy;
+	static const char *policies[] = {"off", "pause", "priority"};
+
+	if ((dict = OSDictionary::withCapacity(12)) == NULL)
+		return;
+	rebuildAccount();
+	if ((policy = OSString::withCString(policies[rebuildPolicy.mode])) != NULL) {
+		dict->setObject("policy", policy);
+		policy->release();
+	}
+	dict->setObject("throttled", rebuildThrottled ? kOSBooleanTrue : kOSBooleanFalse);
+	dictSetNumber(dict, "throttles", rebuildStats.throttles);
+	dictSetNumber(dict, "releases", rebuildStats.releases);
+	dictSetNumber(dict, "failures", rebuildStats.failures);
+	dictSetNumber(dict, "forced-releases", rebuildStats.forcedReleases);
+	dictSetNumber(dict, "normal-ms", rebuildStats.normalTime);
+	dictSetNumber(dict, "throttled-ms", rebuildStats.throttledTime);
+	dictSetNumber(dict, "iops", rebuildStats.lastIOPS);
+	dictSetNumber(dict, "latency-us", rebuildStats.lastLatency);
+	setProperty("rebuild-scheduler", dict);
+	dict->release();
+}
@@ -0,0 +1,272 @@
+//-
+//
+// @APPLE_LICENSE_HEADER_START@
+// 
+// Copyright (c) 2005 Apple Computer, Inc.  All Rights Reserved.
+// 
+// This file contains Original Code and/or Modifications of Original Code
+// as defined in and that are subject to the Apple Public Source License
+// Version 2.0 (the 'License'). You may not use this file except in
+// compliance with the License. Please obtain a copy of the License at
+// http://www.opensource.apple.com/apsl/ and read it before using this
+// file.
+// 
+// The Original Code and all software distributed under the License are
+// distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+// EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+// INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+// Please see the License for the specific language governing rights and
+// limitations under the License.
+// 
+// @APPLE_LICENSE_HEADER_END@
+
+// $Id$
+
+#include "ArcMSRRingBuffer.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// General-purpose byte-holding ringbuffer
+//
+// head and tail run freely and are masked when used; the difference is
+// the number of bytes held, so the whole buffer is usable.
+//
+
+void
+RingBuffer::init(int desiredSize) 
+{ 
+    for (size = 1; size < (uint32_t)desiredSize; size <<= 1)
+	;
+    mask = size - 1;
+    data = (char *)IOMalloc(size);
+    head = 0; 
+    tail = 0;
+    watermark = NULL;
+};
+
+void
+RingBuffer::deinit(void)
+{
+    if (data != NULL)
+	IOFree(data, size);
+    data = NULL;
+};
+
+void
+RingBuffer::clear(void)
+{
+    consume(used());
+}
+
+int
+RingBuffer::avail(void) {
+    return(size - (head - tail));
+};
+
+int
+RingBuffer::used(void) {
+    return(head - tail);
+};
+
+bool
+RingBuffer::empty(void) {
+    return(head == tail);
+};
+
+void
+RingBuffer::setWatermarks(int low, int high, RingBufferWatermark func, void *arg)
+{
+    lowMark = low;
+    highMark = high;
+    watermarkArg = arg;
+    watermark = func;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// In-place access
+//
+// reserve returns the free run at the head, peek the held run at the tail;
+// either may be shorter than the total if it wraps.  Fill or drain it and
+// then commit or consume what was used.
+//
+char *
+RingBuffer::reserve(int *len)
+{
+    uint32_t	offset = head & mask;
+    
+    *len = size - offset;
+    if (*len > avail())
+	*len = avail();
+    return(data + offset);
+}
+
+void
+RingBuffer::commit(int len)
+{
+    head += len;
+    if ((watermark != NULL) && (used() >= highMark) && ((used() - len) < highMark))
+	watermark(watermarkArg, this, true);
+}
+
+char *
+RingBuffer::peek(int *len)
+{
+    uint32_t	offset = tail & mask;
+    
+    *len = size - offset;
+    if (*len > used())
+	*len = used();
+    return(data + offset);
+}
+
+void
+RingBuffer::consume(int len)
+{
+    tail += len;
+    if ((watermark != NULL) && (used() <= lowMark) && ((used() + len) > lowMark))
+	watermark(watermarkArg, this, false);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Copying access
+//
+bool
+RingBuffer::insert(char *indata, int len) 
+{
+    uint32_t	offset, frag;
+    
+    if ((uint32_t)len > (size - (head - tail)))
+	return(false);	    // space check
+    offset = head & mask;
+    frag = size - offset;   // fill head-to-end first
+    if (frag >= (uint32_t)len) {
+	memcpy(data + offset, indata, len);
+    } else {
+	memcpy(data + offset, indata, frag);
+	memcpy(data, indata + frag, len - frag);
+    }
+    commit(len);
+    return(true);
+};
+
+bool
+RingBuffer::insert(IOMemoryDescriptor *md)
+{
+    int		frag, len = md->getLength();
+    char	*p;
+    
+    if (len > avail()) 
+	return(false);	    // space check
+    p = reserve(&frag);	    // fill head-to-end first
+    if (frag > len)
+	frag = len;
+    md->readBytes(0, p, frag);
+    if (len > frag)
+	md->readBytes(frag, data, len - frag);
+    commit(len);
+    return(true);
+};
+
+// Single bytes never wrap, so they skip the copy altogether
+bool
+RingBuffer::insert(uint8_t one)
+{
+    if ((head - tail) == size)
+	return(false);
+    data[head & mask] = one;
+    commit(sizeof(one));
+    return(true);
+}
+
+bool
+RingBuffer::insert(uint16_t one)
+{
+    return(insert((char *)&one, sizeof(one)));
+}
+
+// The SRB tag pool lives on these, so they get the short path
+bool
+RingBuffer::insert(uint32_t one)
+{
+    uint32_t	offset = head & mask;
+    
+    if ((size - (head - tail)) < sizeof(one))
+	return(false);
+    if ((size - offset) < sizeof(one))
+	return(insert((char *)&one, sizeof(one)));
+    memcpy(data + offset, &one, sizeof(one));
+    commit(sizeof(one));
+    return(true);
+}
+
+int
+RingBuffer::remove(char *outdata, int len) 
+{
+    uint32_t	offset, frag;
+    
+    if ((uint32_t)len > (head - tail))
+	len = head - tail;
+    offset = tail & mask;
+    frag = size - offset;   // from tail to end first
+    if (frag >= (uint32_t)len) {
+	memcpy(outdata, data + offset, len);
+    } else {
+	memcpy(outdata, data + offset, frag);
+	memcpy(outdata + frag, data, len - frag);
+    }
+    consume(len);
+    return(len);
+};
+
+int
+RingBuffer::remove(IOMemoryDescriptor *md, int offset) 
+{
+    int		frag, len = md->getLength() - offset;
+    char	*p;
+    
+    if (len > used())
+	len = used();
+    if (len <= 0)
+	return(0);
+    p = peek(&frag);	    // from tail to end first
+    if (frag > len)
+	frag = len;
+    md->writeBytes(offset, p, frag);
+    if (len > frag)
+	md->writeBytes(offset + frag, data, len - frag);
+    consume(len);
+    return(len);
+};
+
+int
+RingBuffer::remove(uint8_t *one)
+{
+    if (head == tail)
+	return(-1);
+    *one = data[tail & mask];
+    consume(sizeof(*one));
+    return(1);
+}
+
+int
+RingBuffer::remove(uint16_t *one)
+{
+    
+    if (remove((char *)one, sizeof(*one)) == sizeof(*one))
+	return(1);
+    return(-1);
+}
+
+int
+RingBuffer::remove(uint32_t *one)
+{
+    uint32_t	offset = tail & mask;
+    
+    if ((head - tail) < sizeof(*one))
+	return(-1);
+    if ((size - offset) < sizeof(*one))
+	return((remove((char *)one, sizeof(*one)) == sizeof(*one)) ? 1 : -1);
+    memcpy(one, data + offset, sizeof(*one));
+    consume(sizeof(*one));
+    return(1);
+}
@@ -0,0 +1,74 @@
+//-
+//
+// @APPLE_LICENSE_HEADER_START@
+// 
+// Copyright (c) 2005 Apple Computer, Inc.  All Rights Reserved.
+// 
+// This file contains Original Code and/or Modifications of Original Code
+// as defined in and that are subject to the Apple Public Source License
+// Version 2.0 (the 'License'). You may not use this file except in
+// compliance with the License. Please obtain a copy of the License at
+// http://www.opensource.apple.com/apsl/ and read it before using this
+// file.
+// 
+// The Original Code and all software distributed under the License are
+// distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+// EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+// INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+// Please see the License for the specific language governing rights and
+// limitations under the License.
+// 
+// @APPLE_LICENSE_HEADER_END@
+
+// $Id$
+
+#ifndef ARCMSRRINGBUFFER_H
+#define ARCMSRRINGBUFFER_H
+
+// This needs nothing from the driver, so that ringbench can build it
+// in userland against its own stand-ins for these.
+#include <IOKit/IOLib.h>
+#include <IOKit/IOMemoryDescriptor.h>
+
+// General-purpose ringbuffer
+//
+// The size is rounded up to a power of two.  If a watermark function is
+// set it is called when the fill level rises to the high mark (high is
+// true) or drains to the low mark.
+//
+class RingBuffer;
+typedef void (*RingBufferWatermark)(void *arg, RingBuffer *ring, bool high);
+
+class RingBuffer {
+public:
+    void	init(int desiredSize);
+    void	deinit(void);
+    void	clear(void);
+    int		avail(void);
+    int		used(void);
+    bool	empty(void);
+    void	setWatermarks(int low, int high, RingBufferWatermark func, void *arg);
+    char	*reserve(int *len);
+    void	commit(int len);
+    char	*peek(int *len);
+    void	consume(int len);
+    bool	insert(char *indata, int len);
+    bool	insert(IOMemoryDescriptor *md);
+    bool	insert(uint8_t one);
+    bool	insert(uint16_t one);
+    bool	insert(uint32_t one);
+    int		remove(char *outdata, int len);
+    int		remove(IOMemoryDescriptor *md, int offset);
+    int		remove(uint8_t *one);
+    int		remove(uint16_t *one);
+    int		remove(uint32_t *one);
+private:
+    uint32_t	head, tail, size, mask;
+    char	*data;
+    int		lowMark, highMark;
+    RingBufferWatermark	watermark;
+    void	*watermarkArg;
+};
+
+#endif /* ARCMSRRINGBUFFER_H */
@@ -29,33 +29,38 @@
 #define self ArcMSR
 
 ////////////////////////////////////////////////////////////////////////////////
-// Target/LUN mapping
+// Target/LUN addressing
 //
-// Due to the fact that IOSCSIParallelInterfaceController handles device
-// arrival/departure on a per-target basis, we have to flatten our
-// target space (because LUNs can come and go in our universe).
+// Adapter targets and LUNs map directly onto SCSI targets and LUNs, so a
+// target is only created when its first unit appears and destroyed when
+// its last unit goes.  IOSCSIParallelInterfaceController has no notion of
+// LUNs coming and going within a live target, and the stack takes no
+// notice of a REPORTED LUNS DATA HAS CHANGED unit attention, so we attach
+// and detach the logical unit nubs under the target ourselves, the way the
+// target device does for the LUNs it finds when it starts (see
+// targetRescan).
 //
 
-#define TARGETLUN2SCSITARGET(_t, _l)	(((_t) * ARCMSR_MAX_TARGETLUN) | (_l))
-#define SCSITARGET2TARGET(_st)		((_st) / ARCMSR_MAX_TARGETLUN)
-#define SCSITARGET2LUN(_st)		((_st) % ARCMSR_MAX_TARGETLUN)
+// Opcodes we look at
+#define SCSI_SYNCHRONIZE_CACHE		0x35
+#define SCSI_SYNCHRONIZE_CACHE_16	0x91
 
 SCSIInitiatorIdentifier
 self::ReportInitiatorIdentifier(void)
 {
-	return(TARGETLUN2SCSITARGET(ARCMSR_SCSI_INITIATOR_ID, 0));
+	return(ARCMSR_SCSI_INITIATOR_ID);
 }
 
 SCSILogicalUnitNumber
 self::ReportHBAHighestLogicalUnitNumber(void)
 {
-	return(0);
+	return(ARCMSR_MAX_TARGETLUN - 1);
 }
 
 SCSIDeviceIdentifier
 self::ReportHighestSupportedDeviceID(void)
 {
-	return(TARGETLUN2SCSITARGET(ARCMSR_MAX_TARGETID - 1, ARCMSR_MAX_TARGETLUN - 1));
+	return(ARCMSR_MAX_TARGETID - 1);
 }
 
 #ifdef DEBUG
@@ -97,8 +102,39 @@ check_cdb(struct arcmsr_srb *srb)
 ////////////////////////////////////////////////////////////////////////////////
 // Handle an inbound SCSI request
 //
+// A request refused because we are going to sleep is held for wake (see
+// holdTask) rather than failed.
+//
 SCSIServiceResponse
 self::ProcessParallelTask(SCSIParallelTaskIdentifier parallelRequest)
+{
+	SCSICommandDescriptorBlock	cdb;
+	SCSIServiceResponse		response;
+	bool				held;
+
+	// cache flushes may be merged with others for the same volume
+	GetCommandDescriptorBlock(parallelRequest, &cdb);
+	if ((cdb[0] == SCSI_SYNCHRONIZE_CACHE) || (cdb[0] == SCSI_SYNCHRONIZE_CACHE_16)) {
+		flushSubmitInvoke(parallelRequest, &response);
+	} else {
+		response = dispatchTask(parallelRequest, NULL);
+	}
+	if (response != kSCSIServiceResponse_Request_In_Process) {
+		holdTaskInvoke(parallelRequest, &held);
+		if (held)
+			response = kSCSIServiceResponse_Request_In_Process;
+	}
+	return(response);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Send a request to the adapter
+//
+// If (tagp) is not NULL, it returns the tag used, or -1 if the request
+// was not sent.
+//
+SCSIServiceResponse
+self::dispatchTask(SCSIParallelTaskIdentifier parallelRequest, int *tagp)
 {
 	struct arcmsr_srb	*srb;
 	int			tag;
@@ -106,8 +142,16 @@ self::ProcessParallelTask(SCSIParallelTaskIdentifier parallelRequest)
 
 	// Get a tag for the task
 	getTagInvoke(&tag);
-
-	if (tag == -1) {	// XXX should never happen
+	if (tagp != NULL)
+		*tagp = tag;
+
+	if (tag == -1) {
+		// refused because we are shutting down?
+		if (adapterState & ARCMSR_STATE_QUIESCED) {
+			debug(DEBUGF_SCSI, "rejecting command, adapter quiesced");
+			return(kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE);
+		}
+		// XXX should never happen
 		error("inbound request overrun");
 		return(kSCSIServiceResponse_FUNCTION_REJECTED);
 	}
@@ -116,18 +160,15 @@ self::ProcessParallelTask(SCSIParallelTaskIdentifier parallelRequest)
 	srb = getSRBPtr(tag);
 
 	srb->bus = 0;
-	srb->target = SCSITARGET2TARGET(GetTargetIdentifier(parallelRequest));
-	srb->lun = SCSITARGET2LUN(GetTargetIdentifier(parallelRequest));
+	srb->target = GetTargetIdentifier(parallelRequest);
+	srb->lun = GetLogicalUnitNumber(parallelRequest);
 	srb->function = 1;
 
 	srb->cdb_length = GetCommandDescriptorBlockSize(parallelRequest);
 	srb->flags = GetDataTransferDirection(parallelRequest) & kSCSIDataTransfer_FromInitiatorToTarget ? ARCMSR_SRB_FLAG_WRITE : 0;
 	GetCommandDescriptorBlock(parallelRequest, (SCSICommandDescriptorBlock *)srb->cdb);
 
-	debug(DEBUGF_SCSI, "Command for %d,%d (host target %d)",
-	      SCSITARGET2TARGET(GetTargetIdentifier(parallelRequest)),
-	      SCSITARGET2LUN(GetTargetIdentifier(parallelRequest)),
-	      GetTargetIdentifier(parallelRequest));
+	debug(DEBUGF_SCSI, "Command for %d,%d", srb->target, srb->lun);
 	debug_hexdump(DEBUGF_SCSI, srb->cdb, srb->cdb_length);
 
 	srb->context = (uintptr_t)srb;
@@ -152,7 +193,7 @@ self::ProcessParallelTask(SCSIParallelTaskIdentifier parallelRequest)
 	if (srb->flags & ARCMSR_SRB_FLAG_SGL_BSIZE)
 		physaddr |= ARCMSR_SRBPOST_FLAG_SGL_BSIZE;
 
-	postSRBInvoke(&physaddr);
+	postSRBInvoke(tag, physaddr);
 	
 	return(kSCSIServiceResponse_Request_In_Process);
 }
@@ -213,14 +254,20 @@ self::handlePostQueueInterrupt(void)
 			debug(DEBUGF_SRB, "got bad tag %d", tag);
 			continue;
 		}
-		parallelRequest = FindTaskForControllerIdentifier(TARGETLUN2SCSITARGET(srb->target, srb->lun), (uintptr_t)srb);
+		parallelRequest = FindTaskForControllerIdentifier(srb->target, (uintptr_t)srb);
 
 		if (parallelRequest == NULL) {
 			debug(DEBUGF_SRB, "got response 0x%x giving invalid task with identifier 0x%08x and target/lun %d/%d",
 			      response, srb, srb->target, srb->lun);
 			// return the tag to the freelist since the request must
 			// have been timed out
+			stats->timeouts++;
 			returnTagInvoke(tag);
+
+			// anyone waiting on a timed-out cache flush will have to try again
+			if (flushState[srb->target][srb->lun].carrierTag == tag)
+				flushDone(srb, kSCSITaskStatus_DeliveryFailure,
+					  kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE);
 			continue;
 		}
 		
@@ -264,11 +311,272 @@ self::handlePostQueueInterrupt(void)
 			SetRealizedDataTransferCount(parallelRequest, GetRequestedDataTransferCount(parallelRequest));
 		}
 		
+		rebuildSample(tag);
+		statsSample(tag, srb, parallelRequest,
+			    (taskStatus != kSCSITaskStatus_GOOD) || (serviceResponse != kSCSIServiceResponse_TASK_COMPLETE));
 		CompleteParallelTask(parallelRequest, taskStatus, serviceResponse);
 
 		// return the tag to the freelist
 		returnTagInvoke(tag);
+
+		// finish the cache flushes this one stood in for, start the next
+		if (flushState[srb->target][srb->lun].carrierTag == tag)
+			flushDone(srb, taskStatus, serviceResponse);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Cache flush coalescing
+//
+// A SYNCHRONIZE CACHE only promises that data written before it was issued
+// is on stable storage when it completes, so a flush that arrives while
+// another is in flight for the same volume cannot share that one.  It
+// can, however, share the *next* flush with any others that arrive in the
+// meantime.  So while a flush is in flight later ones are held, and when it
+// completes a single flush is sent for all of them; when that completes,
+// they all complete with its status.
+//
+// The held requests are chained through their HBA-specific task data.
+// The flush actually sent (the carrier) is found again by its tag.
+//
+#define TASKNEXT(_t)	(((struct arcmsr_task *)GetHBADataPointer(_t))->next)
+
+COMMANDGATE_GLUE2(flushSubmit, SCSIParallelTaskIdentifier, SCSIServiceResponse *);
+
+void
+self::flushSubmit(SCSIParallelTaskIdentifier parallelRequest, SCSIServiceResponse *response)
+{
+	struct arcmsr_flush_state	*fs;
+	SCSIParallelTaskIdentifier	*tp;
+
+	fs = &flushState[GetTargetIdentifier(parallelRequest)][GetLogicalUnitNumber(parallelRequest)];
+	flushStats.requested++;
+
+	// flush in flight; wait for the next one
+	if (fs->carrierTag != -1) {
+		TASKNEXT(parallelRequest) = NULL;
+		for (tp = &fs->next; *tp != NULL; tp = &TASKNEXT(*tp))
+			;
+		*tp = parallelRequest;
+		SetTimeoutForTask(parallelRequest);
+		debug(DEBUGF_SCSI, "cache flush held behind tag %d", fs->carrierTag);
+		*response = kSCSIServiceResponse_Request_In_Process;
+		return;
+	}
+
+	// send it now
+	*response = dispatchTask(parallelRequest, &fs->carrierTag);
+	if (*response == kSCSIServiceResponse_Request_In_Process) {
+		flushStats.issued++;
+	} else {
+		fs->carrierTag = -1;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A carrier flush has completed
+//
+// We are on the workloop.
+//
+void
+self::flushDone(struct arcmsr_srb *srb, SCSITaskStatus taskStatus, SCSIServiceResponse serviceResponse)
+{
+	struct arcmsr_flush_state	*fs;
+	SCSIParallelTaskIdentifier	task;
+
+	fs = &flushState[srb->target][srb->lun];
+	fs->carrierTag = -1;
+
+	// everyone riding on that flush is done
+	while ((task = fs->riders) != NULL) {
+		fs->riders = TASKNEXT(task);
+		if (taskStatus == kSCSITaskStatus_CHECK_CONDITION)
+			SetAutoSenseData(task, (SCSI_Sense_Data *)srb->sense_data, sizeof(srb->sense_data));
+		CompleteParallelTask(task, taskStatus, serviceResponse);
 	}
+	flushNext(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A carrier flush has been timed out
+//
+// The stack has given up on it, but its tag stays out until the adapter
+// hands it back, which may be never.  Its riders can't know whether it
+// reached stable storage, but any flush sent from now on covers them, so
+// they go to the front of the waiting queue and one flush is sent for the
+// lot.  If the old carrier does turn up later its tag no longer matches,
+// so it is just recycled.
+//
+void
+self::flushAbandon(struct arcmsr_flush_state *fs)
+{
+	SCSIParallelTaskIdentifier	*tp;
+
+	fs->carrierTag = -1;
+	if (fs->riders != NULL) {
+		for (tp = &fs->riders; *tp != NULL; tp = &TASKNEXT(*tp))
+			;
+		*tp = fs->next;
+		fs->next = fs->riders;
+		fs->riders = NULL;
+	}
+	flushNext(fs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Send one flush for everyone who arrived while the last was in flight
+//
+void
+self::flushNext(struct arcmsr_flush_state *fs)
+{
+	SCSIParallelTaskIdentifier	task, carrier;
+	SCSIServiceResponse		response;
+	bool				held;
+
+	if ((carrier = fs->next) != NULL) {
+		fs->next = NULL;
+		fs->riders = TASKNEXT(carrier);
+		response = dispatchTask(carrier, &fs->carrierTag);
+		if (response == kSCSIServiceResponse_Request_In_Process) {
+			flushStats.issued++;
+			debug(DEBUGF_SCSI, "sent cache flush on behalf of waiting requests");
+		} else if (adapterState & ARCMSR_STATE_HOLDING) {
+			// going to sleep; they all go again on wake
+			fs->carrierTag = -1;
+			holdTask(carrier, &held);
+			while ((task = fs->riders) != NULL) {
+				fs->riders = TASKNEXT(task);
+				holdTask(task, &held);
+			}
+		} else {
+			fs->carrierTag = -1;
+			CompleteParallelTask(carrier, kSCSITaskStatus_DeliveryFailure, response);
+			while ((task = fs->riders) != NULL) {
+				fs->riders = TASKNEXT(task);
+				CompleteParallelTask(task, kSCSITaskStatus_DeliveryFailure, response);
+			}
+		}
+	}
+	flushPublish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Forget a held flush request (because it has been timed out)
+//
+// Returns true if the request was found.
+//
+bool
+self::flushForget(SCSIParallelTaskIdentifier parallelRequest)
+{
+	struct arcmsr_flush_state	*fs;
+	SCSIParallelTaskIdentifier	*tp;
+
+	fs = &flushState[GetTargetIdentifier(parallelRequest)][GetLogicalUnitNumber(parallelRequest)];
+
+	for (tp = &fs->riders; *tp != NULL; tp = &TASKNEXT(*tp)) {
+		if (*tp == parallelRequest) {
+			*tp = TASKNEXT(parallelRequest);
+			return(true);
+		}
+	}
+	for (tp = &fs->next; *tp != NULL; tp = &TASKNEXT(*tp)) {
+		if (*tp == parallelRequest) {
+			*tp = TASKNEXT(parallelRequest);
+			return(true);
+		}
+	}
+	return(false);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Requests held over sleep
+//
+// From when we start going to sleep until we are awake again, requests the
+// adapter would refuse (and cache flushes that were waiting their turn)
+// are kept here, chained like held flushes, and sent again in order on
+// wake.  If the adapter doesn't come back, or we are stopped instead, they
+// fail then as anything sent to it would.
+//
+COMMANDGATE_GLUE2(holdTask, SCSIParallelTaskIdentifier, bool *);
+
+void
+self::holdTask(SCSIParallelTaskIdentifier parallelRequest, bool *held)
+{
+	SCSIParallelTaskIdentifier	*tp;
+
+	if (!(adapterState & ARCMSR_STATE_HOLDING)) {
+		*held = false;
+		return;
+	}
+	TASKNEXT(parallelRequest) = NULL;
+	for (tp = &heldTasks; *tp != NULL; tp = &TASKNEXT(*tp))
+		;
+	*tp = parallelRequest;
+	debug(DEBUGF_SCSI, "holding request for wake");
+	*held = true;
+}
+
+COMMANDGATE_GLUE1(setHolding, bool);
+
+void
+self::setHolding(bool state)
+{
+	SCSIParallelTaskIdentifier	task;
+	SCSIServiceResponse		response;
+
+	if (state) {
+		adapterState |= ARCMSR_STATE_HOLDING;
+		return;
+	}
+	adapterState &= ~ARCMSR_STATE_HOLDING;
+	while ((task = heldTasks) != NULL) {
+		heldTasks = TASKNEXT(task);
+		response = ProcessParallelTask(task);
+		if (response != kSCSIServiceResponse_Request_In_Process)
+			CompleteParallelTask(task, kSCSITaskStatus_DeliveryFailure, response);
+	}
+}
+
+// Forget a held request (because it has been timed out); returns true if
+// it was found
+bool
+self::holdForget(SCSIParallelTaskIdentifier parallelRequest)
+{
+	SCSIParallelTaskIdentifier	*tp;
+
+	for (tp = &heldTasks; *tp != NULL; tp = &TASKNEXT(*tp)) {
+		if (*tp == parallelRequest) {
+			*tp = TASKNEXT(parallelRequest);
+			return(true);
+		}
+	}
+	return(false);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Advertise the flush statistics in the registry
+//
+// This is on the I/O path, so it's done at most once a second.
+//
+void
+self::flushPublish(void)
+{
+	OSDictionary	*dict;
+	uint64_t	now, interval;
+
+	clock_get_uptime(&now);
+	nanoseconds_to_absolutetime(1000000000ULL, &interval);
+	if ((now - flushStats.published) < interval)
+		return;
+	flushStats.published = now;
+
+	if ((dict = OSDictionary::withCapacity(4)) == NULL)
+		return;
+	dictSetNumber(dict, "requested", flushStats.requested);
+	dictSetNumber(dict, "issued", flushStats.issued);
+	dictSetNumber(dict, "coalesced", flushStats.requested - flushStats.issued);
+	setProperty("flush-statistics", dict);
+	dict->release();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -289,10 +597,30 @@ self::handlePostQueueInterrupt(void)
 // we need to be able to kill single I/Os, but the adapter does not
 // give us a mechanism for that.
 //
+// A held cache flush, or a request held over sleep, has never been near
+// the adapter, so it can simply be dropped from its queue.  If the flush carrying others times out, they
+// are sent again (see flushAbandon).
+//
+// This was previously defined as a free function, so was never called.
+//
 void
-HandleTimeout(SCSIParallelTaskIdentifier parallelRequest)
+self::HandleTimeout(SCSIParallelTaskIdentifier parallelRequest)
 {
-	debug(DEBUGF_SCSI, "request timeout ignored");
+	struct arcmsr_flush_state	*fs;
+
+	fs = &flushState[GetTargetIdentifier(parallelRequest)][GetLogicalUnitNumber(parallelRequest)];
+	if (flushForget(parallelRequest)) {
+		debug(DEBUGF_SCSI, "held cache flush timed out");
+	} else if (holdForget(parallelRequest)) {
+		debug(DEBUGF_SCSI, "request held for wake timed out");
+	} else if ((fs->carrierTag != -1) &&
+		   (GetControllerTaskIdentifier(parallelRequest) == (uintptr_t)getSRBPtr(fs->carrierTag))) {
+		debug(DEBUGF_SCSI, "cache flush tag %d timed out, resending for those held", fs->carrierTag);
+		flushAbandon(fs);
+	} else {
+		debug(DEBUGF_SCSI, "request timeout, leaving tag alone");
+	}
+	IOSCSIParallelInterfaceController::HandleTimeout(parallelRequest);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -348,6 +676,13 @@ self::TargetResetRequest(SCSITargetIdentifier theT)
 // Handle the case where we have detected that the adapter's list of units
 // has changed out from under us.
 //
+// A target is created when its first unit appears and destroyed when its
+// last unit goes.  If units come or go in a target that stays, their
+// logical unit nubs are attached or terminated individually; the others
+// are left alone.  A unit we couldn't deal with (eg. the target device
+// hasn't started yet) stays out of deviceMap, so the next device map
+// brings us back here to try again.
+//
 // Note that there is a small risk that a unit is deleted and then recreated
 // at the same address between scan intervals.  In this case, the system's
 // old representation of the unit will not be discarded.  In practice the
@@ -358,8 +693,10 @@ void
 self::targetRescan(void)
 {
 	int	target, lun;
-	uint8_t	newtarget, lunmask;
+	uint8_t	newtarget, handled;
+	uint64_t start, now, latency;
 
+	clock_get_uptime(&start);
 	for (target = 0; target < ARCMSR_MAX_TARGETID; target++) {
 
 		// avoid racing with the code that checks the map
@@ -368,24 +705,177 @@ self::targetRescan(void)
 		// anything changed in this group?
 		if (newtarget != deviceMap[target]) {
 			debug(DEBUGF_RESCAN, "target %d changed (%02x -> %02x)", target, deviceMap[target], newtarget);
-			for (lun = 0; lun < ARCMSR_MAX_TARGETLUN; lun++) {
-				lunmask = 1 << lun;
 
-				// unit arrived
-				if (!(deviceMap[target] & lunmask) && (newtarget & lunmask)) {
-					debug(DEBUGF_EVENT, "device appeared at %d,%d", target, lun);
-					CreateTargetForID(TARGETLUN2SCSITARGET(target, lun));
-				}
-
-				// unit departed
-				if ((deviceMap[target] & lunmask) && !(newtarget & lunmask)) {
-					debug(DEBUGF_EVENT, "device at %d,%d disappeared", target, lun);
-					DestroyTargetForID(TARGETLUN2SCSITARGET(target, lun));
+			if (deviceMap[target] == 0) {
+				// target arrived
+				debug(DEBUGF_EVENT, "target %d appeared with units %02x", target, newtarget);
+				CreateTargetForID(target);
+			} else if (newtarget == 0) {
+				// target departed
+				debug(DEBUGF_EVENT, "target %d disappeared", target);
+				DestroyTargetForID(target);
+			} else {
+				// units came or went within the target
+				handled = deviceMap[target];
+				for (lun = 0; lun < ARCMSR_MAX_TARGETLUN; lun++) {
+					if ((newtarget & ~deviceMap[target]) & (1 << lun)) {
+						debug(DEBUGF_EVENT, "device appeared at %d,%d", target, lun);
+						if (unitAttach(target, lun))
+							handled |= (1 << lun);
+					}
+					if ((deviceMap[target] & ~newtarget) & (1 << lun)) {
+						debug(DEBUGF_EVENT, "device at %d,%d disappeared", target, lun);
+						if (unitDetach(target, lun))
+							handled &= ~(1 << lun);
+					}
 				}
+				newtarget = handled;
 			}
 
 			// save the mask that we have just scanned against
 			deviceMap[target] = newtarget;
 		}
 	}
+
+	// count what we have now, note how long that took
+	clock_get_uptime(&now);
+	absolutetime_to_nanoseconds(now - start, &latency);
+	scanStats.rescanTime = latency / 1000;
+	scanStats.targets = 0;
+	scanStats.units = 0;
+	for (target = 0; target < ARCMSR_MAX_TARGETID; target++) {
+		if (deviceMap[target] != 0)
+			scanStats.targets++;
+		for (lun = 0; lun < ARCMSR_MAX_TARGETLUN; lun++)
+			if (deviceMap[target] & (1 << lun))
+				scanStats.units++;
+	}
+	debug(DEBUGF_RESCAN, "%d units on %d targets, rescan took %lluus",
+	      scanStats.units, scanStats.targets, scanStats.rescanTime);
+
+	// note how long it took from noticing the change to having dealt with it
+	if (deviceChangeTime != 0) {
+		absolutetime_to_nanoseconds(now - deviceChangeTime, &latency);
+		deviceChangeTime = 0;
+		scanStats.lastLatency = latency / 1000;
+		if (scanStats.lastLatency > scanStats.maxLatency)
+			scanStats.maxLatency = scanStats.lastLatency;
+		debug(DEBUGF_RESCAN, "rescan done %lluus after change noticed", scanStats.lastLatency);
+	}
+	deviceScanPublish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Attach or detach one logical unit within a live target
+//
+// The family layers an IOSCSITargetDevice on each target nub we create,
+// and that creates a logical unit nub for each LUN it finds when it
+// starts.  We find the target device and do the same for a single LUN.
+// Both return true if the unit is now as the adapter says it should be.
+//
+bool
+self::unitAttach(int target, int lun)
+{
+	IOSCSITargetDevice	*device;
+	IOSCSILogicalUnitNub	*nub;
+	bool			result;
+
+	if ((device = unitTargetDevice(target)) == NULL) {
+		debug(DEBUGF_RESCAN, "no target device for %d yet", target);
+		return(false);
+	}
+
+	// the target device may have found it for itself when it started
+	if ((nub = unitFind(device, lun)) != NULL) {
+		nub->release();
+		device->release();
+		return(true);
+	}
+
+	result = false;
+	if ((nub = OSTypeAlloc(IOSCSILogicalUnitNub)) != NULL) {
+		if (nub->init(0)) {
+			nub->SetLogicalUnitNumber(lun);
+			if (nub->attach(device)) {
+				if (nub->start(device)) {
+					result = true;
+				} else {
+					nub->detach(device);
+				}
+			}
+		}
+		nub->release();
+	}
+	if (!result)
+		error("could not attach unit %d,%d", target, lun);
+	device->release();
+	return(result);
+}
+
+bool
+self::unitDetach(int target, int lun)
+{
+	IOSCSITargetDevice	*device;
+	IOSCSILogicalUnitNub	*nub;
+
+	if ((device = unitTargetDevice(target)) == NULL)
+		return(false);
+	if ((nub = unitFind(device, lun)) != NULL) {
+		nub->terminate();
+		nub->release();
+	}
+	device->release();
+	return(true);
+}
+
+// Returned retained
+IOSCSITargetDevice *
+self::unitTargetDevice(int target)
+{
+	IOSCSITargetDevice	*device;
+	IOService		*targetNub;
+	OSIterator		*nubs, *clients;
+	OSObject		*client;
+	OSNumber		*id;
+
+	if ((nubs = getClientIterator()) == NULL)
+		return(NULL);
+	device = NULL;
+	while ((device == NULL) && ((targetNub = OSDynamicCast(IOService, nubs->getNextObject())) != NULL)) {
+		id = OSDynamicCast(OSNumber, targetNub->getProperty(kIOPropertySCSITargetIdentifierKey));
+		if ((id == NULL) || (id->unsigned32BitValue() != (UInt32)target))
+			continue;
+		if ((clients = targetNub->getClientIterator()) == NULL)
+			break;
+		while ((device == NULL) && ((client = clients->getNextObject()) != NULL))
+			device = OSDynamicCast(IOSCSITargetDevice, client);
+		if (device != NULL)
+			device->retain();
+		clients->release();
+	}
+	nubs->release();
+	return(device);
+}
+
+// Returned retained
+IOSCSILogicalUnitNub *
+self::unitFind(IOSCSITargetDevice *device, int lun)
+{
+	IOSCSILogicalUnitNub	*nub;
+	OSIterator		*units;
+	OSObject		*client;
+
+	if ((units = device->getClientIterator()) == NULL)
+		return(NULL);
+	nub = NULL;
+	while ((client = units->getNextObject()) != NULL) {
+		nub = OSDynamicCast(IOSCSILogicalUnitNub, client);
+		if ((nub != NULL) && (nub->GetLogicalUnitNumber() == lun)) {
+			nub->retain();
+			break;
+		}
+		nub = NULL;
+	}
+	units->release();
+	return(nub);
 }
@@ -0,0 +1,177 @@
+//-
+//
+// @APPLE_LICENSE_HEADER_START@
+// 
+// Copyright (c) 2005 Apple Computer, Inc.  All Rights Reserved.
+// 
+// This file contains Original Code and/or Modifications of Original Code
+// as defined in and that are subject to the Apple Public Source License
+// Version 2.0 (the 'License'). You may not use this file except in
+// compliance with the License. Please obtain a copy of the License at
+// http://www.opensource.apple.com/apsl/ and read it before using this
+// file.
+// 
+// The Original Code and all software distributed under the License are
+// distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+// EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+// INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+// Please see the License for the specific language governing rights and
+// limitations under the License.
+// 
+// @APPLE_LICENSE_HEADER_END@
+
+// $Id$
+
+#include "ArcMSR.h"
+
+#define self ArcMSR
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+// I/O statistics
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+//
+// The generic disk statistics can't see that every volume on the adapter
+// draws on the same pool of command tags, so we keep our own: per target
+// and LUN, counts, bytes and latency by direction, and latency histograms
+// by direction, both overall and for just the adapter's part, plus how
+// busy the tag pool is.  They only count up (until someone resets them);
+// tools sample them and do the arithmetic.
+//
+// statsSample is called for every completion from the post queue handler,
+// and the interrupt counts are bumped by the interrupt handler, both on
+// the workloop, so the counters need no locking or per-CPU copies; a
+// completion costs a couple of timestamps and a handful of increments.
+// statsSnapshot and statsReset come in through the gate, so they see
+// the counters whole.
+//
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocate the counters
+//
+bool
+self::statsInit(void)
+{
+	if ((stats = (ArcMSRStatistics *)IOMalloc(sizeof(*stats))) == NULL) {
+		error("could not allocate I/O statistics");
+		return(false);
+	}
+	bzero(stats, sizeof(*stats));
+	stats->version = ARCMSR_STATS_VERSION;
+	return(true);
+}
+
+void
+self::statsFree(void)
+{
+	if (stats != NULL)
+		IOFree(stats, sizeof(*stats));
+	stats = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Microseconds since a timestamp, and the histogram bucket they fall in
+//
+static uint32_t
+statsMicroseconds(uint64_t now, uint64_t then)
+{
+	uint64_t	ns;
+
+	absolutetime_to_nanoseconds(now - then, &ns);
+	return(((ns / 1000) > 0xffffffffULL) ? 0xffffffff : (uint32_t)(ns / 1000));
+}
+
+static int
+statsBucket(uint32_t latency)
+{
+	int	bucket;
+
+	// the first bucket it is under: one more than its highest bit
+	bucket = (latency == 0) ? 0 : (32 - __builtin_clz(latency));
+	return((bucket < ARCMSR_STATS_BUCKETS) ? bucket : (ARCMSR_STATS_BUCKETS - 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Count a completed command
+//
+void
+self::statsSample(int tag, struct arcmsr_srb *srb, SCSIParallelTaskIdentifier parallelRequest, bool failed)
+{
+	ArcMSRUnitStatistics	*us;
+	uint64_t		now;
+	uint32_t		latency, adapterLatency;
+	int			dir;
+
+	if ((srb->target >= ARCMSR_STATS_TARGETS) || (srb->lun >= ARCMSR_STATS_LUNS))
+		return;
+	us = &stats->unit[srb->target][srb->lun];
+
+	clock_get_uptime(&now);
+	latency = statsMicroseconds(now, SRBStart[tag]);
+	adapterLatency = statsMicroseconds(now, SRBPosted[tag]);
+
+	switch (GetDataTransferDirection(parallelRequest)) {
+	case kSCSIDataTransfer_FromTargetToInitiator:
+		dir = ARCMSR_STATS_READ;
+		break;
+	case kSCSIDataTransfer_FromInitiatorToTarget:
+		dir = ARCMSR_STATS_WRITE;
+		break;
+	default:
+		dir = ARCMSR_STATS_OTHER;
+		break;
+	}
+	us->ops[dir]++;
+	us->bytes[dir] += GetRealizedDataTransferCount(parallelRequest);
+	us->latency[dir] += latency;
+	us->adapterLatency[dir] += adapterLatency;
+	if (failed)
+		us->errors++;
+	if (latency > us->maxLatency[dir])
+		us->maxLatency[dir] = latency;
+	us->histogram[dir][statsBucket(latency)]++;
+	us->adapterHistogram[dir][statsBucket(adapterLatency)]++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Copy the counters out for a userclient
+//
+COMMANDGATE_GLUE1(statsSnapshot, ArcMSRStatistics *);
+
+void
+self::statsSnapshot(ArcMSRStatistics *snap)
+{
+	uint64_t	now;
+
+	bcopy(stats, snap, sizeof(*snap));
+	snap->tags = maxSRB;
+	snap->tagsInUse = activeSRB;
+	clock_get_uptime(&now);
+	absolutetime_to_nanoseconds(now, &snap->time);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Start again from zero
+//
+// Commands in flight when this happens are counted when they complete,
+// against the new totals; their latency is still measured from when they
+// were submitted.
+//
+COMMANDGATE_GLUE0(statsReset);
+
+void
+self::statsReset(void)
+{
+	uint64_t	now;
+	uint32_t	resets;
+
+	resets = stats->resets + 1;
+	bzero(stats, sizeof(*stats));
+	stats->version = ARCMSR_STATS_VERSION;
+	stats->resets = resets;
+	stats->tagsPeak = activeSRB;
+	clock_get_uptime(&now);
+	absolutetime_to_nanoseconds(now, &stats->since);
+}
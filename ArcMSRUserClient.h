@@ -35,10 +35,14 @@ protected:
 	task_t			fTask;		// currently active user task
 	ArcMSR			*fProvider;	// our provider
 	void			*fSecurity;     // the user task's credentials
+	IOBufferMemoryDescriptor *fRing[2];	// shared rings, by type
+	bool			fLoopback;	// we turned loopback on
+	struct arcmsr_broker_client *fBroker;	// our management command queue
 
 	// generic interface
 	bool			initWithTask(task_t owningTask, void *security_id, UInt32 type);
 	bool			start(IOService *provider);
+	void			free(void);
 	IOExternalMethod	*getTargetAndMethodForIndex(IOService **target, UInt32 index);
 	IOReturn		open(void);
 	IOReturn		close(void);
@@ -47,9 +51,36 @@ protected:
     
 	// our work methods
 	IOReturn		send(ArcMSRUserCommand *inCommand, ArcMSRUserCommand *outCommand, IOByteCount inCount, IOByteCount *outCount);
+	IOReturn		write(ArcMSRUserCommand *inCommand, ArcMSRUserCommand *outCommand, IOByteCount inCount, IOByteCount *outCount);
+	IOReturn		stream(ArcMSRUserCommand *inCommand, ArcMSRUserCommand *outCommand, IOByteCount inCount, IOByteCount *outCount);
 	IOReturn		recv(ArcMSRUserCommand *inCommand, ArcMSRUserCommand *outCommand, IOByteCount inCount, IOByteCount *outCount);
 	IOReturn		clearWQBuffer(void);
 	IOReturn		clearRQBuffer(void);
+	IOReturn		command(ArcMSRManagementCommand *inCommand, ArcMSRManagementCommand *outCommand, IOByteCount inCount, IOByteCount *outCount);
+	IOReturn		inventory(ArcMSRUserCommand *inCommand, ArcMSRUserCommand *outCommand, IOByteCount inCount, IOByteCount *outCount);
+	IOReturn		statistics(ArcMSRUserCommand *inCommand, ArcMSRUserCommand *outCommand, IOByteCount inCount, IOByteCount *outCount);
+	IOReturn		resetStatistics(void);
+	IOReturn		copyOut(vm_address_t address, const void *data, IOByteCount size);
+	IOReturn		transact(ArcMSRManagementTransaction *inCommand, ArcMSRManagementTransaction *outCommand, IOByteCount inCount, IOByteCount *outCount);
+	IOReturn		brokerRun(struct arcmsr_broker_request *breq, vm_address_t buffer, int *size, bool payload);
+	void			publishStatistics(void);
+
+	// shared ring transport
+	IOReturn		clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory);
+	IOReturn		kick(void);
+	IOReturn		wait(UInt32 timeout);
+	IOReturn		loopback(UInt32 state);
+
+	// adapter event stream
+	struct arcmsr_event_subscriber *fEvents;	// our queue, once mapped
+	mach_port_t		fEventPort;
+
+	// data available and writable notifications, by type
+	mach_msg_header_t	fNotifyMsg[2];
+	IOReturn		registerNotificationPort(mach_port_t port, UInt32 type, UInt32 refCon);
+
+public:
+	void			sendNotification(UInt32 type);
 };
 
 #endif /* ARCMSRUSERCLIENT_H */
@@ -36,10 +36,10 @@
 #define ARCMSR_DRIVER_VERSION	20050924	// datestamp YYYYMMDD
 
 enum {
-	// Obtain exclusive access to the controller
+	// Obtain exclusive access to the raw (terminal) channel
 	kArcMSRUserClientOpen,			// -
 
-	// Release exclusive access to the controller
+	// Release exclusive access to the raw channel
 	kArcMSRUserClientClose,			// -
 
 	// Send text to the controller
@@ -54,6 +54,34 @@ enum {
 	// Clear the read buffer
 	kArcMSRUserClientClearRQBuffer,		// -
 
+	// Shared ring transport; see below
+	kArcMSRUserClientKick,			// -
+	kArcMSRUserClientWait,			// ScalarI: timeout (ms)
+
+	// Turn message channel loopback on/off (for benchmarking)
+	kArcMSRUserClientLoopback,		// ScalarI: 0/1
+
+	// Send a management command frame, wait for the reply frame
+	kArcMSRUserClientCommand,		// StructureI, StructureO
+
+	// Send a management command, wait for the reply payload
+	kArcMSRUserClientTransact,		// StructureI, StructureO
+
+	// Send as much text as there is room for; see below
+	kArcMSRUserClientWrite,			// StructureI, StructureO
+
+	// Send any amount of text, as fast as the adapter will take it
+	kArcMSRUserClientStream,		// StructureI, StructureO
+
+	// Copy out the driver's adapter inventory; see below
+	kArcMSRUserClientInventory,		// StructureI, StructureO
+
+	// Copy out the driver's I/O statistics; see below
+	kArcMSRUserClientStatistics,		// StructureI, StructureO
+
+	// Start the I/O statistics again from zero
+	kArcMSRUserClientResetStatistics,	// -
+
 	// enum range limit
 	kArcMSRUserClientMethodCount
 };
@@ -67,7 +95,391 @@ typedef struct
 	int		timeout;
 	int		result;
 #define	ARCMSR_USERCLIENT_RETURNCODE_OK		0x01
+#define	ARCMSR_USERCLIENT_RETURNCODE_WOULDBLOCK	0x02
 #define	ARCMSR_USERCLIENT_RETURNCODE_ERROR	0x06
 } ArcMSRUserCommand;
 
-#endif ARCMSRUSERCLIENTINTERFACE_H
+//
+// Partial writes
+//
+// Send blocks until the whole buffer (at most 4096 bytes) has been
+// queued.  Write takes any size, queues as much as there is room for and
+// returns the count in data_size.  If there's no room at all it waits up
+// to timeout ms (0 means don't wait) and then returns the
+// ARCMSR_USERCLIENT_RETURNCODE_WOULDBLOCK result with data_size 0.
+//
+// Stream (channel owner only) hands the driver a buffer of any size,
+// which feeds it to the adapter each time the adapter asks for more and
+// returns when it has all gone.  timeout is how long (ms) the adapter may
+// stop taking data before the driver gives up; 0 means the driver's
+// default.  data_size returns the number of bytes sent, and the result is
+// ARCMSR_USERCLIENT_RETURNCODE_ERROR if that isn't all of them.  The
+// rate achieved is published in the driver's "message-statistics".
+//
+
+//
+// Management command structure
+//
+// Any number of clients may send GUI protocol commands (see
+// ArcMSRManagement.h) at once without opening the raw channel.  The
+// driver queues them, sends them one at a time and hands each client back
+// the reply to its own command.  Both frames are complete, from the
+// 0x5E 0x01 0x61 signature through the checksum.
+//
+// result is the IOReturn for the command itself: kIOReturnBusy if too
+// many of this client's commands are already waiting, kIOReturnTimeout if
+// the adapter didn't answer, kIOReturnNoSpace (with reply_size set to the
+// size needed) if the reply buffer is too small.
+//
+typedef struct
+{
+	vm_address_t	frame_buffer;		// command frame
+	vm_offset_t	frame_size;
+	vm_address_t	reply_buffer;		// reply frame
+	vm_offset_t	reply_size;		// in: buffer size, out: reply frame size
+	int		result;
+} ArcMSRManagementCommand;
+
+//
+// Management transaction structure
+//
+// As above, but the driver does the framing: the client supplies the
+// opcode and argument bytes and gets back the reply payload (eg. an
+// sGUI_VOLUMESET for GUI_GET_INFO_V, or a single GUI_OK status byte)
+// with the checksum already verified.
+//
+typedef struct
+{
+	uint32_t	opcode;			// GUI_* command code
+	vm_address_t	arg_buffer;		// argument bytes following the opcode
+	vm_offset_t	arg_size;
+	vm_address_t	reply_buffer;		// reply payload
+	vm_offset_t	reply_size;		// in: buffer size, out: payload size
+	int		result;
+} ArcMSRManagementTransaction;
+
+
+//
+// Receive notification
+//
+// Rather than polling with Recv or Wait, a client may register a port with
+// IOConnectSetNotificationPort(connect, kArcMSRNotifyDataAvailable, port,
+// refCon).  A bare mach_msg_header_t with msgh_id == refCon is sent when
+// data arrives.  Only one message is sent until the client next calls
+// Recv or Kick, so it should drain everything after each notification;
+// if data is still waiting at that point a new notification is sent
+// straight away.
+//
+// Likewise a port registered for kArcMSRNotifyWritable is sent a message
+// once the inbound queue has drained to half full after a Write that
+// didn't queue everything.  Either port may be the same.
+//
+enum {
+	kArcMSRNotifyDataAvailable,
+	kArcMSRNotifyWritable,
+	kArcMSRNotifyEvents			// adapter event queue; see below
+};
+
+//
+// Shared ring transport
+//
+// Instead of using Send/Recv, an open client may map a pair of rings with
+// IOConnectMapMemory (types below) and move message channel bytes through
+// them directly; the driver copies between the rings and the adapter.
+//
+// Each ring has a single producer and a single consumer.  head and tail are
+// free-running byte counts; (head - tail) bytes are waiting at
+// data[tail % size].  The producer only writes head, the consumer only
+// writes tail, and each publishes its index after touching the data.
+//
+// After producing into the inbound ring or consuming from the outbound
+// ring, call Kick so the driver notices.  Wait sleeps until the outbound
+// ring has data or the timeout expires.
+//
+enum {
+	kArcMSRSharedRingInbound,		// client -> adapter
+	kArcMSRSharedRingOutbound,		// adapter -> client
+	kArcMSRMonitorHistory,			// hardware monitor samples, read-only; see below
+	kArcMSREventQueue			// adapter events, an IODataQueue; see below
+};
+
+#define ARCMSR_SHARED_RING_SIZE	16384		// data bytes, power of two
+
+typedef struct
+{
+	volatile uint32_t	head;
+	volatile uint32_t	tail;
+	uint32_t		size;
+	uint32_t		reserved;
+	uint8_t			data[ARCMSR_SHARED_RING_SIZE];
+} ArcMSRSharedRing;
+
+#ifdef KERNEL
+# define ArcMSRSharedRingBarrier()	OSSynchronizeIO()
+#else
+# define ArcMSRSharedRingBarrier()	OSMemoryBarrier()
+#endif
+
+// Bytes waiting / room
+static __inline__ uint32_t
+ArcMSRSharedRingUsed(ArcMSRSharedRing *r)
+{
+	uint32_t used = r->head - r->tail;
+
+	// the other side is not trusted to keep this sane
+	return((used > ARCMSR_SHARED_RING_SIZE) ? 0 : used);
+}
+
+static __inline__ uint32_t
+ArcMSRSharedRingFree(ArcMSRSharedRing *r)
+{
+	return(ARCMSR_SHARED_RING_SIZE - ArcMSRSharedRingUsed(r));
+}
+
+// Copy in up to len bytes, returns the number copied
+static __inline__ uint32_t
+ArcMSRSharedRingPut(ArcMSRSharedRing *r, const void *buf, uint32_t len)
+{
+	uint32_t	head, frag;
+
+	if (len > ArcMSRSharedRingFree(r))
+		len = ArcMSRSharedRingFree(r);
+	head = r->head;
+	frag = ARCMSR_SHARED_RING_SIZE - (head % ARCMSR_SHARED_RING_SIZE);
+	if (frag > len)
+		frag = len;
+	memcpy(&r->data[head % ARCMSR_SHARED_RING_SIZE], buf, frag);
+	memcpy(&r->data[0], (const uint8_t *)buf + frag, len - frag);
+	ArcMSRSharedRingBarrier();
+	r->head = head + len;
+	return(len);
+}
+
+// Copy out up to len bytes, returns the number copied
+static __inline__ uint32_t
+ArcMSRSharedRingGet(ArcMSRSharedRing *r, void *buf, uint32_t len)
+{
+	uint32_t	tail, frag;
+
+	if (len > ArcMSRSharedRingUsed(r))
+		len = ArcMSRSharedRingUsed(r);
+	ArcMSRSharedRingBarrier();
+	tail = r->tail;
+	frag = ARCMSR_SHARED_RING_SIZE - (tail % ARCMSR_SHARED_RING_SIZE);
+	if (frag > len)
+		frag = len;
+	memcpy(buf, &r->data[tail % ARCMSR_SHARED_RING_SIZE], frag);
+	memcpy((uint8_t *)buf + frag, &r->data[0], len - frag);
+	ArcMSRSharedRingBarrier();
+	r->tail = tail + len;
+	return(len);
+}
+
+//
+// Adapter inventory
+//
+// The driver fetches the system, RAID set, volume set and physical drive
+// information from the adapter when it starts and whenever the adapter's
+// event log or device map changes, and keeps the last complete set.  It is
+// published in the registry as "inventory", and Inventory copies out the
+// raw structures, costing the adapter nothing.  Pass an ArcMSRUserCommand
+// describing a buffer of at least sizeof(ArcMSRInventory) bytes.
+//
+// The records are exactly as the adapter returned them (sSYSTEM_INFO,
+// sGUI_RAIDSET, sGUI_VOLUMESET and sGUI_PHY_DRV in ArcMSRManagement.h,
+// little-endian); bit n of each mask is set if record n is present.
+// generation changes every time the inventory is refreshed, and is 0 until
+// the first one completes.
+//
+#define ARCMSR_INVENTORY_VERSION	1
+#define ARCMSR_INVENTORY_RAIDSETS	16
+#define ARCMSR_INVENTORY_VOLUMES	16
+#define ARCMSR_INVENTORY_DRIVES		32
+
+typedef struct
+{
+	uint32_t	version;			// ARCMSR_INVENTORY_VERSION
+	uint32_t	generation;
+	uint32_t	raidSetMask;
+	uint32_t	volumeMask;
+	uint32_t	driveMask;
+	uint32_t	reserved[3];
+	uint8_t		system[256];
+	uint8_t		raidSet[ARCMSR_INVENTORY_RAIDSETS][128];
+	uint8_t		volume[ARCMSR_INVENTORY_VOLUMES][64];
+	uint8_t		drive[ARCMSR_INVENTORY_DRIVES][128];
+} ArcMSRInventory;
+
+//
+// Hardware monitor history
+//
+// The driver asks the adapter for its fan, voltage and temperature readings
+// every MonitorInterval ms and keeps the last ARCMSR_MONITOR_SAMPLES of
+// them here.  Map it with IOConnectMapMemory (kArcMSRMonitorHistory); it
+// is read-only, anyone may map it, and reading it costs the adapter
+// nothing.
+//
+// count is the number of samples ever taken; sample n is in slot
+// n % ARCMSR_MONITOR_SAMPLES and carries n in its sequence field.  The
+// driver invalidates a slot's sequence while rewriting it, so copy a
+// sample with ArcMSRMonitorGet, which fails if the sample has been
+// overwritten (or is being overwritten) under you.
+//
+// Times are mach absolute times.  Fan speeds are in RPM, voltages in mV
+// (nominal is what the sensor is supposed to read) and temperatures in
+// degrees C.  Only the first fans/voltages/temperatures entries of a
+// sample are meaningful.
+//
+#define ARCMSR_MONITOR_VERSION		1
+#define ARCMSR_MONITOR_SAMPLES		256		// power of two
+#define ARCMSR_MONITOR_SENSORS		8		// of each kind
+#define ARCMSR_MONITOR_INVALID		0xffffffff
+
+typedef struct
+{
+	uint64_t		time;
+	volatile uint32_t	sequence;
+	uint8_t			fans;
+	uint8_t			voltages;
+	uint8_t			temperatures;
+	uint8_t			power;			// power supply bits
+	uint8_t			ups;
+	uint8_t			reserved[3];
+	uint16_t		fan[ARCMSR_MONITOR_SENSORS];
+	uint16_t		voltage[ARCMSR_MONITOR_SENSORS];
+	uint16_t		nominal[ARCMSR_MONITOR_SENSORS];
+	uint8_t			temperature[ARCMSR_MONITOR_SENSORS];
+} ArcMSRMonitorSample;
+
+typedef struct
+{
+	uint32_t		version;		// ARCMSR_MONITOR_VERSION
+	uint32_t		interval;		// ms between samples, 0 if not sampling
+	volatile uint32_t	count;			// samples taken
+	uint32_t		reserved;
+	ArcMSRMonitorSample	sample[ARCMSR_MONITOR_SAMPLES];
+} ArcMSRMonitorHistory;
+
+// Copy out sample n, returns nonzero if it was still there
+static __inline__ int
+ArcMSRMonitorGet(ArcMSRMonitorHistory *h, uint32_t n, ArcMSRMonitorSample *s)
+{
+	ArcMSRMonitorSample *slot = &h->sample[n % ARCMSR_MONITOR_SAMPLES];
+
+	if (slot->sequence != n)
+		return(0);
+	ArcMSRSharedRingBarrier();
+	memcpy(s, slot, sizeof(*s));
+	ArcMSRSharedRingBarrier();
+	return((slot->sequence == n) && (s->sequence == n));
+}
+
+//
+// Adapter event stream
+//
+// The driver notices new entries in the adapter event log (via the device
+// scanner's event polls), reads just those, and queues each one to every
+// subscribed client as an ArcMSREvent, oldest first.  Subscribe by mapping
+// kArcMSREventQueue with IOConnectMapMemory; the mapping is an IODataQueue,
+// so use IODataQueueDequeue and, after registering a port with
+// IOConnectSetNotificationPort(connect, kArcMSRNotifyEvents, port, 0),
+// IODataQueueWaitForAvailableData.  The channel need not be open.
+//
+// Only events logged after the driver started are delivered.  If nobody is
+// subscribed, events go to the system log instead.  sequence counts events
+// since the driver started.  lost is nonzero if events were missed just
+// before this one: the number dropped because the queue was full, plus one
+// if the log wrapped or was cleared before we could read it.
+//
+// The record is the adapter's own ARCMSR_EVENT_RECORD_SIZE-byte entry,
+// unchanged.
+//
+#define ARCMSR_EVENT_RECORD_SIZE	32
+#define ARCMSR_EVENT_QUEUE_DEPTH	64
+
+typedef struct
+{
+	uint32_t	sequence;
+	uint32_t	lost;
+	uint64_t	time;				// mach absolute time it was read
+	uint8_t		record[ARCMSR_EVENT_RECORD_SIZE];
+} ArcMSREvent;
+
+//
+// I/O statistics
+//
+// The driver counts every SCSI command it completes, per target and LUN
+// (that is, per volume), split by direction: reads and writes by their
+// data direction, and commands that move no data as "other".  Statistics
+// copies out the lot; pass an ArcMSRUserCommand describing a buffer of at
+// least sizeof(ArcMSRStatistics) bytes.  Nothing is sent to the adapter,
+// so anyone may ask.  ResetStatistics zeroes the counters for everyone, so
+// only root may do it.
+//
+// Everything counts up from when the driver started, or from the last
+// ResetStatistics; sample twice and subtract to get rates.  resets counts
+// the resets, so a tool can tell that the counters went back to zero
+// between its samples, and since is when the last one was, in nanoseconds
+// of uptime (0 if never).
+//
+// Latency is in microseconds, from the command getting its tag as it is
+// submitted to us to its completion being handled; adapterLatency is just the part after it
+// was posted to the adapter, so the difference is time spent in the
+// driver.  Each has a histogram per direction: histogram[d][n] counts
+// commands that took less than 2^n us (and at least 2^(n-1) us), except
+// the last bucket, which takes everything slower.  The total latency
+// divided by the time between samples is the average number of commands
+// the unit had outstanding.
+//
+// tags is the size of the adapter's command tag pool, which all the units
+// share, and tagsInUse how many were vended when the copy was taken;
+// tagsPeak is the most ever in use at once, and tagsExhausted the number
+// of commands that found none free.  timeouts
+// counts replies for commands that had already been timed out.  time is
+// when the copy was taken, in nanoseconds of uptime.  interrupts counts
+// every time the interrupt handler ran, and the three that follow the
+// causes it found; one interrupt may have several causes, or none if the
+// line is shared.
+//
+#define ARCMSR_STATS_VERSION		4
+#define ARCMSR_STATS_TARGETS		16
+#define ARCMSR_STATS_LUNS		8
+#define ARCMSR_STATS_BUCKETS		24
+
+#define ARCMSR_STATS_READ		0
+#define ARCMSR_STATS_WRITE		1
+#define ARCMSR_STATS_OTHER		2
+#define ARCMSR_STATS_DIRECTIONS		3
+
+typedef struct
+{
+	uint64_t	ops[ARCMSR_STATS_DIRECTIONS];
+	uint64_t	bytes[ARCMSR_STATS_DIRECTIONS];
+	uint64_t	latency[ARCMSR_STATS_DIRECTIONS];		// us, total
+	uint64_t	adapterLatency[ARCMSR_STATS_DIRECTIONS];	// us, total
+	uint64_t	errors;
+	uint64_t	maxLatency[ARCMSR_STATS_DIRECTIONS];		// us
+	uint64_t	histogram[ARCMSR_STATS_DIRECTIONS][ARCMSR_STATS_BUCKETS];
+	uint64_t	adapterHistogram[ARCMSR_STATS_DIRECTIONS][ARCMSR_STATS_BUCKETS];
+} ArcMSRUnitStatistics;
+
+typedef struct
+{
+	uint32_t		version;		// ARCMSR_STATS_VERSION
+	uint32_t		tags;
+	uint32_t		tagsInUse;
+	uint32_t		tagsPeak;
+	uint32_t		tagsExhausted;
+	uint32_t		timeouts;
+	uint64_t		time;
+	uint64_t		interrupts;
+	uint64_t		doorbellInterrupts;
+	uint64_t		postQueueInterrupts;
+	uint64_t		messageInterrupts;
+	uint32_t		resets;
+	uint32_t		reserved;
+	uint64_t		since;
+	ArcMSRUnitStatistics	unit[ARCMSR_STATS_TARGETS][ARCMSR_STATS_LUNS];
+} ArcMSRStatistics;
+
+#endif /* ARCMSRUSERCLIENTINTERFACE_H */
@@ -28,6 +28,9 @@
 #define super IOUserClient
 #define self ArcMSRUserClient
 
+// Not in the public headers; IODataQueue notifies its clients the same way.
+extern "C" mach_msg_return_t mach_msg_send_from_kernel(mach_msg_header_t *msg, mach_msg_size_t size);
+
 OSDefineMetaClassAndStructors(self, super);
 
 //////////////////////////////////////////////////////////////////////////////
@@ -80,6 +83,76 @@ self::getTargetAndMethodForIndex(IOService **target, UInt32 index)
 			0,                                  // no input
 			0                                   // no output
 		},
+		{   // kArcMSRUserClientKick
+			NULL,                               // IOService
+			(IOMethod) &self::kick,
+			kIOUCScalarIScalarO,
+			0,                                  // no input
+			0                                   // no output
+		},
+		{   // kArcMSRUserClientWait
+			NULL,                               // IOService
+			(IOMethod) &self::wait,
+			kIOUCScalarIScalarO,
+			1,                                  // timeout
+			0                                   // no output
+		},
+		{   // kArcMSRUserClientLoopback
+			NULL,                               // IOService
+			(IOMethod) &self::loopback,
+			kIOUCScalarIScalarO,
+			1,                                  // on/off
+			0                                   // no output
+		},
+		{   // kArcMSRUserClientCommand
+			NULL,                               // IOService
+			(IOMethod) &self::command,
+			kIOUCStructIStructO,
+			sizeof(ArcMSRManagementCommand),    // command in
+			sizeof(ArcMSRManagementCommand)     // command out
+		},
+		{   // kArcMSRUserClientTransact
+			NULL,                               // IOService
+			(IOMethod) &self::transact,
+			kIOUCStructIStructO,
+			sizeof(ArcMSRManagementTransaction), // transaction in
+			sizeof(ArcMSRManagementTransaction)  // transaction out
+		},
+		{   // kArcMSRUserClientWrite
+			NULL,                               // IOService
+			(IOMethod) &self::write,
+			kIOUCStructIStructO,
+			sizeof(ArcMSRUserCommand),        // command in
+			sizeof(ArcMSRUserCommand)         // command out
+		},
+		{   // kArcMSRUserClientStream
+			NULL,                               // IOService
+			(IOMethod) &self::stream,
+			kIOUCStructIStructO,
+			sizeof(ArcMSRUserCommand),        // command in
+			sizeof(ArcMSRUserCommand)         // command out
+		},
+		{   // kArcMSRUserClientInventory
+			NULL,                               // IOService
+			(IOMethod) &self::inventory,
+			kIOUCStructIStructO,
+			sizeof(ArcMSRUserCommand),        // command in
+			sizeof(ArcMSRUserCommand)         // command out
+		},
+		{   // kArcMSRUserClientStatistics
+			NULL,                               // IOService
+			(IOMethod) &self::statistics,
+			kIOUCStructIStructO,
+			sizeof(ArcMSRUserCommand),        // command in
+			sizeof(ArcMSRUserCommand)         // command out
+		},
+		{   // kArcMSRUserClientResetStatistics
+			NULL,                               // IOService
+			(IOMethod) &self::resetStatistics,
+			kIOUCScalarIScalarO,
+			0,                                  // no input
+			0                                   // no output
+		},
 	};
     
 	// range check
@@ -114,6 +187,13 @@ self::initWithTask(task_t owningTask, void *security_id, UInt32 type)
 	fTask = owningTask;
 	fProvider = NULL;
 	fSecurity = security_id;
+	fRing[kArcMSRSharedRingInbound] = NULL;
+	fRing[kArcMSRSharedRingOutbound] = NULL;
+	fLoopback = false;
+	fBroker = NULL;
+	fEvents = NULL;
+	fEventPort = MACH_PORT_NULL;
+	bzero(fNotifyMsg, sizeof(fNotifyMsg));
 
 	debug(DEBUGF_USERCLIENT, "init done");
 	return(true);
@@ -129,10 +209,37 @@ self::start(IOService *provider)
 	// Must be associated with the right driver
 	if ((fProvider = OSDynamicCast(ArcMSR, provider)) == NULL)
 		return(false);
+
+	// anyone may send management commands
+	if ((fBroker = (struct arcmsr_broker_client *)IOMalloc(sizeof(*fBroker))) == NULL)
+		return(false);
+	bzero(fBroker, sizeof(*fBroker));
+	fProvider->brokerAttachInvoke(fBroker);
+	publishStatistics();
     
 	return(true);
 }
 
+void
+self::free(void)
+{
+	if (fBroker != NULL)
+		IOFree(fBroker, sizeof(*fBroker));
+	if (fEvents != NULL) {
+		fEvents->queue->release();
+		IOFree(fEvents, sizeof(*fEvents));
+	}
+
+	// we own the send rights we were given
+	if (fEventPort != MACH_PORT_NULL)
+		releaseNotificationPort(fEventPort);
+	for (int i = 0; i < 2; i++) {
+		if (fNotifyMsg[i].msgh_remote_port != MACH_PORT_NULL)
+			releaseNotificationPort(fNotifyMsg[i].msgh_remote_port);
+	}
+	super::free();
+}
+
 IOReturn
 self::open(void)
 {
@@ -151,6 +258,9 @@ self::open(void)
 	// open our provider to maintain a reference
 	fProvider->open(this);
 
+	// notification ports registered before opening take effect now
+	fProvider->setNotifyClientInvoke(this);
+
 	debug(DEBUGF_USERCLIENT, "opened");
     
 	return(kIOReturnSuccess);
@@ -160,18 +270,38 @@ IOReturn
 self::close(void)
 {
 	bool openState;
+	IOReturn status;
 	
 	// provider terminated?
 	if (isInactive())
 		return(kIOReturnNotAttached);
 
+	// only the client holding the raw channel can give it up
+	if (!fProvider->isOpen(this))
+		return(kIOReturnNotOpen);
+
+	// detach the shared rings; the client's mappings hold their own references
+	for (int i = 0; i < 2; i++) {
+		if (fRing[i] != NULL) {
+			fProvider->setSharedRingInvoke(i, NULL);
+			fRing[i]->release();
+			fRing[i] = NULL;
+		}
+	}
+	if (fLoopback) {
+		fProvider->setLoopbackInvoke(false, &status);
+		if (status != kIOReturnSuccess)
+			error("could not turn loopback off, status 0x%x", status);
+		fLoopback = false;
+	}
+	fProvider->setNotifyClientInvoke(NULL);
+
 	// drop our lock on the provider
 	openState = false;
 	fProvider->setClientActiveInvoke(&openState);
 
 	// close the provider and drop our reference
-	if (fProvider->isOpen(this))
-		fProvider->close(this);
+	fProvider->close(this);
 
 	debug(DEBUGF_USERCLIENT, "closed");
 
@@ -183,6 +313,12 @@ self::clientClose(void)
 {
 	// close parent if required
 	close();
+
+	// abandon any management commands still waiting
+	if ((fProvider != NULL) && (fBroker != NULL))
+		fProvider->brokerDetachInvoke(fBroker);
+	if ((fProvider != NULL) && (fEvents != NULL))
+		fProvider->eventUnsubscribeInvoke(fEvents);
     
 	if (fTask)
 		fTask = NULL;
@@ -192,6 +328,192 @@ self::clientClose(void)
 	return(kIOReturnSuccess);
 }
 
+//////////////////////////////////////////////////////////////////////////////
+// Receive and writable notifications
+//
+// Ports may be registered before or after opening; the provider only
+// learns about us once we hold the channel.  Each registration hands us a
+// send right, even for the port we already have, so the one it replaces is
+// always given back, as are any left when we go away.  The provider sends
+// from its management gate, so the message is swapped in through that.
+//
+IOReturn
+self::registerNotificationPort(mach_port_t port, UInt32 type, UInt32 refCon)
+{
+	mach_msg_header_t	msg;
+	mach_port_t		old;
+
+	// provider terminated?
+	if (isInactive())
+		return(kIOReturnNotAttached);
+
+	// the event queue notifies for itself
+	if (type == kArcMSRNotifyEvents) {
+		old = fEventPort;
+		fEventPort = port;
+		if (fEvents != NULL)
+			fEvents->queue->setNotificationPort(port);
+		if (old != MACH_PORT_NULL)
+			releaseNotificationPort(old);
+		return(kIOReturnSuccess);
+	}
+
+	if ((type != kArcMSRNotifyDataAvailable) && (type != kArcMSRNotifyWritable))
+		return(kIOReturnBadArgument);
+
+	bzero(&msg, sizeof(msg));
+	msg.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, 0);
+	msg.msgh_size = sizeof(msg);
+	msg.msgh_remote_port = port;
+	msg.msgh_local_port = MACH_PORT_NULL;
+	msg.msgh_id = refCon;
+	fProvider->swapNotifyMessageInvoke(&fNotifyMsg[type], &msg);
+	old = msg.msgh_remote_port;
+	debug(DEBUGF_USERCLIENT, "%s notification port %s",
+	      (type == kArcMSRNotifyWritable) ? "writable" : "data",
+	      (port != MACH_PORT_NULL) ? "registered" : "removed");
+
+	// tells the provider to look again, in case there's already something to say
+	if (fProvider->isOpen(this))
+		fProvider->setNotifyClientInvoke(this);
+	if (old != MACH_PORT_NULL)
+		releaseNotificationPort(old);
+	return(kIOReturnSuccess);
+}
+
+// Called by the provider, with the gate held
+void
+self::sendNotification(UInt32 type)
+{
+	if (fNotifyMsg[type].msgh_remote_port == MACH_PORT_NULL)
+		return;
+	if (mach_msg_send_from_kernel(&fNotifyMsg[type], sizeof(fNotifyMsg[type])) != MACH_MSG_SUCCESS)
+		debug(DEBUGF_USERCLIENT, "notification send failed");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Shared ring transport
+//
+// Rings are created on first mapping and attached to the provider; they
+// stay attached until we close.
+//
+IOReturn
+self::clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory)
+{
+	IOBufferMemoryDescriptor	*md;
+	IOMemoryDescriptor		*history;
+	ArcMSRSharedRing		*ring;
+	
+	// provider terminated?
+	if (isInactive())
+		return(kIOReturnNotAttached);
+
+	// the hardware monitor history is for anyone, and read-only
+	if (type == kArcMSRMonitorHistory) {
+		if ((history = fProvider->monitorMemory()) == NULL)
+			return(kIOReturnUnsupported);
+		history->retain();
+		*options = kIOMapReadOnly;
+		*memory = history;
+		return(kIOReturnSuccess);
+	}
+
+	// mapping the event queue subscribes us
+	if (type == kArcMSREventQueue) {
+		if (fEvents == NULL) {
+			if ((fEvents = (struct arcmsr_event_subscriber *)IOMalloc(sizeof(*fEvents))) == NULL)
+				return(kIOReturnNoMemory);
+			bzero(fEvents, sizeof(*fEvents));
+			fEvents->queue = IODataQueue::withEntries(ARCMSR_EVENT_QUEUE_DEPTH, sizeof(ArcMSREvent));
+			if (fEvents->queue == NULL) {
+				IOFree(fEvents, sizeof(*fEvents));
+				fEvents = NULL;
+				return(kIOReturnNoMemory);
+			}
+			if (fEventPort != MACH_PORT_NULL)
+				fEvents->queue->setNotificationPort(fEventPort);
+			fProvider->eventSubscribeInvoke(fEvents);
+			debug(DEBUGF_USERCLIENT, "subscribed to adapter events");
+		}
+
+		// this one is new, so the caller's reference is the only one
+		if ((*memory = fEvents->queue->getMemoryDescriptor()) == NULL)
+			return(kIOReturnNoMemory);
+		*options = 0;
+		return(kIOReturnSuccess);
+	}
+
+	// must hold the channel
+	if (!fProvider->isOpen(this))
+		return(kIOReturnNotOpen);
+
+	if ((type != kArcMSRSharedRingInbound) && (type != kArcMSRSharedRingOutbound))
+		return(kIOReturnBadArgument);
+
+	if ((md = fRing[type]) == NULL) {
+		md = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared,
+							   round_page_32(sizeof(ArcMSRSharedRing)),
+							   PAGE_SIZE);
+		if (md == NULL)
+			return(kIOReturnNoMemory);
+		ring = (ArcMSRSharedRing *)md->getBytesNoCopy();
+		bzero(ring, sizeof(*ring));
+		ring->size = ARCMSR_SHARED_RING_SIZE;
+		fRing[type] = md;
+		fProvider->setSharedRingInvoke(type, ring);
+		debug(DEBUGF_USERCLIENT, "created %s ring", (type == kArcMSRSharedRingInbound) ? "inbound" : "outbound");
+	}
+
+	// the caller consumes a reference
+	md->retain();
+	*options = 0;
+	*memory = md;
+	return(kIOReturnSuccess);
+}
+
+IOReturn
+self::kick(void)
+{
+	// provider terminated?
+	if (isInactive())
+		return(kIOReturnNotAttached);
+	if (!fProvider->isOpen(this))
+		return(kIOReturnNotOpen);
+
+	fProvider->sharedRingKickInvoke();
+	return(kIOReturnSuccess);
+}
+
+IOReturn
+self::wait(UInt32 timeout)
+{
+	// provider terminated?
+	if (isInactive())
+		return(kIOReturnNotAttached);
+	if (!fProvider->isOpen(this))
+		return(kIOReturnNotOpen);
+
+	fProvider->sharedRingWaitInvoke((int)timeout);
+	return(kIOReturnSuccess);
+}
+
+IOReturn
+self::loopback(UInt32 state)
+{
+	IOReturn	status;
+
+	// provider terminated?
+	if (isInactive())
+		return(kIOReturnNotAttached);
+	if (!fProvider->isOpen(this))
+		return(kIOReturnNotOpen);
+
+	fProvider->setLoopbackInvoke(state != 0, &status);
+	if (status == kIOReturnSuccess)
+		fLoopback = (state != 0);
+	return(status);
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // ArcMSR-specific interface
 //
@@ -233,6 +555,131 @@ self::send(ArcMSRUserCommand *inCommand, ArcMSRUserCommand *outCommand, IOByteCo
 	return(kIOReturnSuccess);
 }
 
+//
+// As send, but never holds the caller for longer than it asks and tells it
+// how much was taken.
+//
+IOReturn
+self::write(ArcMSRUserCommand *inCommand, ArcMSRUserCommand *outCommand, IOByteCount inCount, IOByteCount *outCount)
+{
+	IOMemoryDescriptor	*dataBuf;
+	IOReturn		status;
+	UInt32			size;
+	int			written;
+
+	debug(DEBUGF_USERCLIENT, "%d bytes at %p", inCommand->data_size, inCommand->data_buffer);
+    
+	// provider terminated?
+	if (isInactive())
+		return(kIOReturnNotAttached);
+
+	// raw channel traffic, so only for its owner
+	if (!fProvider->isOpen(this))
+		return(kIOReturnNotOpen);
+
+	if (inCommand->data_size < 1)
+		return(kIOReturnBadArgument);
+
+	// no more than the queue could ever take; the caller comes back for the rest
+	size = inCommand->data_size;
+	if (size > ARCMSR_MESSAGE_BUFFER)
+		size = ARCMSR_MESSAGE_BUFFER;
+    
+	// get an IOMemoryDescriptor for the data
+	dataBuf = IOMemoryDescriptor::withAddress(inCommand->data_buffer, 
+						  size,
+						  kIODirectionOut,
+						  fTask);
+	if (!dataBuf)
+		return(kIOReturnBadArgument);
+	if ((status = dataBuf->prepare()) != kIOReturnSuccess) {
+		dataBuf->release();
+		return(status);
+	}
+
+	// queue what fits and hand off to the adapter
+	fProvider->inboundMQBufferWriteInvoke(dataBuf, &written, inCommand->timeout);
+	dataBuf->complete();
+	dataBuf->release();
+	if (written < 0)
+		return(kIOReturnBusy);	// a stream has the channel
+    
+	outCommand->data_size = written;
+	outCommand->result = (written > 0) ? ARCMSR_USERCLIENT_RETURNCODE_OK : ARCMSR_USERCLIENT_RETURNCODE_WOULDBLOCK;
+    
+	return(kIOReturnSuccess);
+}
+
+//
+// The buffer stays wired while the driver feeds it to the adapter, so the
+// whole thing goes without another trip out here.
+//
+IOReturn
+self::stream(ArcMSRUserCommand *inCommand, ArcMSRUserCommand *outCommand, IOByteCount inCount, IOByteCount *outCount)
+{
+	IOMemoryDescriptor	*dataBuf;
+	IOReturn		status;
+	UInt32			offset, size;
+	int			sent;
+	bool			streaming;
+
+	debug(DEBUGF_USERCLIENT, "%d bytes at %p", inCommand->data_size, inCommand->data_buffer);
+    
+	// provider terminated?
+	if (isInactive())
+		return(kIOReturnNotAttached);
+
+	// raw channel traffic, so only for its owner
+	if (!fProvider->isOpen(this))
+		return(kIOReturnNotOpen);
+
+	if (inCommand->data_size < 1)
+		return(kIOReturnBadArgument);
+
+	// hold the channel for the whole payload, not just a window
+	streaming = true;
+	fProvider->setStreamingInvoke(&streaming);
+	if (!streaming)
+		return(kIOReturnBusy);
+
+	// wire and send a window at a time; a short window means the adapter stalled
+	status = kIOReturnSuccess;
+	for (offset = 0; offset < inCommand->data_size; offset += size) {
+		size = inCommand->data_size - offset;
+		if (size > ARCMSR_STREAM_WINDOW)
+			size = ARCMSR_STREAM_WINDOW;
+		dataBuf = IOMemoryDescriptor::withAddress(inCommand->data_buffer + offset,
+							  size,
+							  kIODirectionOut,
+							  fTask);
+		if (!dataBuf) {
+			status = kIOReturnNoMemory;
+			break;
+		}
+		if ((status = dataBuf->prepare()) != kIOReturnSuccess) {
+			dataBuf->release();
+			break;
+		}
+		fProvider->inboundMQStreamInvoke(dataBuf, &sent, inCommand->timeout);
+		dataBuf->complete();
+		dataBuf->release();
+		if (sent < (int)size) {
+			if (sent > 0)
+				offset += sent;
+			break;
+		}
+	}
+	streaming = false;
+	fProvider->setStreamingInvoke(&streaming);
+	if ((offset == 0) && (status != kIOReturnSuccess))
+		return(status);
+    
+	outCommand->data_size = offset;
+	outCommand->result = (offset == inCommand->data_size) ? ARCMSR_USERCLIENT_RETURNCODE_OK : ARCMSR_USERCLIENT_RETURNCODE_ERROR;
+    
+	return(kIOReturnSuccess);
+}
+
 IOReturn
 self::recv(ArcMSRUserCommand *inCommand, ArcMSRUserCommand *outCommand, IOByteCount inCount, IOByteCount *outCount)
 {
@@ -270,6 +717,275 @@ self::recv(ArcMSRUserCommand *inCommand, ArcMSRUserCommand *outCommand, IOByteCo
 	return(kIOReturnSuccess);
 }
 
+//////////////////////////////////////////////////////////////////////////////
+// Adapter inventory
+//
+// This is too big to go back inline, so it is copied out to the caller's
+// buffer.  Nothing is sent to the adapter, so anyone may ask.
+//
+IOReturn
+self::inventory(ArcMSRUserCommand *inCommand, ArcMSRUserCommand *outCommand, IOByteCount inCount, IOByteCount *outCount)
+{
+	ArcMSRInventory		*snap;
+	IOReturn		status;
+
+	// provider terminated?
+	if (isInactive())
+		return(kIOReturnNotAttached);
+
+	if (inCommand->data_size < sizeof(*snap))
+		return(kIOReturnBadArgument);
+
+	if ((snap = (ArcMSRInventory *)IOMalloc(sizeof(*snap))) == NULL)
+		return(kIOReturnNoMemory);
+	fProvider->inventorySnapshotInvoke(snap);
+	status = copyOut(inCommand->data_buffer, snap, sizeof(*snap));
+	IOFree(snap, sizeof(*snap));
+	if (status != kIOReturnSuccess)
+		return(status);
+
+	outCommand->data_size = sizeof(*snap);
+	outCommand->result = ARCMSR_USERCLIENT_RETURNCODE_OK;
+	return(kIOReturnSuccess);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// I/O statistics
+//
+// Copied out the same way as the inventory, and just as free to ask for.
+//
+IOReturn
+self::statistics(ArcMSRUserCommand *inCommand, ArcMSRUserCommand *outCommand, IOByteCount inCount, IOByteCount *outCount)
+{
+	ArcMSRStatistics	*snap;
+	IOReturn		status;
+
+	// provider terminated?
+	if (isInactive())
+		return(kIOReturnNotAttached);
+
+	if (inCommand->data_size < sizeof(*snap))
+		return(kIOReturnBadArgument);
+
+	if ((snap = (ArcMSRStatistics *)IOMalloc(sizeof(*snap))) == NULL)
+		return(kIOReturnNoMemory);
+	fProvider->statsSnapshotInvoke(snap);
+#ifdef ARCMSR_GATE_STATS
+	fProvider->gatePublish();	// the gate figures go to the registry when asked for
+#endif
+	status = copyOut(inCommand->data_buffer, snap, sizeof(*snap));
+	IOFree(snap, sizeof(*snap));
+	if (status != kIOReturnSuccess)
+		return(status);
+
+	outCommand->data_size = sizeof(*snap);
+	outCommand->result = ARCMSR_USERCLIENT_RETURNCODE_OK;
+	return(kIOReturnSuccess);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Reset the I/O statistics
+//
+// For everyone, not just us; other readers can tell from resets, but since
+// it spoils their figures, only root may.
+//
+IOReturn
+self::resetStatistics(void)
+{
+	// provider terminated?
+	if (isInactive())
+		return(kIOReturnNotAttached);
+
+	if (!kauth_cred_issuser(kauth_cred_get()))
+		return(kIOReturnNotPrivileged);
+
+	fProvider->statsResetInvoke();
+	return(kIOReturnSuccess);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Copy a driver structure out to the client's buffer
+//
+IOReturn
+self::copyOut(vm_address_t address, const void *data, IOByteCount size)
+{
+	IOMemoryDescriptor	*dataBuf;
+	IOReturn		status;
+
+	dataBuf = IOMemoryDescriptor::withAddress(address, size, kIODirectionIn, fTask);
+	if (dataBuf == NULL)
+		return(kIOReturnBadArgument);
+	if ((status = dataBuf->prepare()) == kIOReturnSuccess) {
+		dataBuf->writeBytes(0, data, size);
+		dataBuf->complete();
+	}
+	dataBuf->release();
+	return(status);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Management commands
+//
+// The frame is checked here so that the broker only ever sees well-formed
+// commands; a bad frame would leave the adapter out of step with us.
+//
+IOReturn
+self::command(ArcMSRManagementCommand *inCommand, ArcMSRManagementCommand *outCommand, IOByteCount inCount, IOByteCount *outCount)
+{
+	struct arcmsr_broker_request *breq;
+	IOMemoryDescriptor	*dataBuf;
+	int			size, length;
+
+	// provider terminated?
+	if (isInactive())
+		return(kIOReturnNotAttached);
+
+	size = inCommand->frame_size;
+	if ((size < (GUI_FRAME_OVERHEAD + 1)) || (size > GUI_MAX_FRAME))
+		return(kIOReturnBadArgument);
+
+	if ((breq = (struct arcmsr_broker_request *)IOMalloc(sizeof(*breq))) == NULL)
+		return(kIOReturnNoMemory);
+	bzero(&breq->gui, sizeof(breq->gui));
+
+	// fetch the frame, using the reply buffer as scratch
+	dataBuf = IOMemoryDescriptor::withAddress(inCommand->frame_buffer, size, kIODirectionInOut, fTask);
+	if (!dataBuf) {
+		IOFree(breq, sizeof(*breq));
+		return(kIOReturnBadArgument);
+	}
+	dataBuf->prepare();
+	dataBuf->readBytes(0, breq->reply, size);
+	dataBuf->complete();
+	dataBuf->release();
+
+	// signature, length, checksum
+	if ((length = ArcMSR::GUIunframe(breq->reply, size)) < 0) {
+		debug(DEBUGF_USERCLIENT, "malformed management frame, %d bytes", size);
+		IOFree(breq, sizeof(*breq));
+		return(kIOReturnBadArgument);
+	}
+	breq->gui.opcode = breq->reply[GUI_FRAME_BODY];
+	breq->gui.argLen = length - 1;
+	bcopy(&breq->reply[GUI_FRAME_BODY + 1], breq->args, breq->gui.argLen);
+	debug(DEBUGF_USERCLIENT, "management command 0x%02x, %d argument bytes", breq->gui.opcode, breq->gui.argLen);
+
+	size = inCommand->reply_size;
+	outCommand->result = brokerRun(breq, inCommand->reply_buffer, &size, false);
+	outCommand->reply_size = size;
+	IOFree(breq, sizeof(*breq));
+
+	return(kIOReturnSuccess);
+}
+
+//
+// One call per command: we frame it, the GUI engine parses and checks the
+// reply, and only the payload comes back.
+//
+IOReturn
+self::transact(ArcMSRManagementTransaction *inCommand, ArcMSRManagementTransaction *outCommand, IOByteCount inCount, IOByteCount *outCount)
+{
+	struct arcmsr_broker_request *breq;
+	IOMemoryDescriptor	*dataBuf;
+	int			size;
+
+	// provider terminated?
+	if (isInactive())
+		return(kIOReturnNotAttached);
+
+	if ((inCommand->opcode > 0xff) || (inCommand->arg_size > (GUI_MAX_LENGTH - 1)))
+		return(kIOReturnBadArgument);
+
+	if ((breq = (struct arcmsr_broker_request *)IOMalloc(sizeof(*breq))) == NULL)
+		return(kIOReturnNoMemory);
+	bzero(&breq->gui, sizeof(breq->gui));
+	breq->gui.opcode = inCommand->opcode;
+	breq->gui.argLen = inCommand->arg_size;
+
+	if (breq->gui.argLen > 0) {
+		dataBuf = IOMemoryDescriptor::withAddress(inCommand->arg_buffer, breq->gui.argLen, kIODirectionInOut, fTask);
+		if (!dataBuf) {
+			IOFree(breq, sizeof(*breq));
+			return(kIOReturnBadArgument);
+		}
+		dataBuf->prepare();
+		dataBuf->readBytes(0, breq->args, breq->gui.argLen);
+		dataBuf->complete();
+		dataBuf->release();
+	}
+	debug(DEBUGF_USERCLIENT, "management transaction 0x%02x, %d argument bytes", breq->gui.opcode, breq->gui.argLen);
+
+	size = inCommand->reply_size;
+	outCommand->result = brokerRun(breq, inCommand->reply_buffer, &size, true);
+	outCommand->reply_size = size;
+	IOFree(breq, sizeof(*breq));
+
+	return(kIOReturnSuccess);
+}
+
+//
+// Queue a command with the broker, wait for it and copy out the reply
+// frame or its payload.  *size is the buffer size on the way in and the
+// reply size on the way out.
+//
+IOReturn
+self::brokerRun(struct arcmsr_broker_request *breq, vm_address_t buffer, int *size, bool payload)
+{
+	IOMemoryDescriptor	*dataBuf;
+	IOReturn		status;
+	uint8_t			*reply;
+	int			length;
+
+	fProvider->brokerCommandInvoke(fBroker, breq);
+	publishStatistics();
+
+	if ((status = breq->gui.status) != kIOReturnSuccess) {
+		*size = 0;
+		return(status);
+	}
+	reply = breq->reply;
+	length = breq->replyLen;
+	if (payload) {
+		reply += GUI_FRAME_BODY;
+		length -= GUI_FRAME_OVERHEAD;
+	}
+	if (length > *size) {
+		*size = length;
+		return(kIOReturnNoSpace);
+	}
+	*size = length;
+	if (length == 0)
+		return(kIOReturnSuccess);
+
+	dataBuf = IOMemoryDescriptor::withAddress(buffer, length, kIODirectionInOut, fTask);
+	if (!dataBuf)
+		return(kIOReturnBadArgument);
+	dataBuf->prepare();
+	dataBuf->writeBytes(0, reply, length);
+	dataBuf->complete();
+	dataBuf->release();
+	return(kIOReturnSuccess);
+}
+
+// Our share of the broker's work, published as "broker-statistics" on us
+void
+self::publishStatistics(void)
+{
+	OSDictionary	*dict;
+
+	if ((dict = OSDictionary::withCapacity(8)) == NULL)
+		return;
+	dictSetNumber(dict, "submitted", fBroker->stats.submitted);
+	dictSetNumber(dict, "completed", fBroker->stats.completed);
+	dictSetNumber(dict, "failed", fBroker->stats.failed);
+	dictSetNumber(dict, "rejected", fBroker->stats.rejected);
+	dictSetNumber(dict, "queue-us", fBroker->stats.queueTime);
+	dictSetNumber(dict, "service-us", fBroker->stats.serviceTime);
+	dictSetNumber(dict, "max-queued", fBroker->stats.maxQueued);
+	setProperty("broker-statistics", dict);
+	dict->release();
+}
+
 IOReturn
 self::clearWQBuffer(void)
 {
@@ -49,6 +49,10 @@ static struct {
 	{"adapter",	DEBUGF_ADAPTER},
 	{"power",	DEBUGF_POWER},
 	{"event",	DEBUGF_EVENT},
+	{"management",	DEBUGF_MANAGEMENT},
+	{"rebuild",	DEBUGF_REBUILD},
+	{"inventory",	DEBUGF_INVENTORY},
+	{"monitor",	DEBUGF_MONITOR},
 	{"all",		~(uint32_t)0},
 	{NULL, 0}
 };
@@ -116,195 +120,66 @@ hexdump(void *vp, int count)
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////
-// General-purpose byte-holding ringbuffer
+// Add a number to a dictionary destined for the registry
 //
-
-void
-RingBuffer::init(int desiredSize) 
-{ 
-    size = desiredSize + 1;
-    data = (char *)IOMalloc(size);
-    head = 0; 
-    tail = 0;
-};
-
-void
-RingBuffer::deinit(void)
-{
-    if (data != NULL)
-	IOFree(data, size);
-};
-
-void
-RingBuffer::clear(void)
-{
-	head = 0;
-	tail = 0;
-}
-
-int
-RingBuffer::avail(void) {
-    return(size - (((head + size) - tail) % size));
-};
-
-bool
-RingBuffer::insert(char *indata, int len) 
-{
-    int	frag;
-    
-    if (len > avail()) 
-	return(false);	    // space check
-    frag = size - head;	    // fill head-to-end first
-    if (frag > len)
-	frag = len;
-    memcpy(data + head, indata, frag);
-    head += frag;
-    if (head == size)	    // head never points to end
-	head = 0;
-    if (len > frag) {	    // more to copy?
-	memcpy(data, indata + frag, len - frag);
-	head = len - frag;
-    }
-//    debug(DEBUGF_MISC, "inserted %d  head %d tail %d", len, head, tail);
-    return(true);
-};
-
-bool
-RingBuffer::insert(IOMemoryDescriptor *md)
+__private_extern__ void
+dictSetNumber(OSDictionary *dict, const char *key, uint64_t value)
 {
-    int	frag, len = md->getLength();
-    
-    if (len > avail()) 
-	return(false);	    // space check
-    frag = size - head;	    // fill head-to-end first
-    if (frag > len)
-	frag = len;
-    md->readBytes(0, data + head, frag);
-    head += frag;
-    if (head == size)	    // head never points to end
-	head = 0;
-    if (len > frag) {	    // more to copy?
-	md->readBytes(frag, data, len - frag);
-	head = len - frag;
-    }
-//    debug(DEBUGF_MISC, "inserted %d  head %d tail %d", len, head, tail);
-    return(true);
-};
+	OSNumber	*num;
 
-bool
-RingBuffer::insert(uint8_t one)
-{
-    return(insert((char *)&one, sizeof(one)));
-}
-
-bool
-RingBuffer::insert(uint16_t one)
-{
-    return(insert((char *)&one, sizeof(one)));
+	if ((num = OSNumber::withNumber((unsigned long long)value, 64)) != NULL) {
+		dict->setObject(key, num);
+		num->release();
+	}
 }
 
-bool
-RingBuffer::insert(uint32_t one)
+////////////////////////////////////////////////////////////////////////////////
+// Add a fixed-size adapter string field to a dictionary
+//
+// The adapter pads its strings with spaces or NULs, and doesn't always
+// terminate them.
+//
+__private_extern__ void
+dictSetString(OSDictionary *dict, const char *key, const uint8_t *field, int len)
 {
-    return(insert((char *)&one, sizeof(one)));
+	OSString	*str;
+	char		buf[64];
+	int		i;
+
+	if (len > (int)(sizeof(buf) - 1))
+		len = sizeof(buf) - 1;
+	for (i = 0; (i < len) && (field[i] != 0); i++)
+		buf[i] = ((field[i] >= 32) && (field[i] < 127)) ? field[i] : '?';
+	while ((i > 0) && (buf[i - 1] == ' '))
+		i--;
+	buf[i] = 0;
+	if ((str = OSString::withCString(buf)) != NULL) {
+		dict->setObject(key, str);
+		str->release();
+	}
 }
 
-int
-RingBuffer::remove(char *outdata, int len) 
-{
-    int	frag, frag2;
-    if (head >= tail) {	    // from tail to head
-	frag = head - tail;
-	if (frag > len)
-	    frag = len;
-	if (frag > 0)
-	    memcpy(outdata, data + tail, frag);
-	tail += frag;
-//	debug(DEBUGF_MISC, "removed %d  head %d tail %d", frag, head, tail);
-	return(frag);
-    }
-    // from tail to end
-    frag = size - tail;
-    if (frag > len)
-	frag = len;
-    memcpy(outdata, data + tail, frag);
-    tail += frag;
-    if (tail == size)
-	tail = 0;
-    // maybe wrap
-    if (len > frag) {
-	frag2 = head;
-	if (frag2 > (len - frag))
-	    frag2 = (len - frag);
-	memcpy(outdata + frag, data, frag2);
-	tail = frag2;
-	frag += frag2;
-    }
-//    debug(DEBUGF_MISC, "removed %d  head %d tail %d", frag, head, tail);
-    return(frag);
-};
-
-int
-RingBuffer::remove(IOMemoryDescriptor *md, int offset) 
+////////////////////////////////////////////////////////////////////////////////
+// Fetch a tunable from a service's properties (ie. its personality)
+//
+__private_extern__ uint32_t
+getNumberProperty(IOService *service, const char *key, uint32_t defaultValue)
 {
-    int	frag, frag2, len = md->getLength() - offset;
-    
-    if (head >= tail) {	    // from tail to head
-	frag = head - tail;
-	if (frag > len)
-	    frag = len;
-	if (frag > 0)
-	    md->writeBytes(offset, data + tail, frag);
-	tail += frag;
-//	debug(DEBUGF_MISC, "removed %d  head %d tail %d", frag, head, tail);
-	return(frag);
-    }
-    // from tail to end
-    frag = size - tail;
-    if (frag > len)
-	frag = len;
-    md->writeBytes(offset, data + tail, frag);
-    tail += frag;
-    if (tail == size)
-	tail = 0;
-    // maybe wrap
-    if (len > frag) {
-	frag2 = head;
-	if (frag2 > (len - frag))
-	    frag2 = (len - frag);
-	md->writeBytes(offset + frag, data, frag2);
-	tail = frag2;
-	frag += frag2;
-    }
-//    debug(DEBUGF_MISC, "removed %d  head %d tail %d", frag, head, tail);
-    return(frag);
-};
+	OSNumber	*num;
 
-int
-RingBuffer::remove(uint8_t *one)
-{
-    
-    if (remove((char *)one, sizeof(*one)) == sizeof(*one))
-	return(1);
-    return(-1);
+	if ((num = OSDynamicCast(OSNumber, service->getProperty(key))) == NULL)
+		return(defaultValue);
+	return(num->unsigned32BitValue());
 }
 
-int
-RingBuffer::remove(uint16_t *one)
+__private_extern__ const char *
+getStringProperty(IOService *service, const char *key, const char *defaultValue)
 {
-    
-    if (remove((char *)one, sizeof(*one)) == sizeof(*one))
-	return(1);
-    return(-1);
-}
+	OSString	*str;
 
-int
-RingBuffer::remove(uint32_t *one)
-{
-    
-    if (remove((char *)one, sizeof(*one)) == sizeof(*one))
-	return(1);
-    return(-1);
+	if ((str = OSDynamicCast(OSString, service->getProperty(key))) == NULL)
+		return(defaultValue);
+	return(str->getCStringNoCopy());
 }
 
 ////////////////////////////////////////////////////////////////////////////////
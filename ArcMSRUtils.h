@@ -44,9 +44,13 @@ __private_extern__ void hexdump(void *vp, int count);
 #define DEBUGF_RESCAN		(1<<7)
 #define DEBUGF_MISC		(1<<8)
 #define DEBUGF_ADAPTER		(1<<9)
-#define DEBUGF_POWER		(1<10)
+#define DEBUGF_POWER		(1<<10)
 #define DEBUGF_EVENT		(1<<11)
 #define DEBUGF_ERROR		(1<<12)
+#define DEBUGF_MANAGEMENT	(1<<13)
+#define DEBUGF_REBUILD		(1<<14)
+#define DEBUGF_INVENTORY	(1<<15)
+#define DEBUGF_MONITOR		(1<<16)
 
 #define debug(fac, fmt, args...)					\
 do {									\
@@ -78,27 +82,14 @@ do {									\
 
 
 
-// General-purpose ringbuffer
-class RingBuffer {
-public:
-    void	init(int desiredSize);
-    void	deinit(void);
-    void	clear(void);
-    int		avail(void);
-    bool	insert(char *indata, int len);
-    bool	insert(IOMemoryDescriptor *md);
-    bool	insert(uint8_t one);
-    bool	insert(uint16_t one);
-    bool	insert(uint32_t one);
-    int		remove(char *outdata, int len);
-    int		remove(IOMemoryDescriptor *md, int offset);
-    int		remove(uint8_t *one);
-    int		remove(uint16_t *one);
-    int		remove(uint32_t *one);
-private:
-    int		head, tail, size;
-    char	*data;
-};
+// Registry property helpers
+__private_extern__ void	dictSetNumber(OSDictionary *dict, const char *key, uint64_t value);
+__private_extern__ void	dictSetString(OSDictionary *dict, const char *key, const uint8_t *field, int len);
+__private_extern__ uint32_t	getNumberProperty(IOService *service, const char *key, uint32_t defaultValue);
+__private_extern__ const char	*getStringProperty(IOService *service, const char *key, const char *defaultValue);
+
+// General-purpose ringbuffer, see ArcMSRRingBuffer.h
+#include "ArcMSRRingBuffer.h"
 
 
 
@@ -111,18 +102,37 @@ private:
 ////////////////////////////////////////////////////////////////////////////////
 // Some goop to simplify running things via the commandGate
 //
-#define COMMANDGATE_GLUE0(_func)										\
+// The I/O path uses the controller's own gate; the message channel and
+// management commands have a gate (and workloop) to themselves.  With
+// ARCMSR_GATE_STATS every trip through either is timed; see gateEnter.
+//
+#ifdef ARCMSR_GATE_STATS
+#define GATE_STATS_CALLED		uint64_t called; clock_get_uptime(&called)
+#define GATE_STATS_ARG			((void *)&called)
+#define GATE_STATS_ENTER(_which)	uint64_t entered = sp->gateEnter(_which, (uint64_t *)arg3)
+#define GATE_STATS_LEAVE(_which)	sp->gateLeave(_which, entered)
+#else
+#define GATE_STATS_CALLED		do { } while (0)
+#define GATE_STATS_ARG			NULL
+#define GATE_STATS_ENTER(_which)	do { } while (0)
+#define GATE_STATS_LEAVE(_which)	do { } while (0)
+#endif
+
+#define GATE_GLUE0(_gate, _which, _func)									\
 static IOReturn													\
-_func ## Action(OSObject *owner, void *arg0, __unused void *arg1, __unused void *arg2, __unused void *arg3)	\
+_func ## Action(OSObject *owner, void *arg0, __unused void *arg1, __unused void *arg2, __unused void *arg3)		\
 {														\
 	self  *sp = OSDynamicCast(self, owner);									\
+	GATE_STATS_ENTER(_which);										\
 	sp->_func ();												\
+	GATE_STATS_LEAVE(_which);										\
 	return(kIOReturnSuccess);										\
 }														\
 void														\
 self:: _func ## Invoke ()											\
 {														\
-	GetCommandGate()->runAction(_func ## Action);								\
+	GATE_STATS_CALLED;											\
+	(_gate)->runAction(_func ## Action, NULL, NULL, NULL, GATE_STATS_ARG);					\
 }														\
 struct hack
 
@@ -131,18 +141,21 @@ struct hack
 	void	_func ## Invoke(void)
 
 
-#define COMMANDGATE_GLUE1(_func, cast0)										\
+#define GATE_GLUE1(_gate, _which, _func, cast0)									\
 static IOReturn													\
-_func ## Action(OSObject *owner, void *arg0, __unused void *arg1, __unused void *arg2, __unused void *arg3)	\
+_func ## Action(OSObject *owner, void *arg0, __unused void *arg1, __unused void *arg2, __unused void *arg3)		\
 {														\
 	self  *sp = OSDynamicCast(self, owner);									\
+	GATE_STATS_ENTER(_which);										\
 	sp->_func ((cast0)arg0);										\
+	GATE_STATS_LEAVE(_which);										\
 	return(kIOReturnSuccess);										\
 }														\
 void														\
 self:: _func ## Invoke (cast0 arg0)										\
 {														\
-	GetCommandGate()->runAction(_func ## Action, (void *)arg0);						\
+	GATE_STATS_CALLED;											\
+	(_gate)->runAction(_func ## Action, (void *)arg0, NULL, NULL, GATE_STATS_ARG);				\
 }														\
 struct hack
 
@@ -151,18 +164,21 @@ struct hack
 	void	_func ## Invoke(cast0 arg0)
 
 
-#define COMMANDGATE_GLUE2(_func, cast0, cast1)									\
+#define GATE_GLUE2(_gate, _which, _func, cast0, cast1)								\
 static IOReturn													\
-_func ## Action(OSObject *owner, void *arg0, __unused void *arg1, __unused void *arg2, __unused void *arg3)	\
+_func ## Action(OSObject *owner, void *arg0, __unused void *arg1, __unused void *arg2, __unused void *arg3)		\
 {														\
 	self  *sp = OSDynamicCast(self, owner);									\
+	GATE_STATS_ENTER(_which);										\
 	sp->_func ((cast0)arg0, (cast1)arg1);									\
+	GATE_STATS_LEAVE(_which);										\
 	return(kIOReturnSuccess);										\
 }														\
 void														\
 self:: _func ## Invoke (cast0 arg0, cast1 arg1)									\
 {														\
-	GetCommandGate()->runAction(_func ## Action, (void *)arg0, (void *)arg1);				\
+	GATE_STATS_CALLED;											\
+	(_gate)->runAction(_func ## Action, (void *)arg0, (void *)arg1, NULL, GATE_STATS_ARG);			\
 }														\
 struct hack
 
@@ -170,18 +186,21 @@ struct hack
 	void	_func (cast0 argname0, cast1 argname1);			\
 	void	_func ## Invoke(cast0 arg0, cast1 arg1)
 
-#define COMMANDGATE_GLUE3(_func, cast0, cast1, cast2)								\
+#define GATE_GLUE3(_gate, _which, _func, cast0, cast1, cast2)							\
 static IOReturn													\
-_func ## Action(OSObject *owner, void *arg0, __unused void *arg1, __unused void *arg2, __unused void *arg3)	\
+_func ## Action(OSObject *owner, void *arg0, __unused void *arg1, __unused void *arg2, __unused void *arg3)		\
 {														\
 	self  *sp = OSDynamicCast(self, owner);									\
+	GATE_STATS_ENTER(_which);										\
 	sp->_func ((cast0)arg0, (cast1)arg1, (cast2)arg2);							\
+	GATE_STATS_LEAVE(_which);										\
 	return(kIOReturnSuccess);										\
 }														\
 void														\
 self:: _func ## Invoke (cast0 arg0, cast1 arg1, cast2 arg2)							\
 {														\
-	GetCommandGate()->runAction(_func ## Action, (void *)arg0, (void *)arg1, (void *)arg2);			\
+	GATE_STATS_CALLED;											\
+	(_gate)->runAction(_func ## Action, (void *)arg0, (void *)arg1, (void *)arg2, GATE_STATS_ARG);		\
 }														\
 struct hack
 
@@ -189,6 +208,16 @@ struct hack
 	void	_func (cast0 argname0, cast1 argname1, cast2 argname2);			\
 	void	_func ## Invoke(cast0 arg0, cast1 arg1, cast2 arg2)
 
+#define COMMANDGATE_GLUE0(_func)			GATE_GLUE0(GetCommandGate(), ARCMSR_GATE_IO, _func)
+#define COMMANDGATE_GLUE1(_func, c0)			GATE_GLUE1(GetCommandGate(), ARCMSR_GATE_IO, _func, c0)
+#define COMMANDGATE_GLUE2(_func, c0, c1)		GATE_GLUE2(GetCommandGate(), ARCMSR_GATE_IO, _func, c0, c1)
+#define COMMANDGATE_GLUE3(_func, c0, c1, c2)		GATE_GLUE3(GetCommandGate(), ARCMSR_GATE_IO, _func, c0, c1, c2)
+
+#define MANAGEMENTGATE_GLUE0(_func)			GATE_GLUE0(managementGate, ARCMSR_GATE_MANAGEMENT, _func)
+#define MANAGEMENTGATE_GLUE1(_func, c0)			GATE_GLUE1(managementGate, ARCMSR_GATE_MANAGEMENT, _func, c0)
+#define MANAGEMENTGATE_GLUE2(_func, c0, c1)		GATE_GLUE2(managementGate, ARCMSR_GATE_MANAGEMENT, _func, c0, c1)
+#define MANAGEMENTGATE_GLUE3(_func, c0, c1, c2)		GATE_GLUE3(managementGate, ARCMSR_GATE_MANAGEMENT, _func, c0, c1, c2)
+
 
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
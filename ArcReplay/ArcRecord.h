@@ -0,0 +1,104 @@
+/*
+ * Message channel recordings.
+ *
+ * ArcTerminal -R writes one of these, and ArcReplay plays them back.  A
+ * recording is a header followed by one record per chunk of bytes that
+ * crossed the channel, in the order they crossed it:
+ *
+ *	header:	"ARCR", version byte, three reserved bytes, and the
+ *		start time in microseconds since 1970 (8 bytes,
+ *		little-endian)
+ *	record:	the microseconds since the previous record (since the
+ *		start, for the first), a varint;
+ *		the length shifted left one, ORed with the direction,
+ *		a varint;
+ *		the bytes themselves
+ *
+ * Varints are 7 bits per byte, least significant first, with the top bit
+ * set on all but the last byte, so keystrokes cost three bytes of
+ * overhead.
+ */
+#ifndef ARCRECORD_H
+#define ARCRECORD_H
+
+#include <sys/time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ARCRECORD_MAGIC		"ARCR"
+#define ARCRECORD_VERSION	1
+
+#define ARCRECORD_TO_ADAPTER	0
+#define ARCRECORD_FROM_ADAPTER	1
+
+struct arc_recorder {
+	FILE		*fp;
+	uint64_t	last;			/* us, time of the previous record */
+	pthread_mutex_t	lock;			/* the reader records from its own thread */
+};
+
+static __inline__ uint64_t
+arc_record_now(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return(((uint64_t)tv.tv_sec * 1000000) + tv.tv_usec);
+}
+
+static __inline__ void
+arc_record_varint(FILE *fp, uint64_t v)
+{
+	while (v >= 0x80) {
+		putc((int)(v & 0x7f) | 0x80, fp);
+		v >>= 7;
+	}
+	putc((int)v, fp);
+}
+
+static __inline__ int
+arc_record_open(struct arc_recorder *r, const char *path)
+{
+	uint8_t	header[16];
+	int	i;
+
+	if ((r->fp = fopen(path, "wb")) == NULL)
+		return(-1);
+	r->last = arc_record_now();
+	memcpy(header, ARCRECORD_MAGIC, 4);
+	header[4] = ARCRECORD_VERSION;
+	header[5] = header[6] = header[7] = 0;
+	for (i = 0; i < 8; i++)
+		header[8 + i] = (r->last >> (i * 8)) & 0xff;
+	fwrite(header, sizeof(header), 1, r->fp);
+	pthread_mutex_init(&r->lock, NULL);
+	return(0);
+}
+
+static __inline__ void
+arc_record(struct arc_recorder *r, int direction, const void *data, int len)
+{
+	uint64_t	now;
+
+	if ((r == NULL) || (r->fp == NULL) || (len <= 0))
+		return;
+	pthread_mutex_lock(&r->lock);
+	now = arc_record_now();
+	arc_record_varint(r->fp, (now > r->last) ? (now - r->last) : 0);
+	arc_record_varint(r->fp, ((uint64_t)len << 1) | direction);
+	fwrite(data, len, 1, r->fp);
+	r->last = now;
+	pthread_mutex_unlock(&r->lock);
+}
+
+static __inline__ void
+arc_record_close(struct arc_recorder *r)
+{
+	if (r->fp != NULL)
+		fclose(r->fp);
+	r->fp = NULL;
+}
+
+#endif /* ARCRECORD_H */
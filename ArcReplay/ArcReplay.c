@@ -0,0 +1,665 @@
+/*
+ * ArcReplay
+ *
+ * Play a message channel recording (made with ArcTerminal -R) back as a
+ * benchmark, so that changes to the channel can be judged on the same
+ * traffic every time.
+ *
+ * The recording is cut into exchanges: what the host sent, and what the
+ * adapter sent back before the host said anything more.  Each exchange is
+ * replayed as fast as the channel allows; the time from starting to send
+ * to having the whole reply back is its round trip.
+ *
+ * By default the traffic goes through the driver with the channel looped
+ * back (see ArcTerminal -B), so the adapter isn't involved but the
+ * driver's queues, the user client and the shared rings or Send/Recv all
+ * are.  A loop can only return what it is given, so the host sends the
+ * adapter's side of each exchange too, and both directions carry the
+ * exchange's total.
+ *
+ * With -e the traffic goes through an emulated adapter in this process
+ * instead, which takes what the host sends and returns the recorded
+ * replies a doorbell (124 bytes) at a time, charging -T us per doorbell
+ * and -L us per exchange, with the driver's 4KB of queue each way.
+ *
+ * Either way we count wakeups: the times the host had to block for the
+ * channel and was woken again, and with -e the times the emulated adapter
+ * was.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach.h>
+#include <IOKit/IOKitLib.h>
+
+#include "../ArcMSRUserClientInterface.h"
+#include "ArcRecord.h"
+
+#define MAXTRANSIZE		1031			/* Send limit, as ArcTerminal */
+#define CHANNEL_CHUNK		124			/* bytes per doorbell */
+#define CHANNEL_QUEUE		4096			/* driver queue, each way */
+
+int		verbose;
+
+/*
+ * The recording, as exchanges.
+ */
+struct exchange {
+	char		*host;
+	int		hostLen;
+	char		*reply;
+	int		replyLen;
+};
+
+struct exchange	*exchanges;
+int		nexchanges;
+uint64_t	rec_records;
+uint64_t	rec_bytes[2];
+uint64_t	rec_duration;			/* us */
+
+struct {
+	uint64_t	bytes[2];		/* moved to and from the "adapter" */
+	uint64_t	host_wakeups;
+	uint64_t	emu_wakeups;
+	uint64_t	mismatches;		/* replies that came back wrong */
+	uint32_t	*latency;		/* us, per round trip */
+	int		trips;
+} stats;
+
+double
+now(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return(tv.tv_sec + tv.tv_usec / 1000000.0);
+}
+
+/*
+ * Load a recording
+ */
+int
+varint(const uint8_t **pp, const uint8_t *end, uint64_t *v)
+{
+	const uint8_t	*p = *pp;
+	int		shift;
+
+	*v = 0;
+	for (shift = 0; (p < end) && (shift < 64); shift += 7) {
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) {
+			*pp = p;
+			return(1);
+		}
+	}
+	return(0);
+}
+
+void
+append(char **buf, int *len, const uint8_t *data, int n)
+{
+	if ((*buf = realloc(*buf, *len + n)) == NULL)
+		errx(1, "out of memory");
+	memcpy(*buf + *len, data, n);
+	*len += n;
+}
+
+void
+load(const char *path)
+{
+	struct stat	st;
+	struct exchange	*x;
+	FILE		*fp;
+	uint8_t		*file;
+	const uint8_t	*p, *end;
+	uint64_t	delta, word;
+	int		dir, len;
+
+	if (((fp = fopen(path, "rb")) == NULL) || (fstat(fileno(fp), &st) < 0))
+		err(1, "%s", path);
+	if ((file = malloc(st.st_size)) == NULL)
+		errx(1, "%s: out of memory", path);
+	if (fread(file, 1, st.st_size, fp) != (size_t)st.st_size)
+		err(1, "%s", path);
+	fclose(fp);
+	if ((st.st_size < 16) || memcmp(file, ARCRECORD_MAGIC, 4))
+		errx(1, "%s: not a channel recording", path);
+	if (file[4] != ARCRECORD_VERSION)
+		errx(1, "%s: recording version %d, we understand %d", path, file[4], ARCRECORD_VERSION);
+
+	p = file + 16;
+	end = file + st.st_size;
+	x = NULL;
+	while (p < end) {
+		if (!varint(&p, end, &delta) || !varint(&p, end, &word))
+			errx(1, "%s: truncated record", path);
+		dir = word & 1;
+		len = word >> 1;
+		if ((len <= 0) || (len > (end - p)))
+			errx(1, "%s: bad record length", path);
+
+		// the host speaking again after a reply starts a new exchange
+		if ((x == NULL) || ((dir == ARCRECORD_TO_ADAPTER) && (x->replyLen > 0))) {
+			if ((exchanges = realloc(exchanges, (nexchanges + 1) * sizeof(*x))) == NULL)
+				errx(1, "out of memory");
+			x = &exchanges[nexchanges++];
+			bzero(x, sizeof(*x));
+		}
+		if (dir == ARCRECORD_TO_ADAPTER) {
+			append(&x->host, &x->hostLen, p, len);
+		} else {
+			append(&x->reply, &x->replyLen, p, len);
+		}
+		p += len;
+		rec_records++;
+		rec_bytes[dir] += len;
+		rec_duration += delta;
+	}
+	free(file);
+	if (nexchanges == 0)
+		errx(1, "%s: recording is empty", path);
+}
+
+/*
+ * Emulated adapter
+ *
+ * One queue each way, as the driver has, moved a doorbell at a time.
+ */
+struct queue {
+	char	data[CHANNEL_QUEUE];
+	int	head;				/* bytes ever put */
+	int	tail;				/* bytes ever taken */
+};
+
+struct queue	emu_in, emu_out;
+pthread_mutex_t	emu_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t	emu_in_data = PTHREAD_COND_INITIALIZER;	/* adapter waits */
+pthread_cond_t	emu_in_space = PTHREAD_COND_INITIALIZER;	/* host waits */
+pthread_cond_t	emu_out_data = PTHREAD_COND_INITIALIZER;	/* host waits */
+pthread_cond_t	emu_out_space = PTHREAD_COND_INITIALIZER;	/* adapter waits */
+pthread_t	emu_thread;
+int		emu_quit;
+int		emu_total;			/* exchanges to answer */
+int		emu_latency;			/* us per exchange */
+int		emu_transfer;			/* us per doorbell */
+
+int
+queue_put(struct queue *q, const char *buf, int len)
+{
+	int	n, i;
+
+	n = CHANNEL_QUEUE - (q->head - q->tail);
+	if (n > len)
+		n = len;
+	for (i = 0; i < n; i++)
+		q->data[(q->head + i) % CHANNEL_QUEUE] = buf[i];
+	q->head += n;
+	return(n);
+}
+
+int
+queue_get(struct queue *q, char *buf, int len)
+{
+	int	n, i;
+
+	n = q->head - q->tail;
+	if (n > len)
+		n = len;
+	for (i = 0; i < n; i++)
+		buf[i] = q->data[(q->tail + i) % CHANNEL_QUEUE];
+	q->tail += n;
+	return(n);
+}
+
+/* hand the host a reply, a doorbell at a time */
+void
+emu_reply(const char *buf, int len)
+{
+	int	n, put;
+
+	while (len > 0) {
+		n = (len > CHANNEL_CHUNK) ? CHANNEL_CHUNK : len;
+		if (emu_transfer > 0)
+			usleep(emu_transfer);
+		pthread_mutex_lock(&emu_lock);
+		while (((CHANNEL_QUEUE - (emu_out.head - emu_out.tail)) < n) && !emu_quit) {
+			pthread_cond_wait(&emu_out_space, &emu_lock);
+			stats.emu_wakeups++;
+		}
+		if (emu_quit) {
+			pthread_mutex_unlock(&emu_lock);
+			return;
+		}
+		put = queue_put(&emu_out, buf, n);
+		pthread_cond_signal(&emu_out_data);
+		pthread_mutex_unlock(&emu_lock);
+		buf += put;
+		len -= put;
+	}
+}
+
+void *
+emu_adapter(void *junk)
+{
+	struct exchange	*x;
+	char		buf[CHANNEL_CHUNK];
+	int		e, seen, got;
+
+	e = 0;
+	seen = 0;
+	for (;;) {
+		// answer everything we've heard enough of
+		x = &exchanges[e % nexchanges];
+		while ((e < emu_total) && (seen >= x->hostLen)) {
+			seen -= x->hostLen;
+			if (emu_latency > 0)
+				usleep(emu_latency);
+			emu_reply(x->reply, x->replyLen);
+			x = &exchanges[++e % nexchanges];
+		}
+
+		// then take the next doorbell's worth from the host
+		pthread_mutex_lock(&emu_lock);
+		while ((emu_in.head == emu_in.tail) && !emu_quit) {
+			pthread_cond_wait(&emu_in_data, &emu_lock);
+			stats.emu_wakeups++;
+		}
+		if (emu_quit) {
+			pthread_mutex_unlock(&emu_lock);
+			break;
+		}
+		got = queue_get(&emu_in, buf, sizeof(buf));
+		pthread_cond_signal(&emu_in_space);
+		pthread_mutex_unlock(&emu_lock);
+		if (emu_transfer > 0)
+			usleep(emu_transfer);
+		seen += got;
+	}
+	return(NULL);
+}
+
+void
+emu_start(void)
+{
+	if (pthread_create(&emu_thread, NULL, emu_adapter, NULL))
+		errx(1, "can't start the emulated adapter");
+}
+
+void
+emu_stop(void)
+{
+	pthread_mutex_lock(&emu_lock);
+	emu_quit = 1;
+	pthread_cond_signal(&emu_in_data);
+	pthread_cond_signal(&emu_out_space);
+	pthread_mutex_unlock(&emu_lock);
+	pthread_join(emu_thread, NULL);
+}
+
+void
+emu_exchange(struct exchange *x, char *rbuf)
+{
+	int	sent, rcvd;
+
+	sent = 0;
+	pthread_mutex_lock(&emu_lock);
+	while (sent < x->hostLen) {
+		if (emu_in.head - emu_in.tail == CHANNEL_QUEUE) {
+			pthread_cond_wait(&emu_in_space, &emu_lock);
+			stats.host_wakeups++;
+			continue;
+		}
+		sent += queue_put(&emu_in, x->host + sent, x->hostLen - sent);
+		pthread_cond_signal(&emu_in_data);
+	}
+	rcvd = 0;
+	while (rcvd < x->replyLen) {
+		if (emu_out.head == emu_out.tail) {
+			pthread_cond_wait(&emu_out_data, &emu_lock);
+			stats.host_wakeups++;
+			continue;
+		}
+		rcvd += queue_get(&emu_out, rbuf + rcvd, x->replyLen - rcvd);
+		pthread_cond_signal(&emu_out_space);
+	}
+	pthread_mutex_unlock(&emu_lock);
+	stats.bytes[ARCRECORD_TO_ADAPTER] += x->hostLen;
+	stats.bytes[ARCRECORD_FROM_ADAPTER] += x->replyLen;
+	if (memcmp(rbuf, x->reply, x->replyLen))
+		stats.mismatches++;
+}
+
+/*
+ * The driver, looped back
+ */
+io_connect_t	connectionPort;
+ArcMSRSharedRing *ring_in;
+ArcMSRSharedRing *ring_out;
+mach_port_t	notify_port = MACH_PORT_NULL;
+
+void
+drv_start(int adapter, int legacy)
+{
+	mach_port_t	masterPort, port;
+	io_service_t	serviceObject;
+	io_iterator_t	iterator;
+	CFDictionaryRef	classToMatch;
+	vm_address_t	addr_in, addr_out;
+	vm_size_t	size;
+	kern_return_t	kr;
+	int		i;
+
+	if (IOMasterPort(MACH_PORT_NULL, &masterPort) != KERN_SUCCESS)
+		errx(1, "IOMasterPort failed");
+	if ((classToMatch = IOServiceMatching("ArcMSR")) == NULL)
+		errx(1, "IOServiceMatching failed (no controller found?)");
+	if ((IOServiceGetMatchingServices(masterPort, classToMatch, &iterator)) != KERN_SUCCESS)
+		errx(1, "IOServiceGetMatchingServices failed");
+	for (i = 0; (serviceObject = IOIteratorNext(iterator)) != 0; i++) {
+		if (i == adapter)
+			break;
+		IOObjectRelease(serviceObject);
+	}
+	if (serviceObject == 0)
+		errx(1, "Controller not found");
+	if (IOServiceOpen(serviceObject, mach_task_self(), 0, &connectionPort) != KERN_SUCCESS)
+		errx(1, "IOServiceOpen failed");
+	IOObjectRelease(serviceObject);
+	if ((kr = IOConnectMethodScalarIScalarO(connectionPort, kArcMSRUserClientOpen, 0, 0)) != KERN_SUCCESS) {
+		if (kr == kIOReturnExclusiveAccess)
+			errx(1, "controller is already in use");
+		errx(1, "can't open the controller (0x%x)", kr);
+	}
+	if ((kr = IOConnectMethodScalarIScalarO(connectionPort, kArcMSRUserClientLoopback, 1, 0, 1)) != KERN_SUCCESS) {
+		IOConnectMethodScalarIScalarO(connectionPort, kArcMSRUserClientClose, 0, 0);
+		if (kr == kIOReturnBusy)
+			errx(1, "adapter is busy with a management command, try again");
+		errx(1, "can't loop the adapter back (0x%x)", kr);
+	}
+
+	// the same transports ArcTerminal uses, as available
+	if (!legacy &&
+	    (IOConnectMapMemory(connectionPort, kArcMSRSharedRingInbound, mach_task_self(),
+				&addr_in, &size, kIOMapAnywhere) == KERN_SUCCESS)) {
+		if (IOConnectMapMemory(connectionPort, kArcMSRSharedRingOutbound, mach_task_self(),
+				       &addr_out, &size, kIOMapAnywhere) == KERN_SUCCESS) {
+			ring_in = (ArcMSRSharedRing *)addr_in;
+			ring_out = (ArcMSRSharedRing *)addr_out;
+		} else {
+			IOConnectUnmapMemory(connectionPort, kArcMSRSharedRingInbound, mach_task_self(), addr_in);
+		}
+	}
+	if (mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &port) == KERN_SUCCESS) {
+		if (IOConnectSetNotificationPort(connectionPort, kArcMSRNotifyDataAvailable, port, 0) == KERN_SUCCESS) {
+			notify_port = port;
+		} else {
+			mach_port_destroy(mach_task_self(), port);
+		}
+	}
+}
+
+void
+drv_stop(void)
+{
+	IOConnectMethodScalarIScalarO(connectionPort, kArcMSRUserClientLoopback, 1, 0, 0);
+	IOConnectMethodScalarIScalarO(connectionPort, kArcMSRUserClientClose, 0, 0);
+	IOObjectRelease(connectionPort);
+}
+
+int
+drv_send(const char *buf, int len)
+{
+	ArcMSRUserCommand	cmd;
+	IOByteCount		outSize;
+
+	if (ring_in != NULL) {
+		len = ArcMSRSharedRingPut(ring_in, buf, len);
+		IOConnectMethodScalarIScalarO(connectionPort, kArcMSRUserClientKick, 0, 0);
+		return(len);
+	}
+	cmd.data_buffer = (vm_address_t)buf;
+	cmd.data_size = (len > MAXTRANSIZE) ? MAXTRANSIZE : len;
+	outSize = sizeof(cmd);
+	if (IOConnectMethodStructureIStructureO(connectionPort, kArcMSRUserClientSend,
+						sizeof(cmd), &outSize, &cmd, &cmd) != KERN_SUCCESS)
+		errx(1, "send failed");
+	return(cmd.data_size);
+}
+
+/* doesn't block; also rearms the notification */
+int
+drv_recv(char *buf, int len)
+{
+	ArcMSRUserCommand	cmd;
+	IOByteCount		outSize;
+	int			got;
+
+	if (ring_out != NULL) {
+		if ((got = ArcMSRSharedRingGet(ring_out, buf, len)) > 0)
+			IOConnectMethodScalarIScalarO(connectionPort, kArcMSRUserClientKick, 0, 0);
+		return(got);
+	}
+	cmd.data_buffer = (vm_address_t)buf;
+	cmd.data_size = len;
+	cmd.timeout = 0;
+	outSize = sizeof(cmd);
+	if (IOConnectMethodStructureIStructureO(connectionPort, kArcMSRUserClientRecv,
+						sizeof(cmd), &outSize, &cmd, &cmd) != KERN_SUCCESS)
+		errx(1, "receive failed");
+	return(cmd.data_size);
+}
+
+/* sleep until the driver has something for us */
+void
+drv_wait(void)
+{
+	struct {
+		mach_msg_header_t	header;
+		mach_msg_trailer_t	trailer;
+	} msg;
+
+	if (notify_port != MACH_PORT_NULL) {
+		mach_msg(&msg.header, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0, sizeof(msg), notify_port,
+			 100, MACH_PORT_NULL);
+	} else if (ring_out != NULL) {
+		IOConnectMethodScalarIScalarO(connectionPort, kArcMSRUserClientWait, 1, 0, 100);
+	} else {
+		usleep(1000);
+	}
+	stats.host_wakeups++;
+}
+
+void
+drv_exchange(struct exchange *x, char *sbuf, char *rbuf)
+{
+	int	len, sent, rcvd, got, put;
+
+	// the loop gives back what it gets, so send both sides
+	memcpy(sbuf, x->host, x->hostLen);
+	memcpy(sbuf + x->hostLen, x->reply, x->replyLen);
+	len = x->hostLen + x->replyLen;
+
+	sent = rcvd = 0;
+	while (rcvd < len) {
+		put = 0;
+		if (sent < len) {
+			put = drv_send(sbuf + sent, len - sent);
+			sent += put;
+		}
+		got = drv_recv(rbuf + rcvd, len - rcvd);
+		if (got < 0)
+			errx(1, "receive failed");
+		rcvd += got;
+		if ((put == 0) && (got == 0))
+			drv_wait();
+	}
+	stats.bytes[ARCRECORD_TO_ADAPTER] += len;
+	stats.bytes[ARCRECORD_FROM_ADAPTER] += len;
+	if (memcmp(rbuf, sbuf, len))
+		stats.mismatches++;
+}
+
+/*
+ * Reporting
+ */
+int
+by_value(const void *a, const void *b)
+{
+	uint32_t	x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return((x < y) ? -1 : (x > y));
+}
+
+void
+report(double elapsed, int passes)
+{
+	uint64_t	total;
+	double		mean;
+	int		i;
+
+	printf("replayed %d exchange%s x %d pass%s in %.3fs\n", nexchanges, (nexchanges == 1) ? "" : "s",
+	       passes, (passes == 1) ? "" : "es", elapsed);
+	printf("  to adapter   %12llu bytes %10.1f KB/s\n", (unsigned long long)stats.bytes[0],
+	       stats.bytes[0] / elapsed / 1024.0);
+	printf("  from adapter %12llu bytes %10.1f KB/s\n", (unsigned long long)stats.bytes[1],
+	       stats.bytes[1] / elapsed / 1024.0);
+	if (stats.trips > 0) {
+		qsort(stats.latency, stats.trips, sizeof(*stats.latency), by_value);
+		for (total = 0, i = 0; i < stats.trips; i++)
+			total += stats.latency[i];
+		mean = (double)total / stats.trips;
+		printf("  round trips  %12d  avg %.1f us  p50 %u us  p99 %u us  max %u us\n", stats.trips, mean,
+		       stats.latency[stats.trips / 2], stats.latency[(stats.trips * 99) / 100],
+		       stats.latency[stats.trips - 1]);
+	}
+	printf("  host wakeups %12llu (%.2f per exchange)\n", (unsigned long long)stats.host_wakeups,
+	       (double)stats.host_wakeups / (nexchanges * passes));
+	if (stats.emu_wakeups > 0)
+		printf("  adapter wakeups %9llu (%.2f per exchange)\n", (unsigned long long)stats.emu_wakeups,
+		       (double)stats.emu_wakeups / (nexchanges * passes));
+	if (stats.mismatches > 0)
+		printf("  %llu replies came back WRONG\n", (unsigned long long)stats.mismatches);
+}
+
+void
+usage(void)
+{
+	errx(1, "usage: ArcReplay [-e [-L us] [-T us] | -a adapter [-l]] [-n passes] [-i] file\n"
+	     "  -e          use an emulated adapter rather than the driver's loopback\n"
+	     "  -L us       emulated time per exchange (default 0)\n"
+	     "  -T us       emulated time per 124-byte doorbell (default 0)\n"
+	     "  -a adapter  adapter number (default 0)\n"
+	     "  -l          use send/recv rather than the shared rings\n"
+	     "  -n passes   replay the recording this many times (default 1)\n"
+	     "  -i          describe the recording and exit\n"
+	     "  -v          print each exchange's round trip");
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct exchange	*x;
+	char		*sbuf, *rbuf;
+	double		start, t;
+	int		ch, emulate, adapter, legacy, passes, info, pass, i, biggest;
+
+	emulate = 0;
+	adapter = 0;
+	legacy = 0;
+	passes = 1;
+	info = 0;
+	while ((ch = getopt(argc, argv, "eL:T:a:ln:iv")) != -1) {
+		switch (ch) {
+		case 'e':
+			emulate = 1;
+			break;
+		case 'L':
+			emu_latency = atoi(optarg);
+			break;
+		case 'T':
+			emu_transfer = atoi(optarg);
+			break;
+		case 'a':
+			adapter = atoi(optarg);
+			break;
+		case 'l':
+			legacy = 1;
+			break;
+		case 'n':
+			if ((passes = atoi(optarg)) <= 0)
+				usage();
+			break;
+		case 'i':
+			info = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+
+	load(argv[0]);
+	printf("%s: %llu records, %d exchanges, %llu bytes to adapter, %llu from, %.3fs recorded\n",
+	       argv[0], (unsigned long long)rec_records, nexchanges, (unsigned long long)rec_bytes[0],
+	       (unsigned long long)rec_bytes[1], rec_duration / 1000000.0);
+	if (info)
+		exit(0);
+
+	biggest = 0;
+	for (i = 0; i < nexchanges; i++)
+		if ((exchanges[i].hostLen + exchanges[i].replyLen) > biggest)
+			biggest = exchanges[i].hostLen + exchanges[i].replyLen;
+	if (((sbuf = malloc(biggest)) == NULL) || ((rbuf = malloc(biggest)) == NULL) ||
+	    ((stats.latency = malloc(nexchanges * passes * sizeof(*stats.latency))) == NULL))
+		errx(1, "out of memory");
+
+	if (emulate) {
+		printf("emulated adapter, %d us per exchange, %d us per doorbell\n", emu_latency, emu_transfer);
+		emu_total = nexchanges * passes;
+		emu_start();
+	} else {
+		drv_start(adapter, legacy);
+		printf("driver loopback, %s transport, %s\n", (ring_in != NULL) ? "ring" : "send/recv",
+		       (notify_port != MACH_PORT_NULL) ? "notifications" : "polling");
+	}
+
+	start = now();
+	for (pass = 0; pass < passes; pass++) {
+		for (i = 0; i < nexchanges; i++) {
+			x = &exchanges[i];
+			t = now();
+			if (emulate) {
+				emu_exchange(x, rbuf);
+			} else {
+				drv_exchange(x, sbuf, rbuf);
+			}
+			if (x->replyLen > 0) {
+				t = (now() - t) * 1000000.0;
+				stats.latency[stats.trips++] = (uint32_t)t;
+				if (verbose)
+					printf("%6d %6d -> %6d bytes %10.1f us\n", i, x->hostLen, x->replyLen, t);
+			}
+		}
+	}
+	t = now() - start;
+
+	if (emulate) {
+		emu_stop();
+	} else {
+		drv_stop();
+	}
+	report(t, passes);
+	return(stats.mismatches ? 1 : 0);
+}
@@ -1,30 +1,154 @@
 #include <sys/types.h>
 #include <sys/signal.h>
 #include <sys/select.h>
+#include <sys/time.h>
+#include <ctype.h>
 #include <curses.h>
 #include <err.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <setjmp.h>
+#include <stdarg.h>
 #include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <libkern/OSAtomic.h>
+#include <mach/mach.h>
 #include <machine/endian.h>
 #include <machine/byte_order.h>
 #include <ApplicationServices/ApplicationServices.h>
 
 #include "../ArcMSRUserClientInterface.h"
+#include "../ArcReplay/ArcRecord.h"
 
 #define MAXTRANSIZE		1031
+#define MAX_ADAPTERS		16
 
-io_connect_t	connectionPort;
+/* escape character for multiplexed sessions, ^] */
+#define ESCAPE			0x1d
+
+/*
+ * An adapter we found, and how to tell it from the others.
+ */
+struct adapter {
+	io_service_t	service;
+	char		location[16];		/* PCI bus:device.function */
+	char		model[16];
+	char		serial[32];
+	char		firmware[32];
+	int		selected;
+};
+
+struct adapter	adapters[MAX_ADAPTERS];
+int		nadapters;
+
+/*
+ * A connection to one adapter's message channel.
+ */
+struct session {
+	struct adapter	*adapter;
+	int		index;			/* in adapters[] */
+	io_connect_t	connectionPort;
+
+	/* shared rings, if mapped */
+	ArcMSRSharedRing *ring_in;
+	ArcMSRSharedRing *ring_out;
+
+	/* receive notification port, if registered */
+	mach_port_t	notify_port;
+
+	pthread_t	reader_thread;
+	int		reader_should_quit;
+	int		log;			/* capture file, -1 if none */
+	struct arc_recorder recorder;		/* channel recording, if any */
+	volatile double	last_output;		/* when the adapter last said anything */
+
+	/* script replay */
+	pthread_t	replay_thread;
+	int		replay_sent;
+	int		replay_stalled;		/* driver stopped taking it */
+	double		replay_time;
+};
+
+struct session	sessions[MAX_ADAPTERS];
+int		nsessions;
+
+/* the session on screen, and whether keystrokes go to all of them */
+volatile int	focus;
+int		broadcast;
 
-pthread_t reader_thread;
 int sig_exit = 0;
-int reader_should_quit = 0;
 
+/*
+ * Registry helpers
+ */
 void
-init(void)
+cfstring(CFTypeRef ref, char *buf, int len)
+{
+	if ((ref == NULL) || (CFGetTypeID(ref) != CFStringGetTypeID()) ||
+	    !CFStringGetCString((CFStringRef)ref, buf, len, kCFStringEncodingASCII))
+		buf[0] = 0;
+}
+
+void
+describe(struct adapter *a)
+{
+	io_registry_entry_t	parent;
+	CFTypeRef		ref;
+	CFDictionaryRef		dict;
+	uint32_t		reg;
+
+	strlcpy(a->location, "?", sizeof(a->location));
+	a->model[0] = a->serial[0] = a->firmware[0] = 0;
+
+	/* the adapter's configuration, as published by CTLgetConfig */
+	if ((ref = IORegistryEntryCreateCFProperty(a->service, CFSTR("Controller Characteristics"),
+						   kCFAllocatorDefault, 0)) != NULL) {
+		if (CFGetTypeID(ref) == CFDictionaryGetTypeID()) {
+			dict = (CFDictionaryRef)ref;
+			cfstring(CFDictionaryGetValue(dict, CFSTR("Product Name")), a->model, sizeof(a->model));
+			cfstring(CFDictionaryGetValue(dict, CFSTR("Product Revision Level")), a->firmware, sizeof(a->firmware));
+		}
+		CFRelease(ref);
+	}
+
+	/* the serial number only comes with the inventory */
+	if ((ref = IORegistryEntryCreateCFProperty(a->service, CFSTR("inventory"),
+						   kCFAllocatorDefault, 0)) != NULL) {
+		if ((CFGetTypeID(ref) == CFDictionaryGetTypeID()) &&
+		    ((dict = CFDictionaryGetValue((CFDictionaryRef)ref, CFSTR("system"))) != NULL) &&
+		    (CFGetTypeID(dict) == CFDictionaryGetTypeID()))
+			cfstring(CFDictionaryGetValue(dict, CFSTR("serial")), a->serial, sizeof(a->serial));
+		CFRelease(ref);
+	}
+
+	/* where it is, from the PCI nub's address */
+	if (IORegistryEntryGetParentEntry(a->service, kIOServicePlane, &parent) == KERN_SUCCESS) {
+		if ((ref = IORegistryEntryCreateCFProperty(parent, CFSTR("reg"), kCFAllocatorDefault, 0)) != NULL) {
+			if ((CFGetTypeID(ref) == CFDataGetTypeID()) && (CFDataGetLength((CFDataRef)ref) >= 4)) {
+				memcpy(&reg, CFDataGetBytePtr((CFDataRef)ref), sizeof(reg));
+				snprintf(a->location, sizeof(a->location), "%02x:%02x.%x",
+					 (reg >> 16) & 0xff, (reg >> 11) & 0x1f, (reg >> 8) & 0x7);
+			}
+			CFRelease(ref);
+		}
+		IOObjectRelease(parent);
+	}
+}
+
+int
+by_location(const void *a, const void *b)
+{
+	return(strcmp(((struct adapter *)a)->location, ((struct adapter *)b)->location));
+}
+
+/*
+ * Find all the adapters, in PCI order so their numbers stay put.
+ */
+void
+enumerate(void)
 {
-	kern_return_t	kernResult;
 	mach_port_t	masterPort;
 	io_service_t	serviceObject;
 	io_iterator_t	iterator;
@@ -41,35 +165,178 @@ init(void)
 	// Iterate over the matching instances, consumes dictionary
 	if ((IOServiceGetMatchingServices(masterPort, classToMatch, &iterator)) != KERN_SUCCESS)
 		errx(1, "IOServiceGetMatchingServices failed");
-	serviceObject = IOIteratorNext(iterator);
-	if (serviceObject == 0)
+	while ((serviceObject = IOIteratorNext(iterator)) != 0) {
+		if (nadapters >= MAX_ADAPTERS) {
+			IOObjectRelease(serviceObject);
+			continue;
+		}
+		adapters[nadapters].service = serviceObject;
+		describe(&adapters[nadapters++]);
+	}
+	IOObjectRelease(iterator);
+	if (nadapters == 0)
 		errx(1, "Controller not found");
+	qsort(adapters, nadapters, sizeof(adapters[0]), by_location);
+}
 
-        // instantiate the UserClient and release the service object
-	kernResult = IOServiceOpen(serviceObject, mach_task_self(), 0, &connectionPort);
-	IOObjectRelease(serviceObject);
+void
+list(void)
+{
+	int	i;
+
+	printf("%-3s %-10s %-10s %-20s %s\n", "#", "location", "model", "serial", "firmware");
+	for (i = 0; i < nadapters; i++)
+		printf("%-3d %-10s %-10s %-20s %s\n", i, adapters[i].location, adapters[i].model,
+		       adapters[i].serial[0] ? adapters[i].serial : "-", adapters[i].firmware);
+}
+
+/*
+ * Select adapters by number, location, serial number or model; returns
+ * how many matched.
+ */
+int
+select_adapters(const char *what)
+{
+	char	*end;
+	long	n;
+	int	i, matched;
+
+	n = strtol(what, &end, 10);
+	if ((*what != 0) && (*end == 0)) {
+		if ((n < 0) || (n >= nadapters))
+			return(0);
+		adapters[n].selected = 1;
+		return(1);
+	}
+	matched = 0;
+	for (i = 0; i < nadapters; i++) {
+		if (!strcasecmp(what, adapters[i].location) ||
+		    !strcasecmp(what, adapters[i].serial) ||
+		    !strcasecmp(what, adapters[i].model)) {
+			adapters[i].selected = 1;
+			matched++;
+		}
+	}
+	return(matched);
+}
+
+/*
+ * Open a session with an adapter.
+ */
+void
+init(struct session *s, struct adapter *a)
+{
+	kern_return_t	kernResult;
+
+        // instantiate the UserClient
+	s->adapter = a;
+	s->index = a - adapters;
+	s->ring_in = s->ring_out = NULL;
+	s->notify_port = MACH_PORT_NULL;
+	s->reader_should_quit = 0;
+	s->log = -1;
+	s->recorder.fp = NULL;
+	kernResult = IOServiceOpen(a->service, mach_task_self(), 0, &s->connectionPort);
 	if (kernResult != KERN_SUCCESS)
-		errx(1, "IOServiceOpen failed");
+		errx(1, "adapter %d (%s): IOServiceOpen failed", s->index, a->location);
 
 	// open the controller
-	kernResult = IOConnectMethodScalarIScalarO(connectionPort,
+	kernResult = IOConnectMethodScalarIScalarO(s->connectionPort,
 						   kArcMSRUserClientOpen,
 						   0,
 						   0);
 	if (kernResult != KERN_SUCCESS)
-		errx(1, "controller is already in use");
+		errx(1, "adapter %d (%s): controller is already in use", s->index, a->location);
+
+}
+
+/*
+ * Map the shared rings; if this fails we fall back to send/recv.
+ */
+void
+map_rings(struct session *s)
+{
+	vm_address_t	addr_in, addr_out;
+	vm_size_t	size;
+
+	if (IOConnectMapMemory(s->connectionPort, kArcMSRSharedRingInbound, mach_task_self(),
+			       &addr_in, &size, kIOMapAnywhere) != KERN_SUCCESS)
+		return;
+	if (IOConnectMapMemory(s->connectionPort, kArcMSRSharedRingOutbound, mach_task_self(),
+			       &addr_out, &size, kIOMapAnywhere) != KERN_SUCCESS) {
+		IOConnectUnmapMemory(s->connectionPort, kArcMSRSharedRingInbound, mach_task_self(), addr_in);
+		return;
+	}
+	s->ring_in = (ArcMSRSharedRing *)addr_in;
+	s->ring_out = (ArcMSRSharedRing *)addr_out;
+}
+
+/*
+ * Ask to be told when data arrives; if this fails we poll instead.
+ */
+void
+notify_init(struct session *s)
+{
+	mach_port_t	port;
+
+	if (mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &port) != KERN_SUCCESS)
+		return;
+
+	/* we need a send right of our own to wake the reader at exit */
+	if ((mach_port_insert_right(mach_task_self(), port, port, MACH_MSG_TYPE_MAKE_SEND) != KERN_SUCCESS) ||
+	    (IOConnectSetNotificationPort(s->connectionPort, kArcMSRNotifyDataAvailable, port, 0) != KERN_SUCCESS)) {
+		mach_port_destroy(mach_task_self(), port);
+		return;
+	}
+	s->notify_port = port;
+}
+
+int
+notify_wait(struct session *s)
+{
+	struct {
+		mach_msg_header_t	header;
+		mach_msg_trailer_t	trailer;
+	} msg;
+
+	return(mach_msg(&msg.header, MACH_RCV_MSG, 0, sizeof(msg), s->notify_port,
+			MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL));
+}
+
+void
+notify_poke(struct session *s)
+{
+	mach_msg_header_t	msg;
+
+	msg.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, 0);
+	msg.msgh_size = sizeof(msg);
+	msg.msgh_remote_port = s->notify_port;
+	msg.msgh_local_port = MACH_PORT_NULL;
+	msg.msgh_id = 1;
+	mach_msg(&msg, MACH_SEND_MSG | MACH_SEND_TIMEOUT, sizeof(msg), 0, MACH_PORT_NULL, 0, MACH_PORT_NULL);
+}
 
+void
+arc_kick(struct session *s)
+{
+	IOConnectMethodScalarIScalarO(s->connectionPort, kArcMSRUserClientKick, 0, 0);
+}
+
+void
+arc_loopback(struct session *s, int state)
+{
+	IOConnectMethodScalarIScalarO(s->connectionPort, kArcMSRUserClientLoopback, 1, 0, state);
 }
 
 void
-deinit(void)
+deinit(struct session *s)
 {
-	IOConnectMethodScalarIScalarO(connectionPort, kArcMSRUserClientClose, 0, 0);
-	IOObjectRelease(connectionPort);
+	IOConnectMethodScalarIScalarO(s->connectionPort, kArcMSRUserClientClose, 0, 0);
+	IOObjectRelease(s->connectionPort);
 }
 
 void
-arc_send(const char *outBuf, int outLen)
+arc_send_legacy(struct session *s, const char *outBuf, int outLen)
 {
 	ArcMSRUserCommand	cmd;
 	kern_return_t		kernResult;
@@ -80,23 +347,54 @@ arc_send(const char *outBuf, int outLen)
 	ptr = outBuf;
 	resid = outLen;
 
-	// build outbound data descriptor
-	cmd.data_buffer = (vm_address_t)ptr;
-	cmd.data_size = resid;
-	if (cmd.data_size > MAXTRANSIZE)
-		cmd.data_size = MAXTRANSIZE;
+	while (resid > 0) {
+		// build outbound data descriptor
+		cmd.data_buffer = (vm_address_t)ptr;
+		cmd.data_size = resid;
+		if (cmd.data_size > MAXTRANSIZE)
+			cmd.data_size = MAXTRANSIZE;
 		
+		outSize = sizeof(cmd);
+		kernResult = IOConnectMethodStructureIStructureO(s->connectionPort,
+		    kArcMSRUserClientSend,
+		    sizeof(cmd),
+		    &outSize,
+		    &cmd,
+		    &cmd);
+		if (kernResult != KERN_SUCCESS)
+			break;
+		arc_record(&s->recorder, ARCRECORD_TO_ADAPTER, ptr, cmd.data_size);
+		ptr += cmd.data_size;
+		resid -= cmd.data_size;
+	}
+}
+
+/* queues what fits, waiting up to timeout ms for room; returns bytes taken */
+int
+arc_write(struct session *s, const char *outBuf, int outLen, int timeout)
+{
+	ArcMSRUserCommand	cmd;
+	kern_return_t		kernResult;
+	IOByteCount		outSize;
+
+	cmd.data_buffer = (vm_address_t)outBuf;
+	cmd.data_size = outLen;
+	cmd.timeout = timeout;
 	outSize = sizeof(cmd);
-	kernResult = IOConnectMethodStructureIStructureO(connectionPort,
-	    kArcMSRUserClientSend,
+	kernResult = IOConnectMethodStructureIStructureO(s->connectionPort,
+	    kArcMSRUserClientWrite,
 	    sizeof(cmd),
 	    &outSize,
 	    &cmd,
 	    &cmd);
+	if (kernResult != KERN_SUCCESS)
+		return(-1);
+	arc_record(&s->recorder, ARCRECORD_TO_ADAPTER, outBuf, cmd.data_size);
+	return(cmd.data_size);
 }
 
 int
-arc_recv(char *inBuf, int inLen)
+arc_recv_legacy(struct session *s, char *inBuf, int inLen, int timeout)
 {
 	ArcMSRUserCommand	cmd;
 	kern_return_t		kernResult;
@@ -104,9 +402,9 @@ arc_recv(char *inBuf, int inLen)
 
 	cmd.data_buffer = (vm_address_t)inBuf;
 	cmd.data_size = inLen;
-	cmd.timeout = 500;		// 1/2 second
+	cmd.timeout = timeout;
 	outSize = sizeof(cmd);
-	kernResult = IOConnectMethodStructureIStructureO(connectionPort,
+	kernResult = IOConnectMethodStructureIStructureO(s->connectionPort,
 	    kArcMSRUserClientRecv,
 	    sizeof(cmd),
 	    &outSize,
@@ -114,9 +412,284 @@ arc_recv(char *inBuf, int inLen)
 	    &cmd);
 	if (kernResult != KERN_SUCCESS)
 		return(-1);
+	arc_record(&s->recorder, ARCRECORD_FROM_ADAPTER, inBuf, cmd.data_size);
 	return(cmd.data_size);
 }
 
+void
+arc_send_ring(struct session *s, const char *outBuf, int outLen)
+{
+	int	put;
+
+	while (outLen > 0) {
+		put = ArcMSRSharedRingPut(s->ring_in, outBuf, outLen);
+		arc_record(&s->recorder, ARCRECORD_TO_ADAPTER, outBuf, put);
+		arc_kick(s);
+		outBuf += put;
+		outLen -= put;
+
+		/* ring full, give the adapter a moment to drain it */
+		if (outLen > 0)
+			usleep(1000);
+	}
+}
+
+int
+arc_recv_ring(struct session *s, char *inBuf, int inLen, int timeout)
+{
+	int	got;
+
+	if ((got = ArcMSRSharedRingGet(s->ring_out, inBuf, inLen)) == 0) {
+		if (timeout > 0)
+			IOConnectMethodScalarIScalarO(s->connectionPort, kArcMSRUserClientWait, 1, 0, timeout);
+		got = ArcMSRSharedRingGet(s->ring_out, inBuf, inLen);
+	}
+
+	/* let the driver know there's room again */
+	if (got > 0) {
+		arc_record(&s->recorder, ARCRECORD_FROM_ADAPTER, inBuf, got);
+		arc_kick(s);
+	}
+	return(got);
+}
+
+void
+arc_send(struct session *s, const char *outBuf, int outLen)
+{
+	if (s->ring_in != NULL) {
+		arc_send_ring(s, outBuf, outLen);
+	} else {
+		arc_send_legacy(s, outBuf, outLen);
+	}
+}
+
+int
+arc_recv(struct session *s, char *inBuf, int inLen)
+{
+	if (s->ring_out != NULL)
+		return(arc_recv_ring(s, inBuf, inLen, 500));		// 1/2 second
+	return(arc_recv_legacy(s, inBuf, inLen, 500));
+}
+
+/* doesn't block; also rearms the receive notification */
+int
+arc_recv_now(struct session *s, char *inBuf, int inLen)
+{
+	if (s->ring_out != NULL)
+		return(arc_recv_ring(s, inBuf, inLen, 0));
+	return(arc_recv_legacy(s, inBuf, inLen, 0));
+}
+
+/* blocks until the driver has fed it all to the adapter; returns bytes sent */
+int
+arc_stream(struct session *s, const char *outBuf, int outLen)
+{
+	ArcMSRUserCommand	cmd;
+	kern_return_t		kernResult;
+	IOByteCount		outSize;
+
+	cmd.data_buffer = (vm_address_t)outBuf;
+	cmd.data_size = outLen;
+	cmd.timeout = 0;			/* driver default */
+	outSize = sizeof(cmd);
+	kernResult = IOConnectMethodStructureIStructureO(s->connectionPort,
+	    kArcMSRUserClientStream,
+	    sizeof(cmd),
+	    &outSize,
+	    &cmd,
+	    &cmd);
+	if (kernResult != KERN_SUCCESS)
+		return(-1);
+	arc_record(&s->recorder, ARCRECORD_TO_ADAPTER, outBuf, cmd.data_size);
+	return(cmd.data_size);
+}
+
+/*
+ * Message channel throughput benchmark.
+ *
+ * The channel is looped back in the driver so the adapter isn't involved
+ * and we measure the cost of the transport alone.  Each pass sends a chunk
+ * and then drains everything that came back, so neither side can stall.
+ */
+double
+now(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return(tv.tv_sec + tv.tv_usec / 1000000.0);
+}
+
+void
+bench_one(struct session *s, const char *name, int ring, int total, int chunk)
+{
+	char	sbuf[ARCMSR_SHARED_RING_SIZE], rbuf[ARCMSR_SHARED_RING_SIZE];
+	int	sent, rcvd, calls, got, len;
+	double	start, elapsed;
+
+	memset(sbuf, 'a', sizeof(sbuf));
+	sent = rcvd = calls = 0;
+	arc_loopback(s, 1);
+	start = now();
+	while (rcvd < total) {
+		if (sent < total) {
+			len = total - sent;
+			if (len > chunk)
+				len = chunk;
+			if (ring) {
+				arc_send_ring(s, sbuf, len);
+			} else {
+				arc_send_legacy(s, sbuf, len);
+			}
+			sent += len;
+			calls++;
+		}
+		for (;;) {
+			got = ring ? arc_recv_ring(s, rbuf, sizeof(rbuf), 0) : arc_recv_legacy(s, rbuf, sizeof(rbuf), 0);
+			if (got < 0)
+				errx(1, "%s: receive failed", name);
+			calls++;
+			if (got == 0)
+				break;
+			rcvd += got;
+		}
+		if ((sent >= total) && (rcvd < total))
+			errx(1, "%s: lost %d bytes", name, total - rcvd);
+	}
+	elapsed = now() - start;
+	arc_loopback(s, 0);
+
+	printf("%-8s %10d bytes %8.3fs %10.1f KB/s %8d calls %6.1f us/call\n",
+	       name, total, elapsed, total / elapsed / 1024.0, calls, elapsed * 1000000.0 / calls);
+}
+
+/*
+ * A streamed send doesn't return until it has all gone through, so it is
+ * made from a second thread while we drain the far end.
+ */
+struct stream_job {
+	struct session	*s;
+	const char	*buf;
+	int		len;
+	int		sent;
+	volatile int	done;
+};
+
+void *
+bench_stream_sender(void *arg)
+{
+	struct stream_job *job = arg;
+
+	job->sent = arc_stream(job->s, job->buf, job->len);
+	job->done = 1;
+	return(NULL);
+}
+
+void
+bench_stream(struct session *s, const char *name, int total)
+{
+	char			rbuf[ARCMSR_SHARED_RING_SIZE];
+	struct stream_job	job;
+	pthread_t		thread;
+	char			*sbuf;
+	int			rcvd, calls, got;
+	double			start, elapsed;
+
+	if ((sbuf = malloc(total)) == NULL)
+		errx(1, "%s: out of memory", name);
+	memset(sbuf, 'a', total);
+	job.s = s;
+	job.buf = sbuf;
+	job.len = total;
+	job.sent = 0;
+	job.done = 0;
+	rcvd = 0;
+	calls = 1;
+	arc_loopback(s, 1);
+	start = now();
+	if (pthread_create(&thread, NULL, bench_stream_sender, &job) != 0)
+		errx(1, "%s: can't start sender", name);
+	while (rcvd < total) {
+		if ((got = arc_recv(s, rbuf, sizeof(rbuf))) < 0)
+			errx(1, "%s: receive failed", name);
+		calls++;
+		if ((got == 0) && job.done)
+			break;
+		rcvd += got;
+	}
+	pthread_join(thread, NULL);
+	elapsed = now() - start;
+	arc_loopback(s, 0);
+	free(sbuf);
+
+	if (job.sent != total)
+		errx(1, "%s: sent only %d of %d bytes", name, job.sent, total);
+	if (rcvd < total)
+		errx(1, "%s: lost %d bytes", name, total - rcvd);
+	printf("%-8s %10d bytes %8.3fs %10.1f KB/s %8d calls %6.1f us/call\n",
+	       name, total, elapsed, total / elapsed / 1024.0, calls, elapsed * 1000000.0 / calls);
+}
+
+/*
+ * Round-trip latency for single keystrokes, sleeping in the driver versus
+ * waiting for a notification.
+ */
+void
+bench_latency(struct session *s, const char *name, int notify, int rounds)
+{
+	char	buf[ARCMSR_SHARED_RING_SIZE];
+	double	start, elapsed, total, worst;
+	int	i, got;
+
+	total = worst = 0;
+	arc_loopback(s, 1);
+	for (i = 0; i < rounds; i++) {
+		start = now();
+		arc_send(s, "x", 1);
+		do {
+			if (notify) {
+				if (notify_wait(s) != MACH_MSG_SUCCESS)
+					errx(1, "%s: notification receive failed", name);
+				got = arc_recv_now(s, buf, sizeof(buf));
+			} else {
+				got = arc_recv(s, buf, sizeof(buf));
+			}
+			if (got < 0)
+				errx(1, "%s: receive failed", name);
+		} while (got == 0);
+		elapsed = now() - start;
+		total += elapsed;
+		if (elapsed > worst)
+			worst = elapsed;
+	}
+	arc_loopback(s, 0);
+
+	printf("%-8s %6d round trips %8.1f us avg %8.1f us max\n",
+	       name, rounds, total * 1000000.0 / rounds, worst * 1000000.0);
+}
+
+void
+bench(struct session *s, int total)
+{
+	printf("message channel loopback, %d byte chunks\n", MAXTRANSIZE);
+	bench_one(s, "legacy", 0, total, MAXTRANSIZE);
+	if (s->ring_in != NULL) {
+		bench_one(s, "ring", 1, total, MAXTRANSIZE);
+		bench_one(s, "ring-16k", 1, total, ARCMSR_SHARED_RING_SIZE);
+	} else {
+		printf("ring     not available\n");
+	}
+	bench_stream(s, "stream", total);
+
+	printf("keystroke latency, %s transport\n", (s->ring_in != NULL) ? "ring" : "legacy");
+	bench_latency(s, "poll", 0, 1000);
+	if (s->notify_port != MACH_PORT_NULL) {
+		bench_latency(s, "notify", 1, 1000);
+	} else {
+		printf("notify   not available\n");
+	}
+}
+
 
 void
 sigint(int sig)
@@ -124,6 +697,24 @@ sigint(int sig)
 	sig_exit = 1;
 }
 
+void
+usage(void)
+{
+	errx(1, "usage: ArcTerminal [-l] [-a adapter ...] [-m [-o dir]] [-r file [-w ms]] [-R file] [-B bytes] | -L\n"
+	     "  -L          list the adapters and exit\n"
+	     "  -a adapter  use this adapter: number, location, serial number or model;\n"
+	     "              may be given more than once with -m\n"
+	     "  -m          talk to several adapters at once (all of them unless -a);\n"
+	     "              ^] n shows adapter n, ^] b sends keystrokes to all of them,\n"
+	     "              ^] q quits, ^] ^] sends ^]\n"
+	     "  -o dir      with -m, also log each adapter's output to dir/arcN.log\n"
+	     "  -r file     replay a file of keystrokes (- for stdin) to the adapter(s)\n"
+	     "  -w ms       with -r, send a line at a time, waiting for ms of quiet after each\n"
+	     "  -R file     record the channel traffic to file (file.N for adapter N with -m)\n"
+	     "  -l          use send/recv rather than the shared rings\n"
+	     "  -B bytes    benchmark the message channel and exit");
+}
+
 void
 screen_exit(void)
 {
@@ -134,19 +725,43 @@ screen_exit(void)
 	endwin();	
 }
 
+/*
+ * One reader per session; only the one on screen is shown, but all of
+ * them are logged.
+ */
+void
+reader_output(struct session *s, const char *buf, int len)
+{
+	s->last_output = now();
+	if (s->log >= 0)
+		write(s->log, buf, len);
+	if (s == &sessions[focus])
+		write(1, buf, len);
+}
+
 void *
-reader(void *junk)
+reader(void *arg)
 {
+	struct session *s = arg;
 	char	buf[2048];
 	int	got;
 	
-	while(!reader_should_quit) {
-		/* look for card output */
-		got = arc_recv(buf, sizeof(buf));
+	while(!s->reader_should_quit) {
+		if (s->notify_port != MACH_PORT_NULL) {
+			/* drain everything waiting, then sleep until told there's more */
+			while ((got = arc_recv_now(s, buf, sizeof(buf))) > 0)
+				reader_output(s, buf, got);
+			if ((got < 0) || s->reader_should_quit)
+				break;
+			notify_wait(s);
+		} else {
+			/* look for card output */
+			got = arc_recv(s, buf, sizeof(buf));
 
-		/* if we got something, output it */
-		if (got > 0)
-			write(1, buf, got);
+			/* if we got something, output it */
+			if (got > 0)
+				reader_output(s, buf, got);
+		}
 	}
 	return(NULL);
 }
@@ -154,21 +769,407 @@ reader(void *junk)
 void
 reader_exit(void)
 {
-	reader_should_quit = 1;
+	struct session	*s;
+	int		i;
+
+	for (i = 0; i < nsessions; i++) {
+		s = &sessions[i];
+		s->reader_should_quit = 1;
+		if (s->notify_port != MACH_PORT_NULL)
+			notify_poke(s);
+	}
+	for (i = 0; i < nsessions; i++)
+		pthread_join(sessions[i].reader_thread, NULL);
+}
+
+void
+sessions_exit(void)
+{
+	int	i;
+
+	for (i = 0; i < nsessions; i++) {
+		deinit(&sessions[i]);
+		if (sessions[i].log >= 0)
+			close(sessions[i].log);
+		arc_record_close(&sessions[i].recorder);
+	}
+}
+
+/*
+ * Multiplexed sessions
+ */
+void
+status(const char *fmt, ...)
+{
+	char	msg[128], line[256];
+	va_list	ap;
+	int	len;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	/* on the bottom line, in reverse video, leaving the cursor alone */
+	len = snprintf(line, sizeof(line), "\0337\033[%d;1H\033[7m %s \033[0m\033[K\0338", LINES, msg);
+	write(1, line, len);
+}
+
+void
+show(int which)
+{
+	struct session	*s;
+
+	focus = which;
+	s = &sessions[which];
+	write(1, "\033[H\033[2J", 7);
+	status("%d: %s %s %s%s", s->index, s->adapter->location, s->adapter->model,
+	       s->adapter->serial, broadcast ? "  [broadcast]" : "");
+
+	/* ask for a screen refresh */
+	arc_send(s, "x", 1);
+}
+
+void
+send_keys(const char *buf, int len)
+{
+	int	i;
+
+	if (!broadcast) {
+		arc_send(&sessions[focus], buf, len);
+		return;
+	}
+	for (i = 0; i < nsessions; i++)
+		arc_send(&sessions[i], buf, len);
+}
+
+/*
+ * Handle keystrokes, looking for the escape character; returns nonzero
+ * to quit.
+ */
+int
+keys(const char *buf, int len)
+{
+	static int	escaped;
+	int		i, start;
+
+	start = 0;
+	for (i = 0; i < len; i++) {
+		if (!escaped) {
+			if (buf[i] == ESCAPE) {
+				send_keys(buf + start, i - start);
+				escaped = 1;
+			}
+			continue;
+		}
+		escaped = 0;
+		start = i + 1;
+		if (buf[i] == ESCAPE) {
+			send_keys(buf + i, 1);
+		} else if (buf[i] == 'q') {
+			return(1);
+		} else if (buf[i] == 'b') {
+			broadcast = !broadcast;
+			status("keystrokes go to %s", broadcast ? "all adapters" : "this adapter only");
+		} else if (isdigit(buf[i])) {
+			if ((buf[i] - '0') < nsessions) {
+				show(buf[i] - '0');
+			} else {
+				status("no session %c", buf[i]);
+			}
+		} else {
+			status("^] n: show session n (0-%d)  b: broadcast  q: quit  ^]: send ^]", nsessions - 1);
+		}
+	}
+	if (!escaped && (start < len))
+		send_keys(buf + start, len - start);
+	return(0);
+}
+
+/*
+ * Script replay.
+ *
+ * A recorded maintenance procedure is sent without waiting on the adapter
+ * for every keystroke.  By default the whole file goes in one Stream call,
+ * which the driver feeds to the adapter as fast as it asks for more; if
+ * the driver can't do that we fall back to Write, which tells us how much
+ * it took and waits for room when the queue is full.  A script of
+ * commands that each need the previous one to finish can instead be sent
+ * a line at a time (-w), waiting after each for the adapter to go quiet.
+ * Each session gets its own sender, so a script goes to several adapters
+ * at once.
+ */
+char	*replay_buf;
+int	replay_len;
+int	replay_quiet;			/* ms of silence between lines, 0 to stream */
+
+#define REPLAY_LINE_TIMEOUT	30		/* seconds to wait for a line to finish */
+#define REPLAY_STALL_TIMEOUT	30		/* seconds to wait for the driver to take more */
+
+void
+replay_load(const char *path)
+{
+	FILE	*fp;
+	int	got, size;
 
-	pthread_join(reader_thread, NULL);
+	if (!strcmp(path, "-")) {
+		fp = stdin;
+	} else if ((fp = fopen(path, "r")) == NULL) {
+		err(1, "%s", path);
+	}
+	size = 0;
+	for (;;) {
+		if (replay_len == size) {
+			size = size ? (size * 2) : 65536;
+			if ((replay_buf = realloc(replay_buf, size)) == NULL)
+				errx(1, "%s: out of memory", path);
+		}
+		if ((got = fread(replay_buf + replay_len, 1, size - replay_len, fp)) == 0)
+			break;
+		replay_len += got;
+	}
+	if (ferror(fp))
+		err(1, "%s", path);
+	if (fp != stdin)
+		fclose(fp);
+}
+
+/*
+ * Send it all, pacing on the driver's drain feedback; returns bytes sent.
+ * Gives up if the driver takes nothing for REPLAY_STALL_TIMEOUT, and the
+ * shortfall is reported as a failed replay.
+ */
+int
+replay_write(struct session *s, const char *buf, int len)
+{
+	double	deadline;
+	int	sent, put;
+
+	sent = arc_stream(s, buf, len);
+	if (sent == len)
+		return(sent);
+	if (sent < 0)
+		sent = 0;
+	deadline = now() + REPLAY_STALL_TIMEOUT;
+	while (sent < len) {
+		if ((put = arc_write(s, buf + sent, len - sent, 500)) < 0)
+			break;
+		if (put > 0) {
+			sent += put;
+			deadline = now() + REPLAY_STALL_TIMEOUT;
+		} else if (now() >= deadline) {
+			s->replay_stalled = 1;
+			break;
+		}
+	}
+	return(sent);
+}
+
+/* send a line at a time, letting the adapter finish with each */
+int
+replay_lines(struct session *s, const char *buf, int len)
+{
+	const char	*eol;
+	double		sent_at, t;
+	int		sent, n;
+
+	sent = 0;
+	while (sent < len) {
+		if ((eol = memchr(buf + sent, '\n', len - sent)) != NULL) {
+			n = eol - (buf + sent);
+		} else {
+			n = len - sent;
+		}
+		if (n > 0)
+			arc_send(s, buf + sent, n);
+		if (eol != NULL) {
+			arc_send(s, "\r", 1);		/* the adapter wants CR for Enter */
+			n++;
+		}
+		sent += n;
+
+		/* give it time to start answering, then wait for it to stop */
+		sent_at = now();
+		do {
+			usleep(10000);
+			t = now();
+		} while ((((t - sent_at) * 1000.0) < replay_quiet ||
+			  ((t - s->last_output) * 1000.0) < replay_quiet) &&
+			 ((t - sent_at) < REPLAY_LINE_TIMEOUT));
+	}
+	return(sent);
+}
+
+void *
+replay_sender(void *arg)
+{
+	struct session	*s = arg;
+	double		start;
+
+	start = now();
+	s->replay_stalled = 0;
+	if (replay_quiet > 0) {
+		s->replay_sent = replay_lines(s, replay_buf, replay_len);
+	} else {
+		s->replay_sent = replay_write(s, replay_buf, replay_len);
+	}
+	s->replay_time = now() - start;
+	return(NULL);
+}
+
+/* replay to every session at once; leaves a report in buf */
+void
+replay(char *buf, int len)
+{
+	double	worst;
+	int	i, short_by, stalled;
+
+	for (i = 0; i < nsessions; i++)
+		if (pthread_create(&sessions[i].replay_thread, NULL, replay_sender, &sessions[i]))
+			errx(1, "failed to create replay thread");
+	worst = 0;
+	short_by = 0;
+	stalled = 0;
+	for (i = 0; i < nsessions; i++) {
+		pthread_join(sessions[i].replay_thread, NULL);
+		if (sessions[i].replay_time > worst)
+			worst = sessions[i].replay_time;
+		short_by += replay_len - sessions[i].replay_sent;
+		stalled += sessions[i].replay_stalled;
+	}
+	if (worst <= 0)
+		worst = 0.000001;
+	if (stalled > 0) {
+		snprintf(buf, len, "replay FAILED: %d bytes not delivered, %d adapter%s stopped taking input for %ds",
+			 short_by, stalled, (stalled > 1) ? "s" : "", REPLAY_STALL_TIMEOUT);
+	} else if (short_by > 0) {
+		snprintf(buf, len, "replay FAILED: %d bytes not delivered", short_by);
+	} else {
+		snprintf(buf, len, "replayed %d bytes to %d adapter%s in %.3fs, %.1f KB/s",
+			 replay_len, nsessions, (nsessions > 1) ? "s" : "", worst,
+			 replay_len / worst / 1024.0);
+	}
+}
+
+char	replay_report[128];
+
+void
+replay_exit(void)
+{
+	if (replay_report[0] != 0)
+		fprintf(stderr, "%s\n", replay_report);
 }
 
 int
 main(int argc, char *argv[])
 {
-	char	buf[8];
-	int	got, ret;
+	struct session	*s;
+	char	buf[1024], path[1024];
+	const char	*logdir, *script, *recording;
+	int	got, ret, ch, legacy, bench_bytes, multiplex, listing, selecting, i;
 	fd_set	readfd;
 
-	/* bring the card interface up */
-	init();
-	atexit(deinit);
+	legacy = 0;
+	bench_bytes = 0;
+	multiplex = 0;
+	listing = 0;
+	selecting = 0;
+	logdir = NULL;
+	script = NULL;
+	recording = NULL;
+	enumerate();
+	while ((ch = getopt(argc, argv, "lB:a:mo:Lr:w:R:")) != -1) {
+		switch (ch) {
+		case 'l':
+			legacy = 1;
+			break;
+		case 'B':
+			bench_bytes = atoi(optarg);
+			if (bench_bytes <= 0)
+				usage();
+			break;
+		case 'a':
+			if (select_adapters(optarg) == 0)
+				errx(1, "no adapter matches '%s' (try -L)", optarg);
+			selecting = 1;
+			break;
+		case 'm':
+			multiplex = 1;
+			break;
+		case 'o':
+			logdir = optarg;
+			break;
+		case 'L':
+			listing = 1;
+			break;
+		case 'r':
+			script = optarg;
+			break;
+		case 'R':
+			recording = optarg;
+			break;
+		case 'w':
+			replay_quiet = atoi(optarg);
+			if (replay_quiet <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (listing) {
+		list();
+		exit(0);
+	}
+	if ((logdir != NULL) && !multiplex)
+		usage();
+	if ((replay_quiet > 0) && (script == NULL))
+		usage();
+	if (script != NULL) {
+		replay_load(script);
+		atexit(replay_exit);
+	}
+
+	/* the first adapter, or all of them if multiplexing, unless told otherwise */
+	if (!selecting) {
+		for (i = 0; i < (multiplex ? nadapters : 1); i++)
+			adapters[i].selected = 1;
+	}
+
+	/* bring the card interfaces up */
+	atexit(sessions_exit);
+	for (i = 0; i < nadapters; i++) {
+		if (!adapters[i].selected)
+			continue;
+		if ((nsessions > 0) && !multiplex)
+			errx(1, "more than one adapter selected; use -m, or pick one (try -L)");
+		if (nsessions >= 10)
+			errx(1, "can only multiplex 10 adapters at once");
+		s = &sessions[nsessions];
+		init(s, &adapters[i]);
+		nsessions++;
+		if (!legacy)
+			map_rings(s);
+		notify_init(s);
+		if (logdir != NULL) {
+			snprintf(path, sizeof(path), "%s/arc%d.log", logdir, i);
+			if ((s->log = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+				err(1, "%s", path);
+		}
+		if (recording != NULL) {
+			if (multiplex) {
+				snprintf(path, sizeof(path), "%s.%d", recording, i);
+			} else {
+				strlcpy(path, recording, sizeof(path));
+			}
+			if (arc_record_open(&s->recorder, path) < 0)
+				err(1, "%s", path);
+		}
+	}
+
+	if (bench_bytes > 0) {
+		bench(&sessions[0], bench_bytes);
+		exit(0);
+	}
 
 	/* minimal screen setup */
 	initscr();
@@ -178,14 +1179,25 @@ main(int argc, char *argv[])
 	refresh();
 	atexit(screen_exit);
 
-	/* start the reader thread */
-	if (pthread_create(&reader_thread, NULL, reader, NULL))
-		errx(1, "failed to create reader thread");
+	/* start a reader thread for each adapter */
+	for (i = 0; i < nsessions; i++) {
+		if (pthread_create(&sessions[i].reader_thread, NULL, reader, &sessions[i]))
+			errx(1, "failed to create reader thread");
+	}
 	atexit(reader_exit);
 
-	/* send a screen refresh command */
+	/* send a screen refresh command to each */
 	buf[0] = 'x';
-	arc_send(buf, 1);
+	for (i = 0; i < nsessions; i++)
+		arc_send(&sessions[i], buf, 1);
+	if (multiplex)
+		show(0);
+
+	/* play the script, then carry on interactively */
+	if (script != NULL) {
+		replay(replay_report, sizeof(replay_report));
+		status("%s", replay_report);
+	}
 	
 	signal(SIGINT, sigint);
 
@@ -203,7 +1215,11 @@ main(int argc, char *argv[])
 					err(1, "read error");
 				if (got == 0)
 					exit(0);
-				arc_send(buf, got);
+				if (!multiplex) {
+					arc_send(&sessions[0], buf, got);
+				} else if (keys(buf, got)) {
+					break;
+				}
 			} else {
 				errx(1, "bogus select response");
 			}
@@ -0,0 +1,203 @@
+/*
+ * arcattach
+ *
+ * Measure what it costs to attach an ArcMSR adapter's volumes: how long
+ * it takes from when we start watching until the wanted number of logical
+ * units are attached, and how much kernel memory the target and logical
+ * unit objects took on the way.
+ *
+ *	arcattach [-n units] [-t seconds]
+ *
+ * Start it, then create the volumes (or attach the adapter with the
+ * volumes already on it); it waits until -n units (default 128) are
+ * attached under the first adapter, or -t seconds (default 600) pass,
+ * and reports the elapsed time, the driver's own scan time, the number of
+ * target and logical unit objects, and the growth in the kernel's IOKit
+ * allocations, overall and per unit.  Run it the other way round (-n 0)
+ * to time deleting them.
+ *
+ * The memory figures are the registry's IOKitDiagnostics counters, which
+ * cover the whole of IOKit, so run it on an otherwise idle machine.
+ */
+#include <sys/types.h>
+#include <sys/time.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach.h>
+#include <IOKit/IOKitLib.h>
+
+#define POLL_US		100000
+
+struct sample {
+	double		when;			// seconds
+	long long	memory;			// bytes, IOKit allocations
+	long long	scanTime;		// us, driver's last rescan
+	int		targets;		// target objects
+	int		units;			// logical unit objects
+};
+
+mach_port_t	masterPort;
+io_service_t	adapter;
+
+/* IOKitDiagnostics allocation counters that grow with objects */
+static const char *allocations[] = {
+	"Instance allocation",
+	"Container allocation",
+	"IOMalloc allocation",
+	NULL
+};
+
+double
+now(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return(tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+long long
+cfnumber(CFDictionaryRef dict, const char *key)
+{
+	CFStringRef	name;
+	CFTypeRef	ref;
+	long long	n;
+
+	n = 0;
+	if (dict == NULL)
+		return(0);
+	if ((name = CFStringCreateWithCString(kCFAllocatorDefault, key, kCFStringEncodingASCII)) == NULL)
+		return(0);
+	ref = CFDictionaryGetValue(dict, name);
+	CFRelease(name);
+	if ((ref != NULL) && (CFGetTypeID(ref) == CFNumberGetTypeID()))
+		CFNumberGetValue((CFNumberRef)ref, kCFNumberLongLongType, &n);
+	return(n);
+}
+
+void
+init(void)
+{
+	CFDictionaryRef	classToMatch;
+
+	if (IOMasterPort(MACH_PORT_NULL, &masterPort) != KERN_SUCCESS)
+		errx(1, "IOMasterPort failed");
+	if ((classToMatch = IOServiceMatching("ArcMSR")) == NULL)
+		errx(1, "IOServiceMatching failed");
+	if ((adapter = IOServiceGetMatchingService(masterPort, classToMatch)) == 0)
+		errx(1, "no controller found");
+}
+
+void
+sample(struct sample *s)
+{
+	io_registry_entry_t	root;
+	io_iterator_t		iterator;
+	io_object_t		object;
+	CFTypeRef		ref;
+	int			i;
+
+	s->when = now();
+
+	// kernel memory
+	s->memory = 0;
+	root = IORegistryGetRootEntry(masterPort);
+	ref = IORegistryEntryCreateCFProperty(root, CFSTR("IOKitDiagnostics"), kCFAllocatorDefault, 0);
+	if ((ref == NULL) || (CFGetTypeID(ref) != CFDictionaryGetTypeID()))
+		errx(1, "kernel publishes no IOKitDiagnostics");
+	for (i = 0; allocations[i] != NULL; i++)
+		s->memory += cfnumber((CFDictionaryRef)ref, allocations[i]);
+	CFRelease(ref);
+	IOObjectRelease(root);
+
+	// the driver's view
+	s->scanTime = 0;
+	ref = IORegistryEntryCreateCFProperty(adapter, CFSTR("scan-statistics"), kCFAllocatorDefault, 0);
+	if (ref != NULL) {
+		if (CFGetTypeID(ref) == CFDictionaryGetTypeID())
+			s->scanTime = cfnumber((CFDictionaryRef)ref, "rescan-us");
+		CFRelease(ref);
+	}
+
+	// what actually got attached
+	s->targets = s->units = 0;
+	if (IORegistryEntryCreateIterator(adapter, kIOServicePlane, kIORegistryIterateRecursively, &iterator) != KERN_SUCCESS)
+		errx(1, "can't walk the adapter's devices");
+	while ((object = IOIteratorNext(iterator)) != 0) {
+		if (IOObjectConformsTo(object, "IOSCSITargetDevice"))
+			s->targets++;
+		else if (IOObjectConformsTo(object, "IOSCSILogicalUnitNub"))
+			s->units++;
+		IOObjectRelease(object);
+	}
+	IOObjectRelease(iterator);
+}
+
+void
+report(const char *what, struct sample *s, struct sample *base)
+{
+	long long	grown;
+	int		units;
+
+	grown = s->memory - base->memory;
+	units = s->units - base->units;
+	printf("%-8s %8.3f s  %3d targets  %3d units  scan %lld us  memory %+lld bytes",
+	    what, s->when - base->when, s->targets, s->units, s->scanTime, grown);
+	if (units != 0)
+		printf(" (%+lld per unit)", grown / units);
+	printf("\n");
+}
+
+void
+usage(void)
+{
+	fprintf(stderr, "usage: arcattach [-n units] [-t seconds]\n");
+	exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sample	base, s;
+	double		deadline;
+	int		want, limit, ch;
+
+	want = 128;
+	limit = 600;
+	while ((ch = getopt(argc, argv, "n:t:")) != -1) {
+		switch (ch) {
+		case 'n':
+			want = atoi(optarg);
+			break;
+		case 't':
+			limit = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if ((want < 0) || (limit <= 0))
+		usage();
+
+	init();
+	sample(&base);
+	report("start", &base, &base);
+
+	deadline = base.when + limit;
+	for (;;) {
+		usleep(POLL_US);
+		sample(&s);
+		if ((want > 0) ? (s.units >= want) : (s.units == 0))
+			break;
+		if (s.when >= deadline) {
+			report("timeout", &s, &base);
+			exit(1);
+		}
+	}
+	report("done", &s, &base);
+	IOObjectRelease(adapter);
+	exit(0);
+}
@@ -0,0 +1,954 @@
+/*
+ * arcctl
+ *
+ * Non-interactive adapter management.  Each command turns into zero or
+ * more GUI protocol commands (see ArcMSRManagement.h), sent through the
+ * driver's management broker.  While ArcTerminal or anything else holds
+ * the terminal channel the driver holds management commands back, and
+ * fails them if the channel isn't given back within a few seconds; those
+ * commands are reported as failed because the channel was in use.
+ *
+ * Commands come from the command line, separated by ';', or from a file
+ * (-f, one per line, '#' for comments).  All the adapter commands for the
+ * whole batch are planned first and then issued by a small pool of
+ * threads, so the driver always has the next one queued behind the one
+ * in flight; results are printed in order once everything has answered.
+ * Only reads are overlapped: a command that changes something (or might,
+ * like raw) is sent on its own once everything before it has answered,
+ * and nothing after it is sent until it has.
+ *
+ * "info" is answered from the driver's inventory, which costs the
+ * adapter nothing, unless -L asks for it live.
+ *
+ *	info system|raid|volume|drive
+ *	events				raw event log, newest first
+ *	monitor				fans, voltages and temperatures
+ *	rebuild-priority 0-3
+ *	mute				silence the beeper
+ *	raw opcode [byte ...]		any command, hex reply
+ */
+#include <sys/types.h>
+#include <sys/time.h>
+#include <ctype.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach.h>
+#include <IOKit/IOKitLib.h>
+
+#include "../ArcMSRUserClientInterface.h"
+#include "../ArcMSRManagement.h"
+
+/* the driver lets each client have this many commands waiting */
+#define PIPELINE_DEPTH		4
+
+#define MAX_OPS			1024
+#define MAX_COMMANDS		256
+#define MAX_ARGS		16
+#define BUSY_RETRIES		5000	/* tries at a full queue, 1ms apart */
+
+io_connect_t	connectionPort;
+int		json;
+int		live;
+const char	*password;
+
+/*
+ * One adapter command.
+ */
+struct op {
+	uint8_t		opcode;
+	uint8_t		args[MAX_ARGS + 1];
+	int		argLen;
+	uint8_t		reply[GUI_MAX_LENGTH];
+	int		replyLen;
+	int		result;			/* IOReturn */
+	int		serial;			/* not overlapped with others */
+};
+
+struct op	ops[MAX_OPS];
+int		nops;
+
+/*
+ * One arcctl command, and the adapter commands it planned.
+ */
+struct command;
+struct verb {
+	const char	*name;
+	int		(*plan)(struct command *);
+	void		(*print)(struct command *);
+	int		writes;			/* changes adapter state */
+};
+
+struct command {
+	char		*text;
+	int		argc;
+	char		*argv[MAX_ARGS + 2];
+	struct verb	*verb;
+	int		first;			/* ops[first .. first + count - 1] */
+	int		count;
+	int		failed;
+};
+
+struct command	commands[MAX_COMMANDS];
+int		ncommands;
+
+ArcMSRInventory	inventory;
+int		have_inventory;
+
+/*
+ * Driver access
+ */
+void
+init(void)
+{
+	mach_port_t	masterPort;
+	io_service_t	serviceObject;
+	io_iterator_t	iterator;
+	CFDictionaryRef	classToMatch;
+
+	if (IOMasterPort(MACH_PORT_NULL, &masterPort) != KERN_SUCCESS)
+		errx(1, "IOMasterPort failed");
+	if ((classToMatch = IOServiceMatching("ArcMSR")) == NULL)
+		errx(1, "IOServiceMatching failed (no controller found?)");
+	if ((IOServiceGetMatchingServices(masterPort, classToMatch, &iterator)) != KERN_SUCCESS)
+		errx(1, "IOServiceGetMatchingServices failed");
+	if ((serviceObject = IOIteratorNext(iterator)) == 0)
+		errx(1, "Controller not found");
+	if (IOServiceOpen(serviceObject, mach_task_self(), 0, &connectionPort) != KERN_SUCCESS)
+		errx(1, "IOServiceOpen failed");
+	IOObjectRelease(serviceObject);
+}
+
+void
+transact(struct op *op)
+{
+	ArcMSRManagementTransaction	t;
+	IOByteCount			outSize;
+	kern_return_t			kr;
+	int				waited;
+
+	for (waited = 0; ; waited++) {
+		t.opcode = op->opcode;
+		t.arg_buffer = (vm_address_t)op->args;
+		t.arg_size = op->argLen;
+		t.reply_buffer = (vm_address_t)op->reply;
+		t.reply_size = sizeof(op->reply);
+		t.result = 0;
+		outSize = sizeof(t);
+		kr = IOConnectMethodStructureIStructureO(connectionPort, kArcMSRUserClientTransact,
+							 sizeof(t), &outSize, &t, &t);
+		if (kr != KERN_SUCCESS) {
+			op->result = kr;
+			op->replyLen = 0;
+			return;
+		}
+		/* someone else's batch filled our queue; it won't be for long */
+		if ((t.result != (int)kIOReturnBusy) || (waited >= BUSY_RETRIES))
+			break;
+		usleep(1000);
+	}
+	op->result = t.result;
+	op->replyLen = (t.result == kIOReturnSuccess) ? t.reply_size : 0;
+}
+
+int
+get_inventory(void)
+{
+	ArcMSRUserCommand	cmd;
+	IOByteCount		outSize;
+
+	if (have_inventory)
+		return(1);
+	cmd.data_buffer = (vm_address_t)&inventory;
+	cmd.data_size = sizeof(inventory);
+	cmd.timeout = 0;
+	outSize = sizeof(cmd);
+	if ((IOConnectMethodStructureIStructureO(connectionPort, kArcMSRUserClientInventory,
+						 sizeof(cmd), &outSize, &cmd, &cmd) != KERN_SUCCESS) ||
+	    (inventory.version != ARCMSR_INVENTORY_VERSION) || (inventory.generation == 0))
+		return(0);
+	have_inventory = 1;
+	return(1);
+}
+
+/*
+ * The pipeline: each thread takes the next unsent command until there
+ * are none left in the run of reads it was given.  Serial commands end a
+ * run and are sent by themselves between runs.
+ */
+volatile int	next_op;
+int		last_op;
+pthread_mutex_t	next_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *
+pipeline_worker(void *junk)
+{
+	int	i;
+
+	for (;;) {
+		pthread_mutex_lock(&next_lock);
+		i = next_op++;
+		pthread_mutex_unlock(&next_lock);
+		if (i >= last_op)
+			break;
+		transact(&ops[i]);
+	}
+	return(NULL);
+}
+
+void
+pipeline_run(int from, int to, int depth)
+{
+	pthread_t	threads[PIPELINE_DEPTH];
+	int		i;
+
+	next_op = from;
+	last_op = to;
+	if (depth > to - from)
+		depth = to - from;
+	for (i = 0; i < depth; i++)
+		if (pthread_create(&threads[i], NULL, pipeline_worker, NULL) != 0)
+			errx(1, "can't start pipeline");
+	for (i = 0; i < depth; i++)
+		pthread_join(threads[i], NULL);
+}
+
+void
+pipeline(int from, int depth)
+{
+	int	to;
+
+	while (from < nops) {
+		for (to = from; (to < nops) && !ops[to].serial; to++)
+			;
+		pipeline_run(from, to, depth);
+		if (to < nops)
+			transact(&ops[to++]);
+		from = to;
+	}
+}
+
+struct op *
+add_op(uint8_t opcode, const uint8_t *args, int argLen)
+{
+	struct op	*op;
+
+	if (nops >= MAX_OPS)
+		errx(1, "too many adapter commands in one batch");
+	op = &ops[nops++];
+	op->opcode = opcode;
+	op->argLen = argLen;
+	op->serial = 0;
+	if (argLen > 0)
+		memcpy(op->args, args, argLen);
+	return(op);
+}
+
+/*
+ * Output helpers
+ */
+void
+trim(char *dst, const uint8_t *src, int len)
+{
+	int	i;
+
+	for (i = 0; (i < len) && (src[i] != 0); i++)
+		dst[i] = isprint(src[i]) ? src[i] : '?';
+	while ((i > 0) && (dst[i - 1] == ' '))
+		i--;
+	dst[i] = 0;
+}
+
+void
+json_string(const char *s)
+{
+	putchar('"');
+	for (; *s != 0; s++) {
+		if ((*s == '"') || (*s == '\\')) {
+			printf("\\%c", *s);
+		} else if ((unsigned char)*s < 32) {
+			printf("\\u%04x", *s);
+		} else {
+			putchar(*s);
+		}
+	}
+	putchar('"');
+}
+
+/* a field: "name": value in JSON, "name value" in text */
+int	fields;
+
+void
+field_start(void)
+{
+	fields = 0;
+	if (json)
+		printf("{");
+}
+
+void
+field_end(void)
+{
+	printf(json ? "}" : "\n");
+}
+
+void
+field_str(const char *name, const uint8_t *raw, int len)
+{
+	char	buf[64];
+
+	trim(buf, raw, (len < (int)sizeof(buf)) ? len : (int)sizeof(buf) - 1);
+	if (json) {
+		printf("%s\"%s\": ", fields++ ? ", " : "", name);
+		json_string(buf);
+	} else {
+		printf("%s%s %s", fields++ ? "  " : "", name, buf);
+	}
+}
+
+void
+field_num(const char *name, unsigned long long value)
+{
+	if (json) {
+		printf("%s\"%s\": %llu", fields++ ? ", " : "", name, value);
+	} else {
+		printf("%s%s %llu", fields++ ? "  " : "", name, value);
+	}
+}
+
+void
+field_hex(const char *name, const uint8_t *data, int len)
+{
+	int	i;
+
+	if (json) {
+		printf("%s\"%s\": \"", fields++ ? ", " : "", name);
+	} else {
+		printf("%s%s ", fields++ ? "  " : "", name);
+	}
+	for (i = 0; i < len; i++)
+		printf("%02x", data[i]);
+	if (json)
+		putchar('"');
+}
+
+/* a list of records; JSON array, or one line each */
+int	records;
+
+void
+list_start(void)
+{
+	records = 0;
+	if (json)
+		printf("[");
+}
+
+void
+list_item(void)
+{
+	if (json && (records > 0))
+		printf(", ");
+	records++;
+}
+
+void
+list_end(void)
+{
+	if (json)
+		printf("]");
+}
+
+/* a reply of exactly size bytes is a record */
+uint8_t *
+op_record(struct op *op, int size)
+{
+	if ((op->result != kIOReturnSuccess) || (op->replyLen != size))
+		return(NULL);
+	return(op->reply);
+}
+
+unsigned long long
+capacity(uint32_t lo, uint32_t hi)
+{
+	return(OSSwapLittleToHostInt32(lo) | ((unsigned long long)OSSwapLittleToHostInt32(hi) << 32));
+}
+
+/*
+ * info system|raid|volume|drive
+ */
+enum { INFO_SYSTEM, INFO_RAID, INFO_VOLUME, INFO_DRIVE };
+
+int
+info_kind(struct command *c)
+{
+	static const char *kinds[] = {"system", "raid", "volume", "drive", NULL};
+	int	i;
+
+	for (i = 0; (c->argc == 2) && (kinds[i] != NULL); i++)
+		if (!strcmp(c->argv[1], kinds[i]))
+			return(i);
+	return(-1);
+}
+
+/* how many of each record the adapter has room for */
+int
+info_limit(int kind, sSYSTEM_INFO *sys)
+{
+	switch (kind) {
+	case INFO_RAID:
+		return((sys->gsiMaxRaidSet < ARCMSR_INVENTORY_RAIDSETS) ? sys->gsiMaxRaidSet : ARCMSR_INVENTORY_RAIDSETS);
+	case INFO_VOLUME:
+		return((sys->gsiMaxVolumeSet < ARCMSR_INVENTORY_VOLUMES) ? sys->gsiMaxVolumeSet : ARCMSR_INVENTORY_VOLUMES);
+	case INFO_DRIVE:
+		return((sys->gsiIdeChannels < ARCMSR_INVENTORY_DRIVES) ? sys->gsiIdeChannels : ARCMSR_INVENTORY_DRIVES);
+	}
+	return(1);
+}
+
+sSYSTEM_INFO	live_system;
+int		have_live_system;
+
+int
+info_plan(struct command *c)
+{
+	static const uint8_t opcodes[] = {GUI_GET_INFO_S, GUI_GET_INFO_R, GUI_GET_INFO_V, GUI_GET_INFO_P};
+	struct op	*op;
+	uint8_t		n;
+	int		kind, i;
+
+	if ((kind = info_kind(c)) < 0)
+		return(-1);
+	if (!live) {
+		if (!get_inventory())
+			errx(1, "driver has no inventory yet; use -L");
+		return(0);
+	}
+	if (kind == INFO_SYSTEM) {
+		add_op(GUI_GET_INFO_S, NULL, 0);
+		return(0);
+	}
+
+	/* we need the system information to know how many to ask for */
+	if (!have_live_system) {
+		op = add_op(GUI_GET_INFO_S, NULL, 0);
+		transact(op);
+		nops--;
+		if (op_record(op, sizeof(live_system)) == NULL)
+			errx(1, "adapter did not return system information");
+		memcpy(&live_system, op->reply, sizeof(live_system));
+		have_live_system = 1;
+	}
+	for (i = 0; i < info_limit(kind, &live_system); i++) {
+		n = i;
+		add_op(opcodes[kind], &n, 1);
+	}
+	return(0);
+}
+
+/* the i'th record of a kind, live or from the inventory */
+uint8_t *
+info_record(struct command *c, int kind, int i)
+{
+	switch (kind) {
+	case INFO_SYSTEM:
+		return(live ? op_record(&ops[c->first], sizeof(sSYSTEM_INFO)) : inventory.system);
+	case INFO_RAID:
+		if (live)
+			return(op_record(&ops[c->first + i], sizeof(sGUI_RAIDSET)));
+		return((inventory.raidSetMask & (1 << i)) ? inventory.raidSet[i] : NULL);
+	case INFO_VOLUME:
+		if (live)
+			return(op_record(&ops[c->first + i], sizeof(sGUI_VOLUMESET)));
+		return((inventory.volumeMask & (1 << i)) ? inventory.volume[i] : NULL);
+	case INFO_DRIVE:
+		if (live)
+			return(op_record(&ops[c->first + i], sizeof(sGUI_PHY_DRV)));
+		return((inventory.driveMask & (1 << i)) ? inventory.drive[i] : NULL);
+	}
+	return(NULL);
+}
+
+void
+info_print(struct command *c)
+{
+	sSYSTEM_INFO	*sys;
+	sGUI_RAIDSET	*rs;
+	sGUI_VOLUMESET	*vs;
+	sGUI_PHY_DRV	*pd;
+	int		kind, i, count;
+
+	kind = info_kind(c);
+	if (kind == INFO_SYSTEM) {
+		if ((sys = (sSYSTEM_INFO *)info_record(c, kind, 0)) == NULL) {
+			c->failed = 1;
+			return;
+		}
+		field_start();
+		field_str("vendor", sys->gsiVendorName, sizeof(sys->gsiVendorName));
+		field_str("model", sys->gsiModelName, sizeof(sys->gsiModelName));
+		field_str("serial", sys->gsiSerialNumber, sizeof(sys->gsiSerialNumber));
+		field_str("firmware", sys->gsiFirmVersion, sizeof(sys->gsiFirmVersion));
+		field_str("boot-rom", sys->gsiBootVersion, sizeof(sys->gsiBootVersion));
+		field_num("memory-mb", OSSwapLittleToHostInt32(sys->gsiMemorySize));
+		field_num("drive-channels", sys->gsiIdeChannels);
+		field_num("rebuild-priority", sys->gsiRebuildPriority);
+		field_end();
+		return;
+	}
+
+	count = live ? c->count : info_limit(kind, (sSYSTEM_INFO *)inventory.system);
+	list_start();
+	for (i = 0; i < count; i++) {
+		switch (kind) {
+		case INFO_RAID:
+			if ((rs = (sGUI_RAIDSET *)info_record(c, kind, i)) == NULL)
+				continue;
+			list_item();
+			field_start();
+			field_num("raid-set", i);
+			field_str("name", rs->grsRaidSetName, sizeof(rs->grsRaidSetName));
+			field_num("blocks", capacity(rs->grsCapacity, rs->grsCapacityX));
+			field_num("state", rs->grsRaidState);
+			field_num("members", rs->grsMemberDevices);
+			field_num("volumes", rs->grsVolumes);
+			field_end();
+			break;
+		case INFO_VOLUME:
+			if ((vs = (sGUI_VOLUMESET *)info_record(c, kind, i)) == NULL)
+				continue;
+			list_item();
+			field_start();
+			field_num("volume", i);
+			field_str("name", vs->gvsVolumeName, sizeof(vs->gvsVolumeName));
+			field_num("blocks", capacity(vs->gvsCapacity, vs->gvsCapacityX));
+			field_num("raid-level", vs->gvsRaidLevel);
+			field_num("raid-set", vs->gvsRaidSetNumber);
+			field_num("status", OSSwapLittleToHostInt32(vs->gvsVolumeStatus));
+			field_num("progress", OSSwapLittleToHostInt32(vs->gvsProgress));
+			field_num("scsi-id", vs->gvsScsi.ScsiId);
+			field_num("scsi-lun", vs->gvsScsi.ScsiLun);
+			field_end();
+			break;
+		case INFO_DRIVE:
+			if ((pd = (sGUI_PHY_DRV *)info_record(c, kind, i)) == NULL)
+				continue;
+			list_item();
+			field_start();
+			field_num("drive", i);
+			field_str("model", pd->gpdModelName, sizeof(pd->gpdModelName));
+			field_str("serial", pd->gpdSerialNumber, sizeof(pd->gpdSerialNumber));
+			field_str("firmware", pd->gpdFirmRev, sizeof(pd->gpdFirmRev));
+			field_num("blocks", capacity(pd->gpdCapacity, pd->gpdCapacityX));
+			field_num("state", pd->gpdDeviceState);
+			field_num("raid-set", pd->gpdRaidNumber);
+			field_end();
+			break;
+		}
+	}
+	list_end();
+	if (json)
+		return;
+	if (records == 0)
+		printf("none\n");
+}
+
+/*
+ * events: the whole log, raw; the record layout is the firmware's own
+ */
+int
+events_plan(struct command *c)
+{
+	uint8_t	page;
+
+	if (c->argc != 1)
+		return(-1);
+	for (page = 0; page < 4; page++)
+		add_op(GUI_GET_EVENT, &page, 1);
+	return(0);
+}
+
+void
+events_print(struct command *c)
+{
+	static const uint8_t empty[ARCMSR_EVENT_RECORD_SIZE];
+	struct op	*op;
+	int		i, off, n;
+
+	for (i = 0; i < c->count; i++) {
+		op = &ops[c->first + i];
+		if ((op->result != kIOReturnSuccess) || (op->replyLen < ARCMSR_EVENT_RECORD_SIZE)) {
+			c->failed = 1;
+			return;
+		}
+	}
+	n = 0;
+	list_start();
+	for (i = 0; i < c->count; i++) {
+		op = &ops[c->first + i];
+		for (off = 0; (off + ARCMSR_EVENT_RECORD_SIZE) <= op->replyLen; off += ARCMSR_EVENT_RECORD_SIZE) {
+			if (!memcmp(op->reply + off, empty, ARCMSR_EVENT_RECORD_SIZE))
+				goto done;
+			list_item();
+			field_start();
+			field_num("event", n++);
+			field_hex("record", op->reply + off, ARCMSR_EVENT_RECORD_SIZE);
+			field_end();
+		}
+	}
+done:
+	list_end();
+}
+
+/*
+ * monitor: the same decoding as the driver's sampler
+ */
+int
+monitor_plan(struct command *c)
+{
+	if (c->argc != 1)
+		return(-1);
+	add_op(GUI_GET_HW_MONITOR, NULL, 0);
+	return(0);
+}
+
+void
+monitor_list(const char *name, const uint8_t *p, int count, int size, int offset)
+{
+	int	i;
+
+	if (json) {
+		printf("%s\"%s\": [", fields++ ? ", " : "", name);
+	} else {
+		printf("%s%s", fields++ ? "  " : "", name);
+	}
+	for (i = 0; i < count; i++, p += size) {
+		if (size == 1) {
+			printf(json ? "%s%d" : "%s%d", (json && i) ? ", " : " ", p[0]);
+		} else {
+			printf("%s%d", (json && i) ? ", " : " ", p[offset] | (p[offset + 1] << 8));
+		}
+	}
+	if (json)
+		printf("]");
+}
+
+void
+monitor_print(struct command *c)
+{
+	struct op	*op;
+	const uint8_t	*p;
+	int		fans, voltages, temps;
+
+	op = &ops[c->first];
+	if ((op->result != kIOReturnSuccess) || (op->replyLen < 4)) {
+		c->failed = 1;
+		return;
+	}
+	fans = op->reply[0];
+	voltages = op->reply[1];
+	temps = op->reply[2];
+	if (op->replyLen < (4 + (fans * 2) + (voltages * 4) + temps + 2)) {
+		c->failed = 1;
+		return;
+	}
+	p = op->reply + 4;
+	field_start();
+	monitor_list("fans-rpm", p, fans, 2, 0);
+	p += fans * 2;
+	monitor_list("voltages-mv", p, voltages, 4, 2);
+	monitor_list("nominal-mv", p, voltages, 4, 0);
+	p += voltages * 4;
+	monitor_list("temperatures-c", p, temps, 1, 0);
+	p += temps;
+	field_num("power", p[0]);
+	field_num("ups", p[1]);
+	field_end();
+}
+
+/*
+ * Commands answered with a status byte
+ */
+void
+status_print(struct command *c)
+{
+	struct op	*op;
+
+	op = &ops[c->first];
+	if ((op->result != kIOReturnSuccess) || (op->replyLen != 1) || (op->reply[0] != GUI_OK)) {
+		c->failed = 1;
+		return;
+	}
+	printf(json ? "\"ok\"" : "ok\n");
+}
+
+int
+priority_plan(struct command *c)
+{
+	uint8_t	priority;
+
+	if ((c->argc != 2) || !isdigit(c->argv[1][0]) || ((priority = atoi(c->argv[1])) > 3))
+		return(-1);
+	add_op(GUI_REBUILD_PRIORITY, &priority, 1);
+	return(0);
+}
+
+int
+mute_plan(struct command *c)
+{
+	if (c->argc != 1)
+		return(-1);
+	add_op(GUI_MUTE_BEEPER, NULL, 0);
+	return(0);
+}
+
+/*
+ * raw opcode [byte ...]
+ */
+int
+raw_plan(struct command *c)
+{
+	uint8_t	args[MAX_ARGS];
+	char	*end;
+	long	v;
+	int	i;
+
+	if ((c->argc < 2) || (c->argc - 2 > MAX_ARGS))
+		return(-1);
+	for (i = 2; i < c->argc; i++) {
+		v = strtol(c->argv[i], &end, 16);
+		if ((*end != 0) || (v < 0) || (v > 0xff))
+			return(-1);
+		args[i - 2] = v;
+	}
+	v = strtol(c->argv[1], &end, 16);
+	if ((*end != 0) || (v < 0) || (v > 0xff))
+		return(-1);
+	add_op(v, args, c->argc - 2);
+	return(0);
+}
+
+void
+raw_print(struct command *c)
+{
+	struct op	*op;
+
+	op = &ops[c->first];
+	if (op->result != kIOReturnSuccess) {
+		c->failed = 1;
+		return;
+	}
+	field_start();
+	field_hex("reply", op->reply, op->replyLen);
+	field_end();
+}
+
+struct verb verbs[] = {
+	{"info",		info_plan,	info_print,	0},
+	{"events",		events_plan,	events_print,	0},
+	{"monitor",		monitor_plan,	monitor_print,	0},
+	{"rebuild-priority",	priority_plan,	status_print,	1},
+	{"mute",		mute_plan,	status_print,	1},
+	{"raw",			raw_plan,	raw_print,	1},
+	{NULL, NULL, NULL, 0}
+};
+
+/*
+ * Why a command failed, from the first of its adapter commands that did
+ */
+const char *
+failure(struct command *c)
+{
+	int	i;
+
+	for (i = c->first; i < c->first + c->count; i++) {
+		if (ops[i].result == (int)kIOReturnExclusiveAccess)
+			return("terminal channel in use");
+		if (ops[i].result == (int)kIOReturnBusy)
+			return("driver queue full");
+		if (ops[i].result != kIOReturnSuccess)
+			break;
+	}
+	return("adapter refused or did not answer");
+}
+
+/*
+ * Batch handling
+ */
+void
+add_command(const char *text)
+{
+	struct command	*c;
+	char		*p, *word;
+
+	while (isspace(*text))
+		text++;
+	if ((*text == 0) || (*text == '#'))
+		return;
+	if (ncommands >= MAX_COMMANDS)
+		errx(1, "too many commands");
+	c = &commands[ncommands++];
+	if ((c->text = strdup(text)) == NULL || (p = strdup(text)) == NULL)
+		errx(1, "out of memory");
+	p[strcspn(p, "\r\n")] = 0;
+	c->text[strcspn(c->text, "\r\n")] = 0;
+	c->argc = 0;
+	while ((word = strsep(&p, " \t")) != NULL) {
+		if (*word == 0)
+			continue;
+		if (c->argc >= MAX_ARGS + 2)
+			errx(1, "too many arguments: %s", c->text);
+		c->argv[c->argc++] = word;
+	}
+	for (c->verb = verbs; c->verb->name != NULL; c->verb++)
+		if (!strcmp(c->verb->name, c->argv[0]))
+			break;
+	if (c->verb->name == NULL)
+		errx(1, "unknown command '%s'", c->argv[0]);
+}
+
+void
+usage(void)
+{
+	errx(1, "usage: arcctl [-j] [-L] [-t] [-P password] [-f file | command [; command ...]]\n"
+	     "  -j           JSON output\n"
+	     "  -L           ask the adapter rather than reading the driver's inventory\n"
+	     "  -t           report timing on stderr\n"
+	     "  -P password  log in to the adapter first\n"
+	     "  -f file      read commands from file, one per line\n"
+	     "commands: info system|raid|volume|drive, events, monitor,\n"
+	     "          rebuild-priority 0-3, mute, raw opcode [byte ...]");
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct command	*c;
+	struct timeval	start, end;
+	FILE		*fp;
+	char		line[1024], joined[1024], *cmd, *rest;
+	const char	*file;
+	struct op	*op;
+	int		ch, i, j, timing, failures, first;
+	size_t		len;
+
+	file = NULL;
+	timing = 0;
+	while ((ch = getopt(argc, argv, "jLtP:f:")) != -1) {
+		switch (ch) {
+		case 'j':
+			json = 1;
+			break;
+		case 'L':
+			live = 1;
+			break;
+		case 't':
+			timing = 1;
+			break;
+		case 'P':
+			password = optarg;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	/* collect the batch */
+	if (file != NULL) {
+		if (argc > 0)
+			usage();
+		if (!strcmp(file, "-")) {
+			fp = stdin;
+		} else if ((fp = fopen(file, "r")) == NULL) {
+			err(1, "%s", file);
+		}
+		while (fgets(line, sizeof(line), fp) != NULL)
+			add_command(line);
+		if (fp != stdin)
+			fclose(fp);
+	} else {
+		joined[0] = 0;
+		for (i = 0; i < argc; i++) {
+			strlcat(joined, argv[i], sizeof(joined));
+			strlcat(joined, " ", sizeof(joined));
+		}
+		for (rest = joined; (cmd = strsep(&rest, ";")) != NULL; )
+			add_command(cmd);
+	}
+	if (ncommands == 0)
+		usage();
+
+	init();
+	gettimeofday(&start, NULL);
+
+	/* log in before anything that might need it */
+	if (password != NULL) {
+		len = strlen(password);
+		if (len > 15)
+			errx(1, "password too long");
+		line[0] = len;
+		memcpy(line + 1, password, len);
+		op = add_op(GUI_CHECK_PASSWORD, (uint8_t *)line, len + 1);
+		transact(op);
+		nops--;
+		if ((op->result != kIOReturnSuccess) || (op->replyLen != 1) || (op->reply[0] != GUI_OK))
+			errx(1, "adapter refused the password");
+	}
+
+	/* plan every command, then send the lot */
+	for (i = 0; i < ncommands; i++) {
+		c = &commands[i];
+		c->first = nops;
+		if (c->verb->plan(c) < 0)
+			errx(1, "bad arguments: %s", c->text);
+		c->count = nops - c->first;
+		if (c->verb->writes)
+			for (j = c->first; j < nops; j++)
+				ops[j].serial = 1;
+	}
+	pipeline(0, PIPELINE_DEPTH);
+	gettimeofday(&end, NULL);
+
+	/* and report in order */
+	failures = 0;
+	first = 1;
+	if (json)
+		printf("[\n");
+	for (i = 0; i < ncommands; i++) {
+		c = &commands[i];
+		if (json) {
+			printf("%s  {\"command\": ", first ? "" : ",\n");
+			json_string(c->text);
+			printf(", \"result\": ");
+		} else if (ncommands > 1) {
+			printf("# %s\n", c->text);
+		}
+		first = 0;
+		c->verb->print(c);
+		if (c->failed) {
+			failures++;
+			if (json) {
+				printf("null, \"error\": ");
+				json_string(failure(c));
+			} else {
+				printf("failed: %s\n", failure(c));
+			}
+		}
+		if (json)
+			printf("}");
+	}
+	if (json)
+		printf("\n]\n");
+
+	if (timing)
+		fprintf(stderr, "%d commands, %d adapter commands, %.1fms\n", ncommands, nops,
+			((end.tv_sec - start.tv_sec) * 1000.0) + ((end.tv_usec - start.tv_usec) / 1000.0));
+	return(failures ? 1 : 0);
+}
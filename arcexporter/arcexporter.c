@@ -0,0 +1,809 @@
+/*
+ * arcexporter
+ *
+ * Serve ArcMSR adapter and volume metrics as OpenMetrics text, for
+ * Prometheus and the like, on a localhost port:
+ *
+ *	arcexporter [-f] [-p port] [-i ms]
+ *	arcexporter -1
+ *
+ * Everything comes from what the driver already keeps: the I/O statistics
+ * (rates, latency histograms, tag occupancy and interrupt counts) and the
+ * cached inventory through the user client, and the counters and
+ * hardware-monitor readings it publishes in the registry.  None of it
+ * costs the adapter anything.  A scrape never sends the adapter a
+ * command, so scraping can't get in the way of I/O or of the management
+ * tools, and a busy or hung adapter can't hang a scrape.
+ *
+ * A snapshot is taken at most once every interval (default 1000 ms), and
+ * scrapes in between are served the same text, so any number of scrapers
+ * cost the driver one copy of its counters per interval.  -1 prints one
+ * snapshot to stdout and exits.
+ *
+ * Counters count up from when the driver started, or from when its
+ * statistics were last reset.  Latency buckets are the driver's own: bucket
+ * b counts whole microseconds below 2^b, so its le is 2^b - 1 us, given in
+ * seconds.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <mach/mach.h>
+#include <IOKit/IOKitLib.h>
+
+#include "../ArcMSRUserClientInterface.h"
+#include "../ArcMSRManagement.h"
+
+#define MAX_ADAPTERS	8
+#define MAX_REQUEST	4096
+#define CONTENT_TYPE	"application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+struct adapter {
+	io_service_t		service;
+	io_connect_t		port;
+	ArcMSRStatistics	stats;
+	ArcMSRInventory		inventory;
+	int			haveStats;
+	int			haveInventory;
+	char			label[16];		/* adapter="n" */
+	char			name[ARCMSR_STATS_TARGETS][ARCMSR_STATS_LUNS][40];
+};
+
+struct adapter	adapters[MAX_ADAPTERS];
+int		nadapters;
+int		verbose;
+
+/*
+ * Growable text buffer.
+ */
+struct buf {
+	char	*data;
+	int	len;
+	int	size;
+};
+
+void
+bprintf(struct buf *b, const char *fmt, ...)
+{
+	va_list	ap;
+	int	len;
+
+	for (;;) {
+		va_start(ap, fmt);
+		len = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
+		if ((b->data != NULL) && (len < (b->size - b->len)))
+			break;
+		b->size = (b->size + len + 1) * 2;
+		if ((b->data = realloc(b->data, b->size)) == NULL)
+			errx(1, "out of memory");
+	}
+	b->len += len;
+}
+
+double
+now(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return(tv.tv_sec + tv.tv_usec / 1000000.0);
+}
+
+/*
+ * Metric families and their samples.  OpenMetrics wants every sample of a
+ * family together, but it is easiest to collect them adapter by adapter,
+ * so samples are chained to their family and written out family by
+ * family, in the order the families were first seen.
+ */
+struct family {
+	char		name[64];
+	const char	*type;
+	const char	*help;
+	int		first;
+	int		last;
+};
+
+struct sample {
+	int		next;
+	const char	*suffix;		/* _total, _bucket, ... */
+	char		labels[200];
+	char		value[32];
+};
+
+struct family	*families;
+int		nfamilies, maxfamilies;
+struct sample	*samples;
+int		nsamples, maxsamples;
+
+int
+family(const char *name, const char *type, const char *help)
+{
+	struct family	*f;
+	int		i;
+
+	for (i = nfamilies - 1; i >= 0; i--)
+		if (!strcmp(families[i].name, name))
+			return(i);
+	if (nfamilies == maxfamilies) {
+		maxfamilies = maxfamilies ? (maxfamilies * 2) : 64;
+		if ((families = realloc(families, maxfamilies * sizeof(*families))) == NULL)
+			errx(1, "out of memory");
+	}
+	f = &families[nfamilies];
+	strlcpy(f->name, name, sizeof(f->name));
+	f->type = type;
+	f->help = help;
+	f->first = f->last = -1;
+	return(nfamilies++);
+}
+
+void
+sample(int fam, const char *suffix, const char *labels, const char *fmt, ...)
+{
+	struct sample	*s;
+	va_list		ap;
+
+	if (nsamples == maxsamples) {
+		maxsamples = maxsamples ? (maxsamples * 2) : 1024;
+		if ((samples = realloc(samples, maxsamples * sizeof(*samples))) == NULL)
+			errx(1, "out of memory");
+	}
+	s = &samples[nsamples];
+	s->next = -1;
+	s->suffix = suffix;
+	strlcpy(s->labels, labels, sizeof(s->labels));
+	va_start(ap, fmt);
+	vsnprintf(s->value, sizeof(s->value), fmt, ap);
+	va_end(ap);
+	if (families[fam].last < 0) {
+		families[fam].first = nsamples;
+	} else {
+		samples[families[fam].last].next = nsamples;
+	}
+	families[fam].last = nsamples++;
+}
+
+/* a counter (whose samples are called name_total) */
+void
+counter(const char *name, const char *help, const char *labels, unsigned long long value)
+{
+	sample(family(name, "counter", help), "_total", labels, "%llu", value);
+}
+
+void
+gauge(const char *name, const char *help, const char *labels, double value)
+{
+	if (value == (double)(long long)value) {
+		sample(family(name, "gauge", help), "", labels, "%lld", (long long)value);
+	} else {
+		sample(family(name, "gauge", help), "", labels, "%.9g", value);
+	}
+}
+
+/* a label value, escaped, from a fixed-size space-padded adapter string */
+void
+label_string(char *out, int size, const void *in, int len)
+{
+	const char	*p;
+	int		i, o, end;
+
+	p = in;
+	for (end = 0; (end < len) && (p[end] != 0); end++)
+		;
+	while ((end > 0) && (p[end - 1] == ' '))
+		end--;
+	for (i = o = 0; (i < end) && (o < (size - 3)); i++) {
+		if ((p[i] == '\\') || (p[i] == '"')) {
+			out[o++] = '\\';
+			out[o++] = p[i];
+		} else if ((p[i] >= ' ') && (p[i] < 0x7f)) {
+			out[o++] = p[i];
+		}
+	}
+	out[o] = 0;
+}
+
+/*
+ * Driver access
+ */
+void
+init(void)
+{
+	mach_port_t	masterPort;
+	io_service_t	serviceObject;
+	io_iterator_t	iterator;
+	CFDictionaryRef	classToMatch;
+	struct adapter	*a;
+
+	if (IOMasterPort(MACH_PORT_NULL, &masterPort) != KERN_SUCCESS)
+		errx(1, "IOMasterPort failed");
+	if ((classToMatch = IOServiceMatching("ArcMSR")) == NULL)
+		errx(1, "IOServiceMatching failed (no controller found?)");
+	if ((IOServiceGetMatchingServices(masterPort, classToMatch, &iterator)) != KERN_SUCCESS)
+		errx(1, "IOServiceGetMatchingServices failed");
+	while (((serviceObject = IOIteratorNext(iterator)) != 0) && (nadapters < MAX_ADAPTERS)) {
+		a = &adapters[nadapters];
+		if (IOServiceOpen(serviceObject, mach_task_self(), 0, &a->port) == KERN_SUCCESS) {
+			a->service = serviceObject;
+			snprintf(a->label, sizeof(a->label), "adapter=\"%d\"", nadapters);
+			nadapters++;
+		} else {
+			IOObjectRelease(serviceObject);
+		}
+	}
+	IOObjectRelease(iterator);
+	if (nadapters == 0)
+		errx(1, "Controller not found");
+}
+
+int
+fetch(io_connect_t port, int method, void *buf, int size)
+{
+	ArcMSRUserCommand	cmd;
+	IOByteCount		outSize;
+
+	cmd.data_buffer = (vm_address_t)buf;
+	cmd.data_size = size;
+	cmd.timeout = 0;
+	outSize = sizeof(cmd);
+	return(IOConnectMethodStructureIStructureO(port, method, sizeof(cmd), &outSize, &cmd, &cmd) == KERN_SUCCESS);
+}
+
+/* copy the driver's counters and inventory; neither goes near the adapter */
+void
+snapshot(struct adapter *a)
+{
+	sGUI_VOLUMESET	*vs;
+	int		i;
+
+	a->haveStats = fetch(a->port, kArcMSRUserClientStatistics, &a->stats, sizeof(a->stats)) &&
+	    (a->stats.version == ARCMSR_STATS_VERSION);
+	a->haveInventory = fetch(a->port, kArcMSRUserClientInventory, &a->inventory, sizeof(a->inventory)) &&
+	    (a->inventory.version == ARCMSR_INVENTORY_VERSION) && (a->inventory.generation != 0);
+
+	bzero(a->name, sizeof(a->name));
+	if (!a->haveInventory)
+		return;
+	for (i = 0; i < ARCMSR_INVENTORY_VOLUMES; i++) {
+		if (!(a->inventory.volumeMask & (1 << i)))
+			continue;
+		vs = (sGUI_VOLUMESET *)a->inventory.volume[i];
+		if ((vs->gvsScsi.ScsiId < ARCMSR_STATS_TARGETS) && (vs->gvsScsi.ScsiLun < ARCMSR_STATS_LUNS))
+			label_string(a->name[vs->gvsScsi.ScsiId][vs->gvsScsi.ScsiLun],
+				     sizeof(a->name[0][0]), vs->gvsVolumeName, sizeof(vs->gvsVolumeName));
+	}
+}
+
+/* one of the driver's latency histograms; buckets count up, not across */
+void
+histogram(const char *name, const char *help, const char *labels, const uint64_t *hist, uint64_t sum)
+{
+	unsigned long long	count;
+	char			le[200];
+	int			fam, b;
+
+	fam = family(name, "histogram", help);
+	count = 0;
+	for (b = 0; b < ARCMSR_STATS_BUCKETS; b++) {
+		count += hist[b];
+		if (b < (ARCMSR_STATS_BUCKETS - 1)) {
+			/* whole microseconds under 2^b, so the largest is 2^b - 1 */
+			snprintf(le, sizeof(le), "%s,le=\"%.6f\"", labels, ((1U << b) - 1) / 1000000.0);
+		} else {
+			snprintf(le, sizeof(le), "%s,le=\"+Inf\"", labels);
+		}
+		sample(fam, "_bucket", le, "%llu", count);
+	}
+	sample(fam, "_count", labels, "%llu", count);
+	sample(fam, "_sum", labels, "%.6f", sum / 1000000.0);
+}
+
+/*
+ * Adapter and I/O metrics, from the statistics
+ */
+void
+collect_stats(struct adapter *a)
+{
+	static const char *directions[] = {"read", "write", "other"};
+	ArcMSRUnitStatistics	*us;
+	ArcMSRStatistics	*st;
+	char			unit[160], labels[200];
+	unsigned long long	count;
+	int			t, l, d;
+
+	if (!a->haveStats)
+		return;
+	st = &a->stats;
+
+	gauge("arcmsr_tags", "Size of the adapter's command tag pool", a->label, st->tags);
+	gauge("arcmsr_tags_in_use", "Command tags in use", a->label, st->tagsInUse);
+	gauge("arcmsr_tags_peak", "Most command tags ever in use at once", a->label, st->tagsPeak);
+	counter("arcmsr_tags_exhausted", "Commands that found no tag free", a->label, st->tagsExhausted);
+	counter("arcmsr_timeouts", "Replies for commands that had already timed out", a->label, st->timeouts);
+	counter("arcmsr_statistics_resets", "Times the statistics were reset", a->label, st->resets);
+	counter("arcmsr_interrupts", "Times the interrupt handler ran", a->label, st->interrupts);
+	snprintf(labels, sizeof(labels), "%s,cause=\"doorbell\"", a->label);
+	counter("arcmsr_interrupt_causes", "Interrupts by cause", labels, st->doorbellInterrupts);
+	snprintf(labels, sizeof(labels), "%s,cause=\"postqueue\"", a->label);
+	counter("arcmsr_interrupt_causes", "Interrupts by cause", labels, st->postQueueInterrupts);
+	snprintf(labels, sizeof(labels), "%s,cause=\"message\"", a->label);
+	counter("arcmsr_interrupt_causes", "Interrupts by cause", labels, st->messageInterrupts);
+
+	for (t = 0; t < ARCMSR_STATS_TARGETS; t++) {
+		for (l = 0; l < ARCMSR_STATS_LUNS; l++) {
+			us = &st->unit[t][l];
+
+			/* units that have never done anything and aren't volumes are noise */
+			count = 0;
+			for (d = 0; d < ARCMSR_STATS_DIRECTIONS; d++)
+				count += us->ops[d];
+			if ((count == 0) && (a->name[t][l][0] == 0))
+				continue;
+
+			snprintf(unit, sizeof(unit), "%s,target=\"%d\",lun=\"%d\",volume=\"%s\"",
+				 a->label, t, l, a->name[t][l]);
+			for (d = 0; d < ARCMSR_STATS_DIRECTIONS; d++) {
+				snprintf(labels, sizeof(labels), "%s,direction=\"%s\"", unit, directions[d]);
+				counter("arcmsr_io_operations", "Commands completed", labels, us->ops[d]);
+			}
+			for (d = 0; d < ARCMSR_STATS_DIRECTIONS; d++) {
+				snprintf(labels, sizeof(labels), "%s,direction=\"%s\"", unit, directions[d]);
+				counter("arcmsr_io_bytes", "Bytes transferred", labels, us->bytes[d]);
+			}
+			counter("arcmsr_io_errors", "Commands that failed", unit, us->errors);
+			for (d = 0; d < ARCMSR_STATS_DIRECTIONS; d++) {
+				snprintf(labels, sizeof(labels), "%s,direction=\"%s\"", unit, directions[d]);
+				gauge("arcmsr_io_latency_max_seconds", "Slowest command", labels,
+				      us->maxLatency[d] / 1000000.0);
+				histogram("arcmsr_io_latency_seconds", "Time from a command's submission to its completion",
+					  labels, us->histogram[d], us->latency[d]);
+				histogram("arcmsr_io_adapter_latency_seconds", "Time from a command's posting to the adapter to its completion",
+					  labels, us->adapterHistogram[d], us->adapterLatency[d]);
+			}
+		}
+	}
+}
+
+/*
+ * Topology and rebuild state, from the inventory the driver keeps
+ */
+void
+collect_inventory(struct adapter *a)
+{
+	sSYSTEM_INFO	*sys;
+	sGUI_RAIDSET	*rs;
+	sGUI_VOLUMESET	*vs;
+	sGUI_PHY_DRV	*pd;
+	char		labels[200], s1[64], s2[64], s3[64], s4[64];
+	int		i;
+
+	if (!a->haveInventory)
+		return;
+	sys = (sSYSTEM_INFO *)a->inventory.system;
+	label_string(s1, sizeof(s1), sys->gsiModelName, sizeof(sys->gsiModelName));
+	label_string(s2, sizeof(s2), sys->gsiSerialNumber, sizeof(sys->gsiSerialNumber));
+	label_string(s3, sizeof(s3), sys->gsiFirmVersion, sizeof(sys->gsiFirmVersion));
+	label_string(s4, sizeof(s4), sys->gsiVendorName, sizeof(sys->gsiVendorName));
+	snprintf(labels, sizeof(labels), "%s,vendor=\"%s\",model=\"%s\",serial=\"%s\",firmware=\"%s\"",
+		 a->label, s4, s1, s2, s3);
+	gauge("arcmsr_adapter_info", "Adapter identity", labels, 1);
+	gauge("arcmsr_inventory_generation", "Changes every time the driver refreshes its inventory",
+	      a->label, a->inventory.generation);
+	gauge("arcmsr_rebuild_priority", "Adapter rebuild priority setting", a->label, sys->gsiRebuildPriority);
+
+	for (i = 0; i < ARCMSR_INVENTORY_RAIDSETS; i++) {
+		if (!(a->inventory.raidSetMask & (1 << i)))
+			continue;
+		rs = (sGUI_RAIDSET *)a->inventory.raidSet[i];
+		label_string(s1, sizeof(s1), rs->grsRaidSetName, sizeof(rs->grsRaidSetName));
+		snprintf(labels, sizeof(labels), "%s,raid_set=\"%d\",name=\"%s\"", a->label, i, s1);
+		gauge("arcmsr_raid_set_state", "RAID set state, as the adapter reports it", labels, rs->grsRaidState);
+		gauge("arcmsr_raid_set_members", "Drives in the RAID set", labels, rs->grsMemberDevices);
+	}
+	for (i = 0; i < ARCMSR_INVENTORY_VOLUMES; i++) {
+		if (!(a->inventory.volumeMask & (1 << i)))
+			continue;
+		vs = (sGUI_VOLUMESET *)a->inventory.volume[i];
+		label_string(s1, sizeof(s1), vs->gvsVolumeName, sizeof(vs->gvsVolumeName));
+		snprintf(labels, sizeof(labels), "%s,volume_set=\"%d\",volume=\"%s\",raid_set=\"%d\",raid_level=\"%d\"",
+			 a->label, i, s1, vs->gvsRaidSetNumber, vs->gvsRaidLevel);
+		gauge("arcmsr_volume_status", "Volume status, as the adapter reports it", labels,
+		      OSSwapLittleToHostInt32(vs->gvsVolumeStatus));
+		gauge("arcmsr_volume_progress", "Volume rebuild/initialise/migrate progress, as the adapter reports it",
+		      labels, OSSwapLittleToHostInt32(vs->gvsProgress));
+		gauge("arcmsr_volume_fail_mask", "Failed member drives of the volume", labels,
+		      OSSwapLittleToHostInt32(vs->gvsFailMask));
+		gauge("arcmsr_volume_size_bytes", "Volume capacity", labels,
+		      (OSSwapLittleToHostInt32(vs->gvsCapacity) |
+		       ((unsigned long long)OSSwapLittleToHostInt32(vs->gvsCapacityX) << 32)) * 512.0);
+	}
+	for (i = 0; i < ARCMSR_INVENTORY_DRIVES; i++) {
+		if (!(a->inventory.driveMask & (1 << i)))
+			continue;
+		pd = (sGUI_PHY_DRV *)a->inventory.drive[i];
+		label_string(s1, sizeof(s1), pd->gpdModelName, sizeof(pd->gpdModelName));
+		label_string(s2, sizeof(s2), pd->gpdSerialNumber, sizeof(pd->gpdSerialNumber));
+		snprintf(labels, sizeof(labels), "%s,drive=\"%d\",model=\"%s\",serial=\"%s\",raid_set=\"%d\"",
+			 a->label, i, s1, s2, pd->gpdRaidNumber);
+		gauge("arcmsr_drive_state", "Drive state, as the adapter reports it", labels, pd->gpdDeviceState);
+	}
+}
+
+/*
+ * What the driver publishes in the registry
+ */
+CFTypeRef
+property(struct adapter *a, const char *key)
+{
+	CFTypeRef	ref;
+	CFStringRef	name;
+
+	if ((name = CFStringCreateWithCString(kCFAllocatorDefault, key, kCFStringEncodingASCII)) == NULL)
+		return(NULL);
+	ref = IORegistryEntryCreateCFProperty(a->service, name, kCFAllocatorDefault, 0);
+	CFRelease(name);
+	return(ref);
+}
+
+int
+cfnumber(CFTypeRef ref, double *value)
+{
+	long long	n;
+
+	if (ref == NULL)
+		return(0);
+	if (CFGetTypeID(ref) == CFBooleanGetTypeID()) {
+		*value = CFBooleanGetValue((CFBooleanRef)ref) ? 1 : 0;
+		return(1);
+	}
+	if ((CFGetTypeID(ref) == CFNumberGetTypeID()) &&
+	    CFNumberGetValue((CFNumberRef)ref, kCFNumberLongLongType, &n)) {
+		*value = n;
+		return(1);
+	}
+	return(0);
+}
+
+/* metric names from registry keys: "max-wait-us" -> "max_wait_us" */
+void
+metric_name(char *out, int size, const char *prefix, const char *key)
+{
+	char	*p;
+
+	snprintf(out, size, "arcmsr_%s_%s", prefix, key);
+	for (p = out; *p != 0; p++)
+		if (!(((*p >= 'a') && (*p <= 'z')) || ((*p >= '0') && (*p <= '9')) || (*p == '_')))
+			*p = '_';
+}
+
+/*
+ * The driver's own bookkeeping, published as dictionaries of numbers.  We
+ * don't know which are counters and which gauges, so they go out untyped,
+ * named after the dictionary and the key.  A dictionary of dictionaries
+ * gives one label per inner dictionary.
+ */
+static const struct {
+	const char	*property;
+	const char	*prefix;
+	const char	*label;
+} published[] = {
+	{"gate-statistics",		"gate",		"gate"},
+	{"message-statistics",		"message",	NULL},
+	{"broker-statistics",		"broker",	NULL},
+	{"event-statistics",		"event",	NULL},
+	{"scan-statistics",		"scan",		NULL},
+	{"flush-statistics",		"flush",	NULL},
+	{"power-statistics",		"power",	NULL},
+	{"inventory-statistics",	"inventory",	NULL},
+	{"monitor-statistics",		"monitor",	NULL},
+	{"rebuild-scheduler",		"rebuild",	NULL},
+	{NULL, NULL, NULL}
+};
+
+void
+collect_dictionary(const char *prefix, const char *labels, CFDictionaryRef dict, const char *label)
+{
+	const void	**keys, **values;
+	char		key[64], name[64], inner[200];
+	double		value;
+	CFIndex		i, count;
+
+	count = CFDictionaryGetCount(dict);
+	if ((keys = malloc(count * sizeof(*keys))) == NULL)
+		errx(1, "out of memory");
+	if ((values = malloc(count * sizeof(*values))) == NULL)
+		errx(1, "out of memory");
+	CFDictionaryGetKeysAndValues(dict, keys, values);
+	for (i = 0; i < count; i++) {
+		if (!CFStringGetCString((CFStringRef)keys[i], key, sizeof(key), kCFStringEncodingASCII))
+			continue;
+		if ((label != NULL) && (CFGetTypeID(values[i]) == CFDictionaryGetTypeID())) {
+			snprintf(inner, sizeof(inner), "%s,%s=\"%s\"", labels, label, key);
+			collect_dictionary(prefix, inner, (CFDictionaryRef)values[i], NULL);
+		} else if (cfnumber(values[i], &value)) {
+			metric_name(name, sizeof(name), prefix, key);
+			sample(family(name, "unknown", NULL), "", labels, "%.0f", value);
+		}
+	}
+	free(keys);
+	free(values);
+}
+
+void
+collect_array(const char *name, const char *help, const char *labels, const char *label,
+	      CFArrayRef array, double scale)
+{
+	char		inner[200];
+	double		value;
+	CFIndex		i;
+
+	if ((array == NULL) || (CFGetTypeID(array) != CFArrayGetTypeID()))
+		return;
+	for (i = 0; i < CFArrayGetCount(array); i++) {
+		if (!cfnumber(CFArrayGetValueAtIndex(array, i), &value))
+			continue;
+		snprintf(inner, sizeof(inner), "%s,%s=\"%ld\"", labels, label, (long)i);
+		gauge(name, help, inner, value * scale);
+	}
+}
+
+void
+collect_registry(struct adapter *a)
+{
+	CFTypeRef	ref, policy;
+	CFDictionaryRef	hw;
+	char		labels[200], s[32];
+	double		value;
+	int		i;
+
+	for (i = 0; published[i].property != NULL; i++) {
+		if ((ref = property(a, published[i].property)) == NULL)
+			continue;
+		if (CFGetTypeID(ref) == CFDictionaryGetTypeID())
+			collect_dictionary(published[i].prefix, a->label, (CFDictionaryRef)ref, published[i].label);
+		CFRelease(ref);
+	}
+
+	/* the rebuild policy is a string */
+	if ((ref = property(a, "rebuild-scheduler")) != NULL) {
+		if ((CFGetTypeID(ref) == CFDictionaryGetTypeID()) &&
+		    ((policy = CFDictionaryGetValue((CFDictionaryRef)ref, CFSTR("policy"))) != NULL) &&
+		    (CFGetTypeID(policy) == CFStringGetTypeID()) &&
+		    CFStringGetCString((CFStringRef)policy, s, sizeof(s), kCFStringEncodingASCII)) {
+			snprintf(labels, sizeof(labels), "%s,policy=\"%s\"", a->label, s);
+			gauge("arcmsr_rebuild_policy_info", "Rebuild scheduler policy", labels, 1);
+		}
+		CFRelease(ref);
+	}
+
+	/* and the hardware monitor's last readings */
+	if ((ref = property(a, "hardware-monitor")) != NULL) {
+		if (CFGetTypeID(ref) == CFDictionaryGetTypeID()) {
+			hw = (CFDictionaryRef)ref;
+			collect_array("arcmsr_fan_rpm", "Fan speed", a->label, "fan",
+				      CFDictionaryGetValue(hw, CFSTR("fans-rpm")), 1);
+			collect_array("arcmsr_voltage_volts", "Supply voltage", a->label, "sensor",
+				      CFDictionaryGetValue(hw, CFSTR("voltages-mv")), 0.001);
+			collect_array("arcmsr_voltage_nominal_volts", "Nominal supply voltage", a->label, "sensor",
+				      CFDictionaryGetValue(hw, CFSTR("nominal-mv")), 0.001);
+			collect_array("arcmsr_temperature_celsius", "Temperature", a->label, "sensor",
+				      CFDictionaryGetValue(hw, CFSTR("temperatures-c")), 1);
+			if (cfnumber(CFDictionaryGetValue(hw, CFSTR("power")), &value))
+				gauge("arcmsr_power_status", "Power status, as the adapter reports it", a->label, value);
+			if (cfnumber(CFDictionaryGetValue(hw, CFSTR("ups")), &value))
+				gauge("arcmsr_ups_status", "UPS status, as the adapter reports it", a->label, value);
+		}
+		CFRelease(ref);
+	}
+}
+
+/*
+ * Take a snapshot and render it
+ */
+void
+render(struct buf *out)
+{
+	struct family	*f;
+	struct sample	*s;
+	double		start;
+	int		i, n;
+
+	start = now();
+	nfamilies = nsamples = 0;
+	for (i = 0; i < nadapters; i++) {
+		snapshot(&adapters[i]);
+		collect_stats(&adapters[i]);
+		collect_inventory(&adapters[i]);
+		collect_registry(&adapters[i]);
+	}
+	gauge("arcmsr_exporter_snapshot_seconds", "Time taken to collect this snapshot", "", now() - start);
+
+	out->len = 0;
+	for (i = 0; i < nfamilies; i++) {
+		f = &families[i];
+		bprintf(out, "# TYPE %s %s\n", f->name, f->type);
+		if (f->help != NULL)
+			bprintf(out, "# HELP %s %s\n", f->name, f->help);
+		for (n = f->first; n >= 0; n = s->next) {
+			s = &samples[n];
+			if (s->labels[0] == 0) {
+				bprintf(out, "%s%s %s\n", f->name, s->suffix, s->value);
+			} else {
+				bprintf(out, "%s%s{%s} %s\n", f->name, s->suffix, s->labels, s->value);
+			}
+		}
+	}
+	bprintf(out, "# EOF\n");
+}
+
+/*
+ * HTTP
+ */
+int
+read_request(int fd, char *req, int size)
+{
+	int	len, got;
+
+	len = 0;
+	for (;;) {
+		if (len >= (size - 1))
+			return(-1);
+		if ((got = read(fd, req + len, size - 1 - len)) <= 0)
+			return(-1);
+		len += got;
+		req[len] = 0;
+		if (strstr(req, "\r\n\r\n") != NULL)
+			return(len);
+	}
+}
+
+void
+reply(int fd, const char *status, const char *type, const char *body, int len, int head)
+{
+	char	header[256];
+	int	off, put, hlen;
+
+	hlen = snprintf(header, sizeof(header),
+			"HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
+			status, type, len);
+	if ((write(fd, header, hlen) != hlen) || head)
+		return;
+	for (off = 0; off < len; off += put)
+		if ((put = write(fd, body + off, len - off)) <= 0)
+			break;
+}
+
+void
+serve(int port, int interval)
+{
+	struct sockaddr_in	sin;
+	struct timeval		tv;
+	struct buf		text;
+	char			req[MAX_REQUEST];
+	const char		*msg, *path;
+	double			taken, start;
+	int			s, fd, on;
+
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		err(1, "socket");
+	on = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	bzero(&sin, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(s, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+		err(1, "bind to port %d", port);
+	if (listen(s, 16) < 0)
+		err(1, "listen");
+
+	bzero(&text, sizeof(text));
+	signal(SIGPIPE, SIG_IGN);
+	taken = 0;
+
+	/* scrapes are small and quick; one at a time will do */
+	for (;;) {
+		if ((fd = accept(s, NULL, NULL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "accept");
+		}
+		/* don't let a client that never finishes its request stall the others */
+		tv.tv_sec = 5;
+		tv.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		start = now();
+		if (read_request(fd, req, sizeof(req)) > 0) {
+			if (strncmp(req, "GET ", 4) && strncmp(req, "HEAD ", 5)) {
+				msg = "GET only\n";
+				reply(fd, "405 Method Not Allowed", "text/plain", msg, strlen(msg), 0);
+			} else if (path = strchr(req, ' ') + 1,
+				   strncmp(path, "/metrics", 8) || ((path[8] != ' ') && (path[8] != '?'))) {
+				msg = "Metrics are at /metrics\n";
+				reply(fd, "404 Not Found", "text/plain", msg, strlen(msg), 0);
+			} else {
+				if ((text.len == 0) || ((start - taken) * 1000.0 >= interval)) {
+					render(&text);
+					taken = start;
+				}
+				reply(fd, "200 OK", CONTENT_TYPE, text.data, text.len, !strncmp(req, "HEAD ", 5));
+			}
+			if (verbose)
+				printf("%.*s %.1fms\n", (int)strcspn(req, "\r\n"), req, (now() - start) * 1000.0);
+			fflush(stdout);
+		}
+		close(fd);
+	}
+}
+
+void
+usage(void)
+{
+	errx(1, "usage: arcexporter [-v] [-f] [-p port] [-i ms] | -1\n"
+	     "  -p port    listen on localhost:port (default 9432)\n"
+	     "  -i ms      take a new snapshot at most this often (default 1000)\n"
+	     "  -f         stay in the foreground\n"
+	     "  -1         print one snapshot and exit");
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct buf	text;
+	int		ch, port, interval, foreground, once;
+
+	port = 9432;
+	interval = 1000;
+	foreground = 0;
+	once = 0;
+	while ((ch = getopt(argc, argv, "vfp:i:1")) != -1) {
+		switch (ch) {
+		case 'v':
+			verbose = 1;
+			break;
+		case 'f':
+			foreground = 1;
+			break;
+		case 'p':
+			if ((port = atoi(optarg)) <= 0)
+				usage();
+			break;
+		case 'i':
+			if ((interval = atoi(optarg)) < 0)
+				usage();
+			break;
+		case '1':
+			once = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	init();
+
+	if (once) {
+		bzero(&text, sizeof(text));
+		render(&text);
+		fwrite(text.data, 1, text.len, stdout);
+		exit(0);
+	}
+
+	if (!foreground && (daemon(0, 0) < 0))
+		err(1, "daemon");
+	serve(port, interval);
+	return(0);
+}
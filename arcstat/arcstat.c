@@ -0,0 +1,399 @@
+/*
+ * arcstat
+ *
+ * iostat for ArcMSR adapters.  Samples the driver's I/O statistics (see
+ * ArcMSRUserClientInterface.h) every interval seconds and prints, for
+ * each adapter and each volume that did anything, the command and data
+ * rates, average latency overall and in the adapter, 50th, 99th and 99.9th
+ * percentile latency, the average number of commands outstanding, and how
+ * much of the adapter's shared tag pool was in use.  The first report
+ * covers the time since the driver started, or since the statistics were
+ * last reset.
+ *
+ *	arcstat [-a] [-c] [-z] [interval [count]]
+ *
+ * -a reports idle volumes too; -c prints CSV, with a header, for loading
+ * into a spreadsheet.  -z resets the driver's statistics first, for
+ * everyone, and so needs root.  Reading the statistics costs the adapter
+ * nothing.
+ */
+#include <sys/types.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <mach/mach.h>
+#include <IOKit/IOKitLib.h>
+
+#include "../ArcMSRUserClientInterface.h"
+#include "../ArcMSRManagement.h"
+
+#define MAX_ADAPTERS	8
+
+struct adapter {
+	io_connect_t		port;
+	ArcMSRStatistics	now, then;
+	char			name[ARCMSR_STATS_TARGETS][ARCMSR_STATS_LUNS][17];
+};
+
+struct adapter	adapters[MAX_ADAPTERS];
+int		nadapters;
+int		all;
+int		csv;
+
+/*
+ * What one unit (or a whole adapter) did over an interval.
+ */
+struct rates {
+	double		ops[ARCMSR_STATS_DIRECTIONS];	// per second
+	double		mb[ARCMSR_STATS_DIRECTIONS];	// MB per second
+	double		errors;				// per second
+	double		latency;			// us, mean
+	double		adapter;			// us, mean, in the adapter
+	double		p50;				// us
+	double		p99;
+	double		p999;
+	double		queue;				// mean outstanding
+	uint64_t	count;				// commands completed
+};
+
+/*
+ * Driver access
+ */
+void
+init(void)
+{
+	mach_port_t	masterPort;
+	io_service_t	serviceObject;
+	io_iterator_t	iterator;
+	CFDictionaryRef	classToMatch;
+
+	if (IOMasterPort(MACH_PORT_NULL, &masterPort) != KERN_SUCCESS)
+		errx(1, "IOMasterPort failed");
+	if ((classToMatch = IOServiceMatching("ArcMSR")) == NULL)
+		errx(1, "IOServiceMatching failed (no controller found?)");
+	if ((IOServiceGetMatchingServices(masterPort, classToMatch, &iterator)) != KERN_SUCCESS)
+		errx(1, "IOServiceGetMatchingServices failed");
+	while (((serviceObject = IOIteratorNext(iterator)) != 0) && (nadapters < MAX_ADAPTERS)) {
+		if (IOServiceOpen(serviceObject, mach_task_self(), 0, &adapters[nadapters].port) == KERN_SUCCESS)
+			nadapters++;
+		IOObjectRelease(serviceObject);
+	}
+	IOObjectRelease(iterator);
+	if (nadapters == 0)
+		errx(1, "Controller not found");
+}
+
+int
+fetch(io_connect_t port, int method, void *buf, int size)
+{
+	ArcMSRUserCommand	cmd;
+	IOByteCount		outSize;
+
+	cmd.data_buffer = (vm_address_t)buf;
+	cmd.data_size = size;
+	cmd.timeout = 0;
+	outSize = sizeof(cmd);
+	return(IOConnectMethodStructureIStructureO(port, method, sizeof(cmd), &outSize, &cmd, &cmd) == KERN_SUCCESS);
+}
+
+void
+sample(struct adapter *a)
+{
+	if (!fetch(a->port, kArcMSRUserClientStatistics, &a->now, sizeof(a->now)) ||
+	    (a->now.version != ARCMSR_STATS_VERSION))
+		errx(1, "can't read statistics (driver too old?)");
+
+	// reset since last time?  Then this interval starts from the reset.
+	if (a->now.resets != a->then.resets) {
+		bzero(&a->then, sizeof(a->then));
+		a->then.time = a->now.since;
+	}
+}
+
+void
+reset(struct adapter *a)
+{
+	if (IOConnectMethodScalarIScalarO(a->port, kArcMSRUserClientResetStatistics, 0, 0) != KERN_SUCCESS)
+		errx(1, "can't reset statistics (not root, or driver too old?)");
+}
+
+/*
+ * Label volumes with their names if the driver has an inventory.
+ */
+void
+names(struct adapter *a)
+{
+	ArcMSRInventory	*inv;
+	sGUI_VOLUMESET	*vs;
+	int		i, j;
+
+	if ((inv = malloc(sizeof(*inv))) == NULL)
+		return;
+	if (fetch(a->port, kArcMSRUserClientInventory, inv, sizeof(*inv)) &&
+	    (inv->version == ARCMSR_INVENTORY_VERSION)) {
+		for (i = 0; i < ARCMSR_INVENTORY_VOLUMES; i++) {
+			if (!(inv->volumeMask & (1 << i)))
+				continue;
+			vs = (sGUI_VOLUMESET *)inv->volume[i];
+			if ((vs->gvsScsi.ScsiId >= ARCMSR_STATS_TARGETS) || (vs->gvsScsi.ScsiLun >= ARCMSR_STATS_LUNS))
+				continue;
+			memcpy(a->name[vs->gvsScsi.ScsiId][vs->gvsScsi.ScsiLun], vs->gvsVolumeName, 16);
+			for (j = 15; (j >= 0) && (a->name[vs->gvsScsi.ScsiId][vs->gvsScsi.ScsiLun][j] == ' '); j--)
+				a->name[vs->gvsScsi.ScsiId][vs->gvsScsi.ScsiLun][j] = 0;
+		}
+	}
+	free(inv);
+}
+
+/*
+ * Arithmetic
+ */
+
+/* p'th percentile latency from a histogram, interpolating within the bucket */
+double
+percentile(const uint64_t *hist, uint64_t total, double p, uint64_t max)
+{
+	double		want, low, high;
+	uint64_t	seen;
+	int		b;
+
+	if (total == 0)
+		return(0);
+	want = total * p;
+	seen = 0;
+	for (b = 0; b < ARCMSR_STATS_BUCKETS; b++) {
+		if ((seen + hist[b]) >= want)
+			break;
+		seen += hist[b];
+	}
+	if (b == ARCMSR_STATS_BUCKETS)
+		b--;
+	low = b ? (double)(1U << (b - 1)) : 0;
+	high = (b < (ARCMSR_STATS_BUCKETS - 1)) ? (double)(1U << b) : (double)max;
+	if (high > max)
+		high = max;
+	if (high < low)
+		high = low;
+	if (hist[b] == 0)
+		return(high);
+	return(low + ((high - low) * (want - seen) / hist[b]));
+}
+
+/*
+ * What some units did between then and now, all directions together.
+ */
+struct totals {
+	uint64_t	ops[ARCMSR_STATS_DIRECTIONS];
+	uint64_t	bytes[ARCMSR_STATS_DIRECTIONS];
+	uint64_t	latency;
+	uint64_t	adapter;
+	uint64_t	errors;
+	uint64_t	hist[ARCMSR_STATS_BUCKETS];
+	uint64_t	max;
+};
+
+void
+accumulate(const ArcMSRUnitStatistics *now, const ArcMSRUnitStatistics *then, struct totals *t)
+{
+	int	d, b;
+
+	for (d = 0; d < ARCMSR_STATS_DIRECTIONS; d++) {
+		t->ops[d] += now->ops[d] - then->ops[d];
+		t->bytes[d] += now->bytes[d] - then->bytes[d];
+		t->latency += now->latency[d] - then->latency[d];
+		t->adapter += now->adapterLatency[d] - then->adapterLatency[d];
+		for (b = 0; b < ARCMSR_STATS_BUCKETS; b++)
+			t->hist[b] += now->histogram[d][b] - then->histogram[d][b];
+		if (now->maxLatency[d] > t->max)
+			t->max = now->maxLatency[d];
+	}
+	t->errors += now->errors - then->errors;
+}
+
+void
+rates(struct rates *r, double seconds, struct totals *t)
+{
+	int	d;
+
+	r->count = 0;
+	for (d = 0; d < ARCMSR_STATS_DIRECTIONS; d++) {
+		r->ops[d] = t->ops[d] / seconds;
+		r->mb[d] = t->bytes[d] / seconds / (1024.0 * 1024.0);
+		r->count += t->ops[d];
+	}
+	r->errors = t->errors / seconds;
+	r->latency = r->count ? ((double)t->latency / r->count) : 0;
+	r->adapter = r->count ? ((double)t->adapter / r->count) : 0;
+	r->p50 = percentile(t->hist, r->count, 0.50, t->max);
+	r->p99 = percentile(t->hist, r->count, 0.99, t->max);
+	r->p999 = percentile(t->hist, r->count, 0.999, t->max);
+	r->queue = t->latency / (seconds * 1000000.0);
+}
+
+/*
+ * Output
+ */
+void
+header(void)
+{
+	if (csv) {
+		printf("time,adapter,unit,name,reads/s,writes/s,other/s,read-MB/s,write-MB/s,"
+		       "latency-us,adapter-us,p50-us,p99-us,p999-us,outstanding,errors/s,"
+		       "tags,tags-busy,tag-util-%%,tags-peak,tags-exhausted\n");
+	} else {
+		printf("%-22s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s %7s %6s\n",
+		       "", "r/s", "w/s", "o/s", "rMB/s", "wMB/s", "avg-ms", "adp-ms",
+		       "p50-ms", "p99-ms", "p999-ms", "queue", "err/s");
+	}
+}
+
+void
+line(time_t when, int adapter, const char *unit, const char *name, struct rates *r,
+     const ArcMSRStatistics *s, double busy, uint32_t exhausted)
+{
+	char	label[64];
+
+	if (csv) {
+		printf("%ld,%d,%s,\"%s\",%.1f,%.1f,%.1f,%.3f,%.3f,%.0f,%.0f,%.0f,%.0f,%.0f,%.2f,%.2f",
+		       (long)when, adapter, unit, name,
+		       r->ops[ARCMSR_STATS_READ], r->ops[ARCMSR_STATS_WRITE], r->ops[ARCMSR_STATS_OTHER],
+		       r->mb[ARCMSR_STATS_READ], r->mb[ARCMSR_STATS_WRITE],
+		       r->latency, r->adapter, r->p50, r->p99, r->p999, r->queue, r->errors);
+		if (s != NULL) {
+			printf(",%u,%.2f,%.1f,%u,%u\n", s->tags, busy, s->tags ? (busy * 100.0 / s->tags) : 0,
+			       s->tagsPeak, exhausted);
+		} else {
+			printf(",,,,,\n");
+		}
+		return;
+	}
+	if (s != NULL) {
+		snprintf(label, sizeof(label), "arc%d", adapter);
+	} else {
+		snprintf(label, sizeof(label), "  %s %s", unit, name);
+	}
+	printf("%-22.22s %8.1f %8.1f %8.1f %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f %7.2f %6.1f\n", label,
+	       r->ops[ARCMSR_STATS_READ], r->ops[ARCMSR_STATS_WRITE], r->ops[ARCMSR_STATS_OTHER],
+	       r->mb[ARCMSR_STATS_READ], r->mb[ARCMSR_STATS_WRITE],
+	       r->latency / 1000.0, r->adapter / 1000.0,
+	       r->p50 / 1000.0, r->p99 / 1000.0, r->p999 / 1000.0, r->queue, r->errors);
+	if (s != NULL)
+		printf("%-22s tags %u, %.1f busy (%.0f%%), peak %u, %u exhausted\n", "",
+		       s->tags, busy, s->tags ? (busy * 100.0 / s->tags) : 0, s->tagsPeak, exhausted);
+}
+
+void
+report(struct adapter *a, int index, time_t when)
+{
+	struct totals	total;
+	struct rates	r;
+	double		seconds;
+	char		unit[16];
+	int		t, l;
+
+	seconds = (a->now.time - a->then.time) / 1000000000.0;
+	if (seconds <= 0)
+		seconds = 1;
+
+	// the adapter as a whole first
+	bzero(&total, sizeof(total));
+	for (t = 0; t < ARCMSR_STATS_TARGETS; t++)
+		for (l = 0; l < ARCMSR_STATS_LUNS; l++)
+			accumulate(&a->now.unit[t][l], &a->then.unit[t][l], &total);
+	rates(&r, seconds, &total);
+	line(when, index, "all", "", &r, &a->now, r.queue, a->now.tagsExhausted - a->then.tagsExhausted);
+
+	// then each volume
+	for (t = 0; t < ARCMSR_STATS_TARGETS; t++) {
+		for (l = 0; l < ARCMSR_STATS_LUNS; l++) {
+			bzero(&total, sizeof(total));
+			accumulate(&a->now.unit[t][l], &a->then.unit[t][l], &total);
+			rates(&r, seconds, &total);
+			if (r.count == 0) {
+				if (!all || ((a->now.unit[t][l].ops[0] + a->now.unit[t][l].ops[1] +
+					      a->now.unit[t][l].ops[2]) == 0))
+					continue;
+			}
+			snprintf(unit, sizeof(unit), "%d:%d", t, l);
+			line(when, index, unit, a->name[t][l], &r, NULL, 0, 0);
+		}
+	}
+}
+
+void
+usage(void)
+{
+	errx(1, "usage: arcstat [-a] [-c] [-z] [interval [count]]\n"
+	     "  -a  include idle volumes\n"
+	     "  -c  CSV output\n"
+	     "  -z  reset the driver's statistics first");
+}
+
+int
+main(int argc, char *argv[])
+{
+	int	ch, interval, count, zero, i, n;
+	time_t	when;
+
+	zero = 0;
+	while ((ch = getopt(argc, argv, "acz")) != -1) {
+		switch (ch) {
+		case 'a':
+			all = 1;
+			break;
+		case 'c':
+			csv = 1;
+			break;
+		case 'z':
+			zero = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	interval = 0;
+	count = 1;
+	if (argc > 0) {
+		if ((interval = atoi(argv[0])) <= 0)
+			usage();
+		count = -1;
+	}
+	if (argc > 1) {
+		if ((count = atoi(argv[1])) <= 0)
+			usage();
+	}
+	if (argc > 2)
+		usage();
+
+	init();
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	for (i = 0; i < nadapters; i++) {
+		names(&adapters[i]);
+		bzero(&adapters[i].then, sizeof(adapters[i].then));
+		if (zero)
+			reset(&adapters[i]);
+	}
+
+	if (csv)
+		header();
+	for (n = 0; (count < 0) || (n < count); n++) {
+		if ((n > 0) || (zero && (interval > 0)))
+			sleep(interval);
+		when = time(NULL);
+		if (!csv)
+			header();
+		for (i = 0; i < nadapters; i++) {
+			sample(&adapters[i]);
+			report(&adapters[i], i, when);
+			adapters[i].then = adapters[i].now;
+		}
+		if (!csv)
+			printf("\n");
+	}
+	return(0);
+}
@@ -0,0 +1,24 @@
+/*
+ * Userland stand-in for the bits of <IOKit/IOLib.h> that
+ * ArcMSRRingBuffer.cpp uses, so ringbench can build it as it is.
+ */
+#ifndef RINGBENCH_IOLIB_H
+#define RINGBENCH_IOLIB_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static inline void *
+IOMalloc(size_t size)
+{
+	return(malloc(size));
+}
+
+static inline void
+IOFree(void *p, size_t size)
+{
+	free(p);
+}
+
+#endif /* RINGBENCH_IOLIB_H */
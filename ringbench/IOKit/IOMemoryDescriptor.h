@@ -0,0 +1,33 @@
+/*
+ * Userland stand-in for <IOKit/IOMemoryDescriptor.h>: just the three
+ * methods RingBuffer calls, over a plain buffer.
+ */
+#ifndef RINGBENCH_IOMEMORYDESCRIPTOR_H
+#define RINGBENCH_IOMEMORYDESCRIPTOR_H
+
+#include <IOKit/IOLib.h>
+
+typedef size_t	IOByteCount;
+
+class IOMemoryDescriptor {
+public:
+	IOMemoryDescriptor(void *buf, IOByteCount len) : buffer((char *)buf), length(len) {}
+	IOByteCount	getLength(void) { return(length); }
+	IOByteCount
+	readBytes(IOByteCount offset, void *bytes, IOByteCount len)
+	{
+		memcpy(bytes, buffer + offset, len);
+		return(len);
+	}
+	IOByteCount
+	writeBytes(IOByteCount offset, const void *bytes, IOByteCount len)
+	{
+		memcpy(buffer + offset, bytes, len);
+		return(len);
+	}
+private:
+	char		*buffer;
+	IOByteCount	length;
+};
+
+#endif /* RINGBENCH_IOMEMORYDESCRIPTOR_H */
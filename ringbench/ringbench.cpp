@@ -0,0 +1,476 @@
+/*
+ * ringbench
+ *
+ * Time the driver's RingBuffer against the one it replaced, in userland.
+ *
+ *	ringbench [-m megabytes]
+ *
+ * ArcMSRRingBuffer.cpp is built as it is, against the stand-ins for
+ * IOMalloc and IOMemoryDescriptor in ringbench/IOKit; the old ring
+ * (desiredSize + 1 bytes, indices wrapped with %) is kept below as it was.
+ * Each workload runs both rings half full, so every pass wraps, and
+ * moves -m megabytes (default 256) through them:
+ *
+ *	bytes	insert/remove of uint8_t, as the message queues did
+ *	words	insert/remove of uint32_t, as the SRB tag pool does
+ *	frames	insert/remove of 1031-byte runs, a GUI frame less one,
+ *		so the wrap point moves around
+ *	md	the same through an IOMemoryDescriptor, as the userclient does
+ *	spans	reserve/commit and peek/consume on the new ring only
+ *
+ * and reports nanoseconds per operation for each.  Both rings must hand
+ * back exactly what went in; a mismatch is fatal.
+ *
+ * Build it from the top of the tree with
+ *
+ *	c++ -O2 -I ringbench -o ringbench ringbench/ringbench.cpp ArcMSRRingBuffer.cpp
+ */
+#include <sys/types.h>
+#include <sys/time.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../ArcMSRRingBuffer.h"
+
+#define RING_SIZE	4096
+#define FRAME		1031
+#define BATCH		64
+
+// the sequence, laid out so any frame of it can be copied or compared whole
+static uint8_t	pattern[256 + FRAME];
+
+////////////////////////////////////////////////////////////////////////////////
+// The ring as it was before the power-of-two rework
+//
+class OldRingBuffer {
+public:
+    void	init(int desiredSize);
+    void	deinit(void);
+    int		avail(void);
+    bool	insert(char *indata, int len);
+    bool	insert(IOMemoryDescriptor *md);
+    bool	insert(uint8_t one);
+    bool	insert(uint32_t one);
+    int		remove(char *outdata, int len);
+    int		remove(IOMemoryDescriptor *md, int offset);
+    int		remove(uint8_t *one);
+    int		remove(uint32_t *one);
+private:
+    int		head, tail, size;
+    char	*data;
+};
+
+void
+OldRingBuffer::init(int desiredSize)
+{
+    size = desiredSize + 1;
+    data = (char *)IOMalloc(size);
+    head = 0;
+    tail = 0;
+};
+
+void
+OldRingBuffer::deinit(void)
+{
+    if (data != NULL)
+	IOFree(data, size);
+};
+
+int
+OldRingBuffer::avail(void) {
+    return(size - (((head + size) - tail) % size));
+};
+
+bool
+OldRingBuffer::insert(char *indata, int len)
+{
+    int	frag;
+
+    if (len > avail())
+	return(false);	    // space check
+    frag = size - head;	    // fill head-to-end first
+    if (frag > len)
+	frag = len;
+    memcpy(data + head, indata, frag);
+    head += frag;
+    if (head == size)	    // head never points to end
+	head = 0;
+    if (len > frag) {	    // more to copy?
+	memcpy(data, indata + frag, len - frag);
+	head = len - frag;
+    }
+    return(true);
+};
+
+bool
+OldRingBuffer::insert(IOMemoryDescriptor *md)
+{
+    int	frag, len = md->getLength();
+
+    if (len > avail())
+	return(false);	    // space check
+    frag = size - head;	    // fill head-to-end first
+    if (frag > len)
+	frag = len;
+    md->readBytes(0, data + head, frag);
+    head += frag;
+    if (head == size)	    // head never points to end
+	head = 0;
+    if (len > frag) {	    // more to copy?
+	md->readBytes(frag, data, len - frag);
+	head = len - frag;
+    }
+    return(true);
+};
+
+bool
+OldRingBuffer::insert(uint8_t one)
+{
+    return(insert((char *)&one, sizeof(one)));
+}
+
+bool
+OldRingBuffer::insert(uint32_t one)
+{
+    return(insert((char *)&one, sizeof(one)));
+}
+
+int
+OldRingBuffer::remove(char *outdata, int len)
+{
+    int	frag, frag2;
+    if (head >= tail) {	    // from tail to head
+	frag = head - tail;
+	if (frag > len)
+	    frag = len;
+	if (frag > 0)
+	    memcpy(outdata, data + tail, frag);
+	tail += frag;
+	return(frag);
+    }
+    // from tail to end
+    frag = size - tail;
+    if (frag > len)
+	frag = len;
+    memcpy(outdata, data + tail, frag);
+    tail += frag;
+    if (tail == size)
+	tail = 0;
+    // maybe wrap
+    if (len > frag) {
+	frag2 = head;
+	if (frag2 > (len - frag))
+	    frag2 = (len - frag);
+	memcpy(outdata + frag, data, frag2);
+	tail = frag2;
+	frag += frag2;
+    }
+    return(frag);
+};
+
+int
+OldRingBuffer::remove(IOMemoryDescriptor *md, int offset)
+{
+    int	frag, frag2, len = md->getLength() - offset;
+
+    if (head >= tail) {	    // from tail to head
+	frag = head - tail;
+	if (frag > len)
+	    frag = len;
+	if (frag > 0)
+	    md->writeBytes(offset, data + tail, frag);
+	tail += frag;
+	return(frag);
+    }
+    // from tail to end
+    frag = size - tail;
+    if (frag > len)
+	frag = len;
+    md->writeBytes(offset, data + tail, frag);
+    tail += frag;
+    if (tail == size)
+	tail = 0;
+    // maybe wrap
+    if (len > frag) {
+	frag2 = head;
+	if (frag2 > (len - frag))
+	    frag2 = (len - frag);
+	md->writeBytes(offset + frag, data, frag2);
+	tail = frag2;
+	frag += frag2;
+    }
+    return(frag);
+};
+
+int
+OldRingBuffer::remove(uint8_t *one)
+{
+
+    if (remove((char *)one, sizeof(*one)) == sizeof(*one))
+	return(1);
+    return(-1);
+}
+
+int
+OldRingBuffer::remove(uint32_t *one)
+{
+
+    if (remove((char *)one, sizeof(*one)) == sizeof(*one))
+	return(1);
+    return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Workloads
+//
+// Each takes a ring already half full of the sequence 0, 1, 2, ... and
+// keeps it that way, checking that what comes out continues the sequence.
+// They return the number of operations done.
+//
+
+double
+now(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return(tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+void
+mismatch(const char *what)
+{
+	errx(1, "%s: ring returned the wrong data", what);
+}
+
+template <class Ring> void
+prefill(Ring *r)
+{
+	uint8_t	i;
+	int	n;
+
+	for (n = 0, i = 0; n < (RING_SIZE / 2); n++, i++)
+		if (!r->insert(i))
+			errx(1, "prefill: ring full");
+}
+
+template <class Ring> long long
+bytes(Ring *r, long long total)
+{
+	uint8_t		in, out, b;
+	long long	n;
+	int		i;
+
+	in = (uint8_t)(RING_SIZE / 2);
+	out = 0;
+	for (n = 0; n < total; n += BATCH) {
+		for (i = 0; i < BATCH; i++)
+			if (!r->insert(in++))
+				mismatch("bytes");
+		for (i = 0; i < BATCH; i++)
+			if ((r->remove(&b) != 1) || (b != out++))
+				mismatch("bytes");
+	}
+	return(n * 2);
+}
+
+template <class Ring> long long
+words(Ring *r, long long total)
+{
+	uint32_t	in, out, w;
+	uint8_t		b;
+	long long	n;
+	int		i;
+
+	// realign the sequence to whole words
+	for (i = 0; i < (RING_SIZE / 2); i++)
+		r->remove(&b);
+	for (in = out = 0; in < (RING_SIZE / 2 / sizeof(in)); in++)
+		r->insert(in);
+	for (n = 0; n < total; n += BATCH * sizeof(w)) {
+		for (i = 0; i < BATCH; i++)
+			if (!r->insert(in++))
+				mismatch("words");
+		for (i = 0; i < BATCH; i++)
+			if ((r->remove(&w) != 1) || (w != out++))
+				mismatch("words");
+	}
+	return((n / sizeof(w)) * 2);
+}
+
+template <class Ring> long long
+frames(Ring *r, long long total)
+{
+	char		out[FRAME];
+	uint8_t		next, check;
+	long long	n;
+
+	next = (uint8_t)(RING_SIZE / 2);
+	check = 0;
+	for (n = 0; n < total; n += FRAME) {
+		if (!r->insert((char *)&pattern[next], FRAME))
+			mismatch("frames");
+		next += FRAME;
+		if ((r->remove(out, FRAME) != FRAME) || memcmp(out, &pattern[check], FRAME))
+			mismatch("frames");
+		check += FRAME;
+	}
+	return((n / FRAME) * 2);
+}
+
+template <class Ring> long long
+md(Ring *r, long long total)
+{
+	char			out[FRAME];
+	IOMemoryDescriptor	outmd(out, FRAME);
+	uint8_t			next, check;
+	long long		n;
+
+	next = (uint8_t)(RING_SIZE / 2);
+	check = 0;
+	for (n = 0; n < total; n += FRAME) {
+		IOMemoryDescriptor	inmd(&pattern[next], FRAME);
+
+		if (!r->insert(&inmd))
+			mismatch("md");
+		next += FRAME;
+		if ((r->remove(&outmd, 0) != FRAME) || memcmp(out, &pattern[check], FRAME))
+			mismatch("md");
+		check += FRAME;
+	}
+	return((n / FRAME) * 2);
+}
+
+long long
+spans(RingBuffer *r, long long total)
+{
+	char		*p;
+	uint8_t		next, check;
+	long long	n;
+	int		done, frag;
+
+	next = (uint8_t)(RING_SIZE / 2);
+	check = 0;
+	for (n = 0; n < total; n += FRAME) {
+		for (done = 0; done < FRAME; done += frag) {
+			p = r->reserve(&frag);
+			if (frag > (FRAME - done))
+				frag = FRAME - done;
+			memcpy(p, &pattern[(uint8_t)(next + done)], frag);
+			r->commit(frag);
+		}
+		next += FRAME;
+		for (done = 0; done < FRAME; done += frag) {
+			p = r->peek(&frag);
+			if (frag > (FRAME - done))
+				frag = FRAME - done;
+			if (memcmp(p, &pattern[(uint8_t)(check + done)], frag))
+				mismatch("spans");
+			r->consume(frag);
+		}
+		check += FRAME;
+	}
+	return((n / FRAME) * 2);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Driver
+//
+
+typedef long long (*newload)(RingBuffer *, long long);
+typedef long long (*oldload)(OldRingBuffer *, long long);
+
+struct workload {
+	const char	*name;
+	newload		fresh;
+	oldload		old;
+};
+
+static struct workload workloads[] = {
+	{ "bytes",	bytes<RingBuffer>,	bytes<OldRingBuffer> },
+	{ "words",	words<RingBuffer>,	words<OldRingBuffer> },
+	{ "frames",	frames<RingBuffer>,	frames<OldRingBuffer> },
+	{ "md",		md<RingBuffer>,		md<OldRingBuffer> },
+	{ "spans",	spans,			NULL },
+	{ NULL }
+};
+
+double
+runnew(newload fn, long long total)
+{
+	RingBuffer	r;
+	long long	ops;
+	double		start;
+
+	r.init(RING_SIZE);
+	prefill(&r);
+	start = now();
+	ops = fn(&r, total);
+	start = now() - start;
+	r.deinit();
+	return(start * 1e9 / ops);
+}
+
+double
+runold(oldload fn, long long total)
+{
+	OldRingBuffer	r;
+	long long	ops;
+	double		start;
+
+	r.init(RING_SIZE);
+	prefill(&r);
+	start = now();
+	ops = fn(&r, total);
+	start = now() - start;
+	r.deinit();
+	return(start * 1e9 / ops);
+}
+
+void
+usage(void)
+{
+	fprintf(stderr, "usage: ringbench [-m megabytes]\n");
+	exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct workload	*w;
+	long long	total;
+	double		o, n;
+	int		ch;
+
+	total = 256;
+	while ((ch = getopt(argc, argv, "m:")) != -1) {
+		switch (ch) {
+		case 'm':
+			total = atoll(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	if ((argc != 0) || (total <= 0))
+		usage();
+	total <<= 20;
+	for (ch = 0; ch < (int)sizeof(pattern); ch++)
+		pattern[ch] = ch;
+
+	printf("%-8s %10s %10s %8s\n", "workload", "old ns/op", "new ns/op", "old/new");
+	for (w = workloads; w->name != NULL; w++) {
+		n = runnew(w->fresh, total);
+		if (w->old != NULL) {
+			o = runold(w->old, total);
+			printf("%-8s %10.2f %10.2f %8.2f\n", w->name, o, n, o / n);
+		} else {
+			printf("%-8s %10s %10.2f %8s\n", w->name, "-", n, "-");
+		}
+	}
+	exit(0);
+}